@@ -7,11 +7,18 @@
 #include "websocket_protocol.h"
 #include "assets/lang_config.h"
 #include "mcp_server.h"
+#include "voice_memo.h"
+#include "local_commands.h"
+#include "connection_manager.h"
+#include "task_registry.h"
+#include "memory_budget.h"
+#include "settings.h"
 
 // 添加闹钟功能相关引用
 #include "alarm.h"
 
 #include <cstring>
+#include <thread>
 #include <esp_log.h>
 #include <cJSON.h>
 #include <driver/gpio.h>
@@ -23,21 +30,6 @@
 #define TAG "Application"
 
 
-static const char* const STATE_STRINGS[] = {
-    "unknown",
-    "starting",
-    "configuring",
-    "idle",
-    "connecting",
-    "listening",
-    "speaking",
-    "upgrading",
-    "activating",
-    "audio_testing",
-    "fatal_error",
-    "invalid_state"
-};
-
 Application::Application() {
     event_group_ = xEventGroupCreate();
 
@@ -72,32 +64,39 @@ Application::~Application() {
     vEventGroupDelete(event_group_);
 }
 
-void Application::CheckNewVersion(Ota& ota) {
+// In the background the device is already running from the cached server configuration, so failures
+// are only logged, and an upgrade or an activation waits until the device is idle
+bool Application::CheckNewVersion(Ota& ota, bool background) {
     const int MAX_RETRY = 10;
     int retry_count = 0;
     int retry_delay = 10; // 初始重试延迟为10秒
 
     auto& board = Board::GetInstance();
     while (true) {
-        SetDeviceState(kDeviceStateActivating);
         auto display = board.GetDisplay();
-        display->SetStatus(Lang::Strings::CHECKING_NEW_VERSION);
+        if (!background) {
+            SetDeviceState(kDeviceStateActivating);
+            display->SetStatus(Lang::Strings::CHECKING_NEW_VERSION);
+        }
 
         if (!ota.CheckVersion()) {
             retry_count++;
             if (retry_count >= MAX_RETRY) {
                 ESP_LOGE(TAG, "Too many retries, exit version check");
-                return;
+                return false;
             }
 
-            char buffer[256];
-            snprintf(buffer, sizeof(buffer), Lang::Strings::CHECK_NEW_VERSION_FAILED, retry_delay, ota.GetCheckVersionUrl().c_str());
-            Alert(Lang::Strings::ERROR, buffer, "cloud_slash", Lang::Sounds::OGG_EXCLAMATION);
+            if (!background) {
+                char buffer[256];
+                snprintf(buffer, sizeof(buffer), Lang::Strings::CHECK_NEW_VERSION_FAILED, retry_delay, ota.GetCheckVersionUrl().c_str());
+                Alert(Lang::Strings::ERROR, buffer, "cloud_slash", Lang::Sounds::OGG_EXCLAMATION);
+            }
 
             ESP_LOGW(TAG, "Check new version failed, retry in %d seconds (%d/%d)", retry_delay, retry_count, MAX_RETRY);
             for (int i = 0; i < retry_delay; i++) {
                 vTaskDelay(pdMS_TO_TICKS(1000));
-                if (device_state_ == kDeviceStateIdle) {
+                // Pressing the button while the check is shown skips the wait
+                if (!background && device_state_ == kDeviceStateIdle) {
                     break;
                 }
             }
@@ -108,11 +107,16 @@ void Application::CheckNewVersion(Ota& ota) {
         retry_delay = 10; // 重置重试延迟时间
 
         if (ota.HasNewVersion()) {
+            if (background) {
+                EnterStateWhenIdle(kDeviceStateUpgrading);
+            }
             Alert(Lang::Strings::OTA_UPGRADE, Lang::Strings::UPGRADING, "download", Lang::Sounds::OGG_UPGRADE);
 
             vTaskDelay(pdMS_TO_TICKS(3000));
 
-            SetDeviceState(kDeviceStateUpgrading);
+            if (!background) {
+                SetDeviceState(kDeviceStateUpgrading);
+            }
             
             std::string message = std::string(Lang::Strings::NEW_VERSION) + ota.GetFirmwareVersion();
             display->SetChatMessage("system", message.c_str());
@@ -136,6 +140,14 @@ void Application::CheckNewVersion(Ota& ota) {
                 board.SetPowerSaveMode(true); // Restore power save mode
                 Alert(Lang::Strings::ERROR, Lang::Strings::UPGRADE_FAILED, "circle_xmark", Lang::Sounds::OGG_EXCLAMATION);
                 vTaskDelay(pdMS_TO_TICKS(3000));
+                // In the background nothing else leaves the upgrading state, the device would stay deaf
+                if (background) {
+                    Schedule([this]() {
+                        if (device_state_ == kDeviceStateUpgrading) {
+                            SetDeviceState(kDeviceStateIdle);
+                        }
+                    });
+                }
                 // Continue to normal operation (don't break, just fall through)
             } else {
                 // Upgrade success, reboot immediately
@@ -143,7 +155,7 @@ void Application::CheckNewVersion(Ota& ota) {
                 display->SetChatMessage("system", "Upgrade successful, rebooting...");
                 vTaskDelay(pdMS_TO_TICKS(1000)); // Brief pause to show message
                 Reboot();
-                return; // This line will never be reached after reboot
+                return true; // This line will never be reached after reboot
             }
         }
 
@@ -155,6 +167,9 @@ void Application::CheckNewVersion(Ota& ota) {
             break;
         }
 
+        if (background) {
+            EnterStateWhenIdle(kDeviceStateActivating);
+        }
         display->SetStatus(Lang::Strings::ACTIVATION);
         // Activation code is shown to the user and waiting for the user to input
         if (ota.HasActivationCode()) {
@@ -178,6 +193,26 @@ void Application::CheckNewVersion(Ota& ota) {
             }
         }
     }
+    if (background && device_state_ == kDeviceStateActivating) {
+        Schedule([this]() {
+            SetDeviceState(kDeviceStateIdle);
+        });
+    }
+    return true;
+}
+
+// The state is changed by the main loop, where it cannot race with a wake word or a button
+void Application::EnterStateWhenIdle(DeviceState state) {
+    while (device_state_ != state) {
+        if (device_state_ == kDeviceStateIdle) {
+            Schedule([this, state]() {
+                if (device_state_ == kDeviceStateIdle && !(protocol_ && protocol_->IsAudioChannelOpened())) {
+                    SetDeviceState(state);
+                }
+            });
+        }
+        vTaskDelay(pdMS_TO_TICKS(1000));
+    }
 }
 
 void Application::ShowActivationCode(const std::string& code, const std::string& message) {
@@ -217,7 +252,8 @@ void Application::Alert(const char* status, const char* message, const char* emo
     display->SetEmotion(emotion);
     display->SetChatMessage("system", message);
     if (!sound.empty()) {
-        audio_service_.PlaySound(sound);
+        // The network phase of the boot may alert before the audio service is up
+        PlaySound(sound);
     }
 }
 
@@ -244,6 +280,14 @@ void Application::ToggleChatState() {
         return;
     }
 
+#if CONFIG_USE_VOICE_MEMO
+    /* The button stops the memo recording instead of starting a conversation */
+    if (device_state_ == kDeviceStateIdle && VoiceMemo::GetInstance().IsRecording()) {
+        VoiceMemo::GetInstance().StopRecording();
+        return;
+    }
+#endif
+
     if (!protocol_) {
         ESP_LOGE(TAG, "Protocol not initialized");
         return;
@@ -261,7 +305,7 @@ void Application::ToggleChatState() {
             SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
         });
     } else if (device_state_ == kDeviceStateSpeaking) {
-        Schedule([this]() {
+        ScheduleControl([this]() {
             AbortSpeaking(kAbortReasonNone);
         });
     } else if (device_state_ == kDeviceStateListening) {
@@ -287,6 +331,7 @@ void Application::StartListening() {
     }
     
     if (device_state_ == kDeviceStateIdle) {
+        stop_listening_requested_ = false;
         Schedule([this]() {
             if (!protocol_->IsAudioChannelOpened()) {
                 SetDeviceState(kDeviceStateConnecting);
@@ -295,10 +340,15 @@ void Application::StartListening() {
                 }
             }
 
+            // The stop goes through the control lane and may have run before this task
+            if (stop_listening_requested_) {
+                SetDeviceState(kDeviceStateIdle);
+                return;
+            }
             SetListeningMode(kListeningModeManualStop);
         });
     } else if (device_state_ == kDeviceStateSpeaking) {
-        Schedule([this]() {
+        ScheduleControl([this]() {
             AbortSpeaking(kAbortReasonNone);
             SetListeningMode(kListeningModeManualStop);
         });
@@ -322,7 +372,8 @@ void Application::StopListening() {
         return;
     }
 
-    Schedule([this]() {
+    stop_listening_requested_ = true;
+    ScheduleControl([this]() {
         if (device_state_ == kDeviceStateListening) {
             protocol_->SendStopListening();
             SetDeviceState(kDeviceStateIdle);
@@ -331,95 +382,231 @@ void Application::StopListening() {
 }
 
 void Application::Start() {
-    auto& board = Board::GetInstance();
-    
-    // Initialize NVS flash for WiFi configuration
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_LOGW(TAG, "Erasing NVS flash to fix corruption");
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK(ret);
-
-    // Initialize the MCP server and add common tools
-    auto& mcp_server = McpServer::GetInstance();
-    mcp_server.AddCommonTools();
-    
-    // 初始化闹钟系统
-    auto& alarm_manager = AlarmManager::GetInstance();
-    alarm_manager.Initialize();
-    
-    // 启动闹钟检查定时器
-    esp_timer_create_args_t alarm_timer_args = {
-        .callback = [](void* arg) {
-            auto& alarm_manager = AlarmManager::GetInstance();
-            bool triggered = alarm_manager.CheckAlarms();
-            
-            if (triggered) {
-                // 闹钟触发，唤醒AI
-                ESP_LOGI("Application", "An alarm has been triggered!");
-                auto& app = Application::GetInstance();
-                // 使用WakeWordInvoke方法唤醒AI并传递具体消息
-                app.WakeWordInvoke("闹钟响了，需要大声唤醒用户");
-            }
-        },
-        .arg = nullptr,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "alarm_check_timer",
-        .skip_unhandled_events = true
-    };
-    
-    esp_timer_handle_t alarm_timer;
-    esp_timer_create(&alarm_timer_args, &alarm_timer);
-    // 改回每分钟检查一次，更加节能
-    esp_timer_start_periodic(alarm_timer, 60 * 1000 * 1000); // 每分钟检查一次
+    // Hooks the failed allocations before anything else allocates
+    MemoryBudget::GetInstance();
 
-    SetDeviceState(kDeviceStateStarting);
+    // Boot runs as a graph of phases, audio bring-up and the alarms overlap with the network
+    Ota ota;
+    int nvs_phase = boot_sequence_.AddPhase("nvs", {}, 0, []() {
+        // Initialize NVS flash for WiFi configuration
+        esp_err_t ret = nvs_flash_init();
+        if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+            ESP_LOGW(TAG, "Erasing NVS flash to fix corruption");
+            ESP_ERROR_CHECK(nvs_flash_erase());
+            ret = nvs_flash_init();
+        }
+        ESP_ERROR_CHECK(ret);
+    });
 
-    /* Setup the display */
-    auto display = board.GetDisplay();
+    // The board brings up the display and its UI, everything else needs it
+    int board_phase = boot_sequence_.AddPhase("board", { nvs_phase }, 0, [this]() {
+        Board::GetInstance();
+        SetDeviceState(kDeviceStateStarting);
 
-    /* Setup the audio service */
-    auto codec = board.GetAudioCodec();
-    audio_service_.Initialize(codec);
-    audio_service_.Start();
+        EventBus::GetInstance().Subscribe("status_bar", TopicMask(kEventNetwork, kEventBattery), [](const Event& event, void* arg) {
+            Board::GetInstance().GetDisplay()->UpdateStatusBarItem(
+                event.topic == kEventNetwork ? kStatusBarNetwork : kStatusBarBattery);
+        }, nullptr);
 
-    AudioServiceCallbacks callbacks;
-    callbacks.on_send_queue_available = [this]() {
-        xEventGroupSetBits(event_group_, MAIN_EVENT_SEND_AUDIO);
-    };
-    callbacks.on_wake_word_detected = [this](const std::string& wake_word) {
-        xEventGroupSetBits(event_group_, MAIN_EVENT_WAKE_WORD_DETECTED);
-    };
-    callbacks.on_vad_change = [this](bool speaking) {
-        xEventGroupSetBits(event_group_, MAIN_EVENT_VAD_CHANGE);
-    };
-    audio_service_.SetCallbacks(callbacks);
+        /* Start the clock timer to update the status bar */
+        esp_timer_start_periodic(clock_timer_handle_, 1000000);
+    });
 
-    /* Start the clock timer to update the status bar */
-    esp_timer_start_periodic(clock_timer_handle_, 1000000);
+    int alarm_phase = boot_sequence_.AddPhase("alarm", { nvs_phase }, 4096, []() {
+        // 初始化闹钟系统
+        auto& alarm_manager = AlarmManager::GetInstance();
+        alarm_manager.Initialize();
+
+        // 启动闹钟检查定时器
+        esp_timer_create_args_t alarm_timer_args = {
+            .callback = [](void* arg) {
+                auto& alarm_manager = AlarmManager::GetInstance();
+                bool triggered = alarm_manager.CheckAlarms();
+
+                if (triggered) {
+                    // 闹钟触发，唤醒AI
+                    ESP_LOGI("Application", "An alarm has been triggered!");
+                    auto& app = Application::GetInstance();
+                    // 使用WakeWordInvoke方法唤醒AI并传递具体消息
+                    app.WakeWordInvoke("闹钟响了，需要大声唤醒用户");
+                }
+            },
+            .arg = nullptr,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "alarm_check_timer",
+            .skip_unhandled_events = true
+        };
+
+        esp_timer_handle_t alarm_timer;
+        esp_timer_create(&alarm_timer_args, &alarm_timer);
+        // 改回每分钟检查一次，更加节能
+        esp_timer_start_periodic(alarm_timer, 60 * 1000 * 1000); // 每分钟检查一次
+    });
 
-    /* Wait for the network to be ready */
-    board.StartNetwork();
+    // Runs in its own task with the stack of the main task, Wi-Fi association and the modem
+    // registration take seconds. Alerts of the boards wait for the audio phase
+    int network_phase = boot_sequence_.AddPhase("network", { board_phase }, CONFIG_ESP_MAIN_TASK_STACK_SIZE, []() {
+        auto& board = Board::GetInstance();
+        /* Wait for the network to be ready */
+        board.StartNetwork();
 
-    // Update the status bar immediately to show the network state
-    display->UpdateStatusBar(true);
+        // Update the status bar immediately to show the network state
+        board.GetDisplay()->UpdateStatusBar(true);
+    });
 
-    // Check for new firmware version or get the MQTT broker address
-    Ota ota;
-    CheckNewVersion(ota);
+    audio_phase_ = boot_sequence_.AddPhase("audio", { board_phase }, 0, [this]() {
+        /* Setup the audio service */
+        auto codec = Board::GetInstance().GetAudioCodec();
+        codec->OnOutputVolumeChanged([](int volume) {
+            Board::GetInstance().GetDisplay()->UpdateStatusBarItem(kStatusBarMute);
+        });
+        audio_service_.Initialize(codec);
+        audio_service_.Start();
+#if CONFIG_USE_VOICE_MEMO
+        VoiceMemo::GetInstance().Initialize(&audio_service_);
+#endif
+
+        AudioServiceCallbacks callbacks;
+        callbacks.on_send_queue_available = [this]() {
+            xEventGroupSetBits(event_group_, MAIN_EVENT_SEND_AUDIO);
+        };
+#if CONFIG_USE_LOCAL_COMMANDS
+        callbacks.on_local_command = [this](int command_id) {
+            Schedule([command_id]() {
+                LocalCommands::Execute(command_id);
+            });
+        };
+#endif
+        audio_service_.SetCallbacks(callbacks);
+        // The main loop reads the VAD state and the wake word from the audio service
+        EventBus::GetInstance().Subscribe("main_loop", TopicMask(kEventVad, kEventWakeWord), [](const Event& event, void* arg) {
+            auto app = static_cast<Application*>(arg);
+            xEventGroupSetBits(app->event_group_,
+                event.topic == kEventVad ? MAIN_EVENT_VAD_CHANGE : MAIN_EVENT_WAKE_WORD_DETECTED);
+        }, this);
+#if CONFIG_USE_LOCAL_COMMANDS
+        if (!audio_service_.SetLocalCommands(LocalCommands::GetCommandWords())) {
+            ESP_LOGW(TAG, "Local commands are not supported by the wake word engine");
+        }
+#endif
+
+        // The sounds of the alerts raised so far
+        std::vector<std::string_view> sounds;
+        {
+            std::lock_guard<std::mutex> lock(sound_mutex_);
+            audio_ready_ = true;
+            sounds.swap(pending_sounds_);
+        }
+        for (auto& sound : sounds) {
+            audio_service_.PlaySound(sound);
+        }
+    });
+
+    // Once, after the voice memo storage is mounted, so that its tools are included
+    int mcp_phase = boot_sequence_.AddPhase("mcp_tools", { audio_phase_, alarm_phase }, 0, []() {
+        McpServer::GetInstance().AddCommonTools();
+    });
+
+    // Check for new firmware version or get the MQTT broker address. The upgrade stops the audio service
+    int ota_phase = boot_sequence_.AddPhase("ota", { network_phase, audio_phase_ }, 0, [this, &ota]() {
+#if CONFIG_USE_FAST_START
+        if (ota.LoadCachedConfig()) {
+            ESP_LOGI(TAG, "Starting with the cached server configuration, the version is checked in the background");
+            fast_start_ = true;
+            return;
+        }
+#endif
+        CheckNewVersion(ota, false);
+    });
+
+    boot_sequence_.AddPhase("protocol", { ota_phase, mcp_phase }, 0, [this, &ota]() {
+        StartProtocol(ota);
+    });
+
+    boot_sequence_.Run();
+
+    if (fast_start_) {
+        TaskRegistry::GetInstance().Create(kTaskCheckVersion, [](void* arg) {
+            auto app = (Application*)arg;
+            Ota ota;
+            if (app->CheckNewVersion(ota, true)) {
+                app->OnBackgroundCheckDone(ota);
+            }
+            app->check_new_version_task_handle_ = nullptr;
+            vTaskDelete(NULL);
+        }, this, &check_new_version_task_handle_);
+    }
+
+    // Print heap stats
+    SystemInfo::PrintHeapStats();
+}
+
+// Runs in the background check task
+void Application::OnBackgroundCheckDone(Ota& ota) {
+    Schedule([this, changed = ota.IsConfigChanged(), use_mqtt = ota.HasMqttConfig(),
+        use_websocket = ota.HasWebsocketConfig(), server_time = ota.HasServerTime()]() {
+        has_server_time_ = has_server_time_ || server_time;
+        if (changed) {
+            ESP_LOGI(TAG, "Server configuration changed, applying it once idle");
+            pending_protocol_ = use_mqtt ? kPendingProtocolMqtt :
+                use_websocket ? kPendingProtocolWebsocket : kPendingProtocolDefault;
+            ApplyServerConfig();
+        }
+    });
+}
+
+// Runs in the main loop. A conversation is not interrupted, the clock timer tries again later
+void Application::ApplyServerConfig() {
+    if (pending_protocol_ == kPendingProtocolNone) {
+        return;
+    }
+    if (device_state_ != kDeviceStateIdle || (protocol_ && protocol_->IsAudioChannelOpened())) {
+        return;
+    }
+    auto pending_protocol = pending_protocol_;
+    pending_protocol_ = kPendingProtocolNone;
+    // The old protocol is stopped first, the broker takes the session from one of two MQTT clients with
+    // the same client id. Like at boot, a protocol that failed to start connects again when it is used
+    protocol_.reset();
+    if (!CreateProtocol(pending_protocol == kPendingProtocolMqtt, pending_protocol == kPendingProtocolWebsocket)) {
+        ESP_LOGW(TAG, "The protocol with the new server configuration did not start, it connects again later");
+        return;
+    }
+    ESP_LOGI(TAG, "Protocol restarted with the new server configuration");
+}
+
+void Application::StartProtocol(Ota& ota) {
+    auto display = Board::GetInstance().GetDisplay();
 
     // Initialize the protocol
     display->SetStatus(Lang::Strings::LOADING_PROTOCOL);
 
-    // Add MCP common tools before initializing the protocol
-    McpServer::GetInstance().AddCommonTools();
+    InitializeMessageHandlers();
+    bool protocol_started = CreateProtocol(ota.HasMqttConfig(), ota.HasWebsocketConfig());
+
+    SetDeviceState(kDeviceStateIdle);
 
-    if (ota.HasMqttConfig()) {
+    has_server_time_ = ota.HasServerTime();
+    if (protocol_started) {
+        std::string message = std::string(Lang::Strings::VERSION) + ota.GetCurrentVersion();
+        display->ShowNotification(message.c_str());
+        display->SetChatMessage("system", "");
+        // Play the success sound to indicate the device is ready
+        audio_service_.PlaySound(Lang::Sounds::OGG_SUCCESS);
+    }
+}
+
+// Returns the result of Protocol::Start
+bool Application::CreateProtocol(bool use_mqtt, bool use_websocket) {
+    auto& board = Board::GetInstance();
+    auto codec = board.GetAudioCodec();
+
+    if (use_mqtt) {
         protocol_ = std::make_unique<MqttProtocol>();
-    } else if (ota.HasWebsocketConfig()) {
+    } else if (use_websocket) {
         protocol_ = std::make_unique<WebsocketProtocol>();
+        // The first wake word should not wait for the DNS lookup
+        ConnectionManager::GetInstance().PrefetchHost(Settings("websocket", false).GetString("url"));
     } else {
         ESP_LOGW(TAG, "No protocol specified in the OTA config, using MQTT");
         protocol_ = std::make_unique<MqttProtocol>();
@@ -433,13 +620,23 @@ void Application::Start() {
         last_error_message_ = message;
         xEventGroupSetBits(event_group_, MAIN_EVENT_ERROR);
     });
+    protocol_->OnSessionLost([this]() {
+        // No tts stop or listen reply will come for the old session, closing the channel goes back to idle
+        Schedule([this]() {
+            ESP_LOGW(TAG, "The server did not resume the session, ending the conversation");
+            protocol_->CloseAudioChannel();
+        });
+    });
     protocol_->OnIncomingAudio([this](std::unique_ptr<AudioStreamPacket> packet) {
         if (device_state_ == kDeviceStateSpeaking) {
             audio_service_.PushPacketToDecodeQueue(std::move(packet));
+        } else {
+            AudioPacketPool::GetInstance().Release(std::move(packet));
         }
     });
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
         board.SetPowerSaveMode(false);
+        NetworkQualityMonitor::GetInstance().Reset();
         if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
             ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
                 protocol_->server_sample_rate(), codec->output_sample_rate());
@@ -453,133 +650,215 @@ void Application::Start() {
             SetDeviceState(kDeviceStateIdle);
         });
     });
-    protocol_->OnIncomingJson([this, display](const cJSON* root) {
-        // Parse JSON data
-        auto type = cJSON_GetObjectItem(root, "type");
-        if (strcmp(type->valuestring, "tts") == 0) {
-            auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
-                Schedule([this]() {
-                    aborted_ = false;
-                    if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
-                        SetDeviceState(kDeviceStateSpeaking);
-                    }
-                });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
-                Schedule([this]() {
-                    if (device_state_ == kDeviceStateSpeaking) {
-                        if (listening_mode_ == kListeningModeManualStop) {
-                            SetDeviceState(kDeviceStateIdle);
-                        } else {
-                            SetDeviceState(kDeviceStateListening);
-                        }
-                    }
-                });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
-                auto text = cJSON_GetObjectItem(root, "text");
-                if (cJSON_IsString(text)) {
-                    ESP_LOGI(TAG, "<< %s", text->valuestring);
-                    Schedule([this, display, message = std::string(text->valuestring)]() {
-                        display->SetChatMessage("assistant", message.c_str());
-                    });
-                }
-            }
-        } else if (strcmp(type->valuestring, "stt") == 0) {
-            auto text = cJSON_GetObjectItem(root, "text");
-            if (cJSON_IsString(text)) {
-                ESP_LOGI(TAG, ">> %s", text->valuestring);
-                Schedule([this, display, message = std::string(text->valuestring)]() {
-                    display->SetChatMessage("user", message.c_str());
-                });
-            }
-        } else if (strcmp(type->valuestring, "llm") == 0) {
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(emotion)) {
-                Schedule([this, display, emotion_str = std::string(emotion->valuestring)]() {
-                    display->SetEmotion(emotion_str.c_str());
-                });
-            }
-        } else if (strcmp(type->valuestring, "mcp") == 0) {
-            auto payload = cJSON_GetObjectItem(root, "payload");
-            if (cJSON_IsObject(payload)) {
-                McpServer::GetInstance().ParseMessage(payload);
+    protocol_->OnIncomingMessage([this](const JsonMessage& message) {
+        if (!message_dispatcher_.Dispatch(message)) {
+            ESP_LOGW(TAG, "Unknown message type: %s, state: %s", message.type().data(), message.state().data());
+        }
+    });
+    return protocol_->Start();
+}
+
+// Handlers of the server messages, they run in the network task
+void Application::InitializeMessageHandlers() {
+    auto display = Board::GetInstance().GetDisplay();
+    message_dispatcher_.On("tts", "start", [this](const JsonMessage& message) {
+        Schedule([this]() {
+            aborted_ = false;
+            if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
+                SetDeviceState(kDeviceStateSpeaking);
             }
-        } else if (strcmp(type->valuestring, "system") == 0) {
-            auto command = cJSON_GetObjectItem(root, "command");
-            if (cJSON_IsString(command)) {
-                ESP_LOGI(TAG, "System command: %s", command->valuestring);
-                if (strcmp(command->valuestring, "reboot") == 0) {
-                    // Do a reboot if user requests a OTA update
-                    Schedule([this]() {
-                        Reboot();
-                    });
+        });
+    });
+    message_dispatcher_.On("tts", "stop", [this](const JsonMessage& message) {
+        Schedule([this]() {
+            if (device_state_ == kDeviceStateSpeaking) {
+                if (listening_mode_ == kListeningModeManualStop) {
+                    SetDeviceState(kDeviceStateIdle);
                 } else {
-                    ESP_LOGW(TAG, "Unknown system command: %s", command->valuestring);
+                    SetDeviceState(kDeviceStateListening);
                 }
             }
-        } else if (strcmp(type->valuestring, "alert") == 0) {
-            auto status = cJSON_GetObjectItem(root, "status");
-            auto message = cJSON_GetObjectItem(root, "message");
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(status) && cJSON_IsString(message) && cJSON_IsString(emotion)) {
-                Alert(status->valuestring, message->valuestring, emotion->valuestring, Lang::Sounds::OGG_VIBRATION);
-            } else {
-                ESP_LOGW(TAG, "Alert command requires status, message and emotion");
+        });
+    });
+    message_dispatcher_.On("tts", "sentence_start", [this, display](const JsonMessage& message) {
+        auto text = message.GetString("text");
+        if (!text.empty()) {
+            ESP_LOGI(TAG, "<< %s", text.data());
+            Schedule([this, display, message = std::string(text)]() {
+                display->SetChatMessage("assistant", message.c_str());
+            });
+        }
+    });
+    // Other states of tts, e.g. sentence_end, need no handling
+    message_dispatcher_.On("tts", [](const JsonMessage& message) {});
+    message_dispatcher_.On("stt", [this, display](const JsonMessage& message) {
+        auto text = message.GetString("text");
+        if (!text.empty()) {
+            ESP_LOGI(TAG, ">> %s", text.data());
+            Schedule([this, display, message = std::string(text)]() {
+                display->SetChatMessage("user", message.c_str());
+            });
+        }
+    });
+    message_dispatcher_.On("llm", [this, display](const JsonMessage& message) {
+        auto emotion = message.GetString("emotion");
+        if (!emotion.empty()) {
+            Schedule([this, display, emotion_str = std::string(emotion)]() {
+                display->SetEmotion(emotion_str.c_str());
+            });
+        }
+    });
+    message_dispatcher_.On("mcp", [](const JsonMessage& message) {
+        // MCP needs the whole tree, only its payload is built
+        if (message.IsObject("payload")) {
+            cJSON* root = message.GetTree("payload");
+            if (root != nullptr) {
+                McpServer::GetInstance().ParseMessage(root);
+                cJSON_Delete(root);
             }
-#if CONFIG_RECEIVE_CUSTOM_MESSAGE
-        } else if (strcmp(type->valuestring, "custom") == 0) {
-            auto payload = cJSON_GetObjectItem(root, "payload");
-            ESP_LOGI(TAG, "Received custom message: %s", cJSON_PrintUnformatted(root));
-            if (cJSON_IsObject(payload)) {
-                Schedule([this, display, payload_str = std::string(cJSON_PrintUnformatted(payload))]() {
-                    display->SetChatMessage("system", payload_str.c_str());
+        }
+    });
+    message_dispatcher_.On("system", [this](const JsonMessage& message) {
+        auto command = message.GetString("command");
+        if (!command.empty()) {
+            ESP_LOGI(TAG, "System command: %s", command.data());
+            if (command == "reboot") {
+                // Do a reboot if user requests a OTA update
+                Schedule([this]() {
+                    Reboot();
                 });
             } else {
-                ESP_LOGW(TAG, "Invalid custom message format: missing payload");
+                ESP_LOGW(TAG, "Unknown system command: %s", command.data());
             }
-#endif
+        }
+    });
+    message_dispatcher_.On("alert", [this](const JsonMessage& message) {
+        auto status = message.GetString("status");
+        auto text = message.GetString("message");
+        auto emotion = message.GetString("emotion");
+        if (!status.empty() && !text.empty() && !emotion.empty()) {
+            Alert(status.data(), text.data(), emotion.data(), Lang::Sounds::OGG_VIBRATION);
         } else {
-            ESP_LOGW(TAG, "Unknown message type: %s", type->valuestring);
+            ESP_LOGW(TAG, "Alert command requires status, message and emotion");
         }
     });
-    bool protocol_started = protocol_->Start();
-
-    SetDeviceState(kDeviceStateIdle);
-
-    has_server_time_ = ota.HasServerTime();
-    if (protocol_started) {
-        std::string message = std::string(Lang::Strings::VERSION) + ota.GetCurrentVersion();
-        display->ShowNotification(message.c_str());
-        display->SetChatMessage("system", "");
-        // Play the success sound to indicate the device is ready
-        audio_service_.PlaySound(Lang::Sounds::OGG_SUCCESS);
-    }
-
-    // Print heap stats
-    SystemInfo::PrintHeapStats();
+#if CONFIG_RECEIVE_CUSTOM_MESSAGE
+    message_dispatcher_.On("custom", [this, display](const JsonMessage& message) {
+        if (message.IsObject("payload")) {
+            auto payload = message.GetRaw("payload");
+            ESP_LOGI(TAG, "Received custom message: %.*s", (int)payload.size(), payload.data());
+            Schedule([this, display, payload_str = std::string(payload)]() {
+                display->SetChatMessage("system", payload_str.c_str());
+            });
+        } else {
+            ESP_LOGW(TAG, "Invalid custom message format: missing payload");
+        }
+    });
+#endif
 }
 
 void Application::OnClockTimer() {
-    clock_ticks_++;
+    clock_ticks_ += clock_period_seconds_;
+    stall_detector_.Check();
 
+    // The mute icon and the clock are updated by their own events
     auto display = Board::GetInstance().GetDisplay();
-    display->UpdateStatusBar();
+    CheckBattery();
+    if (clock_ticks_ % 10 == 0) {
+        display->UpdateStatusBarItem(kStatusBarNetwork);
+    }
+
+    NetworkQualityMonitor::GetInstance().Update();
+    if (clock_ticks_ % NETWORK_PING_INTERVAL_SECONDS == 0) {
+        Schedule([this]() {
+            if (protocol_ && protocol_->IsAudioChannelOpened()) {
+                protocol_->SendPing();
+            }
+        });
+    }
+
+#if CONFIG_USE_TASK_STACK_TUNING
+    auto& tasks = TaskRegistry::GetInstance();
+    tasks.Sample();
+    if (clock_ticks_ % 60 == 0) {
+        tasks.PrintReport();
+    }
+#endif
 
     // Print the debug info every 10 seconds
     if (clock_ticks_ % 10 == 0) {
         // SystemInfo::PrintTaskCpuUsage(pdMS_TO_TICKS(1000));
         // SystemInfo::PrintTaskList();
         SystemInfo::PrintHeapStats();
+        Schedule([this]() {
+            ConnectionManager::GetInstance().Sweep();
+            ApplyServerConfig();
+        });
+        for (auto queue : { &control_tasks_, &main_tasks_ }) {
+            auto stats = queue->stats();
+            if (stats.run > 0) {
+                ESP_LOGI(TAG, "%s tasks: run=%lu avg_run=%lluus max_run=%lums max_wait=%lums max_depth=%lu heap=%lu overflowed=%lu",
+                    queue->name(), stats.run, stats.total_run_us / stats.run, stats.max_run_ms, stats.max_wait_ms,
+                    stats.max_depth, stats.heap_tasks, stats.overflowed);
+            }
+            // The code addresses that kept the loop busiest, resolved with addr2line
+            TaskOriginStats origins[3];
+            size_t count = queue->GetOriginStats(origins, 3);
+            for (size_t i = 0; i < count; i++) {
+                ESP_LOGI(TAG, "  from %p: run=%lu avg_run=%lluus max_run=%lums", origins[i].origin, origins[i].run,
+                    origins[i].total_run_us / origins[i].run, origins[i].max_run_ms);
+            }
+        }
+        ESP_LOGD(TAG, "Status bar redraws: mute=%lu clock=%lu battery=%lu/%lu network=%lu/%lu",
+            display->GetStatusBarStats(kStatusBarMute).redraws, display->GetStatusBarStats(kStatusBarClock).redraws,
+            display->GetStatusBarStats(kStatusBarBattery).redraws, display->GetStatusBarStats(kStatusBarBattery).updates,
+            display->GetStatusBarStats(kStatusBarNetwork).redraws, display->GetStatusBarStats(kStatusBarNetwork).updates);
+        if (audio_lane_stats_.sent > 0 || stall_detector_.stall_count() > 0) {
+            ESP_LOGI(TAG, "Audio lane: sent=%lu preemptions=%lu, main loop stalls=%lu",
+                audio_lane_stats_.sent, audio_lane_stats_.preemptions, stall_detector_.stall_count());
+        }
     }
 }
 
-// Add a async task to MainLoop
-void Application::Schedule(std::function<void()> callback) {
-    {
-        std::lock_guard<std::mutex> lock(mutex_);
-        main_tasks_.push_back(std::move(callback));
+// The battery monitor of all boards, publishes kEventBattery when the level or the charging state changes
+void Application::CheckBattery() {
+    int level;
+    bool charging, discharging;
+    if (!Board::GetInstance().GetBatteryLevel(level, charging, discharging)) {
+        return;
+    }
+    if (level == battery_level_ && charging == battery_charging_ && discharging == battery_discharging_) {
+        return;
+    }
+    battery_level_ = level;
+    battery_charging_ = charging;
+    battery_discharging_ = discharging;
+    EventBus::GetInstance().PublishBattery(level, charging, discharging);
+}
+
+// Add a async task to MainLoop. Not inlined, so the return address is the code that queued the task
+__attribute__((noinline))
+void Application::PushTask(TaskQueue& queue, ScheduledTask& task, EventBits_t event) {
+    queue.Push(task, __builtin_return_address(0));
+    xEventGroupSetBits(event_group_, event);
+}
+
+void Application::RunControlTasks() {
+    while (control_tasks_.RunNext(stall_detector_)) {
+    }
+}
+
+void Application::RunMainTasks() {
+    while (main_tasks_.RunNext(stall_detector_)) {
+        // Control tasks, audio and the wake word are handled between two tasks, the rest runs after them
+        if (xEventGroupGetBits(event_group_) & (MAIN_EVENT_SEND_CONTROL | MAIN_EVENT_SEND_AUDIO |
+            MAIN_EVENT_WAKE_WORD_DETECTED | MAIN_EVENT_ERROR)) {
+            if (!main_tasks_.Empty()) {
+                xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
+            }
+            break;
+        }
     }
-    xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
 }
 
 // The Main Event Loop controls the chat state and websocket connection
@@ -591,6 +870,7 @@ void Application::MainEventLoop() {
 
     while (true) {
         auto bits = xEventGroupWaitBits(event_group_, MAIN_EVENT_SCHEDULE |
+            MAIN_EVENT_SEND_CONTROL |
             MAIN_EVENT_SEND_AUDIO |
             MAIN_EVENT_WAKE_WORD_DETECTED |
             MAIN_EVENT_VAD_CHANGE |
@@ -600,15 +880,32 @@ void Application::MainEventLoop() {
             Alert(Lang::Strings::ERROR, last_error_message_.c_str(), "circle_xmark", Lang::Sounds::OGG_EXCLAMATION);
         }
 
+        // The control lane goes first, and preempts the audio drain between messages
+        if (bits & MAIN_EVENT_SEND_CONTROL) {
+            RunControlTasks();
+        }
+
         if (bits & MAIN_EVENT_SEND_AUDIO) {
-            while (auto packet = audio_service_.PopPacketFromSendQueue()) {
-                if (!protocol_->SendAudio(std::move(packet))) {
+            // When caught up there is one frame per message, a backlog is drained in batches
+            while (audio_service_.PopPacketsFromSendQueue(audio_send_batch_, protocol_->max_audio_frames_per_message())) {
+                bool sent;
+                {
+                    StallDetector::Scope scope(stall_detector_, "audio send");
+                    sent = protocol_->SendAudioFrames(audio_send_batch_);
+                }
+                if (!sent) {
                     break;
                 }
+                audio_lane_stats_.sent++;
+                if (xEventGroupClearBits(event_group_, MAIN_EVENT_SEND_CONTROL) & MAIN_EVENT_SEND_CONTROL) {
+                    audio_lane_stats_.preemptions++;
+                    RunControlTasks();
+                }
             }
         }
 
         if (bits & MAIN_EVENT_WAKE_WORD_DETECTED) {
+            StallDetector::Scope scope(stall_detector_, "wake word");
             OnWakeWordDetected();
         }
 
@@ -620,12 +917,7 @@ void Application::MainEventLoop() {
         }
 
         if (bits & MAIN_EVENT_SCHEDULE) {
-            std::unique_lock<std::mutex> lock(mutex_);
-            auto tasks = std::move(main_tasks_);
-            lock.unlock();
-            for (auto& task : tasks) {
-                task();
-            }
+            RunMainTasks();
         }
     }
 }
@@ -636,6 +928,7 @@ void Application::OnWakeWordDetected() {
     }
 
     if (device_state_ == kDeviceStateIdle) {
+        boot_sequence_.Mark("first_wake_word");
         audio_service_.EncodeWakeWord();
 
         if (!protocol_->IsAudioChannelOpened()) {
@@ -683,36 +976,61 @@ void Application::SetDeviceState(DeviceState state) {
     if (device_state_ == state) {
         return;
     }
-    
-    clock_ticks_ = 0;
+
     auto previous_state = device_state_;
+    auto transition = DeviceStateMachine::FindTransition(previous_state, state);
+    if (transition == nullptr) {
+        state_machine_.RecordGuardViolation(previous_state, state);
+        return;
+    }
+    clock_ticks_ = 0;
     device_state_ = state;
-    ESP_LOGI(TAG, "STATE: %s", STATE_STRINGS[device_state_]);
+    ESP_LOGI(TAG, "STATE: %s", DeviceStateMachine::GetStateName(state));
+    state_machine_.Run(*transition, previous_state, state);
 
-    // Send the state change event
-    DeviceStateEventManager::GetInstance().PostStateChangeEvent(previous_state, state);
+    // The clock on the display and the slower idle tick only run while idle
+    if (state == kDeviceStateIdle || previous_state == kDeviceStateIdle) {
+        bool idle = state == kDeviceStateIdle;
+        clock_period_seconds_ = idle ? CLOCK_TIMER_IDLE_PERIOD_SECONDS : 1;
+        esp_timer_stop(clock_timer_handle_);
+        esp_timer_start_periodic(clock_timer_handle_, clock_period_seconds_ * 1000000LL);
+        Board::GetInstance().GetDisplay()->SetClockEnabled(idle);
+    }
+}
 
+// The steps of the transitions in device_state_machine.cc
+void Application::RunStateAction(DeviceStateAction action, DeviceState previous_state, DeviceState state) {
     auto& board = Board::GetInstance();
     auto display = board.GetDisplay();
-    auto led = board.GetLed();
-    led->OnStateChanged();
-    switch (state) {
-        case kDeviceStateUnknown:
-        case kDeviceStateIdle:
-            display->SetStatus(Lang::Strings::STANDBY);
-            display->SetEmotion("neutral");
-            audio_service_.EnableVoiceProcessing(false);
-            audio_service_.EnableWakeWordDetection(true);
+    switch (action) {
+        case kStateActionPostEvent:
+            EventBus::GetInstance().PublishDeviceState(previous_state, state);
+            break;
+        case kStateActionUpdateLed:
+            board.GetLed()->OnStateChanged();
+            break;
+        case kStateActionShowStatus:
+            if (state == kDeviceStateIdle) {
+                display->SetStatus(Lang::Strings::STANDBY);
+                display->SetEmotion("neutral");
+            } else if (state == kDeviceStateConnecting) {
+                display->SetStatus(Lang::Strings::CONNECTING);
+                display->SetEmotion("neutral");
+            } else if (state == kDeviceStateListening) {
+                display->SetStatus(Lang::Strings::LISTENING);
+                display->SetEmotion("neutral");
+            } else if (state == kDeviceStateSpeaking) {
+                display->SetStatus(Lang::Strings::SPEAKING);
+            }
             break;
-        case kDeviceStateConnecting:
-            display->SetStatus(Lang::Strings::CONNECTING);
-            display->SetEmotion("neutral");
+        case kStateActionClearChat:
             display->SetChatMessage("system", "");
             break;
-        case kDeviceStateListening:
-            display->SetStatus(Lang::Strings::LISTENING);
-            display->SetEmotion("neutral");
-
+        case kStateActionWaitForWakeWord:
+            audio_service_.EnableVoiceProcessing(false);
+            audio_service_.EnableWakeWordDetection(true);
+            break;
+        case kStateActionStartListening:
             // Make sure the audio processor is running
             if (!audio_service_.IsAudioProcessorRunning()) {
                 // Send the start listening command
@@ -721,22 +1039,21 @@ void Application::SetDeviceState(DeviceState state) {
                 audio_service_.EnableWakeWordDetection(false);
             }
             break;
-        case kDeviceStateSpeaking:
-            display->SetStatus(Lang::Strings::SPEAKING);
-
+        case kStateActionStopListening:
             if (listening_mode_ != kListeningModeRealtime) {
                 audio_service_.EnableVoiceProcessing(false);
-                // Only AFE wake word can be detected in speaking mode
-#if CONFIG_USE_AFE_WAKE_WORD
+                // Only AFE wake word can be detected in speaking mode, local commands are also recognized while speaking
+#if CONFIG_USE_AFE_WAKE_WORD || CONFIG_USE_LOCAL_COMMANDS
                 audio_service_.EnableWakeWordDetection(true);
 #else
                 audio_service_.EnableWakeWordDetection(false);
 #endif
             }
+            break;
+        case kStateActionResetDecoder:
             audio_service_.ResetDecoder();
             break;
         default:
-            // Do nothing
             break;
     }
 }
@@ -755,7 +1072,7 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
             }
         }); 
     } else if (device_state_ == kDeviceStateSpeaking) {
-        Schedule([this]() {
+        ScheduleControl([this]() {
             AbortSpeaking(kAbortReasonNone);
         });
     } else if (device_state_ == kDeviceStateListening) {   
@@ -784,14 +1101,20 @@ bool Application::CanEnterSleepMode() {
     return true;
 }
 
-void Application::SendMcpMessage(const std::string& payload) {
-    Schedule([this, payload]() {
+void Application::SendMcpMessage(cJSON* payload) {
+    ScheduleControl([this, payload]() {
         if (protocol_) {
             protocol_->SendMcpMessage(payload);
+        } else {
+            cJSON_Delete(payload);
         }
     });
 }
 
+bool Application::IsCborEnabled() const {
+    return protocol_ && protocol_->cbor_enabled();
+}
+
 void Application::SetAecMode(AecMode mode) {
     aec_mode_ = mode;
     Schedule([this]() {
@@ -820,9 +1143,63 @@ void Application::SetAecMode(AecMode mode) {
 }
 
 void Application::PlaySound(const std::string_view& sound) {
+    // Also called from the esp_timer task, which must not wait for the boot
+    {
+        std::lock_guard<std::mutex> lock(sound_mutex_);
+        if (!audio_ready_) {
+            pending_sounds_.push_back(sound);
+            return;
+        }
+    }
     audio_service_.PlaySound(sound);
 }
 
+// The calibration needs the speaker and the microphone for itself, so the conversation is closed first
+void Application::EndConversation() {
+    Schedule([this]() {
+        if (protocol_ && protocol_->IsAudioChannelOpened()) {
+            protocol_->CloseAudioChannel();
+        }
+    });
+}
+
+void Application::StartAcousticCalibration() {
+    EndConversation();
+    Schedule([this]() {
+        TaskRegistry::GetInstance().Create(kTaskAcousticCalibration, [](void* arg) {
+            auto app = (Application*)arg;
+            app->RunAcousticCalibration();
+            vTaskDelete(NULL);
+        }, this);
+    });
+}
+
+void Application::RunAcousticCalibration() {
+    // Wait for the device to become idle and the speaker to drain
+    for (int i = 0; i < 50; i++) {
+        if (device_state_ == kDeviceStateIdle && audio_service_.IsIdle()) {
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    if (device_state_ != kDeviceStateIdle) {
+        ESP_LOGW(TAG, "Device is not idle, skip acoustic calibration");
+        return;
+    }
+    vTaskDelay(pdMS_TO_TICKS(500));
+
+    AcousticCalibrationResult result;
+    auto display = Board::GetInstance().GetDisplay();
+    char buffer[64];
+    if (audio_service_.CalibrateAcousticLatency(result)) {
+        snprintf(buffer, sizeof(buffer), "AEC %dms (I2S %dms) %ddB", (int)result.end_to_end_ms,
+            (int)result.i2s_buffer_ms, (int)result.loopback.echo_gain_db);
+    } else {
+        snprintf(buffer, sizeof(buffer), "AEC calibration failed");
+    }
+    display->ShowNotification(buffer, 5000);
+}
+
 // 添加供外部组件调用的C接口
 extern "C" void application_set_device_state(int state) {
     auto& app = Application::GetInstance();
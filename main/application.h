@@ -7,14 +7,20 @@
 #include <esp_timer.h>
 
 #include <string>
+#include <string_view>
+#include <vector>
 #include <mutex>
 #include <deque>
 #include <memory>
+#include <atomic>
 
 #include "protocol.h"
 #include "ota.h"
 #include "audio_service.h"
-#include "device_state_event.h"
+#include "event_bus.h"
+#include "device_state_machine.h"
+#include "task_queue.h"
+#include "boot_sequence.h"
 
 // 添加闹钟功能相关引用
 #include "alarm.h"
@@ -25,6 +31,32 @@
 #define MAIN_EVENT_VAD_CHANGE (1 << 3)
 #define MAIN_EVENT_ERROR (1 << 4)
 #define MAIN_EVENT_CHECK_NEW_VERSION_DONE (1 << 5)
+#define MAIN_EVENT_SEND_CONTROL (1 << 6)
+
+// RTT probes while the audio channel is open
+#define NETWORK_PING_INTERVAL_SECONDS 10
+
+// Slots of the task queues of the main loop, powers of two
+#define MAIN_TASK_QUEUE_SIZE 32
+#define CONTROL_TASK_QUEUE_SIZE 16
+// Tasks and events that keep the main loop busy for longer are logged
+#define MAIN_LOOP_STALL_MS 200
+// While idle the clock timer only samples the battery and the network, it ticks less often
+#define CLOCK_TIMER_IDLE_PERIOD_SECONDS 10
+
+// Metrics of the audio send lane of the main loop
+struct SendLaneStats {
+    uint32_t sent = 0;          // Audio messages sent
+    uint32_t preemptions = 0;   // Audio drains interrupted by control tasks
+};
+
+// Protocol to restart with after the background version check changed the server configuration
+enum PendingProtocol {
+    kPendingProtocolNone,
+    kPendingProtocolMqtt,
+    kPendingProtocolWebsocket,
+    kPendingProtocolDefault,    // Neither was given, falls back to MQTT
+};
 
 enum AecMode {
     kAecOff,
@@ -45,9 +77,23 @@ public:
     void Start();
     void MainEventLoop();
     DeviceState GetDeviceState() const { return device_state_; }
+    DeviceStateMachine& GetStateMachine() { return state_machine_; }
+    BootSequence& GetBootSequence() { return boot_sequence_; }
     bool IsVoiceDetected() const { return audio_service_.IsVoiceDetected(); }
     AudioService& GetAudioService() { return audio_service_; }  // 添加GetAudioService函数声明
-    void Schedule(std::function<void()> callback);
+    // Runs the callback in the main loop. Captures up to SCHEDULED_TASK_INLINE_SIZE bytes are not allocated.
+    // Never blocks, a callback that finds the queue full waits in its overflow list
+    template <typename Callable>
+    void Schedule(Callable&& callback) {
+        ScheduledTask task(std::forward<Callable>(callback));
+        PushTask(main_tasks_, task, MAIN_EVENT_SCHEDULE);
+    }
+    // Like Schedule, but runs ahead of queued tasks and between audio messages, for aborts and MCP replies
+    template <typename Callable>
+    void ScheduleControl(Callable&& callback) {
+        ScheduledTask task(std::forward<Callable>(callback));
+        PushTask(control_tasks_, task, MAIN_EVENT_SEND_CONTROL);
+    }
     void SetDeviceState(DeviceState state);
     void Alert(const char* status, const char* message, const char* emotion = "", const std::string_view& sound = "");
     void DismissAlert();
@@ -58,36 +104,76 @@ public:
     void Reboot();
     void WakeWordInvoke(const std::string& wake_word);
     bool CanEnterSleepMode();
-    void SendMcpMessage(const std::string& payload);
+    // Takes the ownership of the payload tree
+    void SendMcpMessage(cJSON* payload);
+    // The server accepted CBOR control messages on the current channel
+    bool IsCborEnabled() const;
     void SetAecMode(AecMode mode);
     AecMode GetAecMode() const { return aec_mode_; }
+    // Never waits, a sound played before the audio service is up is queued until it is
     void PlaySound(const std::string_view& sound);
+    void EndConversation();
+    void StartAcousticCalibration();
 
 private:
     Application();
     ~Application();
 
-    std::mutex mutex_;
-    std::deque<std::function<void()>> main_tasks_;
+    TaskQueue main_tasks_{"main", MAIN_TASK_QUEUE_SIZE};
+    TaskQueue control_tasks_{"control", CONTROL_TASK_QUEUE_SIZE};
+    StallDetector stall_detector_{MAIN_LOOP_STALL_MS};
+    BootSequence boot_sequence_;
+    int audio_phase_ = -1;
+    std::mutex sound_mutex_;
+    bool audio_ready_ = false;
+    std::vector<std::string_view> pending_sounds_;
+    SendLaneStats audio_lane_stats_;
     std::unique_ptr<Protocol> protocol_;
     EventGroupHandle_t event_group_ = nullptr;
     esp_timer_handle_t clock_timer_handle_ = nullptr;
     volatile DeviceState device_state_ = kDeviceStateUnknown;
+    DeviceStateMachine state_machine_{[this](DeviceStateAction action, DeviceState previous_state, DeviceState state) {
+        RunStateAction(action, previous_state, state);
+    }};
     ListeningMode listening_mode_ = kListeningModeAutoStop;
     AecMode aec_mode_ = kAecOff;
     std::string last_error_message_;
     AudioService audio_service_;
+    JsonMessageDispatcher message_dispatcher_;
+    std::vector<std::unique_ptr<AudioStreamPacket>> audio_send_batch_;
 
     bool has_server_time_ = false;
+    bool fast_start_ = false;
+    int battery_level_ = -1;
+    bool battery_charging_ = false;
+    bool battery_discharging_ = false;
+    PendingProtocol pending_protocol_ = kPendingProtocolNone;
     bool aborted_ = false;
+    // Set by StopListening, so a push-to-talk released while the channel is still opening does not start listening
+    std::atomic<bool> stop_listening_requested_ = false;
+    // Seconds since the last state change, advanced by the period of the clock timer
     int clock_ticks_ = 0;
+    int clock_period_seconds_ = 1;
     TaskHandle_t check_new_version_task_handle_ = nullptr;
 
     void OnWakeWordDetected();
-    void CheckNewVersion(Ota& ota);
+    bool CheckNewVersion(Ota& ota, bool background);
+    // For the background check, waits until the main loop moved from idle to `state`
+    void EnterStateWhenIdle(DeviceState state);
+    void OnBackgroundCheckDone(Ota& ota);
+    void ApplyServerConfig();
+    void StartProtocol(Ota& ota);
+    bool CreateProtocol(bool use_mqtt, bool use_websocket);
     void ShowActivationCode(const std::string& code, const std::string& message);
     void OnClockTimer();
+    void CheckBattery();
     void SetListeningMode(ListeningMode mode);
+    void RunStateAction(DeviceStateAction action, DeviceState previous_state, DeviceState state);
+    void RunAcousticCalibration();
+    void InitializeMessageHandlers();
+    void PushTask(TaskQueue& queue, ScheduledTask& task, EventBits_t event);
+    void RunControlTasks();
+    void RunMainTasks();
 };
 
 #endif // _APPLICATION_H_
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include "acoustic_calibration.h"
+
+#include <cmath>
+#include <algorithm>
+
+// Below this normalized correlation the peak is considered as noise
+#define LOOPBACK_MIN_CONFIDENCE 0.2f
+
+std::vector<int16_t> AcousticCalibration::GenerateChirp(int sample_rate, int duration_ms, float f0, float f1, float amplitude) {
+    size_t samples = (size_t)sample_rate * duration_ms / 1000;
+    std::vector<int16_t> chirp(samples);
+    if (samples == 0) {
+        return chirp;
+    }
+
+    const double duration = (double)samples / sample_rate;
+    const double k = (f1 - f0) / duration;
+    const size_t fade = std::min(samples / 2, (size_t)(sample_rate / 100)); // 10ms
+    for (size_t i = 0; i < samples; i++) {
+        double t = (double)i / sample_rate;
+        double phase = 2.0 * M_PI * (f0 * t + 0.5 * k * t * t);
+        double window = 1.0;
+        if (i < fade) {
+            window = 0.5 - 0.5 * std::cos(M_PI * i / fade);
+        } else if (i >= samples - fade) {
+            window = 0.5 - 0.5 * std::cos(M_PI * (samples - 1 - i) / fade);
+        }
+        chirp[i] = (int16_t)std::lround(amplitude * 32767.0 * window * std::sin(phase));
+    }
+    return chirp;
+}
+
+LoopbackResult AcousticCalibration::Analyze(const int16_t* reference, size_t reference_size,
+    const int16_t* capture, size_t capture_size, int sample_rate) {
+    LoopbackResult result;
+    if (reference_size == 0 || capture_size < reference_size || sample_rate <= 0) {
+        return result;
+    }
+
+    int64_t reference_energy = 0;
+    for (size_t i = 0; i < reference_size; i++) {
+        reference_energy += (int32_t)reference[i] * reference[i];
+    }
+    if (reference_energy == 0) {
+        return result;
+    }
+
+    // Energy of the capture window under the reference, updated incrementally
+    int64_t window_energy = 0;
+    for (size_t i = 0; i < reference_size; i++) {
+        window_energy += (int32_t)capture[i] * capture[i];
+    }
+
+    const size_t max_lag = capture_size - reference_size;
+    int64_t best_correlation = 0;
+    int64_t best_window_energy = 0;
+    size_t best_lag = 0;
+    for (size_t lag = 0; lag <= max_lag; lag++) {
+        if (lag > 0) {
+            int32_t out = capture[lag - 1];
+            int32_t in = capture[lag + reference_size - 1];
+            window_energy += in * in - out * out;
+        }
+
+        const int16_t* window = capture + lag;
+        int64_t correlation = 0;
+        for (size_t i = 0; i < reference_size; i++) {
+            correlation += (int32_t)reference[i] * window[i];
+        }
+        if (std::llabs(correlation) > std::llabs(best_correlation)) {
+            best_correlation = correlation;
+            best_window_energy = window_energy;
+            best_lag = lag;
+        }
+    }
+
+    if (best_window_energy <= 0) {
+        return result;
+    }
+
+    result.delay_samples = (int)best_lag;
+    result.delay_ms = best_lag * 1000.0f / sample_rate;
+    result.confidence = (float)(std::llabs(best_correlation) / std::sqrt((double)reference_energy * (double)best_window_energy));
+    double gain = (double)std::llabs(best_correlation) / (double)reference_energy;
+    result.echo_gain_db = gain > 0 ? (float)(20.0 * std::log10(gain)) : -120.0f;
+    result.valid = result.confidence >= LOOPBACK_MIN_CONFIDENCE;
+    return result;
+}
+
+float AcousticCalibration::GetI2sBufferLatencyMs(int desc_num, int frame_num, int input_sample_rate, int output_sample_rate) {
+    float latency = 0;
+    if (input_sample_rate > 0) {
+        latency += desc_num * frame_num * 1000.0f / input_sample_rate;
+    }
+    if (output_sample_rate > 0) {
+        latency += desc_num * frame_num * 1000.0f / output_sample_rate;
+    }
+    return latency;
+}
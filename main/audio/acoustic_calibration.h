@@ -0,0 +1,37 @@
+#ifndef ACOUSTIC_CALIBRATION_H
+#define ACOUSTIC_CALIBRATION_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Loopback calibration core, used to measure the speaker -> mic delay of a board.
+ *
+ * A linear chirp is played through the output path and captured by the microphone,
+ * the capture is cross-correlated against the same chirp generated at the capture
+ * sample rate. The lag of the correlation peak is the end-to-end acoustic latency.
+ */
+
+struct LoopbackResult {
+    bool valid = false;
+    int delay_samples = 0;      // Lag of the correlation peak in the capture
+    float delay_ms = 0;
+    float echo_gain_db = 0;     // Least-squares gain of the reference found in the capture
+    float confidence = 0;       // Normalized correlation at the peak (0 ~ 1)
+};
+
+class AcousticCalibration {
+public:
+    // Linear chirp from f0 to f1 with raised-cosine fade in / fade out
+    static std::vector<int16_t> GenerateChirp(int sample_rate, int duration_ms, float f0, float f1, float amplitude);
+
+    // Find the reference inside the capture, searching lags in [0, capture_size - reference_size]
+    static LoopbackResult Analyze(const int16_t* reference, size_t reference_size,
+        const int16_t* capture, size_t capture_size, int sample_rate);
+
+    // Latency added by the I2S DMA ring buffers on both the TX and RX side
+    static float GetI2sBufferLatencyMs(int desc_num, int frame_num, int input_sample_rate, int output_sample_rate);
+};
+
+#endif // ACOUSTIC_CALIBRATION_H
@@ -53,6 +53,10 @@ void AudioCodec::SetOutputVolume(int volume) {
     
     Settings settings("audio", true);
     settings.SetInt("output_volume", output_volume_);
+
+    if (on_output_volume_changed_) {
+        on_output_volume_changed_(output_volume_);
+    }
 }
 
 void AudioCodec::EnableInput(bool enable) {
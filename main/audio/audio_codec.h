@@ -27,6 +27,8 @@ public:
     virtual void OutputData(std::vector<int16_t>& data);
     virtual bool InputData(std::vector<int16_t>& data);
     virtual void Start();
+    // Called after the volume is set, for the mute icon
+    void OnOutputVolumeChanged(std::function<void(int volume)> callback) { on_output_volume_changed_ = callback; }
 
     inline bool duplex() const { return duplex_; }
     inline bool input_reference() const { return input_reference_; }
@@ -51,6 +53,7 @@ protected:
     int input_channels_ = 1;
     int output_channels_ = 1;
     int output_volume_ = 70;
+    std::function<void(int volume)> on_output_volume_changed_;
 
     virtual int Read(int16_t* dest, int samples) = 0;
     virtual int Write(const int16_t* data, int samples) = 0;
@@ -1,6 +1,12 @@
 #include "audio_service.h"
+#include "settings.h"
+#include "event_bus.h"
+#include "task_registry.h"
+#include "memory_budget.h"
 #include <esp_log.h>
 #include <cstring>
+#include <cmath>
+#include <atomic>
 
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "processors/afe_audio_processor.h"
@@ -34,10 +40,17 @@ void AudioService::Initialize(AudioCodec* codec) {
     codec_ = codec;
     codec_->Start();
 
+    /* Load the result of the last acoustic calibration */
+    Settings settings("audio", false);
+    aec_delay_ms_ = settings.GetInt("aec_delay_ms", 0);
+
     /* Setup the audio codec */
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
-    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-    opus_encoder_->SetComplexity(0);
+    {
+        MemoryBudget::Measure measure(kMemoryOpus);
+        opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
+        opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
+        opus_encoder_->SetComplexity(0);
+    }
 
     if (codec->input_sample_rate() != 16000) {
         input_resampler_.Configure(codec->input_sample_rate(), 16000);
@@ -66,15 +79,16 @@ void AudioService::Initialize(AudioCodec* codec) {
 
     audio_processor_->OnVadStateChange([this](bool speaking) {
         voice_detected_ = speaking;
-        if (callbacks_.on_vad_change) {
-            callbacks_.on_vad_change(speaking);
-        }
+        EventBus::GetInstance().PublishVad(speaking);
     });
 
     if (wake_word_) {
         wake_word_->OnWakeWordDetected([this](const std::string& wake_word) {
-            if (callbacks_.on_wake_word_detected) {
-                callbacks_.on_wake_word_detected(wake_word);
+            EventBus::GetInstance().PublishWakeWord(wake_word.c_str());
+        });
+        wake_word_->OnCommandDetected([this](int command_id) {
+            if (callbacks_.on_local_command) {
+                callbacks_.on_local_command(command_id);
             }
         });
     }
@@ -94,46 +108,32 @@ void AudioService::Initialize(AudioCodec* codec) {
 
 void AudioService::Start() {
     service_stopped_ = false;
-    xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+    xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING |
+        AS_EVENT_MEMO_RECORDING);
 
     esp_timer_start_periodic(audio_power_timer_, 1000000);
 
-#if CONFIG_USE_AUDIO_PROCESSOR
+    auto& tasks = TaskRegistry::GetInstance();
     /* Start the audio input task */
-    xTaskCreatePinnedToCore([](void* arg) {
+    tasks.Create(kTaskAudioInput, [](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioInputTask();
         vTaskDelete(NULL);
-    }, "audio_input", 2048 * 3, this, 8, &audio_input_task_handle_, 1);
+    }, this, &audio_input_task_handle_);
 
     /* Start the audio output task */
-    xTaskCreate([](void* arg) {
+    tasks.Create(kTaskAudioOutput, [](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioOutputTask();
         vTaskDelete(NULL);
-    }, "audio_output", 2048 * 2, this, 3, &audio_output_task_handle_);
-#else
-    /* Start the audio input task */
-    xTaskCreate([](void* arg) {
-        AudioService* audio_service = (AudioService*)arg;
-        audio_service->AudioInputTask();
-        vTaskDelete(NULL);
-    }, "audio_input", 2048 * 2, this, 8, &audio_input_task_handle_);
-
-    /* Start the audio output task */
-    xTaskCreate([](void* arg) {
-        AudioService* audio_service = (AudioService*)arg;
-        audio_service->AudioOutputTask();
-        vTaskDelete(NULL);
-    }, "audio_output", 2048, this, 3, &audio_output_task_handle_);
-#endif
+    }, this, &audio_output_task_handle_);
 
     /* Start the opus codec task */
-    xTaskCreate([](void* arg) {
+    tasks.Create(kTaskOpusCodec, [](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->OpusCodecTask();
         vTaskDelete(NULL);
-    }, "opus_codec", 2048 * 13, this, 2, &opus_codec_task_handle_);
+    }, this, &opus_codec_task_handle_);
 }
 
 void AudioService::Stop() {
@@ -163,26 +163,27 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
         if (!codec_->InputData(data)) {
             return false;
         }
+        /* The scratch buffers keep their capacity, so there is no allocation after the first read */
         if (codec_->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
-                mic_channel[i] = data[j];
-                reference_channel[i] = data[j + 1];
+            mic_channel_.resize(data.size() / 2);
+            reference_channel_.resize(data.size() / 2);
+            for (size_t i = 0, j = 0; i < mic_channel_.size(); ++i, j += 2) {
+                mic_channel_[i] = data[j];
+                reference_channel_[i] = data[j + 1];
             }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
-                data[j] = resampled_mic[i];
-                data[j + 1] = resampled_reference[i];
+            resampled_mic_.resize(input_resampler_.GetOutputSamples(mic_channel_.size()));
+            resampled_reference_.resize(reference_resampler_.GetOutputSamples(reference_channel_.size()));
+            input_resampler_.Process(mic_channel_.data(), mic_channel_.size(), resampled_mic_.data());
+            reference_resampler_.Process(reference_channel_.data(), reference_channel_.size(), resampled_reference_.data());
+            data.resize(resampled_mic_.size() + resampled_reference_.size());
+            for (size_t i = 0, j = 0; i < resampled_mic_.size(); ++i, j += 2) {
+                data[j] = resampled_mic_[i];
+                data[j + 1] = resampled_reference_[i];
             }
         } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
+            resampled_mic_.resize(input_resampler_.GetOutputSamples(data.size()));
+            input_resampler_.Process(data.data(), data.size(), resampled_mic_.data());
+            data.swap(resampled_mic_);
         }
     } else {
         data.resize(samples * codec_->input_channels());
@@ -209,12 +210,13 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
 void AudioService::AudioInputTask() {
     while (true) {
         EventBits_t bits = xEventGroupWaitBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
-            AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING,
+            AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING | AS_EVENT_MEMO_RECORDING,
             pdFALSE, pdFALSE, portMAX_DELAY);
 
         if (service_stopped_) {
             break;
         }
+        std::lock_guard<std::mutex> input_lock(audio_input_mutex_);
         if (audio_input_need_warmup_) {
             audio_input_need_warmup_ = false;
             vTaskDelay(pdMS_TO_TICKS(120));
@@ -244,13 +246,36 @@ void AudioService::AudioInputTask() {
             }
         }
 
+        /* Voice memo takes the microphone over the wake word until the recording stops */
+        if (bits & AS_EVENT_MEMO_RECORDING) {
+            std::vector<int16_t> data;
+            int samples = OPUS_FRAME_DURATION_MS * 16000 / 1000;
+            if (ReadAudioData(data, 16000, samples)) {
+                if (codec_->input_channels() == 2) {
+                    auto mono_data = std::vector<int16_t>(data.size() / 2);
+                    for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
+                        mono_data[i] = data[j];
+                    }
+                    data = std::move(mono_data);
+                }
+                PushTaskToEncodeQueue(kAudioTaskTypeEncodeToMemo, std::move(data));
+                continue;
+            }
+        }
+
         /* Feed the wake word */
         if (bits & AS_EVENT_WAKE_WORD_RUNNING) {
-            std::vector<int16_t> data;
             int samples = wake_word_->GetFeedSize();
             if (samples > 0) {
-                if (ReadAudioData(data, 16000, samples)) {
-                    wake_word_->Feed(data);
+                if (ReadAudioData(wake_word_input_, 16000, samples)) {
+#if CONFIG_USE_WAKE_WORD_GATE
+                    /* The model only runs around speech-like activity */
+                    wake_word_gate_.Process(wake_word_input_, [this](const std::vector<int16_t>& data) {
+                        wake_word_->Feed(data);
+                    });
+#else
+                    wake_word_->Feed(wake_word_input_);
+#endif
                     continue;
                 }
             }
@@ -335,7 +360,9 @@ void AudioService::OpusCodecTask() {
             task->timestamp = packet->timestamp;
 
             SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
-            if (opus_decoder_->Decode(std::move(packet->payload), task->pcm)) {
+            bool decoded = opus_decoder_->Decode(std::move(packet->payload), task->pcm);
+            AudioPacketPool::GetInstance().Release(std::move(packet));
+            if (decoded) {
                 // Resample if the sample rate is different
                 if (opus_decoder_->sample_rate() != codec_->output_sample_rate()) {
                     int target_size = output_resampler_.GetOutputSamples(task->pcm.size());
@@ -365,10 +392,17 @@ void AudioService::OpusCodecTask() {
             packet->frame_duration = OPUS_FRAME_DURATION_MS;
             packet->sample_rate = 16000;
             packet->timestamp = task->timestamp;
-            if (!opus_encoder_->Encode(std::move(task->pcm), packet->payload)) {
+            if (!opus_encoder_->Encode(std::move(task->pcm), encode_buffer_)) {
                 ESP_LOGE(TAG, "Failed to encode audio");
                 continue;
             }
+            /* Packets to the server leave room for the transport header in front of the Opus data */
+            if (task->type == kAudioTaskTypeEncodeToSendQueue) {
+                packet->headroom = AUDIO_PACKET_HEADROOM;
+            }
+            packet->payload.reserve(packet->headroom + encode_buffer_.size());
+            packet->payload.resize(packet->headroom);
+            packet->payload.insert(packet->payload.end(), encode_buffer_.begin(), encode_buffer_.end());
 
             if (task->type == kAudioTaskTypeEncodeToSendQueue) {
                 {
@@ -381,6 +415,11 @@ void AudioService::OpusCodecTask() {
             } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
                 std::lock_guard<std::mutex> lock(audio_queue_mutex_);
                 audio_testing_queue_.push_back(std::move(packet));
+            } else if (task->type == kAudioTaskTypeEncodeToMemo) {
+                /* The memo writer only copies the packet into its buffer, flash writes happen in its own task */
+                if (on_memo_packet_) {
+                    on_memo_packet_(*packet);
+                }
             }
             debug_statistics_.encode_count++;
             lock.lock();
@@ -434,6 +473,7 @@ bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> pa
         if (wait) {
             audio_queue_cv_.wait(lock, [this]() { return audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE; });
         } else {
+            AudioPacketPool::GetInstance().Release(std::move(packet));
             return false;
         }
     }
@@ -453,6 +493,20 @@ std::unique_ptr<AudioStreamPacket> AudioService::PopPacketFromSendQueue() {
     return packet;
 }
 
+bool AudioService::PopPacketsFromSendQueue(std::vector<std::unique_ptr<AudioStreamPacket>>& packets, size_t max_count) {
+    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+    packets.clear();
+    while (!audio_send_queue_.empty() && packets.size() < max_count) {
+        packets.push_back(std::move(audio_send_queue_.front()));
+        audio_send_queue_.pop_front();
+    }
+    if (packets.empty()) {
+        return false;
+    }
+    audio_queue_cv_.notify_all();
+    return true;
+}
+
 void AudioService::EncodeWakeWord() {
     if (wake_word_) {
         wake_word_->EncodeWakeWordData();
@@ -484,11 +538,31 @@ void AudioService::EnableWakeWordDetection(bool enable) {
                 return;
             }
             wake_word_initialized_ = true;
+#if CONFIG_USE_WAKE_WORD_GATE
+            WakeWordGateConfig gate_config;
+            gate_config.channels = codec_->input_channels();
+            gate_config.chunk_size = wake_word_->GetFeedSize() * codec_->input_channels();
+            gate_config.chunk_ms = wake_word_->GetFeedSize() * 1000 / 16000;
+            gate_config.preroll_ms = CONFIG_WAKE_WORD_GATE_PREROLL_MS;
+            gate_config.hangover_ms = CONFIG_WAKE_WORD_GATE_HANGOVER_MS;
+            gate_config.open_threshold_db = CONFIG_WAKE_WORD_GATE_THRESHOLD_DB;
+            wake_word_gate_.Configure(gate_config);
+#endif
         }
         wake_word_->Start();
+#if CONFIG_USE_WAKE_WORD_GATE
+        /* The gate is only touched by the audio input task while the wake word is running */
+        if (!IsWakeWordRunning()) {
+            wake_word_gate_.Reset();
+        }
+#endif
         xEventGroupSetBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
     } else {
         wake_word_->Stop();
+#if CONFIG_USE_WAKE_WORD_GATE
+        ESP_LOGD(TAG, "Wake word gate: passed=%lu gated=%lu noise_floor=%.1fdB", wake_word_gate_.passed_chunks(),
+            wake_word_gate_.gated_chunks(), wake_word_gate_.noise_floor_db());
+#endif
         xEventGroupClearBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
     }
 }
@@ -535,10 +609,140 @@ void AudioService::EnableDeviceAec(bool enable) {
     audio_processor_->EnableDeviceAec(enable);
 }
 
+void AudioService::EnableMemoRecording(bool enable) {
+    ESP_LOGI(TAG, "%s memo recording", enable ? "Enabling" : "Disabling");
+    if (enable) {
+        xEventGroupSetBits(event_group_, AS_EVENT_MEMO_RECORDING);
+    } else {
+        xEventGroupClearBits(event_group_, AS_EVENT_MEMO_RECORDING);
+    }
+}
+
+void AudioService::OnMemoPacket(std::function<void(const AudioStreamPacket& packet)> callback) {
+    on_memo_packet_ = callback;
+}
+
+// Shared with the playback task, deleted by whichever side lets go of it last
+struct CalibrationProbe {
+    AudioCodec* codec;
+    EventGroupHandle_t event_group;
+    std::vector<int16_t> pcm;
+    int64_t play_time_us = 0;
+    std::atomic<bool> released = false;
+
+    void Release() {
+        if (released.exchange(true)) {
+            delete this;
+        }
+    }
+};
+
+bool AudioService::CalibrateAcousticLatency(AcousticCalibrationResult& result) {
+    const int sample_rate = 16000;
+    auto probe = new CalibrationProbe{
+        .codec = codec_,
+        .event_group = event_group_,
+        .pcm = AcousticCalibration::GenerateChirp(codec_->output_sample_rate(), ACOUSTIC_CALIBRATION_PROBE_MS, 200, 6000, 0.5f),
+    };
+    auto reference = AcousticCalibration::GenerateChirp(sample_rate, ACOUSTIC_CALIBRATION_PROBE_MS, 200, 6000, 0.5f);
+
+    /* Take over the microphone from the wake word and the audio processor. The input task finishes the
+       read it is in, then waits for the lock, so the codec and the read buffers are ours until it is released */
+    EventBits_t running_bits = xEventGroupGetBits(event_group_) & (AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+    xEventGroupClearBits(event_group_, running_bits | AS_EVENT_CALIBRATION_PLAYED);
+    std::unique_lock<std::mutex> input_lock(audio_input_mutex_);
+    ResetDecoder();
+
+    if (!codec_->input_enabled() || !codec_->output_enabled()) {
+        esp_timer_stop(audio_power_timer_);
+        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+        codec_->EnableInput(true);
+        codec_->EnableOutput(true);
+    }
+
+    /* Drain the samples already queued in the RX DMA buffers, so that the next read is real time */
+    std::vector<int16_t> data;
+    const int chunk_samples = sample_rate * 10 / 1000;
+    const int flush_samples = AUDIO_CODEC_DMA_DESC_NUM * AUDIO_CODEC_DMA_FRAME_NUM * sample_rate / codec_->input_sample_rate();
+    for (int flushed = 0; flushed < flush_samples * 2; flushed += chunk_samples) {
+        ReadAudioData(data, sample_rate, chunk_samples);
+    }
+
+    std::vector<int16_t> capture;
+    capture.reserve(sample_rate * (ACOUSTIC_CALIBRATION_PROBE_MS + ACOUSTIC_CALIBRATION_MAX_DELAY_MS) / 1000);
+    int64_t capture_time_us = esp_timer_get_time();
+
+    bool created = TaskRegistry::GetInstance().Create(kTaskCalibrationProbe, [](void* arg) {
+        auto probe = (CalibrationProbe*)arg;
+        probe->play_time_us = esp_timer_get_time();
+        probe->codec->OutputData(probe->pcm);
+        xEventGroupSetBits(probe->event_group, AS_EVENT_CALIBRATION_PLAYED);
+        probe->Release();
+        vTaskDelete(NULL);
+    }, probe);
+    if (!created) {
+        ESP_LOGE(TAG, "Acoustic calibration failed, cannot create the probe task");
+        delete probe;
+        input_lock.unlock();
+        xEventGroupSetBits(event_group_, running_bits);
+        return false;
+    }
+
+    int channels = codec_->input_channels();
+    while (capture.size() < capture.capacity()) {
+        if (!ReadAudioData(data, sample_rate, chunk_samples)) {
+            break;
+        }
+        /* Only the first channel is the microphone */
+        for (size_t i = 0; i < data.size() && capture.size() < capture.capacity(); i += channels) {
+            capture.push_back(data[i]);
+        }
+    }
+    input_lock.unlock();
+
+    EventBits_t bits = xEventGroupWaitBits(event_group_, AS_EVENT_CALIBRATION_PLAYED, pdTRUE, pdFALSE,
+        pdMS_TO_TICKS(ACOUSTIC_CALIBRATION_PLAY_TIMEOUT_MS));
+    int64_t play_time_us = probe->play_time_us;
+    probe->Release();
+    last_output_time_ = std::chrono::steady_clock::now();
+    xEventGroupSetBits(event_group_, running_bits);
+    if (!(bits & AS_EVENT_CALIBRATION_PLAYED)) {
+        ESP_LOGW(TAG, "Acoustic calibration failed, the probe did not finish playing");
+        return false;
+    }
+
+    result.loopback = AcousticCalibration::Analyze(reference.data(), reference.size(), capture.data(), capture.size(), sample_rate);
+    result.i2s_buffer_ms = AcousticCalibration::GetI2sBufferLatencyMs(AUDIO_CODEC_DMA_DESC_NUM, AUDIO_CODEC_DMA_FRAME_NUM,
+        codec_->input_sample_rate(), codec_->output_sample_rate());
+    result.end_to_end_ms = result.loopback.delay_ms - (play_time_us - capture_time_us) / 1000.0f;
+    ESP_LOGI(TAG, "Acoustic calibration: valid=%d end_to_end=%.1fms i2s=%.1fms gain=%.1fdB confidence=%.2f",
+        result.loopback.valid, result.end_to_end_ms, result.i2s_buffer_ms, result.loopback.echo_gain_db, result.loopback.confidence);
+
+    if (!result.loopback.valid || result.end_to_end_ms < 0) {
+        ESP_LOGW(TAG, "Acoustic calibration failed, the probe was not found in the capture");
+        return false;
+    }
+
+    // Only reported to the server for its AEC, the reference channel of the device-side AEC is already aligned
+    aec_delay_ms_ = std::lround(result.end_to_end_ms);
+    Settings settings("audio", true);
+    settings.SetInt("aec_delay_ms", aec_delay_ms_);
+    settings.SetInt("echo_gain_db", std::lround(result.loopback.echo_gain_db));
+    return true;
+}
+
 void AudioService::SetCallbacks(AudioServiceCallbacks& callbacks) {
     callbacks_ = callbacks;
 }
 
+bool AudioService::SetLocalCommands(const std::vector<std::pair<int, std::string>>& commands) {
+    if (!wake_word_ || !wake_word_->SupportsCommands()) {
+        return false;
+    }
+    wake_word_->SetCommands(commands);
+    return true;
+}
+
 void AudioService::PlaySound(const std::string_view& ogg) {
     if (!codec_->output_enabled()) {
         esp_timer_stop(audio_power_timer_);
@@ -626,10 +830,9 @@ void AudioService::PlaySound(const std::string_view& ogg) {
             }
 
             // Audio packet (Opus)
-            auto packet = std::make_unique<AudioStreamPacket>();
+            auto packet = AudioPacketPool::GetInstance().Acquire(pkt_len);
             packet->sample_rate = sample_rate;
             packet->frame_duration = 60;
-            packet->payload.resize(pkt_len);
             std::memcpy(packet->payload.data(), pkt_ptr, pkt_len);
             PushPacketToDecodeQueue(std::move(packet), true);
         }
@@ -20,6 +20,8 @@
 #include "audio_processor.h"
 #include "processors/audio_debugger.h"
 #include "wake_word.h"
+#include "wake_word_gate.h"
+#include "acoustic_calibration.h"
 #include "protocol.h"
 
 
@@ -42,6 +44,11 @@
 #define AUDIO_TESTING_MAX_DURATION_MS 10000
 #define MAX_TIMESTAMPS_IN_QUEUE 3
 
+#define ACOUSTIC_CALIBRATION_PROBE_MS 300
+#define ACOUSTIC_CALIBRATION_MAX_DELAY_MS 500
+// Time given to the speaker to play the probe before the calibration gives up
+#define ACOUSTIC_CALIBRATION_PLAY_TIMEOUT_MS 3000
+
 #define AUDIO_POWER_TIMEOUT_MS 15000
 #define AUDIO_POWER_CHECK_INTERVAL_MS 1000
 
@@ -50,18 +57,20 @@
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
 #define AS_EVENT_AUDIO_PROCESSOR_RUNNING    (1 << 2)
 #define AS_EVENT_PLAYBACK_NOT_EMPTY         (1 << 3)
+#define AS_EVENT_CALIBRATION_PLAYED         (1 << 4)
+#define AS_EVENT_MEMO_RECORDING             (1 << 5)
 
 struct AudioServiceCallbacks {
     std::function<void(void)> on_send_queue_available;
-    std::function<void(const std::string&)> on_wake_word_detected;
-    std::function<void(bool)> on_vad_change;
     std::function<void(void)> on_audio_testing_queue_full;
+    std::function<void(int)> on_local_command;
 };
 
 
 enum AudioTaskType {
     kAudioTaskTypeEncodeToSendQueue,
     kAudioTaskTypeEncodeToTestingQueue,
+    kAudioTaskTypeEncodeToMemo,
     kAudioTaskTypeDecodeToPlaybackQueue,
 };
 
@@ -71,6 +80,12 @@ struct AudioTask {
     uint32_t timestamp;
 };
 
+struct AcousticCalibrationResult {
+    LoopbackResult loopback;
+    float end_to_end_ms = 0;    // Speaker write -> mic read, including the I2S buffers
+    float i2s_buffer_ms = 0;    // Part of end_to_end_ms spent in the I2S DMA buffers
+};
+
 struct DebugStatistics {
     uint32_t input_count = 0;
     uint32_t decode_count = 0;
@@ -98,11 +113,18 @@ public:
     void EnableVoiceProcessing(bool enable);
     void EnableAudioTesting(bool enable);
     void EnableDeviceAec(bool enable);
+    void EnableMemoRecording(bool enable);
+    void OnMemoPacket(std::function<void(const AudioStreamPacket& packet)> callback);
+    bool CalibrateAcousticLatency(AcousticCalibrationResult& result);
+    int GetAecDelayMs() const { return aec_delay_ms_; }
 
     void SetCallbacks(AudioServiceCallbacks& callbacks);
+    bool SetLocalCommands(const std::vector<std::pair<int, std::string>>& commands);
 
     bool PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait = false);
     std::unique_ptr<AudioStreamPacket> PopPacketFromSendQueue();
+    // Moves up to max_count packets into packets, returns false if the queue is empty
+    bool PopPacketsFromSendQueue(std::vector<std::unique_ptr<AudioStreamPacket>>& packets, size_t max_count);
     void PlaySound(const std::string_view& sound);
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
@@ -110,6 +132,7 @@ public:
 private:
     AudioCodec* codec_ = nullptr;
     AudioServiceCallbacks callbacks_;
+    std::function<void(const AudioStreamPacket& packet)> on_memo_packet_;
     std::unique_ptr<AudioProcessor> audio_processor_;
     std::unique_ptr<WakeWord> wake_word_;
     std::unique_ptr<AudioDebugger> audio_debugger_;
@@ -118,6 +141,7 @@ private:
     OpusResampler input_resampler_;
     OpusResampler reference_resampler_;
     OpusResampler output_resampler_;
+    WakeWordGate wake_word_gate_;
     DebugStatistics debug_statistics_;
 
     EventGroupHandle_t event_group_;
@@ -127,6 +151,8 @@ private:
     TaskHandle_t audio_output_task_handle_ = nullptr;
     TaskHandle_t opus_codec_task_handle_ = nullptr;
     std::mutex audio_queue_mutex_;
+    // Held by the input task while it reads, the acoustic calibration takes it to have the microphone alone
+    std::mutex audio_input_mutex_;
     std::condition_variable audio_queue_cv_;
     std::deque<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
     std::deque<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
@@ -136,11 +162,22 @@ private:
     // For server AEC
     std::deque<uint32_t> timestamp_queue_;
 
+    // Output of the Opus encoder, copied once into the packet after the headroom
+    std::vector<uint8_t> encode_buffer_;
+
+    // Reused by the audio input task, so that reading the microphone does not allocate
+    std::vector<int16_t> wake_word_input_;
+    std::vector<int16_t> mic_channel_;
+    std::vector<int16_t> reference_channel_;
+    std::vector<int16_t> resampled_mic_;
+    std::vector<int16_t> resampled_reference_;
+
     bool wake_word_initialized_ = false;
     bool audio_processor_initialized_ = false;
     bool voice_detected_ = false;
     bool service_stopped_ = true;
     bool audio_input_need_warmup_ = false;
+    int aec_delay_ms_ = 0;
 
     esp_timer_handle_t audio_power_timer_ = nullptr;
     std::chrono::steady_clock::time_point last_input_time_;
@@ -0,0 +1,229 @@
+#include "ogg_opus_stream.h"
+
+#include <cstring>
+
+static const char kOpusVendor[] = "xiaozhi";
+
+static void WriteLe16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void WriteLe32(uint8_t* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (v >> (i * 8)) & 0xff;
+    }
+}
+
+static void WriteLe64(uint8_t* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (v >> (i * 8)) & 0xff;
+    }
+}
+
+static uint32_t ReadLe32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t OggCrc32(uint32_t crc, const uint8_t* data, size_t size) {
+    static uint32_t table[256];
+    static bool table_ready = false;
+    if (!table_ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t r = i << 24;
+            for (int j = 0; j < 8; j++) {
+                r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : (r << 1);
+            }
+            table[i] = r;
+        }
+        table_ready = true;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        crc = (crc << 8) ^ table[((crc >> 24) ^ data[i]) & 0xff];
+    }
+    return crc;
+}
+
+OggOpusWriter::OggOpusWriter(PageSink sink, uint32_t serial) : sink_(sink), serial_(serial) {
+    page_.reserve(OGG_PAGE_MAX_HEADER_SIZE + OGG_PAGE_TARGET_BODY_SIZE + 2 * OGG_PAGE_MAX_SEGMENTS);
+    page_.resize(OGG_PAGE_MAX_HEADER_SIZE);
+}
+
+bool OggOpusWriter::WriteHeaders(int sample_rate, int channels, int pre_skip) {
+    uint8_t head[19];
+    memcpy(head, "OpusHead", 8);
+    head[8] = 1;    // version
+    head[9] = channels;
+    WriteLe16(head + 10, pre_skip);
+    WriteLe32(head + 12, sample_rate);
+    WriteLe16(head + 16, 0);    // output gain
+    head[18] = 0;   // channel mapping family
+    if (!AppendPacket(head, sizeof(head)) || !FlushPage(false)) {
+        return false;
+    }
+
+    uint8_t tags[8 + 4 + sizeof(kOpusVendor) - 1 + 4];
+    size_t vendor_size = sizeof(kOpusVendor) - 1;
+    memcpy(tags, "OpusTags", 8);
+    WriteLe32(tags + 8, vendor_size);
+    memcpy(tags + 12, kOpusVendor, vendor_size);
+    WriteLe32(tags + 12 + vendor_size, 0);  // user comment count
+    return AppendPacket(tags, sizeof(tags)) && FlushPage(false);
+}
+
+bool OggOpusWriter::WritePacket(const uint8_t* data, size_t size, int frame_duration_ms) {
+    if (!AppendPacket(data, size)) {
+        return false;
+    }
+    granule_ += frame_duration_ms * OGG_OPUS_GRANULE_RATE / 1000;
+
+    size_t body_size = page_.size() - OGG_PAGE_MAX_HEADER_SIZE;
+    if (body_size >= OGG_PAGE_TARGET_BODY_SIZE || granule_ - page_start_granule_ >= OGG_PAGE_MAX_GRANULE_SPAN) {
+        return FlushPage(false);
+    }
+    return true;
+}
+
+bool OggOpusWriter::Finish() {
+    return FlushPage(true);
+}
+
+bool OggOpusWriter::AppendPacket(const uint8_t* data, size_t size) {
+    // A packet of N bytes takes N / 255 + 1 lacing values
+    int segments = size / 255 + 1;
+    if (segments > OGG_PAGE_MAX_SEGMENTS) {
+        return false;
+    }
+    if (segment_count_ + segments > OGG_PAGE_MAX_SEGMENTS) {
+        FlushPage(false);
+    }
+
+    for (int i = 0; i < segments - 1; i++) {
+        segments_[segment_count_++] = 255;
+    }
+    segments_[segment_count_++] = size % 255;
+    page_.insert(page_.end(), data, data + size);
+    return true;
+}
+
+bool OggOpusWriter::FlushPage(bool eos) {
+    if (segment_count_ == 0 && !eos) {
+        return true;
+    }
+
+    size_t header_size = OGG_PAGE_HEADER_SIZE + segment_count_;
+    uint8_t* header = page_.data() + OGG_PAGE_MAX_HEADER_SIZE - header_size;
+    memcpy(header, "OggS", 4);
+    header[4] = 0;  // version
+    header[5] = header_type_ | (eos ? 0x04 : 0);
+    WriteLe64(header + 6, granule_);
+    WriteLe32(header + 14, serial_);
+    WriteLe32(header + 18, sequence_);
+    WriteLe32(header + 22, 0);
+    header[26] = segment_count_;
+    memcpy(header + OGG_PAGE_HEADER_SIZE, segments_, segment_count_);
+
+    size_t page_size = page_.size() - (OGG_PAGE_MAX_HEADER_SIZE - header_size);
+    WriteLe32(header + 22, OggCrc32(0, header, page_size));
+
+    bool accepted = sink_(header, page_size);
+    if (!accepted) {
+        dropped_pages_++;
+    }
+
+    sequence_++;
+    header_type_ = 0;
+    segment_count_ = 0;
+    page_start_granule_ = granule_;
+    page_.resize(OGG_PAGE_MAX_HEADER_SIZE);
+    return accepted;
+}
+
+OggOpusReader::OggOpusReader(Source source) : source_(source) {
+}
+
+bool OggOpusReader::ReadHeaders() {
+    std::vector<uint8_t> packet;
+    if (!ReadRawPacket(packet) || packet.size() < 19 || memcmp(packet.data(), "OpusHead", 8) != 0) {
+        return false;
+    }
+    channels_ = packet[9];
+    sample_rate_ = ReadLe32(packet.data() + 12);
+
+    if (!ReadRawPacket(packet) || packet.size() < 8 || memcmp(packet.data(), "OpusTags", 8) != 0) {
+        return false;
+    }
+    return true;
+}
+
+bool OggOpusReader::ReadPacket(std::vector<uint8_t>& packet) {
+    while (ReadRawPacket(packet)) {
+        if (!packet.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool OggOpusReader::ReadPage() {
+    while (true) {
+        if (source_(header_, OGG_PAGE_HEADER_SIZE) != OGG_PAGE_HEADER_SIZE) {
+            return false;
+        }
+        if (memcmp(header_, "OggS", 4) != 0) {
+            // No resync, the files are written by OggOpusWriter page by page
+            corrupted_pages_++;
+            return false;
+        }
+
+        int segment_count = header_[26];
+        if (source_(header_ + OGG_PAGE_HEADER_SIZE, segment_count) != (size_t)segment_count) {
+            return false;
+        }
+        size_t body_size = 0;
+        for (int i = 0; i < segment_count; i++) {
+            body_size += header_[OGG_PAGE_HEADER_SIZE + i];
+        }
+        body_.resize(body_size);
+        if (body_size > 0 && source_(body_.data(), body_size) != body_size) {
+            return false;
+        }
+
+        uint32_t crc = ReadLe32(header_ + 22);
+        WriteLe32(header_ + 22, 0);
+        uint32_t actual = OggCrc32(0, header_, OGG_PAGE_HEADER_SIZE + segment_count);
+        actual = OggCrc32(actual, body_.data(), body_size);
+        if (crc != actual) {
+            corrupted_pages_++;
+            continue;
+        }
+
+        segment_count_ = segment_count;
+        segment_index_ = 0;
+        body_offset_ = 0;
+        return true;
+    }
+}
+
+bool OggOpusReader::ReadRawPacket(std::vector<uint8_t>& packet) {
+    packet.clear();
+    while (true) {
+        while (segment_index_ >= segment_count_) {
+            if (!ReadPage()) {
+                return false;
+            }
+            // Drop the partial packet if the next page is not its continuation
+            if (!(header_[5] & 0x01)) {
+                packet.clear();
+            }
+        }
+
+        uint8_t lacing = header_[OGG_PAGE_HEADER_SIZE + segment_index_++];
+        packet.insert(packet.end(), body_.begin() + body_offset_, body_.begin() + body_offset_ + lacing);
+        body_offset_ += lacing;
+        if (lacing < 255) {
+            return true;
+        }
+    }
+}
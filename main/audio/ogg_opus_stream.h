@@ -0,0 +1,94 @@
+#ifndef OGG_OPUS_STREAM_H
+#define OGG_OPUS_STREAM_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+/*
+ * Streaming Ogg/Opus muxer and demuxer (RFC 3533 / RFC 7845).
+ *
+ * Both sides work page by page, only one page is kept in memory at any time, so a long
+ * recording never has to be buffered as a whole. Packets are never split across pages.
+ */
+
+#define OGG_PAGE_HEADER_SIZE 27
+#define OGG_PAGE_MAX_SEGMENTS 255
+#define OGG_PAGE_MAX_HEADER_SIZE (OGG_PAGE_HEADER_SIZE + OGG_PAGE_MAX_SEGMENTS)
+// A page is flushed when its body reaches this size or it holds one second of audio
+#define OGG_PAGE_TARGET_BODY_SIZE 2048
+#define OGG_PAGE_MAX_GRANULE_SPAN 48000
+// Opus granule positions always count samples at 48kHz
+#define OGG_OPUS_GRANULE_RATE 48000
+
+class OggOpusWriter {
+public:
+    // Called with a complete page (header + body), must return false if the page was not accepted
+    using PageSink = std::function<bool(const uint8_t* page, size_t size)>;
+
+    OggOpusWriter(PageSink sink, uint32_t serial);
+
+    // OpusHead and OpusTags, each on its own page
+    bool WriteHeaders(int sample_rate, int channels, int pre_skip);
+    bool WritePacket(const uint8_t* data, size_t size, int frame_duration_ms);
+    // Flush the pending packets with the end-of-stream flag
+    bool Finish();
+
+    uint32_t page_count() const { return sequence_; }
+    uint32_t dropped_pages() const { return dropped_pages_; }
+    uint64_t granule_position() const { return granule_; }
+
+private:
+    PageSink sink_;
+    uint32_t serial_;
+    uint32_t sequence_ = 0;
+    uint32_t dropped_pages_ = 0;
+    uint64_t granule_ = 0;
+    uint64_t page_start_granule_ = 0;
+    uint8_t header_type_ = 0x02;    // The first page carries the beginning-of-stream flag
+    // Lacing values of the pending page
+    uint8_t segments_[OGG_PAGE_MAX_SEGMENTS];
+    int segment_count_ = 0;
+    // The header is built right in front of the body, so the page is emitted with a single call
+    std::vector<uint8_t> page_;
+
+    bool AppendPacket(const uint8_t* data, size_t size);
+    bool FlushPage(bool eos);
+};
+
+class OggOpusReader {
+public:
+    // Read up to size bytes, returns the number of bytes read, 0 at the end of the stream
+    using Source = std::function<size_t(uint8_t* data, size_t size)>;
+
+    explicit OggOpusReader(Source source);
+
+    // Parse OpusHead and skip OpusTags
+    bool ReadHeaders();
+    // Next audio packet, returns false at the end of the stream
+    bool ReadPacket(std::vector<uint8_t>& packet);
+
+    int sample_rate() const { return sample_rate_; }
+    int channels() const { return channels_; }
+    uint32_t corrupted_pages() const { return corrupted_pages_; }
+
+private:
+    Source source_;
+    int sample_rate_ = 16000;
+    int channels_ = 1;
+    uint32_t corrupted_pages_ = 0;
+    uint8_t header_[OGG_PAGE_MAX_HEADER_SIZE];
+    std::vector<uint8_t> body_;
+    int segment_count_ = 0;
+    int segment_index_ = 0;
+    size_t body_offset_ = 0;
+
+    bool ReadPage();
+    bool ReadRawPacket(std::vector<uint8_t>& packet);
+};
+
+// CRC-32 used by Ogg: polynomial 0x04c11db7, initial value 0, no reflection
+uint32_t OggCrc32(uint32_t crc, const uint8_t* data, size_t size);
+
+#endif // OGG_OPUS_STREAM_H
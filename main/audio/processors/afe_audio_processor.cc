@@ -1,4 +1,6 @@
 #include "afe_audio_processor.h"
+#include "task_registry.h"
+#include "memory_budget.h"
 #include <esp_log.h>
 
 #define PROCESSOR_RUNNING 0x01
@@ -60,14 +62,17 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms) {
     afe_config->vad_init = true;
 #endif
 
-    afe_iface_ = esp_afe_handle_from_config(afe_config);
-    afe_data_ = afe_iface_->create_from_config(afe_config);
-    
-    xTaskCreate([](void* arg) {
+    {
+        MemoryBudget::Measure measure(kMemoryAudio);
+        afe_iface_ = esp_afe_handle_from_config(afe_config);
+        afe_data_ = afe_iface_->create_from_config(afe_config);
+    }
+
+    TaskRegistry::GetInstance().Create(kTaskAudioProcessor, [](void* arg) {
         auto this_ = (AfeAudioProcessor*)arg;
         this_->AudioProcessorTask();
         vTaskDelete(NULL);
-    }, "audio_communication", 4096, this, 3, NULL);
+    }, this);
 }
 
 AfeAudioProcessor::~AfeAudioProcessor() {
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <functional>
+#include <utility>
 
 #include "audio_codec.h"
 
@@ -20,6 +21,11 @@ public:
     virtual void EncodeWakeWordData() = 0;
     virtual bool GetWakeWordOpus(std::vector<uint8_t>& opus) = 0;
     virtual const std::string& GetLastDetectedWakeWord() const = 0;
+
+    // Extra command words recognized by the same model, only supported by the MultiNet based engine
+    virtual bool SupportsCommands() const { return false; }
+    virtual void SetCommands(const std::vector<std::pair<int, std::string>>& commands) {}
+    virtual void OnCommandDetected(std::function<void(int command_id)> callback) {}
 };
 
 #endif
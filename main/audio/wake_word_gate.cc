@@ -0,0 +1,100 @@
+#include "wake_word_gate.h"
+
+#include <cmath>
+#include <algorithm>
+
+// Time constants of the noise floor tracker, it follows a quieter room quickly
+// and a louder one slowly, so a steady noise closes the gate after a while
+#define NOISE_FLOOR_FALL_MS 100
+#define NOISE_FLOOR_RISE_MS 10000
+
+void WakeWordGate::Configure(const WakeWordGateConfig& config) {
+    config_ = config;
+    int chunk_ms = std::max(config_.chunk_ms, 1);
+    hangover_chunks_ = (config_.hangover_ms + chunk_ms - 1) / chunk_ms;
+    preroll_chunks_ = (config_.preroll_ms + chunk_ms - 1) / chunk_ms;
+    preroll_.assign(preroll_chunks_ * config_.chunk_size, 0);
+    replay_chunk_.assign(config_.chunk_size, 0);
+
+    open_ratio_ = std::pow(10.0f, config_.open_threshold_db / 10.0f);
+    min_open_level_ = 32768.0f * 32768.0f * std::pow(10.0f, config_.min_open_level_db / 10.0f);
+    floor_fall_ = 1.0f - std::exp(-(float)chunk_ms / NOISE_FLOOR_FALL_MS);
+    floor_rise_ = 1.0f - std::exp(-(float)chunk_ms / NOISE_FLOOR_RISE_MS);
+    Reset();
+}
+
+void WakeWordGate::Reset() {
+    open_ = false;
+    hangover_left_ = 0;
+    noise_floor_ = 0;
+    preroll_head_ = 0;
+    preroll_count_ = 0;
+}
+
+float WakeWordGate::noise_floor_db() const {
+    if (noise_floor_ <= 0) {
+        return -120.0f;
+    }
+    return 10.0f * std::log10(noise_floor_ / (32768.0f * 32768.0f));
+}
+
+float WakeWordGate::MeanSquare(const std::vector<int16_t>& data) const {
+    // Only the microphone channel, read with a stride instead of extracting it
+    int channels = std::max(config_.channels, 1);
+    int64_t sum = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < data.size(); i += channels) {
+        sum += (int32_t)data[i] * data[i];
+        count++;
+    }
+    return count > 0 ? (float)sum / count : 0;
+}
+
+void WakeWordGate::Process(const std::vector<int16_t>& data, const std::function<void(const std::vector<int16_t>&)>& feed) {
+    // Not configured for this chunk size, pass everything through
+    if (config_.chunk_size == 0 || data.size() != config_.chunk_size) {
+        feed(data);
+        return;
+    }
+
+    float energy = MeanSquare(data);
+    if (noise_floor_ <= 0) {
+        noise_floor_ = std::max(energy, 1.0f);
+    }
+    bool active = energy > noise_floor_ * open_ratio_ && energy > min_open_level_;
+    noise_floor_ += (energy - noise_floor_) * (energy < noise_floor_ ? floor_fall_ : floor_rise_);
+    noise_floor_ = std::max(noise_floor_, 1.0f);
+
+    if (active) {
+        hangover_left_ = hangover_chunks_;
+        if (!open_) {
+            open_ = true;
+            // Replay the pre-roll, oldest chunk first
+            const size_t chunk_size = config_.chunk_size;
+            for (int i = 0; i < preroll_count_; i++) {
+                int slot = (preroll_head_ - preroll_count_ + i + preroll_chunks_) % preroll_chunks_;
+                auto begin = preroll_.begin() + slot * chunk_size;
+                std::copy(begin, begin + chunk_size, replay_chunk_.begin());
+                feed(replay_chunk_);
+                passed_chunks_++;
+            }
+            preroll_count_ = 0;
+        }
+    }
+
+    if (open_) {
+        feed(data);
+        passed_chunks_++;
+        if (!active && --hangover_left_ <= 0) {
+            open_ = false;
+        }
+        return;
+    }
+
+    if (preroll_chunks_ > 0) {
+        std::copy(data.begin(), data.end(), preroll_.begin() + preroll_head_ * config_.chunk_size);
+        preroll_head_ = (preroll_head_ + 1) % preroll_chunks_;
+        preroll_count_ = std::min(preroll_count_ + 1, preroll_chunks_);
+    }
+    gated_chunks_++;
+}
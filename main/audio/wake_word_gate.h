@@ -0,0 +1,66 @@
+#ifndef WAKE_WORD_GATE_H
+#define WAKE_WORD_GATE_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+/*
+ * Energy gate in front of the wake word engine.
+ *
+ * The gate tracks the noise floor of the microphone channel and only passes chunks to the
+ * wake word model while the energy is above the floor, plus a hangover after the activity
+ * ends. The last chunks are kept in a pre-roll ring and replayed when the gate opens, so the
+ * model still sees the onset of the wake word.
+ *
+ * All buffers are allocated in Configure(), Process() does not allocate.
+ */
+
+struct WakeWordGateConfig {
+    int channels = 1;           // Interleaved channels of a chunk, the first one is the microphone
+    size_t chunk_size = 0;      // Samples per chunk, all channels included
+    int chunk_ms = 32;
+    int preroll_ms = 500;
+    int hangover_ms = 1500;
+    float open_threshold_db = 6.0f;     // Above the noise floor
+    float min_open_level_db = -60.0f;   // Absolute, relative to full scale
+};
+
+class WakeWordGate {
+public:
+    void Configure(const WakeWordGateConfig& config);
+    void Reset();
+
+    // Calls feed for every chunk the model should see, the pre-roll is replayed before the chunk that opens the gate
+    void Process(const std::vector<int16_t>& data, const std::function<void(const std::vector<int16_t>&)>& feed);
+
+    bool IsOpen() const { return open_; }
+    float noise_floor_db() const;
+    uint32_t passed_chunks() const { return passed_chunks_; }
+    uint32_t gated_chunks() const { return gated_chunks_; }
+
+private:
+    WakeWordGateConfig config_;
+    bool open_ = false;
+    int hangover_left_ = 0;
+    int hangover_chunks_ = 0;
+    float noise_floor_ = 0;     // Mean square of the microphone channel
+    float open_ratio_ = 0;
+    float min_open_level_ = 0;
+    float floor_rise_ = 0;
+    float floor_fall_ = 0;
+    uint32_t passed_chunks_ = 0;
+    uint32_t gated_chunks_ = 0;
+
+    // Pre-roll ring, preroll_chunks_ slots of chunk_size samples in one block
+    std::vector<int16_t> preroll_;
+    int preroll_chunks_ = 0;
+    int preroll_head_ = 0;
+    int preroll_count_ = 0;
+    std::vector<int16_t> replay_chunk_;
+
+    float MeanSquare(const std::vector<int16_t>& data) const;
+};
+
+#endif // WAKE_WORD_GATE_H
@@ -1,5 +1,7 @@
 #include "afe_wake_word.h"
 #include "audio_service.h"
+#include "task_registry.h"
+#include "memory_budget.h"
 
 #include <esp_log.h>
 #include <sstream>
@@ -22,7 +24,7 @@ AfeWakeWord::~AfeWakeWord() {
     }
 
     if (wake_word_encode_task_stack_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_stack_);
+        MemoryBudget::GetInstance().Free(kMemoryAudio, wake_word_encode_task_stack_);
     }
 
     if (wake_word_encode_task_buffer_ != nullptr) {
@@ -73,14 +75,17 @@ bool AfeWakeWord::Initialize(AudioCodec* codec) {
     afe_config->afe_perferred_priority = 1;
     afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
     
-    afe_iface_ = esp_afe_handle_from_config(afe_config);
-    afe_data_ = afe_iface_->create_from_config(afe_config);
+    {
+        MemoryBudget::Measure measure(kMemoryAudio);
+        afe_iface_ = esp_afe_handle_from_config(afe_config);
+        afe_data_ = afe_iface_->create_from_config(afe_config);
+    }
 
-    xTaskCreate([](void* arg) {
+    TaskRegistry::GetInstance().Create(kTaskWakeWordDetection, [](void* arg) {
         auto this_ = (AfeWakeWord*)arg;
         this_->AudioDetectionTask();
         vTaskDelete(NULL);
-    }, "audio_detection", 4096, this, 3, nullptr);
+    }, this);
 
     return true;
 }
@@ -143,19 +148,25 @@ void AfeWakeWord::AudioDetectionTask() {
 }
 
 void AfeWakeWord::StoreWakeWordData(const int16_t* data, size_t samples) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.emplace_back(std::vector<int16_t>(data, data + samples));
     // keep about 2 seconds of data, detect duration is 30ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 30) {
+    // Once the history is full, the storage of the oldest chunk is reused for the new one
+    if (wake_word_pcm_.size() >= 2000 / 30) {
+        auto oldest = std::move(wake_word_pcm_.front());
         wake_word_pcm_.pop_front();
+        oldest.assign(data, data + samples);
+        wake_word_pcm_.push_back(std::move(oldest));
+    } else {
+        wake_word_pcm_.emplace_back(data, data + samples);
     }
 }
 
 void AfeWakeWord::EncodeWakeWordData() {
-    const size_t stack_size = 4096 * 7;
+    auto& tasks = TaskRegistry::GetInstance();
+    auto& config = tasks.Get(kTaskWakeWordEncode);
+    const size_t stack_size = config.stack_size;
     wake_word_opus_.clear();
     if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(stack_size, MALLOC_CAP_SPIRAM);
+        wake_word_encode_task_stack_ = (StackType_t*)MemoryBudget::GetInstance().Allocate(kMemoryAudio, stack_size, config.stack_caps);
         assert(wake_word_encode_task_stack_ != nullptr);
     }
     if (wake_word_encode_task_buffer_ == nullptr) {
@@ -189,7 +200,8 @@ void AfeWakeWord::EncodeWakeWordData() {
             this_->wake_word_cv_.notify_all();
         }
         vTaskDelete(NULL);
-    }, "encode_wake_word", stack_size, this, 2, wake_word_encode_task_stack_, wake_word_encode_task_buffer_);
+    }, config.name, stack_size, this, config.priority, wake_word_encode_task_stack_, wake_word_encode_task_buffer_);
+    tasks.NoteCreated(kTaskWakeWordEncode);
 }
 
 bool AfeWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
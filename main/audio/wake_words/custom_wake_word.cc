@@ -1,6 +1,8 @@
 #include "custom_wake_word.h"
 #include "audio_service.h"
 #include "system_info.h"
+#include "task_registry.h"
+#include "memory_budget.h"
 
 #include <esp_log.h>
 #include "esp_mn_iface.h"
@@ -22,7 +24,7 @@ CustomWakeWord::~CustomWakeWord() {
     }
 
     if (wake_word_encode_task_stack_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_stack_);
+        MemoryBudget::GetInstance().Free(kMemoryAudio, wake_word_encode_task_stack_);
     }
 
     if (wake_word_encode_task_buffer_ != nullptr) {
@@ -55,12 +57,33 @@ bool CustomWakeWord::Initialize(AudioCodec* codec) {
     multinet_ = esp_mn_handle_from_name(mn_name_);
     multinet_model_data_ = multinet_->create(mn_name_, 3000);  // 3 秒超时
     multinet_->set_det_threshold(multinet_model_data_, CONFIG_CUSTOM_WAKE_WORD_THRESHOLD / 100.0f);
+    UpdateCommands();
+    return true;
+}
+
+void CustomWakeWord::SetCommands(const std::vector<std::pair<int, std::string>>& commands) {
+    commands_ = commands;
+    if (multinet_model_data_ != nullptr) {
+        UpdateCommands();
+    }
+}
+
+void CustomWakeWord::OnCommandDetected(std::function<void(int command_id)> callback) {
+    command_detected_callback_ = callback;
+}
+
+void CustomWakeWord::UpdateCommands() {
+    // Command id 1 is the wake word, the other ids are passed to the command callback
     esp_mn_commands_clear();
     esp_mn_commands_add(1, CONFIG_CUSTOM_WAKE_WORD);
+    for (auto& [id, phrase] : commands_) {
+        if (esp_mn_commands_add(id, phrase.c_str()) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to add command %d: %s", id, phrase.c_str());
+        }
+    }
     esp_mn_commands_update();
     
     multinet_->print_active_speech_commands(multinet_model_data_);
-    return true;
 }
 
 void CustomWakeWord::OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback) {
@@ -80,20 +103,19 @@ void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
         return;
     }
 
-    esp_mn_state_t mn_state;
     // If input channels is 2, we need to fetch the left channel data
+    // mono_data_ keeps its capacity between chunks, so this does not allocate
+    const std::vector<int16_t>* mono_data = &data;
     if (codec_->input_channels() == 2) {
-        auto mono_data = std::vector<int16_t>(data.size() / 2);
-        for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-            mono_data[i] = data[j];
+        mono_data_.resize(data.size() / 2);
+        for (size_t i = 0, j = 0; i < mono_data_.size(); ++i, j += 2) {
+            mono_data_[i] = data[j];
         }
-
-        StoreWakeWordData(mono_data);
-        mn_state = multinet_->detect(multinet_model_data_, const_cast<int16_t*>(mono_data.data()));
-    } else {
-        StoreWakeWordData(data);
-        mn_state = multinet_->detect(multinet_model_data_, const_cast<int16_t*>(data.data()));
+        mono_data = &mono_data_;
     }
+
+    StoreWakeWordData(*mono_data);
+    esp_mn_state_t mn_state = multinet_->detect(multinet_model_data_, const_cast<int16_t*>(mono_data->data()));
     
     if (mn_state == ESP_MN_STATE_DETECTING) {
         return;
@@ -102,9 +124,16 @@ void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
         ESP_LOGI(TAG, "Custom wake word detected: command_id=%d, string=%s, prob=%f", 
                 mn_result->command_id[0], mn_result->string, mn_result->prob[0]);
         
-        if (mn_result->command_id[0] == 1) {
-            last_detected_wake_word_ = CONFIG_CUSTOM_WAKE_WORD_DISPLAY;
+        if (mn_result->command_id[0] != 1) {
+            // A command word, keep listening for the wake word and more commands
+            if (command_detected_callback_) {
+                command_detected_callback_(mn_result->command_id[0]);
+            }
+            multinet_->clean(multinet_model_data_);
+            return;
         }
+
+        last_detected_wake_word_ = CONFIG_CUSTOM_WAKE_WORD_DISPLAY;
         running_ = false;
         
         if (wake_word_detected_callback_) {
@@ -125,19 +154,25 @@ size_t CustomWakeWord::GetFeedSize() {
 }
 
 void CustomWakeWord::StoreWakeWordData(const std::vector<int16_t>& data) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.push_back(data);
     // keep about 2 seconds of data, detect duration is 30ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 30) {
+    // Once the history is full, the storage of the oldest chunk is reused for the new one
+    if (wake_word_pcm_.size() >= 2000 / 30) {
+        auto oldest = std::move(wake_word_pcm_.front());
         wake_word_pcm_.pop_front();
+        oldest.assign(data.begin(), data.end());
+        wake_word_pcm_.push_back(std::move(oldest));
+    } else {
+        wake_word_pcm_.push_back(data);
     }
 }
 
 void CustomWakeWord::EncodeWakeWordData() {
-    const size_t stack_size = 4096 * 7;
+    auto& tasks = TaskRegistry::GetInstance();
+    auto& config = tasks.Get(kTaskWakeWordEncode);
+    const size_t stack_size = config.stack_size;
     wake_word_opus_.clear();
     if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(stack_size, MALLOC_CAP_SPIRAM);
+        wake_word_encode_task_stack_ = (StackType_t*)MemoryBudget::GetInstance().Allocate(kMemoryAudio, stack_size, config.stack_caps);
         assert(wake_word_encode_task_stack_ != nullptr);
     }
     if (wake_word_encode_task_buffer_ == nullptr) {
@@ -171,7 +206,8 @@ void CustomWakeWord::EncodeWakeWordData() {
             this_->wake_word_cv_.notify_all();
         }
         vTaskDelete(NULL);
-    }, "encode_wake_word", stack_size, this, 2, wake_word_encode_task_stack_, wake_word_encode_task_buffer_);
+    }, config.name, stack_size, this, config.priority, wake_word_encode_task_stack_, wake_word_encode_task_buffer_);
+    tasks.NoteCreated(kTaskWakeWordEncode);
 }
 
 bool CustomWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
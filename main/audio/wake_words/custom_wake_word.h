@@ -31,6 +31,9 @@ public:
     void EncodeWakeWordData();
     bool GetWakeWordOpus(std::vector<uint8_t>& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
+    bool SupportsCommands() const { return true; }
+    void SetCommands(const std::vector<std::pair<int, std::string>>& commands);
+    void OnCommandDetected(std::function<void(int command_id)> callback);
 
 private:
     // multinet 相关成员变量
@@ -40,9 +43,12 @@ private:
     char* mn_name_ = nullptr;
  
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
+    std::function<void(int command_id)> command_detected_callback_;
+    std::vector<std::pair<int, std::string>> commands_;
     AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
     std::atomic<bool> running_ = false;
+    std::vector<int16_t> mono_data_;
 
     TaskHandle_t wake_word_encode_task_ = nullptr;
     StaticTask_t* wake_word_encode_task_buffer_ = nullptr;
@@ -53,6 +59,7 @@ private:
     std::condition_variable wake_word_cv_;
 
     void StoreWakeWordData(const std::vector<int16_t>& data);
+    void UpdateCommands();
 };
 
 #endif
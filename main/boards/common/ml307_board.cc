@@ -2,6 +2,7 @@
 
 #include "application.h"
 #include "display.h"
+#include "event_bus.h"
 #include "assets/lang_config.h"
 
 #include <esp_log.h>
@@ -32,6 +33,7 @@ void Ml307Board::StartNetwork() {
     }
 
     modem_->OnNetworkStateChanged([this, &application](bool network_ready) {
+        EventBus::GetInstance().PublishNetwork(network_ready);
         if (network_ready) {
             ESP_LOGI(TAG, "Network is ready");
         } else {
@@ -128,6 +130,7 @@ std::string Ml307Board::GetDeviceStatusJson() {
      *         "charging": true
      *     },
      *     "network": {
+     *         "quality": { "rtt_ms": 80, "jitter_ms": 5, "uplink_kbps": 24, ... },
      *         "type": "cellular",
      *         "carrier": "CHINA MOBILE",
      *         "csq": 10
@@ -184,6 +187,7 @@ std::string Ml307Board::GetDeviceStatusJson() {
     } else if (csq >= 25 && csq <= 31) {
         cJSON_AddStringToObject(network, "signal", "strong");
     }
+    cJSON_AddItemToObject(network, "quality", NetworkQualityMonitor::GetInstance().ToJson());
     cJSON_AddItemToObject(root, "network", network);
 
     auto json_str = cJSON_PrintUnformatted(root);
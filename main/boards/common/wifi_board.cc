@@ -2,6 +2,7 @@
 
 #include "display.h"
 #include "application.h"
+#include "event_bus.h"
 #include "system_info.h"
 #include "settings.h"
 #include "assets/lang_config.h"
@@ -101,6 +102,7 @@ void WifiBoard::StartNetwork() {
         std::string notification = Lang::Strings::CONNECTED_TO;
         notification += ssid;
         display->ShowNotification(notification.c_str(), 30000);
+        EventBus::GetInstance().PublishNetwork(true);
     });
     wifi_station.Start();
 
@@ -188,6 +190,7 @@ std::string WifiBoard::GetDeviceStatusJson() {
      *         "charging": true
      *     },
      *     "network": {
+     *         "quality": { "rtt_ms": 80, "jitter_ms": 5, "uplink_kbps": 24, ... },
      *         "type": "wifi",
      *         "ssid": "Xiaozhi",
      *         "rssi": -60
@@ -244,6 +247,7 @@ std::string WifiBoard::GetDeviceStatusJson() {
     } else {
         cJSON_AddStringToObject(network, "signal", "weak");
     }
+    cJSON_AddItemToObject(network, "quality", NetworkQualityMonitor::GetInstance().ToJson());
     cJSON_AddItemToObject(root, "network", network);
 
     // Chip
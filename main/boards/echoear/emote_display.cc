@@ -401,6 +401,13 @@ void EmoteDisplay::SetStatus(const char* status)
     engine_->Unlock();
 }
 
+bool EmoteDisplay::ShowClock(const char* time)
+{
+    // The time goes to the tips label like any other status
+    SetStatus(time);
+    return engine_ != nullptr;
+}
+
 void EmoteDisplay::InitializeEngine(esp_lcd_panel_handle_t panel, esp_lcd_panel_io_handle_t panel_io)
 {
     engine_ = std::make_unique<EmoteEngine>(panel, panel_io);
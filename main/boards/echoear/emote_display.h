@@ -59,6 +59,7 @@ private:
     void InitializeEngine(esp_lcd_panel_handle_t panel, esp_lcd_panel_io_handle_t panel_io);
     virtual bool Lock(int timeout_ms = 0) override;
     virtual void Unlock() override;
+    virtual bool ShowClock(const char* time) override;
 
     std::unique_ptr<anim::EmoteEngine> engine_;
 };
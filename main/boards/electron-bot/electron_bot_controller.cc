@@ -14,6 +14,7 @@
 #include "movements.h"
 #include "sdkconfig.h"
 #include "settings.h"
+#include "task_registry.h"
 
 #define TAG "ElectronBotController"
 
@@ -112,8 +113,7 @@ private:
 
     void StartActionTaskIfNeeded() {
         if (action_task_handle_ == nullptr) {
-            xTaskCreate(ActionTask, "electron_bot_action", 1024 * 4, this, configMAX_PRIORITIES - 1,
-                        &action_task_handle_);
+            TaskRegistry::GetInstance().Create(kTaskRobotAction, ActionTask, this, &action_task_handle_);
         }
     }
 
@@ -155,6 +155,13 @@ void EmojiWidget::SetStatus(const char* status)
     }
 }
 
+bool EmojiWidget::ShowClock(const char* time)
+{
+    // There is no status label, the widget decides what a status shows
+    SetStatus(time);
+    return player_ != nullptr;
+}
+
 void EmojiWidget::InitializePlayer(esp_lcd_panel_handle_t panel, esp_lcd_panel_io_handle_t panel_io)
 {
     player_ = std::make_unique<EmojiPlayer>(panel, panel_io);
@@ -23,7 +23,7 @@
 #include "servo_dog_ctrl.h"
 #include "led_strip.h"
 #include "driver/rmt_tx.h"
-#include "device_state_event.h"
+#include "event_bus.h"
 
 #include "sdkconfig.h"
 
@@ -398,10 +398,10 @@ public:
         InitializeLcdDisplay();
         InitializeTools();
 
-        DeviceStateEventManager::GetInstance().RegisterStateChangeCallback([this](DeviceState previous_state, DeviceState current_state) {
-            ESP_LOGD(TAG, "Device state changed from %d to %d", previous_state, current_state);
-            this->GetAudioCodec()->EnableOutput(current_state == kDeviceStateSpeaking);
-        });
+        EventBus::GetInstance().Subscribe("esp_hi_speaker", TopicMask(kEventDeviceState), [](const Event& event, void* arg) {
+            ESP_LOGD(TAG, "Device state changed from %d to %d", event.state.previous, event.state.current);
+            static_cast<EspHi*>(arg)->GetAudioCodec()->EnableOutput(event.state.current == kDeviceStateSpeaking);
+        }, this);
     }
 
     virtual AudioCodec* GetAudioCodec() override
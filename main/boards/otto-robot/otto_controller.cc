@@ -14,6 +14,7 @@
 #include "otto_movements.h"
 #include "sdkconfig.h"
 #include "settings.h"
+#include "task_registry.h"
 
 #define TAG "OttoController"
 
@@ -138,8 +139,7 @@ private:
 
     void StartActionTaskIfNeeded() {
         if (action_task_handle_ == nullptr) {
-            xTaskCreate(ActionTask, "otto_action", 1024 * 3, this, configMAX_PRIORITIES - 1,
-                        &action_task_handle_);
+            TaskRegistry::GetInstance().Create(kTaskRobotAction, ActionTask, this, &action_task_handle_);
         }
     }
 
@@ -176,6 +176,8 @@ private:
 
 public:
     OttoController() {
+        // Otto's actions need less stack than the default of the robots
+        TaskRegistry::GetInstance().Override(kTaskRobotAction, 1024 * 3, TaskRegistry::GetInstance().Get(kTaskRobotAction).priority);
         otto_.Init(LEFT_LEG_PIN, RIGHT_LEG_PIN, LEFT_FOOT_PIN, RIGHT_FOOT_PIN, LEFT_HAND_PIN,
                    RIGHT_HAND_PIN);
 
@@ -0,0 +1,133 @@
+#include "boot_sequence.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
+
+#include <cassert>
+#include <cstring>
+
+#define TAG "BootSequence"
+
+BootSequence::BootSequence() {
+    event_group_ = xEventGroupCreate();
+}
+
+BootSequence::~BootSequence() {
+    vEventGroupDelete(event_group_);
+}
+
+int BootSequence::AddPhase(const char* name, std::initializer_list<int> depends_on, uint32_t stack_size,
+    std::function<void()> run) {
+    int index = phases_.size();
+    assert(index < BOOT_MAX_PHASES);
+    uint32_t mask = 0;
+    for (int dependency : depends_on) {
+        assert(dependency >= 0 && dependency < index);
+        mask |= 1u << dependency;
+    }
+    phases_.push_back({ name, mask, stack_size, std::move(run) });
+    return index;
+}
+
+void BootSequence::RunPhase(int index) {
+    auto& phase = phases_[index];
+    phase.start_us = esp_timer_get_time();
+    phase.run();
+    phase.end_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "%s done in %lld ms", phase.name, (phase.end_us - phase.start_us) / 1000);
+    xEventGroupSetBits(event_group_, 1u << index);
+}
+
+void BootSequence::Run() {
+    const uint32_t all = (1u << phases_.size()) - 1;
+    uint32_t started = 0;
+    while (true) {
+        uint32_t done = xEventGroupGetBits(event_group_) & all;
+        if (done == all) {
+            break;
+        }
+
+        int inline_phase = -1;
+        for (int i = 0; i < (int)phases_.size(); i++) {
+            auto& phase = phases_[i];
+            if ((started & (1u << i)) || (phase.depends_on & done) != phase.depends_on) {
+                continue;
+            }
+            if (phase.stack_size == 0) {
+                if (inline_phase < 0) {
+                    inline_phase = i;
+                }
+                continue;
+            }
+            started |= 1u << i;
+            auto args = new std::pair<BootSequence*, int>(this, i);
+            auto ret = xTaskCreate([](void* arg) {
+                auto args = (std::pair<BootSequence*, int>*)arg;
+                args->first->RunPhase(args->second);
+                delete args;
+                vTaskDelete(NULL);
+            }, phase.name, phase.stack_size, args, uxTaskPriorityGet(NULL), nullptr);
+            if (ret != pdPASS) {
+                ESP_LOGW(TAG, "Failed to create the task of %s, running it in place", phase.name);
+                delete args;
+                RunPhase(i);
+            }
+        }
+
+        if (inline_phase >= 0) {
+            started |= 1u << inline_phase;
+            RunPhase(inline_phase);
+        } else {
+            // Everything that can start is running elsewhere
+            xEventGroupWaitBits(event_group_, all & ~done, pdFALSE, pdFALSE, portMAX_DELAY);
+        }
+    }
+    Mark("boot_done");
+    PrintTimeline();
+}
+
+void BootSequence::Mark(const char* name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& [mark_name, time] : marks_) {
+        if (strcmp(mark_name, name) == 0) {
+            return;
+        }
+    }
+    int64_t now = esp_timer_get_time();
+    marks_.emplace_back(name, now);
+    ESP_LOGI(TAG, "%s at %lld ms", name, now / 1000);
+}
+
+void BootSequence::PrintTimeline() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ESP_LOGI(TAG, "Boot timeline (ms since power-on):");
+    for (auto& phase : phases_) {
+        ESP_LOGI(TAG, "  %-12s %6lld - %6lld (%lld)", phase.name, phase.start_us / 1000, phase.end_us / 1000,
+            (phase.end_us - phase.start_us) / 1000);
+    }
+    for (auto& [name, time] : marks_) {
+        ESP_LOGI(TAG, "  %-12s %6lld", name, time / 1000);
+    }
+}
+
+cJSON* BootSequence::ToJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto json = cJSON_CreateObject();
+    auto phases = cJSON_CreateArray();
+    for (auto& phase : phases_) {
+        auto item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "name", phase.name);
+        cJSON_AddNumberToObject(item, "start_ms", phase.start_us / 1000);
+        cJSON_AddNumberToObject(item, "end_ms", phase.end_us / 1000);
+        cJSON_AddNumberToObject(item, "duration_ms", (phase.end_us - phase.start_us) / 1000);
+        cJSON_AddItemToArray(phases, item);
+    }
+    cJSON_AddItemToObject(json, "phases", phases);
+    auto marks = cJSON_CreateObject();
+    for (auto& [name, time] : marks_) {
+        cJSON_AddNumberToObject(marks, name, time / 1000);
+    }
+    cJSON_AddItemToObject(json, "milestones", marks);
+    return json;
+}
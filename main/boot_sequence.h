@@ -0,0 +1,58 @@
+#ifndef BOOT_SEQUENCE_H
+#define BOOT_SEQUENCE_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <cJSON.h>
+
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <vector>
+
+// One event bit per phase, FreeRTOS event groups have 24
+#define BOOT_MAX_PHASES 16
+
+struct BootPhase {
+    const char* name;
+    uint32_t depends_on;    // Mask of the phases that must be done first
+    uint32_t stack_size;    // 0: runs in the task that runs the sequence, otherwise in a task of its own
+    std::function<void()> run;
+    int64_t start_us = 0;   // Time since power-on
+    int64_t end_us = 0;
+};
+
+/*
+ * Boot as a graph of phases. A phase starts as soon as the phases it depends on are done, so
+ * independent phases overlap: phases with a stack size run in their own task, the others one after
+ * another in the calling task. Every phase is timed, and milestones after the boot can be added to
+ * the timeline.
+ */
+class BootSequence {
+public:
+    BootSequence();
+    ~BootSequence();
+    BootSequence(const BootSequence&) = delete;
+    BootSequence& operator=(const BootSequence&) = delete;
+
+    // Returns the index of the phase. Phases can only depend on phases added before them
+    int AddPhase(const char* name, std::initializer_list<int> depends_on, uint32_t stack_size, std::function<void()> run);
+    // Returns when all phases are done
+    void Run();
+    // Records the time of a milestone, only the first time it is reached
+    void Mark(const char* name);
+
+    void PrintTimeline();
+    // Returns a new object with the phases and milestones, the caller owns it
+    cJSON* ToJson();
+
+private:
+    EventGroupHandle_t event_group_ = nullptr;
+    std::mutex mutex_;
+    std::vector<BootPhase> phases_;
+    std::vector<std::pair<const char*, int64_t>> marks_;
+
+    void RunPhase(int index);
+};
+
+#endif // BOOT_SEQUENCE_H
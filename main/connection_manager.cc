@@ -0,0 +1,201 @@
+#include "connection_manager.h"
+#include "board.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <lwip/dns.h>
+#include <lwip/tcpip.h>
+
+#include <cstring>
+
+#define TAG "ConnectionManager"
+
+static const char* const kConnectionTypeNames[kConnectionTypeCount] = {
+    "ota_check",
+    "ota_activate",
+    "ota_upgrade",
+    "camera_explain",
+    "voice_memo",
+    "websocket",
+};
+
+int ConnectionManager::GetConnectId(ConnectionType type) {
+    // The slots the requests used before, the cellular modems have a fixed number of them
+    switch (type) {
+        case kConnectionWebSocket:
+            return 1;
+        case kConnectionCameraExplain:
+            return 3;
+        case kConnectionVoiceMemo:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+std::string ConnectionManager::GetHost(const std::string& url) {
+    size_t start = url.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+    size_t end = url.find_first_of(":/?", start);
+    return url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+}
+
+std::unique_ptr<Http> ConnectionManager::OpenHttp(ConnectionType type, const std::string& method, const std::string& url,
+    std::function<void(Http* http)> setup) {
+    int connect_id = GetConnectId(type);
+    PrefetchHost(url);
+
+    auto start_time = esp_timer_get_time();
+    auto http = Board::GetInstance().GetNetwork()->CreateHttp(connect_id);
+    setup(http.get());
+    bool success = http->Open(method, url);
+    uint32_t elapsed_ms = (esp_timer_get_time() - start_time) / 1000;
+    Record(type, success, elapsed_ms);
+    ESP_LOGI(TAG, "%s %s: %s in %lu ms", kConnectionTypeNames[type], method.c_str(), success ? "opened" : "failed", elapsed_ms);
+    if (!success) {
+        return nullptr;
+    }
+    return http;
+}
+
+std::unique_ptr<WebSocket> ConnectionManager::CreateWebSocket(const std::string& url) {
+    PrefetchHost(url);
+    return Board::GetInstance().GetNetwork()->CreateWebSocket(GetConnectId(kConnectionWebSocket));
+}
+
+bool ConnectionManager::ConnectWebSocket(WebSocket* websocket, const std::string& url) {
+    auto start_time = esp_timer_get_time();
+    bool success = websocket->Connect(url.c_str());
+    uint32_t elapsed_ms = (esp_timer_get_time() - start_time) / 1000;
+    Record(kConnectionWebSocket, success, elapsed_ms);
+    ESP_LOGI(TAG, "websocket: %s in %lu ms", success ? "connected" : "failed", elapsed_ms);
+    return success;
+}
+
+void ConnectionManager::Record(ConnectionType type, bool success, uint32_t elapsed_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& stats = stats_[type];
+    stats.count++;
+    if (!success) {
+        stats.failures++;
+        return;
+    }
+    stats.last_ms = elapsed_ms;
+    stats.total_ms += elapsed_ms;
+    if (elapsed_ms > stats.max_ms) {
+        stats.max_ms = elapsed_ms;
+    }
+}
+
+void ConnectionManager::PrefetchHost(const std::string& url) {
+    if (Board::GetInstance().GetBoardType() != "wifi") {
+        return;
+    }
+    auto host = GetHost(url);
+    if (host.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& entry = dns_cache_[host];
+    entry.requested_at = std::chrono::steady_clock::now();
+    if (!entry.resolved && !entry.pending) {
+        StartLookup(host);
+    }
+}
+
+// Called with the mutex held
+void ConnectionManager::StartLookup(const std::string& host) {
+    auto& entry = dns_cache_[host];
+    entry.pending = true;
+    entry.lookup_started_us = esp_timer_get_time();
+
+    // dns_gethostbyname must run in the lwIP thread, it answers from the cache or calls back later.
+    // The post does not block, as the mutex is held and the answer takes it too
+    char* name = strdup(host.c_str());
+    auto err = tcpip_try_callback([](void* arg) {
+        auto name = (char*)arg;
+        ip_addr_t address;
+        auto found = [](const char* name, const ip_addr_t* address, void* arg) {
+            ConnectionManager::GetInstance().OnLookupDone((char*)arg, address != nullptr);
+            free(arg);
+        };
+        auto err = dns_gethostbyname(name, &address, found, name);
+        if (err != ERR_INPROGRESS) {
+            ConnectionManager::GetInstance().OnLookupDone(name, err == ERR_OK);
+            free(name);
+        }
+    }, name);
+    if (err != ERR_OK) {
+        free(name);
+        entry.pending = false;
+    }
+}
+
+void ConnectionManager::OnLookupDone(const char* host, bool resolved) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = dns_cache_.find(host);
+    if (it == dns_cache_.end()) {
+        return;
+    }
+    auto& entry = it->second;
+    entry.pending = false;
+    entry.resolved = resolved;
+    entry.resolved_at = std::chrono::steady_clock::now();
+    entry.lookup_ms = (esp_timer_get_time() - entry.lookup_started_us) / 1000;
+    if (!resolved) {
+        ESP_LOGW(TAG, "Failed to resolve %s", host);
+    }
+}
+
+void ConnectionManager::Sweep() {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = dns_cache_.begin(); it != dns_cache_.end();) {
+        auto& entry = it->second;
+        if (now - entry.requested_at > std::chrono::seconds(CONNECTION_DNS_FORGET_SECONDS)) {
+            if (!entry.pending) {
+                it = dns_cache_.erase(it);
+                continue;
+            }
+        } else if (!entry.pending && now - entry.resolved_at > std::chrono::seconds(CONNECTION_DNS_REFRESH_SECONDS)) {
+            StartLookup(it->first);
+        }
+        ++it;
+    }
+}
+
+ConnectionStats ConnectionManager::GetStats(ConnectionType type) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_[type];
+}
+
+cJSON* ConnectionManager::ToJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto json = cJSON_CreateObject();
+    auto requests = cJSON_CreateObject();
+    for (int i = 0; i < kConnectionTypeCount; i++) {
+        auto& stats = stats_[i];
+        if (stats.count == 0) {
+            continue;
+        }
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "count", stats.count);
+        cJSON_AddNumberToObject(item, "failures", stats.failures);
+        cJSON_AddNumberToObject(item, "last_ms", stats.last_ms);
+        uint32_t succeeded = stats.count - stats.failures;
+        cJSON_AddNumberToObject(item, "avg_ms", succeeded > 0 ? stats.total_ms / succeeded : 0);
+        cJSON_AddNumberToObject(item, "max_ms", stats.max_ms);
+        cJSON_AddItemToObject(requests, kConnectionTypeNames[i], item);
+    }
+    cJSON_AddItemToObject(json, "requests", requests);
+    if (!dns_cache_.empty()) {
+        auto dns = cJSON_CreateObject();
+        for (auto& [host, entry] : dns_cache_) {
+            if (entry.resolved) {
+                cJSON_AddNumberToObject(dns, host.c_str(), entry.lookup_ms);
+            }
+        }
+        cJSON_AddItemToObject(json, "dns_lookup_ms", dns);
+    }
+    return json;
+}
@@ -0,0 +1,94 @@
+#ifndef CONNECTION_MANAGER_H
+#define CONNECTION_MANAGER_H
+
+#include <http.h>
+#include <web_socket.h>
+#include <cJSON.h>
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <chrono>
+#include <functional>
+
+// Hosts looked up again after this period, so the DNS cache of lwIP stays warm
+#define CONNECTION_DNS_REFRESH_SECONDS 120
+// Hosts that were not requested for this long are no longer refreshed
+#define CONNECTION_DNS_FORGET_SECONDS 600
+
+enum ConnectionType {
+    kConnectionOtaCheck,
+    kConnectionOtaActivate,
+    kConnectionOtaUpgrade,
+    kConnectionCameraExplain,
+    kConnectionVoiceMemo,
+    kConnectionWebSocket,
+    kConnectionTypeCount
+};
+
+struct ConnectionStats {
+    uint32_t count = 0;
+    uint32_t failures = 0;
+    uint32_t last_ms = 0;       // Time until the response headers, or the websocket handshake
+    uint32_t max_ms = 0;
+    uint64_t total_ms = 0;
+};
+
+/*
+ * All outbound HTTP requests and the websocket go through here:
+ * - On Wi-Fi the hosts are looked up ahead and refreshed, the answers are cached by lwIP for their TTL.
+ *   The cellular modems resolve the names themselves.
+ * - Time to the response and failures are counted per request type
+ * HTTP connections are not kept between requests, the network component opens a new one on every Open()
+ */
+class ConnectionManager {
+public:
+    static ConnectionManager& GetInstance() {
+        static ConnectionManager instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    ConnectionManager(const ConnectionManager&) = delete;
+    ConnectionManager& operator=(const ConnectionManager&) = delete;
+
+    // Returns the opened request, or nullptr. `setup` sets the headers and the content
+    std::unique_ptr<Http> OpenHttp(ConnectionType type, const std::string& method, const std::string& url,
+        std::function<void(Http* http)> setup);
+
+    std::unique_ptr<WebSocket> CreateWebSocket(const std::string& url);
+    bool ConnectWebSocket(WebSocket* websocket, const std::string& url);
+
+    // Looks up the host in the background, Wi-Fi only
+    void PrefetchHost(const std::string& url);
+    // Refreshes the DNS cache, called from the main loop
+    void Sweep();
+    // Called in the lwIP thread when a lookup finished
+    void OnLookupDone(const char* host, bool resolved);
+
+    ConnectionStats GetStats(ConnectionType type);
+    // Returns a new object for the device status, the caller owns it
+    cJSON* ToJson();
+
+private:
+    ConnectionManager() = default;
+
+    struct DnsEntry {
+        std::chrono::steady_clock::time_point resolved_at;
+        std::chrono::steady_clock::time_point requested_at;
+        int64_t lookup_started_us = 0;
+        uint32_t lookup_ms = 0;
+        bool pending = false;
+        bool resolved = false;
+    };
+
+    std::mutex mutex_;
+    std::map<std::string, DnsEntry> dns_cache_;
+    ConnectionStats stats_[kConnectionTypeCount];
+    static int GetConnectId(ConnectionType type);
+    static std::string GetHost(const std::string& url);
+    void Record(ConnectionType type, bool success, uint32_t elapsed_ms);
+    void StartLookup(const std::string& host);
+};
+
+#endif // CONNECTION_MANAGER_H
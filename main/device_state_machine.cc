@@ -0,0 +1,219 @@
+#include "device_state_machine.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "DeviceStateMachine"
+
+static constexpr DeviceStateTransition kTransitions[] = {
+    { "boot", StateMask(kDeviceStateUnknown), kDeviceStateStarting,
+        { kStateActionPostEvent, kStateActionUpdateLed } },
+    { "wifi_configure", kAnyDeviceState, kDeviceStateWifiConfiguring,
+        { kStateActionPostEvent, kStateActionUpdateLed } },
+    { "audio_test", StateMask(kDeviceStateWifiConfiguring), kDeviceStateAudioTesting,
+        { kStateActionPostEvent, kStateActionUpdateLed } },
+    { "activate", StateMask(kDeviceStateStarting, kDeviceStateIdle), kDeviceStateActivating,
+        { kStateActionPostEvent, kStateActionUpdateLed } },
+    { "upgrade", StateMask(kDeviceStateStarting, kDeviceStateIdle, kDeviceStateActivating), kDeviceStateUpgrading,
+        { kStateActionPostEvent, kStateActionUpdateLed } },
+    // Errors, the end of a conversation and the boards return to idle from anywhere
+    { "idle", kAnyDeviceState, kDeviceStateIdle,
+        { kStateActionPostEvent, kStateActionUpdateLed, kStateActionShowStatus, kStateActionWaitForWakeWord } },
+    { "connect", StateMask(kDeviceStateIdle), kDeviceStateConnecting,
+        { kStateActionPostEvent, kStateActionUpdateLed, kStateActionShowStatus, kStateActionClearChat } },
+    // Wake word or button, with the audio channel opened just now or still open
+    { "listen", StateMask(kDeviceStateIdle, kDeviceStateConnecting), kDeviceStateListening,
+        { kStateActionPostEvent, kStateActionUpdateLed, kStateActionShowStatus, kStateActionStartListening } },
+    // The reply ended or was interrupted
+    { "listen_again", StateMask(kDeviceStateSpeaking), kDeviceStateListening,
+        { kStateActionPostEvent, kStateActionUpdateLed, kStateActionShowStatus, kStateActionStartListening } },
+    { "speak", StateMask(kDeviceStateIdle, kDeviceStateListening), kDeviceStateSpeaking,
+        { kStateActionPostEvent, kStateActionUpdateLed, kStateActionShowStatus, kStateActionStopListening,
+          kStateActionResetDecoder } },
+    { "fatal_error", kAnyDeviceState, kDeviceStateFatalError,
+        { kStateActionPostEvent, kStateActionUpdateLed } },
+};
+
+static constexpr const char* kStateNames[kDeviceStateCount] = {
+    "unknown",
+    "starting",
+    "configuring",
+    "idle",
+    "connecting",
+    "listening",
+    "speaking",
+    "upgrading",
+    "activating",
+    "audio_testing",
+    "fatal_error",
+};
+
+static constexpr const char* kActionNames[kStateActionCount] = {
+    "none",
+    "post_event",
+    "update_led",
+    "show_status",
+    "clear_chat",
+    "wait_for_wake_word",
+    "start_listening",
+    "stop_listening",
+    "reset_decoder",
+};
+
+// The action lists are packed at the front, and no action appears twice in a row
+static constexpr bool ActionListsAreValid() {
+    for (const auto& transition : kTransitions) {
+        bool ended = false;
+        for (int i = 0; i < DEVICE_STATE_MAX_ACTIONS; i++) {
+            auto action = transition.actions[i];
+            if (action >= kStateActionCount || (ended && action != kStateActionNone)) {
+                return false;
+            }
+            ended = action == kStateActionNone;
+            for (int j = 0; j < i && !ended; j++) {
+                if (transition.actions[j] == action) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// At most one row for every pair of states, so the table is never ambiguous
+static constexpr bool TransitionsAreUnique() {
+    constexpr int count = sizeof(kTransitions) / sizeof(kTransitions[0]);
+    for (int i = 0; i < count; i++) {
+        if (kTransitions[i].from == 0 || (kTransitions[i].from & ~kAnyDeviceState) != 0) {
+            return false;
+        }
+        for (int j = i + 1; j < count; j++) {
+            if (kTransitions[i].to == kTransitions[j].to && (kTransitions[i].from & kTransitions[j].from) != 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Every state but the initial one can be entered
+static constexpr bool AllStatesReachable() {
+    for (int state = kDeviceStateStarting; state < kDeviceStateCount; state++) {
+        bool found = false;
+        for (const auto& transition : kTransitions) {
+            found = found || transition.to == state;
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(sizeof(kTransitions) / sizeof(kTransitions[0]) == DEVICE_STATE_TRANSITION_COUNT,
+    "DEVICE_STATE_TRANSITION_COUNT does not match the transition table");
+static_assert(ActionListsAreValid(), "Action lists must be packed and free of duplicates");
+static_assert(TransitionsAreUnique(), "Two transitions share a pair of states");
+static_assert(AllStatesReachable(), "A device state cannot be entered");
+
+const DeviceStateTransition* DeviceStateMachine::FindTransition(DeviceState from, DeviceState to) {
+    if (from >= kDeviceStateCount || to >= kDeviceStateCount) {
+        return nullptr;
+    }
+    for (const auto& transition : kTransitions) {
+        if (transition.to == to && (transition.from & StateMask(from)) != 0) {
+            return &transition;
+        }
+    }
+    return nullptr;
+}
+
+const char* DeviceStateMachine::GetStateName(DeviceState state) {
+    if (state >= kDeviceStateCount) {
+        return "invalid_state";
+    }
+    return kStateNames[state];
+}
+
+const char* DeviceStateMachine::GetActionName(DeviceStateAction action) {
+    if (action >= kStateActionCount) {
+        return "invalid_action";
+    }
+    return kActionNames[action];
+}
+
+void DeviceStateMachine::RecordGuardViolation(DeviceState from, DeviceState to) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    guard_violations_++;
+    if (to < kDeviceStateCount) {
+        guard_violations_by_state_[to]++;
+    }
+    ESP_LOGW(TAG, "No transition from %s to %s, state kept", GetStateName(from), GetStateName(to));
+}
+
+void DeviceStateMachine::Run(const DeviceStateTransition& transition, DeviceState from, DeviceState to) {
+    int64_t start_time = esp_timer_get_time();
+    int64_t action_start_time = start_time;
+    int64_t action_us[DEVICE_STATE_MAX_ACTIONS] = {};
+    for (int i = 0; i < DEVICE_STATE_MAX_ACTIONS && transition.actions[i] != kStateActionNone; i++) {
+        handler_(transition.actions[i], from, to);
+        int64_t now = esp_timer_get_time();
+        action_us[i] = now - action_start_time;
+        action_start_time = now;
+    }
+    int64_t elapsed_us = action_start_time - start_time;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Record(transition_stats_[&transition - kTransitions], elapsed_us);
+    for (int i = 0; i < DEVICE_STATE_MAX_ACTIONS && transition.actions[i] != kStateActionNone; i++) {
+        Record(action_stats_[transition.actions[i]], action_us[i]);
+    }
+    ESP_LOGD(TAG, "%s: %s -> %s in %lld us", transition.name, GetStateName(from), GetStateName(to), elapsed_us);
+}
+
+void DeviceStateMachine::Record(DeviceStateTransitionStats& stats, int64_t elapsed_us) {
+    stats.count++;
+    stats.last_us = elapsed_us;
+    stats.total_us += elapsed_us;
+    if (stats.last_us > stats.max_us) {
+        stats.max_us = stats.last_us;
+    }
+}
+
+cJSON* DeviceStateMachine::ToJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto add_stats = [](cJSON* parent, const char* name, const DeviceStateTransitionStats& stats) {
+        if (stats.count == 0) {
+            return;
+        }
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "count", stats.count);
+        cJSON_AddNumberToObject(item, "last_us", stats.last_us);
+        cJSON_AddNumberToObject(item, "avg_us", stats.total_us / stats.count);
+        cJSON_AddNumberToObject(item, "max_us", stats.max_us);
+        cJSON_AddItemToObject(parent, name, item);
+    };
+
+    auto json = cJSON_CreateObject();
+    auto transitions = cJSON_CreateObject();
+    for (int i = 0; i < DEVICE_STATE_TRANSITION_COUNT; i++) {
+        add_stats(transitions, kTransitions[i].name, transition_stats_[i]);
+    }
+    cJSON_AddItemToObject(json, "transitions", transitions);
+
+    auto actions = cJSON_CreateObject();
+    for (int i = kStateActionNone + 1; i < kStateActionCount; i++) {
+        add_stats(actions, kActionNames[i], action_stats_[i]);
+    }
+    cJSON_AddItemToObject(json, "actions", actions);
+
+    auto violations = cJSON_CreateObject();
+    cJSON_AddNumberToObject(violations, "total", guard_violations_);
+    for (int i = 0; i < kDeviceStateCount; i++) {
+        if (guard_violations_by_state_[i] > 0) {
+            cJSON_AddNumberToObject(violations, kStateNames[i], guard_violations_by_state_[i]);
+        }
+    }
+    cJSON_AddItemToObject(json, "guard_violations", violations);
+    return json;
+}
@@ -0,0 +1,94 @@
+#ifndef _DEVICE_STATE_MACHINE_H_
+#define _DEVICE_STATE_MACHINE_H_
+
+#include <cJSON.h>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+#include "device_state.h"
+
+constexpr int kDeviceStateCount = kDeviceStateFatalError + 1;
+
+// The steps a transition runs, in the order of its action list
+enum DeviceStateAction : uint8_t {
+    kStateActionNone,               // Ends an action list
+    kStateActionPostEvent,          // Publish kEventDeviceState on the event bus
+    kStateActionUpdateLed,
+    kStateActionShowStatus,         // Status text and emotion of the new state
+    kStateActionClearChat,
+    kStateActionWaitForWakeWord,    // Voice processing off, wake word detection on
+    kStateActionStartListening,     // Send listen start and turn voice processing on
+    kStateActionStopListening,      // Voice processing off while speaking, unless in realtime mode
+    kStateActionResetDecoder,
+    kStateActionCount
+};
+
+#define DEVICE_STATE_MAX_ACTIONS 6
+// Rows of the transition table in device_state_machine.cc
+#define DEVICE_STATE_TRANSITION_COUNT 11
+
+constexpr uint32_t StateMask(DeviceState state) {
+    return 1u << state;
+}
+
+template <typename... States>
+constexpr uint32_t StateMask(DeviceState state, States... states) {
+    return StateMask(state) | StateMask(states...);
+}
+
+constexpr uint32_t kAnyDeviceState = (1u << kDeviceStateCount) - 1;
+
+struct DeviceStateTransition {
+    const char* name;
+    uint32_t from;          // Mask of the states the transition is allowed from
+    DeviceState to;
+    DeviceStateAction actions[DEVICE_STATE_MAX_ACTIONS];
+};
+
+struct DeviceStateTransitionStats {
+    uint32_t count = 0;
+    uint32_t last_us = 0;
+    uint32_t max_us = 0;
+    uint64_t total_us = 0;
+};
+
+/*
+ * The rules of the device states as a table of transitions. A state change that has no row for the
+ * current state is refused by the owner and counted as a guard violation. The rows run their actions
+ * through the handler given by the owner, and the time of every transition and action is recorded.
+ */
+class DeviceStateMachine {
+public:
+    using ActionHandler = std::function<void(DeviceStateAction action, DeviceState previous_state, DeviceState state)>;
+
+    explicit DeviceStateMachine(ActionHandler handler) : handler_(handler) {}
+    DeviceStateMachine(const DeviceStateMachine&) = delete;
+    DeviceStateMachine& operator=(const DeviceStateMachine&) = delete;
+
+    // Returns the row for the change, or nullptr if the table does not allow it
+    static const DeviceStateTransition* FindTransition(DeviceState from, DeviceState to);
+    static const char* GetStateName(DeviceState state);
+    static const char* GetActionName(DeviceStateAction action);
+
+    // Runs the actions of the row and records their time
+    void Run(const DeviceStateTransition& transition, DeviceState from, DeviceState to);
+    // For a change that has no row
+    void RecordGuardViolation(DeviceState from, DeviceState to);
+
+    uint32_t guard_violations() const { return guard_violations_; }
+    // Returns a new object with the stats of the transitions and actions, the caller owns it
+    cJSON* ToJson();
+
+private:
+    ActionHandler handler_;
+    std::mutex mutex_;
+    DeviceStateTransitionStats transition_stats_[DEVICE_STATE_TRANSITION_COUNT];
+    DeviceStateTransitionStats action_stats_[kStateActionCount];
+    uint32_t guard_violations_ = 0;
+    uint32_t guard_violations_by_state_[kDeviceStateCount] = {};
+
+    void Record(DeviceStateTransitionStats& stats, int64_t elapsed_us);
+};
+
+#endif // _DEVICE_STATE_MACHINE_H_
@@ -14,6 +14,9 @@
 
 #define TAG "Display"
 
+// The clock replaces the status text once it has been shown this long
+#define STATUS_BAR_CLOCK_DELAY_SECONDS 10
+
 Display::Display() {
     // Notification timer
     esp_timer_create_args_t notification_timer_args = {
@@ -30,6 +33,19 @@ Display::Display() {
     };
     ESP_ERROR_CHECK(esp_timer_create(&notification_timer_args, &notification_timer_));
 
+    // Clock timer, armed for the next minute boundary while the clock is shown
+    esp_timer_create_args_t clock_timer_args = {
+        .callback = [](void *arg) {
+            Display *display = static_cast<Display*>(arg);
+            display->UpdateStatusBarItem(kStatusBarClock);
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "clock_timer",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&clock_timer_args, &clock_timer_));
+
     // Create a power management lock
     auto ret = esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "display_update", &pm_lock_);
     if (ret == ESP_ERR_NOT_SUPPORTED) {
@@ -44,6 +60,10 @@ Display::~Display() {
         esp_timer_stop(notification_timer_);
         esp_timer_delete(notification_timer_);
     }
+    if (clock_timer_ != nullptr) {
+        esp_timer_stop(clock_timer_);
+        esp_timer_delete(clock_timer_);
+    }
 
     if (network_label_ != nullptr) {
         lv_obj_del(network_label_);
@@ -71,6 +91,7 @@ void Display::SetStatus(const char* status) {
     lv_obj_add_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
 
     last_status_update_time_ = std::chrono::system_clock::now();
+    clock_shown_ = false;
 }
 
 void Display::ShowNotification(const std::string &notification, int duration_ms) {
@@ -91,107 +112,193 @@ void Display::ShowNotification(const char* notification, int duration_ms) {
 }
 
 void Display::UpdateStatusBar(bool update_all) {
-    auto& app = Application::GetInstance();
-    auto& board = Board::GetInstance();
-    auto codec = board.GetAudioCodec();
+    for (int item = 0; item < kStatusBarItemCount; item++) {
+        RefreshStatusBarItem((StatusBarItem)item, update_all);
+    }
+}
 
-    // Update mute icon
-    {
-        DisplayLockGuard lock(this);
-        if (mute_label_ == nullptr) {
-            return;
-        }
+void Display::UpdateStatusBarItem(StatusBarItem item) {
+    RefreshStatusBarItem(item, false);
+}
 
-        // 如果静音状态改变，则更新图标
-        if (codec->output_volume() == 0 && !muted_) {
-            muted_ = true;
-            lv_label_set_text(mute_label_, FONT_AWESOME_VOLUME_XMARK);
-        } else if (codec->output_volume() > 0 && muted_) {
-            muted_ = false;
-            lv_label_set_text(mute_label_, "");
-        }
+void Display::RefreshStatusBarItem(StatusBarItem item, bool force) {
+    bool redrawn = false;
+    switch (item) {
+    case kStatusBarMute:
+        redrawn = UpdateMuteIcon(force);
+        break;
+    case kStatusBarClock:
+        redrawn = UpdateClock(force);
+        break;
+    case kStatusBarBattery:
+        redrawn = UpdateBatteryIcon(force);
+        break;
+    case kStatusBarNetwork:
+        redrawn = UpdateNetworkIcon(force);
+        break;
+    default:
+        return;
+    }
+    status_bar_stats_[item].updates++;
+    if (redrawn) {
+        status_bar_stats_[item].redraws++;
     }
+}
 
-    // Update time
-    if (app.GetDeviceState() == kDeviceStateIdle) {
-        if (last_status_update_time_ + std::chrono::seconds(10) < std::chrono::system_clock::now()) {
-            // Set status to clock "HH:MM"
-            time_t now = time(NULL);
-            struct tm* tm = localtime(&now);
-            // Check if the we have already set the time
-            if (tm->tm_year >= 2025 - 1900) {
-                char time_str[16];
-                strftime(time_str, sizeof(time_str), "%H:%M  ", tm);
-                SetStatus(time_str);
-            } else {
-                ESP_LOGW(TAG, "System time is not set, tm_year: %d", tm->tm_year);
-            }
-        }
+void Display::SetClockEnabled(bool enabled) {
+    clock_shown_ = false;
+    if (!enabled) {
+        esp_timer_stop(clock_timer_);
+        return;
     }
+    last_status_update_time_ = std::chrono::system_clock::now();
+    StartClockTimer(STATUS_BAR_CLOCK_DELAY_SECONDS * 1000);
+}
 
-    esp_pm_lock_acquire(pm_lock_);
+void Display::StartClockTimer(int64_t delay_ms) {
+    esp_timer_stop(clock_timer_);
+    esp_timer_start_once(clock_timer_, delay_ms * 1000);
+}
+
+bool Display::UpdateMuteIcon(bool force) {
+    if (mute_label_ == nullptr) {
+        return false;
+    }
+    auto codec = Board::GetInstance().GetAudioCodec();
+    bool muted = codec->output_volume() == 0;
+    // 如果静音状态改变，则更新图标
+    if (muted == muted_ && !force) {
+        return false;
+    }
+    DisplayLockGuard lock(this);
+    muted_ = muted;
+    lv_label_set_text(mute_label_, muted_ ? FONT_AWESOME_VOLUME_XMARK : "");
+    return true;
+}
+
+bool Display::UpdateClock(bool force) {
+    // The timer is armed again when the device returns to idle
+    if (Application::GetInstance().GetDeviceState() != kDeviceStateIdle) {
+        return false;
+    }
+    auto shown_for = std::chrono::system_clock::now() - last_status_update_time_;
+    if (shown_for < std::chrono::seconds(STATUS_BAR_CLOCK_DELAY_SECONDS)) {
+        StartClockTimer(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::seconds(STATUS_BAR_CLOCK_DELAY_SECONDS) - shown_for).count());
+        return false;
+    }
+
+    // Set status to clock "HH:MM"
+    time_t now = time(NULL);
+    struct tm* tm = localtime(&now);
+    StartClockTimer((60 - tm->tm_sec) * 1000);
+    // Check if the we have already set the time
+    if (tm->tm_year < 2025 - 1900) {
+        ESP_LOGW(TAG, "System time is not set, tm_year: %d", tm->tm_year);
+        return false;
+    }
+    char time_str[sizeof(clock_text_)];
+    strftime(time_str, sizeof(time_str), "%H:%M  ", tm);
+    if (clock_shown_ && strcmp(time_str, clock_text_) == 0 && !force) {
+        return false;
+    }
+
+    if (!ShowClock(time_str)) {
+        return false;
+    }
+    strcpy(clock_text_, time_str);
+    clock_shown_ = true;
+    return true;
+}
+
+bool Display::ShowClock(const char* time) {
+    DisplayLockGuard lock(this);
+    if (status_label_ == nullptr) {
+        return false;
+    }
+    lv_label_set_text(status_label_, time);
+    lv_obj_remove_flag(status_label_, LV_OBJ_FLAG_HIDDEN);
+    lv_obj_add_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
+    return true;
+}
+
+bool Display::UpdateBatteryIcon(bool force) {
+    if (battery_label_ == nullptr && low_battery_popup_ == nullptr) {
+        return false;
+    }
     // 更新电池图标
     int battery_level;
     bool charging, discharging;
+    if (!Board::GetInstance().GetBatteryLevel(battery_level, charging, discharging)) {
+        return false;
+    }
     const char* icon = nullptr;
-    if (board.GetBatteryLevel(battery_level, charging, discharging)) {
-        if (charging) {
-            icon = FONT_AWESOME_BATTERY_BOLT;
-        } else {
-            const char* levels[] = {
-                FONT_AWESOME_BATTERY_EMPTY, // 0-19%
-                FONT_AWESOME_BATTERY_QUARTER,    // 20-39%
-                FONT_AWESOME_BATTERY_HALF,    // 40-59%
-                FONT_AWESOME_BATTERY_THREE_QUARTERS,    // 60-79%
-                FONT_AWESOME_BATTERY_FULL, // 80-99%
-                FONT_AWESOME_BATTERY_FULL, // 100%
-            };
-            icon = levels[battery_level / 20];
-        }
+    if (charging) {
+        icon = FONT_AWESOME_BATTERY_BOLT;
+    } else {
+        const char* levels[] = {
+            FONT_AWESOME_BATTERY_EMPTY, // 0-19%
+            FONT_AWESOME_BATTERY_QUARTER,    // 20-39%
+            FONT_AWESOME_BATTERY_HALF,    // 40-59%
+            FONT_AWESOME_BATTERY_THREE_QUARTERS,    // 60-79%
+            FONT_AWESOME_BATTERY_FULL, // 80-99%
+            FONT_AWESOME_BATTERY_FULL, // 100%
+        };
+        icon = levels[battery_level / 20];
+    }
+    bool low_battery = strcmp(icon, FONT_AWESOME_BATTERY_EMPTY) == 0 && discharging;
+    if (icon == battery_icon_ && low_battery == low_battery_shown_ && !force) {
+        return false;
+    }
+
+    esp_pm_lock_acquire(pm_lock_);
+    {
         DisplayLockGuard lock(this);
-        if (battery_label_ != nullptr && battery_icon_ != icon) {
-            battery_icon_ = icon;
+        battery_icon_ = icon;
+        if (battery_label_ != nullptr) {
             lv_label_set_text(battery_label_, battery_icon_);
         }
 
-        if (low_battery_popup_ != nullptr) {
-            if (strcmp(icon, FONT_AWESOME_BATTERY_EMPTY) == 0 && discharging) {
-                if (lv_obj_has_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN)) { // 如果低电量提示框隐藏，则显示
-                    lv_obj_remove_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
-                    app.PlaySound(Lang::Sounds::OGG_LOW_BATTERY);
-                }
+        if (low_battery_popup_ != nullptr && low_battery != low_battery_shown_) {
+            if (low_battery) {
+                // 如果低电量提示框隐藏，则显示
+                lv_obj_remove_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
+                Application::GetInstance().PlaySound(Lang::Sounds::OGG_LOW_BATTERY);
             } else {
                 // Hide the low battery popup when the battery is not empty
-                if (!lv_obj_has_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN)) { // 如果低电量提示框显示，则隐藏
-                    lv_obj_add_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
-                }
+                lv_obj_add_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
             }
         }
+        low_battery_shown_ = low_battery;
     }
+    esp_pm_lock_release(pm_lock_);
+    return true;
+}
 
-    // 每 10 秒更新一次网络图标
-    static int seconds_counter = 0;
-    if (update_all || seconds_counter++ % 10 == 0) {
-        // 升级固件时，不读取 4G 网络状态，避免占用 UART 资源
-        auto device_state = Application::GetInstance().GetDeviceState();
-        static const std::vector<DeviceState> allowed_states = {
-            kDeviceStateIdle,
-            kDeviceStateStarting,
-            kDeviceStateWifiConfiguring,
-            kDeviceStateListening,
-            kDeviceStateActivating,
-        };
-        if (std::find(allowed_states.begin(), allowed_states.end(), device_state) != allowed_states.end()) {
-            icon = board.GetNetworkStateIcon();
-            if (network_label_ != nullptr && icon != nullptr && network_icon_ != icon) {
-                DisplayLockGuard lock(this);
-                network_icon_ = icon;
-                lv_label_set_text(network_label_, network_icon_);
-            }
-        }
+bool Display::UpdateNetworkIcon(bool force) {
+    if (network_label_ == nullptr) {
+        return false;
     }
-
-    esp_pm_lock_release(pm_lock_);
+    // 升级固件时，不读取 4G 网络状态，避免占用 UART 资源
+    auto device_state = Application::GetInstance().GetDeviceState();
+    static const std::vector<DeviceState> allowed_states = {
+        kDeviceStateIdle,
+        kDeviceStateStarting,
+        kDeviceStateWifiConfiguring,
+        kDeviceStateListening,
+        kDeviceStateActivating,
+    };
+    if (std::find(allowed_states.begin(), allowed_states.end(), device_state) == allowed_states.end()) {
+        return false;
+    }
+    const char* icon = Board::GetInstance().GetNetworkStateIcon();
+    if (icon == nullptr || (icon == network_icon_ && !force)) {
+        return false;
+    }
+    DisplayLockGuard lock(this);
+    network_icon_ = icon;
+    lv_label_set_text(network_label_, network_icon_);
+    return true;
 }
 
 
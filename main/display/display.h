@@ -9,6 +9,20 @@
 #include <string>
 #include <chrono>
 
+// Items of the status bar, each is redrawn only when its value changes
+enum StatusBarItem {
+    kStatusBarMute,         // Reported by the audio codec when the volume is set
+    kStatusBarClock,        // Minute boundaries while idle, from 10 seconds after the device became idle
+    kStatusBarBattery,      // kEventBattery from the battery check of the clock timer
+    kStatusBarNetwork,      // kEventNetwork, and sampled every 10 seconds for the signal strength
+    kStatusBarItemCount
+};
+
+struct StatusBarStats {
+    uint32_t updates = 0;   // Times the source reported or was sampled
+    uint32_t redraws = 0;   // Times the value had changed
+};
+
 struct DisplayFonts {
     const lv_font_t* text_font = nullptr;
     const lv_font_t* icon_font = nullptr;
@@ -29,7 +43,13 @@ public:
     virtual void SetPreviewImage(const lv_img_dsc_t* image);
     virtual void SetTheme(const std::string& theme_name);
     virtual std::string GetTheme() { return current_theme_name_; }
+    // Redraws every item of the status bar if update_all, otherwise only those that changed
     virtual void UpdateStatusBar(bool update_all = false);
+    // Called by the source of an item when its value may have changed
+    void UpdateStatusBarItem(StatusBarItem item);
+    const StatusBarStats& GetStatusBarStats(StatusBarItem item) const { return status_bar_stats_[item]; }
+    // Set by the application when the device enters or leaves idle, the only state that shows the clock
+    void SetClockEnabled(bool enabled);
     virtual void SetPowerSaveMode(bool on);
 
     inline int width() const { return width_; }
@@ -55,14 +75,31 @@ protected:
     const char* battery_icon_ = nullptr;
     const char* network_icon_ = nullptr;
     bool muted_ = false;
+    bool low_battery_shown_ = false;
+    bool clock_shown_ = false;
+    char clock_text_[16] = {};
     std::string current_theme_name_;
 
     std::chrono::system_clock::time_point last_status_update_time_;
     esp_timer_handle_t notification_timer_ = nullptr;
+    esp_timer_handle_t clock_timer_ = nullptr;
+    StatusBarStats status_bar_stats_[kStatusBarItemCount];
 
     friend class DisplayLockGuard;
     virtual bool Lock(int timeout_ms = 0) = 0;
     virtual void Unlock() = 0;
+    // Shows the time in place of the status while idle, unlike SetStatus it does not restart the clock delay.
+    // Returns false if the display has no place for it
+    virtual bool ShowClock(const char* time);
+
+private:
+    // Each returns true if it redrew its item
+    bool UpdateMuteIcon(bool force);
+    bool UpdateClock(bool force);
+    bool UpdateBatteryIcon(bool force);
+    bool UpdateNetworkIcon(bool force);
+    void RefreshStatusBarItem(StatusBarItem item, bool force);
+    void StartClockTimer(int64_t delay_ms);
 };
 
 
@@ -10,6 +10,7 @@
 #include "assets/lang_config.h"
 #include <cstring>
 #include "settings.h"
+#include "memory_budget.h"
 
 #include "board.h"
 
@@ -94,6 +95,7 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
                            int width, int height, int offset_x, int offset_y, bool mirror_x, bool mirror_y, bool swap_xy,
                            DisplayFonts fonts)
     : LcdDisplay(panel_io, panel, fonts, width, height) {
+    MemoryBudget::Measure measure(kMemoryDisplay);
     ESP_LOGI(TAG, "SpiLcdDisplay constructor begin");
 
     // Initialize LVGL library first
@@ -159,6 +161,7 @@ RgbLcdDisplay::RgbLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
                            bool mirror_x, bool mirror_y, bool swap_xy,
                            DisplayFonts fonts)
     : LcdDisplay(panel_io, panel, fonts, width, height) {
+    MemoryBudget::Measure measure(kMemoryDisplay);
 
     // draw white
     std::vector<uint16_t> buffer(width_, 0xFFFF);
@@ -221,6 +224,7 @@ MipiLcdDisplay::MipiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel
                             bool mirror_x, bool mirror_y, bool swap_xy,
                             DisplayFonts fonts)
     : LcdDisplay(panel_io, panel, fonts, width, height) {
+    MemoryBudget::Measure measure(kMemoryDisplay);
 
     // Set the display to on
     ESP_LOGI(TAG, "Turning display on");
@@ -544,7 +548,8 @@ void LcdDisplay::SetPreviewImage(const lv_img_dsc_t* img_dsc) {
         lv_obj_t* preview_image = lv_image_create(img_bubble);
         
         // Copy the image descriptor and data to avoid source data changes
-        lv_img_dsc_t* copied_img_dsc = (lv_img_dsc_t*)heap_caps_malloc(sizeof(lv_img_dsc_t), MALLOC_CAP_8BIT);
+        auto& memory = MemoryBudget::GetInstance();
+        lv_img_dsc_t* copied_img_dsc = (lv_img_dsc_t*)memory.Allocate(kMemoryDisplay, sizeof(lv_img_dsc_t), MALLOC_CAP_8BIT);
         if (copied_img_dsc == nullptr) {
             ESP_LOGE(TAG, "Failed to allocate memory for image descriptor");
             lv_obj_del(img_bubble);
@@ -556,14 +561,11 @@ void LcdDisplay::SetPreviewImage(const lv_img_dsc_t* img_dsc) {
         copied_img_dsc->data_size = img_dsc->data_size;
         
         // Copy the image data
-        uint8_t* copied_data = (uint8_t*)heap_caps_malloc(img_dsc->data_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-        if (copied_data == nullptr) {
-            // Fallback to internal RAM if SPIRAM allocation fails
-            copied_data = (uint8_t*)heap_caps_malloc(img_dsc->data_size, MALLOC_CAP_8BIT);
-        }
+        // Large images go to SPIRAM, or to internal RAM if SPIRAM is full
+        uint8_t* copied_data = (uint8_t*)memory.Allocate(kMemoryDisplay, img_dsc->data_size);
         if (copied_data == nullptr) {
             ESP_LOGE(TAG, "Failed to allocate memory for image data (size: %lu bytes)", img_dsc->data_size);
-            heap_caps_free(copied_img_dsc);
+            memory.Free(kMemoryDisplay, copied_img_dsc);
             lv_obj_del(img_bubble);
             return;
         }
@@ -594,8 +596,9 @@ void LcdDisplay::SetPreviewImage(const lv_img_dsc_t* img_dsc) {
         lv_obj_add_event_cb(preview_image, [](lv_event_t* e) {
             lv_img_dsc_t* copied_img_dsc = (lv_img_dsc_t*)lv_event_get_user_data(e);
             if (copied_img_dsc != nullptr) {
-                heap_caps_free((void*)copied_img_dsc->data);
-                heap_caps_free(copied_img_dsc);
+                auto& memory = MemoryBudget::GetInstance();
+                memory.Free(kMemoryDisplay, (void*)copied_img_dsc->data);
+                memory.Free(kMemoryDisplay, copied_img_dsc);
             }
         }, LV_EVENT_DELETE, (void*)copied_img_dsc);
         
@@ -1,5 +1,6 @@
 #include "oled_display.h"
 #include "assets/lang_config.h"
+#include "memory_budget.h"
 
 #include <string>
 #include <algorithm>
@@ -16,6 +17,7 @@ LV_FONT_DECLARE(font_awesome_30_1);
 OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
     int width, int height, bool mirror_x, bool mirror_y, DisplayFonts fonts)
     : panel_io_(panel_io), panel_(panel), fonts_(fonts) {
+    MemoryBudget::Measure measure(kMemoryDisplay);
     width_ = width;
     height_ = height;
 
@@ -0,0 +1,172 @@
+#include "event_bus.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <cassert>
+#include <cstring>
+
+#define TAG "EventBus"
+
+static constexpr const char* kTopicNames[kEventTopicCount] = {
+    "device_state",
+    "vad",
+    "network",
+    "battery",
+    "wake_word",
+};
+
+int EventBus::AddSubscriber(const EventSubscriber& subscriber) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int index = subscriber_count_.load(std::memory_order_relaxed);
+    if (index >= EVENT_BUS_MAX_SUBSCRIBERS) {
+        ESP_LOGE(TAG, "Too many subscribers, %s is not added", subscriber.name);
+        return -1;
+    }
+    subscribers_[index] = subscriber;
+    // Publishers only read the entries below the count
+    subscriber_count_.store(index + 1, std::memory_order_release);
+    return index;
+}
+
+int EventBus::Subscribe(const char* name, uint32_t topics, EventHandler handler, void* arg) {
+    return AddSubscriber({ name, topics, handler, arg, nullptr });
+}
+
+int EventBus::SubscribeQueue(const char* name, uint32_t topics, int queue_length) {
+    QueueHandle_t queue = xQueueCreate(queue_length, sizeof(Event));
+    if (queue == nullptr) {
+        ESP_LOGE(TAG, "Failed to create the queue of %s", name);
+        return -1;
+    }
+    int id = AddSubscriber({ name, topics, nullptr, nullptr, queue });
+    if (id < 0) {
+        vQueueDelete(queue);
+    }
+    return id;
+}
+
+bool EventBus::Receive(int subscriber, Event& event, TickType_t timeout) {
+    assert(subscriber >= 0 && subscriber < subscriber_count_.load(std::memory_order_acquire));
+    auto queue = subscribers_[subscriber].queue;
+    if (queue == nullptr || xQueueReceive(queue, &event, timeout) != pdTRUE) {
+        return false;
+    }
+    RecordLatency(event.topic, event.publish_us);
+    return true;
+}
+
+void EventBus::Publish(Event& event) {
+    assert(event.topic < kEventTopicCount);
+    auto& stats = stats_[event.topic];
+    bool in_isr = xPortInIsrContext();
+    event.publish_us = esp_timer_get_time();
+    stats.published.fetch_add(1, std::memory_order_relaxed);
+
+    // The ISR yields once, after every queue got the event
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    int count = subscriber_count_.load(std::memory_order_acquire);
+    for (int i = 0; i < count; i++) {
+        auto& subscriber = subscribers_[i];
+        if ((subscriber.topics & TopicMask(event.topic)) == 0) {
+            continue;
+        }
+
+        if (subscriber.queue != nullptr) {
+            BaseType_t sent;
+            if (in_isr) {
+                sent = xQueueSendFromISR(subscriber.queue, &event, &higher_priority_task_woken);
+            } else {
+                sent = xQueueSend(subscriber.queue, &event, 0);
+            }
+            if (sent != pdTRUE) {
+                stats.dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+        } else if (in_isr) {
+            stats.dropped.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            subscriber.handler(event, subscriber.arg);
+            RecordLatency(event.topic, event.publish_us);
+        }
+    }
+    if (in_isr) {
+        portYIELD_FROM_ISR(higher_priority_task_woken);
+    }
+}
+
+void EventBus::RecordLatency(EventTopic topic, int64_t publish_us) {
+    auto& stats = stats_[topic];
+    uint32_t latency_us = esp_timer_get_time() - publish_us;
+    stats.delivered.fetch_add(1, std::memory_order_relaxed);
+    stats.total_latency_us.fetch_add(latency_us, std::memory_order_relaxed);
+    uint32_t max_latency_us = stats.max_latency_us.load(std::memory_order_relaxed);
+    while (latency_us > max_latency_us &&
+        !stats.max_latency_us.compare_exchange_weak(max_latency_us, latency_us, std::memory_order_relaxed)) {
+    }
+}
+
+void EventBus::PublishDeviceState(DeviceState previous, DeviceState current) {
+    Event event = { .topic = kEventDeviceState };
+    event.state.previous = previous;
+    event.state.current = current;
+    Publish(event);
+}
+
+void EventBus::PublishVad(bool speaking) {
+    Event event = { .topic = kEventVad };
+    event.vad.speaking = speaking;
+    Publish(event);
+}
+
+void EventBus::PublishNetwork(bool connected) {
+    Event event = { .topic = kEventNetwork };
+    event.network.connected = connected;
+    Publish(event);
+}
+
+void EventBus::PublishBattery(int level, bool charging, bool discharging) {
+    Event event = { .topic = kEventBattery };
+    event.battery.level = level;
+    event.battery.charging = charging;
+    event.battery.discharging = discharging;
+    Publish(event);
+}
+
+void EventBus::PublishWakeWord(const char* wake_word) {
+    Event event = { .topic = kEventWakeWord };
+    strncpy(event.wake_word, wake_word, sizeof(event.wake_word) - 1);
+    event.wake_word[sizeof(event.wake_word) - 1] = '\0';
+    Publish(event);
+}
+
+const char* EventBus::GetTopicName(EventTopic topic) {
+    if (topic >= kEventTopicCount) {
+        return "invalid_topic";
+    }
+    return kTopicNames[topic];
+}
+
+cJSON* EventBus::ToJson() {
+    auto json = cJSON_CreateObject();
+    for (int i = 0; i < kEventTopicCount; i++) {
+        auto& stats = stats_[i];
+        uint32_t delivered = stats.delivered.load(std::memory_order_relaxed);
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "published", stats.published.load(std::memory_order_relaxed));
+        cJSON_AddNumberToObject(item, "delivered", delivered);
+        cJSON_AddNumberToObject(item, "dropped", stats.dropped.load(std::memory_order_relaxed));
+        if (delivered > 0) {
+            cJSON_AddNumberToObject(item, "avg_latency_us", stats.total_latency_us.load(std::memory_order_relaxed) / delivered);
+            cJSON_AddNumberToObject(item, "max_latency_us", stats.max_latency_us.load(std::memory_order_relaxed));
+        }
+        cJSON_AddItemToObject(json, kTopicNames[i], item);
+    }
+
+    auto subscribers = cJSON_CreateArray();
+    int count = subscriber_count_.load(std::memory_order_acquire);
+    for (int i = 0; i < count; i++) {
+        cJSON_AddItemToArray(subscribers, cJSON_CreateString(subscribers_[i].name));
+    }
+    cJSON_AddItemToObject(json, "subscribers", subscribers);
+    return json;
+}
@@ -0,0 +1,123 @@
+#ifndef _EVENT_BUS_H_
+#define _EVENT_BUS_H_
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <cJSON.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+#include "device_state.h"
+
+#define EVENT_BUS_MAX_SUBSCRIBERS 16
+#define EVENT_WAKE_WORD_MAX_LENGTH 24
+
+enum EventTopic : uint8_t {
+    kEventDeviceState,
+    kEventVad,
+    kEventNetwork,      // The network interface came up or went down
+    kEventBattery,      // Level or charging state changed
+    kEventWakeWord,
+    kEventTopicCount
+};
+
+constexpr uint32_t TopicMask(EventTopic topic) {
+    return 1u << topic;
+}
+
+template <typename... Topics>
+constexpr uint32_t TopicMask(EventTopic topic, Topics... topics) {
+    return TopicMask(topic) | TopicMask(topics...);
+}
+
+// Fixed size, so events are copied into the queues of the subscribers without allocation
+struct Event {
+    EventTopic topic;
+    int64_t publish_us;
+    union {
+        struct {
+            DeviceState previous;
+            DeviceState current;
+        } state;
+        struct {
+            bool speaking;
+        } vad;
+        struct {
+            bool connected;
+        } network;
+        struct {
+            int level;
+            bool charging;
+            bool discharging;
+        } battery;
+        char wake_word[EVENT_WAKE_WORD_MAX_LENGTH];
+    };
+};
+
+using EventHandler = void (*)(const Event& event, void* arg);
+
+struct EventSubscriber {
+    const char* name;
+    uint32_t topics;
+    EventHandler handler;   // Runs in the task that publishes, nullptr for a queue
+    void* arg;
+    QueueHandle_t queue;    // Taken by the task of the subscriber with Receive
+};
+
+struct EventTopicStats {
+    std::atomic<uint32_t> published = 0;
+    std::atomic<uint32_t> delivered = 0;
+    std::atomic<uint32_t> dropped = 0;          // A queue was full, or a handler was skipped in an ISR
+    std::atomic<uint32_t> max_latency_us = 0;   // From the publish to the end of the handler, or to Receive
+    std::atomic<uint64_t> total_latency_us = 0;
+};
+
+/*
+ * Typed publish/subscribe between the components. The subscribers are registered once at startup
+ * into a static table, and the publish walks the table without a lock, so it can be called from any
+ * task; from an ISR only the queues get the event. A subscriber either has a short handler that runs
+ * in the publisher's task, or a queue that its own task empties with Receive.
+ */
+class EventBus {
+public:
+    static EventBus& GetInstance() {
+        static EventBus instance;
+        return instance;
+    }
+    EventBus(const EventBus&) = delete;
+    EventBus& operator=(const EventBus&) = delete;
+
+    // The handler must not block. Returns the subscriber id, -1 if the table is full
+    int Subscribe(const char* name, uint32_t topics, EventHandler handler, void* arg);
+    // Returns the subscriber id, -1 if the table is full or the queue cannot be created
+    int SubscribeQueue(const char* name, uint32_t topics, int queue_length);
+    // For a subscriber with a queue, returns false on timeout
+    bool Receive(int subscriber, Event& event, TickType_t timeout);
+
+    void Publish(Event& event);
+    void PublishDeviceState(DeviceState previous, DeviceState current);
+    void PublishVad(bool speaking);
+    void PublishNetwork(bool connected);
+    void PublishBattery(int level, bool charging, bool discharging);
+    // Wake words longer than EVENT_WAKE_WORD_MAX_LENGTH - 1 are cut
+    void PublishWakeWord(const char* wake_word);
+
+    static const char* GetTopicName(EventTopic topic);
+    // Returns a new object with the counters of every topic, the caller owns it
+    cJSON* ToJson();
+
+private:
+    EventBus() = default;
+
+    std::mutex mutex_;  // Only for Subscribe
+    EventSubscriber subscribers_[EVENT_BUS_MAX_SUBSCRIBERS] = {};
+    std::atomic<int> subscriber_count_ = 0;
+    EventTopicStats stats_[kEventTopicCount];
+
+    int AddSubscriber(const EventSubscriber& subscriber);
+    void RecordLatency(EventTopic topic, int64_t publish_us);
+};
+
+#endif // _EVENT_BUS_H_
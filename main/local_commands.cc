@@ -0,0 +1,179 @@
+#include "local_commands.h"
+#include "application.h"
+#include "board.h"
+#include "display.h"
+#include "mcp_server.h"
+#include "assets/lang_config.h"
+
+#include <esp_log.h>
+#include <cJSON.h>
+#include <ctime>
+#include <algorithm>
+
+#define TAG "LocalCommands"
+
+enum LocalCommandId {
+    kLocalCommandVolumeUp = LOCAL_COMMAND_ID_BASE,
+    kLocalCommandVolumeDown,
+    kLocalCommandMute,
+    kLocalCommandStop,
+    kLocalCommandTime,
+    kLocalCommandBrightnessUp,
+    kLocalCommandBrightnessDown,
+    kLocalCommandNextAlarm,
+};
+
+struct LocalCommandWord {
+    int id;
+    const char* phrase;     // 拼音，每个字之间用空格隔开
+};
+
+static const LocalCommandWord kCommandWords[] = {
+    { kLocalCommandVolumeUp,        "tiao da yin liang" },      // 调大音量
+    { kLocalCommandVolumeUp,        "da sheng yi dian" },       // 大声一点
+    { kLocalCommandVolumeDown,      "tiao xiao yin liang" },    // 调小音量
+    { kLocalCommandVolumeDown,      "xiao sheng yi dian" },     // 小声一点
+    { kLocalCommandMute,            "jing yin" },               // 静音
+    { kLocalCommandStop,            "ting zhi shuo hua" },      // 停止说话
+    { kLocalCommandTime,            "xian zai ji dian" },       // 现在几点
+    { kLocalCommandBrightnessUp,    "tiao liang ping mu" },     // 调亮屏幕
+    { kLocalCommandBrightnessDown,  "tiao an ping mu" },        // 调暗屏幕
+    { kLocalCommandNextAlarm,       "nao zhong ji dian" },      // 闹钟几点
+};
+
+std::vector<std::pair<int, std::string>> LocalCommands::GetCommandWords() {
+    std::vector<std::pair<int, std::string>> words;
+    for (auto& word : kCommandWords) {
+        words.emplace_back(word.id, word.phrase);
+    }
+    return words;
+}
+
+static bool CallTool(const char* tool_name, const char* argument, int value, ReturnValue& result) {
+    cJSON* arguments = cJSON_CreateObject();
+    if (argument != nullptr) {
+        cJSON_AddNumberToObject(arguments, argument, value);
+    }
+    bool success = McpServer::GetInstance().CallToolLocally(tool_name, arguments, result);
+    cJSON_Delete(arguments);
+    return success;
+}
+
+// Find the next enabled alarm in the result of the alarm.list tool
+static bool GetNextAlarm(const std::string& alarms_json, int& hour, int& minute) {
+    cJSON* root = cJSON_Parse(alarms_json.c_str());
+    if (root == nullptr) {
+        return false;
+    }
+
+    bool found = false;
+    double next_trigger_time = 0;
+    cJSON* alarm;
+    cJSON_ArrayForEach(alarm, cJSON_GetObjectItem(root, "alarms")) {
+        auto enabled = cJSON_GetObjectItem(alarm, "enabled");
+        auto trigger_time = cJSON_GetObjectItem(alarm, "next_trigger_time");
+        auto alarm_hour = cJSON_GetObjectItem(alarm, "hour");
+        auto alarm_minute = cJSON_GetObjectItem(alarm, "minute");
+        if (!cJSON_IsTrue(enabled) || !cJSON_IsNumber(trigger_time) || !cJSON_IsNumber(alarm_hour) ||
+            !cJSON_IsNumber(alarm_minute)) {
+            continue;
+        }
+        if (!found || trigger_time->valuedouble < next_trigger_time) {
+            found = true;
+            next_trigger_time = trigger_time->valuedouble;
+            hour = alarm_hour->valueint;
+            minute = alarm_minute->valueint;
+        }
+    }
+    cJSON_Delete(root);
+    return found;
+}
+
+bool LocalCommands::Execute(int command_id) {
+    auto& app = Application::GetInstance();
+    auto& board = Board::GetInstance();
+    auto display = board.GetDisplay();
+    ReturnValue result;
+    bool success = false;
+    std::string message;
+
+    switch (command_id) {
+        case kLocalCommandVolumeUp:
+        case kLocalCommandVolumeDown:
+        case kLocalCommandMute: {
+            int volume = board.GetAudioCodec()->output_volume();
+            if (command_id == kLocalCommandVolumeUp) {
+                volume = std::min(100, volume + LOCAL_COMMAND_VOLUME_STEP);
+            } else if (command_id == kLocalCommandVolumeDown) {
+                volume = std::max(0, volume - LOCAL_COMMAND_VOLUME_STEP);
+            } else {
+                volume = 0;
+            }
+            success = CallTool("self.audio_speaker.set_volume", "volume", volume, result);
+            message = Lang::Strings::VOLUME + std::to_string(volume);
+            break;
+        }
+        case kLocalCommandBrightnessUp:
+        case kLocalCommandBrightnessDown: {
+            auto backlight = board.GetBacklight();
+            if (backlight == nullptr) {
+                break;
+            }
+            int brightness = backlight->brightness();
+            if (command_id == kLocalCommandBrightnessUp) {
+                brightness = std::min(100, brightness + LOCAL_COMMAND_BRIGHTNESS_STEP);
+            } else {
+                brightness = std::max(LOCAL_COMMAND_BRIGHTNESS_STEP, brightness - LOCAL_COMMAND_BRIGHTNESS_STEP);
+            }
+            success = CallTool("self.screen.set_brightness", "brightness", brightness, result);
+            break;
+        }
+        case kLocalCommandStop:
+            if (app.GetDeviceState() == kDeviceStateSpeaking) {
+                app.AbortSpeaking(kAbortReasonNone);
+            }
+            success = true;
+            break;
+        case kLocalCommandTime: {
+            time_t now = time(nullptr);
+            struct tm tm;
+            localtime_r(&now, &tm);
+            // The clock is not synchronized yet
+            if (tm.tm_year < 2025 - 1900) {
+                break;
+            }
+            char buffer[16];
+            strftime(buffer, sizeof(buffer), "%H:%M", &tm);
+            message = buffer;
+            success = true;
+            break;
+        }
+        case kLocalCommandNextAlarm: {
+            int hour = 0, minute = 0;
+            if (CallTool("alarm.list", nullptr, 0, result) && std::holds_alternative<std::string>(result)) {
+                char buffer[16];
+                if (GetNextAlarm(std::get<std::string>(result), hour, minute)) {
+                    snprintf(buffer, sizeof(buffer), "%02d:%02d", hour, minute);
+                } else {
+                    snprintf(buffer, sizeof(buffer), "--:--");
+                }
+                message = buffer;
+                success = true;
+            }
+            break;
+        }
+        default:
+            ESP_LOGW(TAG, "Unknown local command: %d", command_id);
+            return false;
+    }
+
+    ESP_LOGI(TAG, "Local command %d %s", command_id, success ? "done" : "failed");
+    if (!message.empty()) {
+        display->ShowNotification(message);
+    }
+    // The cue would be queued behind the speech, so it is only played when the speaker is free
+    if (app.GetDeviceState() == kDeviceStateIdle) {
+        app.PlaySound(success ? Lang::Sounds::OGG_POPUP : Lang::Sounds::OGG_EXCLAMATION);
+    }
+    return success;
+}
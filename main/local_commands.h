@@ -0,0 +1,27 @@
+#ifndef LOCAL_COMMANDS_H
+#define LOCAL_COMMANDS_H
+
+#include <string>
+#include <vector>
+#include <utility>
+
+/*
+ * Simple intents recognized on the device by the command word model of the custom wake word,
+ * and executed by calling the existing MCP tools locally, without a server round trip.
+ * They keep working when the network is down.
+ */
+
+// Command ids below are reserved for wake words
+#define LOCAL_COMMAND_ID_BASE 100
+#define LOCAL_COMMAND_VOLUME_STEP 10
+#define LOCAL_COMMAND_BRIGHTNESS_STEP 20
+
+class LocalCommands {
+public:
+    // Command id and pinyin phrase pairs, several phrases may share one id
+    static std::vector<std::pair<int, std::string>> GetCommandWords();
+    // Called in the main loop, returns false if the command failed
+    static bool Execute(int command_id);
+};
+
+#endif // LOCAL_COMMANDS_H
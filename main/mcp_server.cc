@@ -8,11 +8,16 @@
 #include <esp_app_desc.h>
 #include <algorithm>
 #include <cstring>
-#include <esp_pthread.h>
+#include <cassert>
 
 #include "application.h"
 #include "display.h"
 #include "board.h"
+#include "voice_memo.h"
+#include "connection_manager.h"
+#include "task_registry.h"
+#include "memory_budget.h"
+#include "cbor_json.h"
 
 // 添加WiFi重新配置功能相关头文件
 #include "../newfunction/wifi_reconfig.h"
@@ -30,6 +35,7 @@ McpServer::~McpServer() {
         delete tool;
     }
     tools_.clear();
+    tool_index_.clear();
 }
 
 void McpServer::AddCommonTools() {
@@ -70,6 +76,100 @@ void McpServer::AddCommonTools() {
             return board.GetDeviceStatusJson();
         });
 
+    AddTool("self.network.get_quality",
+        "Get the quality of the connection to the server: round trip time, jitter, packet loss and audio throughput,\n"
+        "and the connect times of the HTTP requests and the websocket.\n"
+        "Use this tool when the user asks why the voice is choppy or delayed, or how good the network is.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto json = NetworkQualityMonitor::GetInstance().ToJson();
+            cJSON_AddItemToObject(json, "connections", ConnectionManager::GetInstance().ToJson());
+            auto json_str = cJSON_PrintUnformatted(json);
+            std::string result(json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(json);
+            return result;
+        });
+
+    AddTool("self.system.get_state_metrics",
+        "Get how long the device took to change its state (e.g. from idle to listening), per transition and per step,\n"
+        "and how many state changes were refused. Use this tool when the user asks why the device reacts slowly.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto json = Application::GetInstance().GetStateMachine().ToJson();
+            auto json_str = cJSON_PrintUnformatted(json);
+            std::string result(json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(json);
+            return result;
+        });
+
+    AddTool("self.system.get_event_stats",
+        "Get how many internal events (device state, voice activity, network, battery, wake word) were published,\n"
+        "delivered and dropped, and how long the delivery took. Use this tool when the user asks why the device reacts slowly.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto json = EventBus::GetInstance().ToJson();
+            auto json_str = cJSON_PrintUnformatted(json);
+            std::string result(json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(json);
+            return result;
+        });
+
+    AddTool("self.system.get_task_config",
+        "Get the stack size, priority and core of every firmware task. If stack measurement is enabled in the firmware,\n"
+        "also the stack really used, a suggested stack size and how long each task waited to start.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto json = TaskRegistry::GetInstance().ToJson();
+            auto json_str = cJSON_PrintUnformatted(json);
+            std::string result(json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(json);
+            return result;
+        });
+
+    AddTool("self.system.get_memory_usage",
+        "Get the memory used by each part of the firmware (display, audio, opus, MCP tool calls, protocol buffers)\n"
+        "in internal SRAM and PSRAM, their budgets, how fragmented the heaps are, and the failed allocations.\n"
+        "Use this tool when the user asks about memory or the device ran out of memory.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto json = MemoryBudget::GetInstance().ToJson();
+            auto json_str = cJSON_PrintUnformatted(json);
+            std::string result(json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(json);
+            return result;
+        });
+
+    AddTool("self.system.get_tool_call_stats",
+        "Get the statistics of the MCP tool calls: the workers and how many are busy, the calls refused because too many\n"
+        "were in progress, timed out or cancelled, and the average and longest wait in the queue and run time in microseconds.",
+        PropertyList(),
+        [this](const PropertyList& properties) -> ReturnValue {
+            auto json = GetToolCallStats();
+            auto json_str = cJSON_PrintUnformatted(json);
+            std::string result(json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(json);
+            return result;
+        });
+
+    AddTool("self.system.get_boot_timeline",
+        "Get the boot timeline of the device: when each boot phase (board, audio, network, OTA check, protocol) started\n"
+        "and ended in milliseconds since power-on, and when the first wake word was heard. Use this tool when the user asks why the device starts slowly.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto json = Application::GetInstance().GetBootSequence().ToJson();
+            auto json_str = cJSON_PrintUnformatted(json);
+            std::string result(json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(json);
+            return result;
+        });
+
     // 添加闹钟工具
     AddTool("alarm.set",
         "Set an alarm clock",
@@ -150,6 +250,84 @@ void McpServer::AddCommonTools() {
             return true;
         });
     
+    AddTool("self.audio_speaker.calibrate_latency",
+        "Measure the delay from the speaker to the microphone by playing a short test sound, the result is used for echo cancellation.\n"
+        "Use this tool only when the user asks to calibrate the audio. The current conversation will be ended.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            Application::GetInstance().StartAcousticCalibration();
+            return "Calibration will start after the conversation is closed, the result will be shown on the screen";
+        });
+
+#if CONFIG_USE_VOICE_MEMO
+    auto& voice_memo = VoiceMemo::GetInstance();
+    if (voice_memo.IsMounted()) {
+        AddTool("self.memo.start_recording",
+            "Record a voice memo to the device storage. Use this tool when the user asks to record a memo or a note.\n"
+            "The current conversation will be ended, and the recording stops after `max_seconds` or when the user presses the button.",
+            PropertyList({
+                Property("max_seconds", kPropertyTypeInteger, 60, 5, VOICE_MEMO_MAX_SECONDS)
+            }),
+            [&voice_memo](const PropertyList& properties) -> ReturnValue {
+                if (voice_memo.IsRecording() || voice_memo.IsPlaying()) {
+                    return "{\"success\": false, \"message\": \"Voice memo is busy\"}";
+                }
+                Application::GetInstance().EndConversation();
+                voice_memo.StartRecording(properties["max_seconds"].value<int>());
+                return "Recording will start after the conversation is closed";
+            });
+
+        AddTool("self.memo.list",
+            "List the voice memos saved on the device, with the file name and size in bytes.",
+            PropertyList(),
+            [&voice_memo](const PropertyList& properties) -> ReturnValue {
+                return voice_memo.GetMemosAsJson();
+            });
+
+        AddTool("self.memo.play",
+            "Play a voice memo. The current conversation will be ended before playing.\n"
+            "Args:\n"
+            "  `name`: The file name returned by `self.memo.list`.",
+            PropertyList({
+                Property("name", kPropertyTypeString)
+            }),
+            [&voice_memo](const PropertyList& properties) -> ReturnValue {
+                auto name = properties["name"].value<std::string>();
+                if (voice_memo.IsRecording() || voice_memo.IsPlaying()) {
+                    return "{\"success\": false, \"message\": \"Voice memo is busy\"}";
+                }
+                Application::GetInstance().EndConversation();
+                if (!voice_memo.StartPlayback(name)) {
+                    return "{\"success\": false, \"message\": \"Memo not found\"}";
+                }
+                return true;
+            });
+
+        AddTool("self.memo.delete",
+            "Delete a voice memo by the file name returned by `self.memo.list`.",
+            PropertyList({
+                Property("name", kPropertyTypeString)
+            }),
+            [&voice_memo](const PropertyList& properties) -> ReturnValue {
+                return voice_memo.Delete(properties["name"].value<std::string>());
+            });
+
+        AddTool("self.memo.upload",
+            "Upload a voice memo to the server, for example to transcribe it.\n"
+            "Args:\n"
+            "  `name`: The file name returned by `self.memo.list`.\n"
+            "Return:\n"
+            "  The response of the upload server.",
+            PropertyList({
+                Property("name", kPropertyTypeString)
+            }),
+            [&voice_memo](const PropertyList& properties) -> ReturnValue {
+                return voice_memo.Upload(properties["name"].value<std::string>());
+            });
+        SetToolTimeout("self.memo.upload", 60 * 1000);
+    }
+#endif
+
     auto backlight = board.GetBacklight();
     if (backlight) {
         AddTool("self.screen.set_brightness",
@@ -188,13 +366,19 @@ void McpServer::AddCommonTools() {
             PropertyList({
                 Property("question", kPropertyTypeString)
             }),
-            [camera](const PropertyList& properties) -> ReturnValue {
+            [this, camera](const PropertyList& properties) -> ReturnValue {
                 if (!camera->Capture()) {
                     return "{\"success\": false, \"message\": \"Failed to capture photo\"}";
                 }
+                // The upload is slow, no need to start it for a cancelled call
+                if (IsToolCallCancelled()) {
+                    return "{\"success\": false, \"message\": \"Cancelled\"}";
+                }
                 auto question = properties["question"].value<std::string>();
                 return camera->Explain(question);
             });
+        // Capture, upload and the answer of the vision model
+        SetToolTimeout("self.camera.take_photo", 60 * 1000);
     }
 
     // Restore the original tools list to the end of the tools list
@@ -203,7 +387,7 @@ void McpServer::AddCommonTools() {
 
 void McpServer::AddTool(McpTool* tool) {
     // Prevent adding duplicate tools
-    if (std::find_if(tools_.begin(), tools_.end(), [tool](const McpTool* t) { return t->name() == tool->name(); }) != tools_.end()) {
+    if (!tool_index_.emplace(tool->name(), tool).second) {
         ESP_LOGW(TAG, "Tool %s already added", tool->name().c_str());
         return;
     }
@@ -243,6 +427,17 @@ void McpServer::ParseCapabilities(const cJSON* capabilities) {
             }
         }
     }
+
+#if CONFIG_USE_VOICE_MEMO
+    auto memo = cJSON_GetObjectItem(capabilities, "memo");
+    if (cJSON_IsObject(memo)) {
+        auto url = cJSON_GetObjectItem(memo, "url");
+        auto token = cJSON_GetObjectItem(memo, "token");
+        if (cJSON_IsString(url)) {
+            VoiceMemo::GetInstance().SetUploadUrl(url->valuestring, cJSON_IsString(token) ? token->valuestring : "");
+        }
+    }
+#endif
 }
 
 void McpServer::ParseMessage(const cJSON* json) {
@@ -261,6 +456,14 @@ void McpServer::ParseMessage(const cJSON* json) {
     }
     
     auto method_str = std::string(method->valuestring);
+    if (method_str == "notifications/cancelled") {
+        auto params = cJSON_GetObjectItem(json, "params");
+        auto request_id = cJSON_GetObjectItem(params, "requestId");
+        if (cJSON_IsNumber(request_id)) {
+            CancelToolCall(request_id->valueint);
+        }
+        return;
+    }
     if (method_str.find("notifications") == 0) {
         return;
     }
@@ -287,10 +490,14 @@ void McpServer::ParseMessage(const cJSON* json) {
             }
         }
         auto app_desc = esp_app_get_description();
-        std::string message = "{\"protocolVersion\":\"2024-11-05\",\"capabilities\":{\"tools\":{}},\"serverInfo\":{\"name\":\"" BOARD_NAME "\",\"version\":\"";
-        message += app_desc->version;
-        message += "\"}}";
-        ReplyResult(id_int, message);
+        cJSON* result = cJSON_CreateObject();
+        cJSON_AddStringToObject(result, "protocolVersion", "2024-11-05");
+        cJSON* capabilities = cJSON_AddObjectToObject(result, "capabilities");
+        cJSON_AddObjectToObject(capabilities, "tools");
+        cJSON* server_info = cJSON_AddObjectToObject(result, "serverInfo");
+        cJSON_AddStringToObject(server_info, "name", BOARD_NAME);
+        cJSON_AddStringToObject(server_info, "version", app_desc->version);
+        ReplyResult(id_int, result);
     } else if (method_str == "tools/list") {
         std::string cursor_str = "";
         if (params != nullptr) {
@@ -331,26 +538,32 @@ void McpServer::ParseMessage(const cJSON* json) {
     }
 }
 
-void McpServer::ReplyResult(int id, const std::string& result) {
-    std::string payload = "{\"jsonrpc\":\"2.0\",\"id\":";
-    payload += std::to_string(id) + ",\"result\":";
-    payload += result;
-    payload += "}";
+void McpServer::ReplyResult(int id, cJSON* result) {
+    cJSON* payload = cJSON_CreateObject();
+    cJSON_AddStringToObject(payload, "jsonrpc", "2.0");
+    cJSON_AddNumberToObject(payload, "id", id);
+    cJSON_AddItemToObject(payload, "result", result);
     Application::GetInstance().SendMcpMessage(payload);
 }
 
 void McpServer::ReplyError(int id, const std::string& message) {
-    std::string payload = "{\"jsonrpc\":\"2.0\",\"id\":";
-    payload += std::to_string(id);
-    payload += ",\"error\":{\"message\":\"";
-    payload += message;
-    payload += "\"}}";
+    cJSON* payload = cJSON_CreateObject();
+    cJSON_AddStringToObject(payload, "jsonrpc", "2.0");
+    cJSON_AddNumberToObject(payload, "id", id);
+    cJSON* error = cJSON_AddObjectToObject(payload, "error");
+    cJSON_AddStringToObject(error, "message", message.c_str());
     Application::GetInstance().SendMcpMessage(payload);
 }
 
 void McpServer::GetToolsList(int id, const std::string& cursor) {
-    const int max_payload_size = 8000;
-    std::string json = "{\"tools\":[";
+    // The limit holds for the message on the wire, which is smaller once CBOR is used
+    const size_t max_payload_size = 8000;
+    bool cbor = Application::GetInstance().IsCborEnabled();
+    std::vector<uint8_t> cbor_buffer;
+    cJSON* result = cJSON_CreateObject();
+    cJSON* tools = cJSON_AddArrayToObject(result, "tools");
+    // Room for the envelope of the reply
+    size_t payload_size = 40;
     
     bool found_cursor = cursor.empty();
     auto it = tools_.begin();
@@ -368,94 +581,358 @@ void McpServer::GetToolsList(int id, const std::string& cursor) {
         }
         
         // 添加tool前检查大小
-        std::string tool_json = (*it)->to_json() + ",";
-        if (json.length() + tool_json.length() + 30 > max_payload_size) {
+        cJSON* tool = (*it)->to_json();
+        size_t tool_size;
+        if (cbor) {
+            cbor_buffer.clear();
+            CJsonToCbor(tool, cbor_buffer);
+            tool_size = cbor_buffer.size();
+        } else {
+            char* tool_json = cJSON_PrintUnformatted(tool);
+            tool_size = strlen(tool_json) + 1;
+            cJSON_free(tool_json);
+        }
+        if (payload_size + tool_size > max_payload_size) {
             // 如果添加这个tool会超出大小限制，设置next_cursor并退出循环
+            cJSON_Delete(tool);
             next_cursor = (*it)->name();
             break;
         }
         
-        json += tool_json;
+        cJSON_AddItemToArray(tools, tool);
+        payload_size += tool_size;
         ++it;
     }
     
-    if (json.back() == ',') {
-        json.pop_back();
-    }
-    
-    if (json.back() == '[' && !tools_.empty()) {
+    if (cJSON_GetArraySize(tools) == 0 && !tools_.empty()) {
         // 如果没有添加任何tool，返回错误
+        cJSON_Delete(result);
         ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", next_cursor.c_str());
         ReplyError(id, "Failed to add tool " + next_cursor + " because of payload size limit");
         return;
     }
 
-    if (next_cursor.empty()) {
-        json += "]}";
-    } else {
-        json += "],\"nextCursor\":\"" + next_cursor + "\"}";
+    if (!next_cursor.empty()) {
+        cJSON_AddStringToObject(result, "nextCursor", next_cursor.c_str());
     }
     
-    ReplyResult(id, json);
+    ReplyResult(id, result);
+}
+
+McpTool* McpServer::FindTool(const std::string& tool_name) {
+    auto it = tool_index_.find(tool_name);
+    return it == tool_index_.end() ? nullptr : it->second;
+}
+
+bool McpServer::BindArguments(const McpTool* tool, const cJSON* tool_arguments, PropertyList& arguments, std::string& error) {
+    auto& schema = tool->properties();
+    arguments = schema.Bind();
+    try {
+        // One pass over the given arguments, unknown names and values of the wrong type are ignored
+        if (cJSON_IsObject(tool_arguments)) {
+            for (auto value = tool_arguments->child; value != nullptr; value = value->next) {
+                int slot = value->string != nullptr ? schema.FindSlot(value->string) : -1;
+                if (slot < 0 || arguments.is_set(slot)) {
+                    continue;
+                }
+                auto& property = schema.property(slot);
+                if (property.type() == kPropertyTypeBoolean && cJSON_IsBool(value)) {
+                    arguments.set_value(slot, value->valueint == 1);
+                } else if (property.type() == kPropertyTypeInteger && cJSON_IsNumber(value)) {
+                    property.CheckRange(value->valueint);
+                    arguments.set_value(slot, value->valueint);
+                } else if (property.type() == kPropertyTypeString && cJSON_IsString(value)) {
+                    arguments.set_value(slot, std::string(value->valuestring));
+                }
+            }
+        }
+    } catch (const std::exception& e) {
+        error = e.what();
+        return false;
+    }
+
+    for (size_t slot = 0; slot < schema.size(); slot++) {
+        auto& property = schema.property(slot);
+        if (!property.has_default_value() && !arguments.is_set(slot)) {
+            error = "Missing valid argument: " + property.name();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool McpServer::CallToolLocally(const std::string& tool_name, const cJSON* tool_arguments, ReturnValue& result) {
+    auto tool = FindTool(tool_name);
+    if (tool == nullptr) {
+        ESP_LOGE(TAG, "Local call: Unknown tool: %s", tool_name.c_str());
+        return false;
+    }
+
+    PropertyList arguments;
+    std::string error;
+    if (!BindArguments(tool, tool_arguments, arguments, error)) {
+        ESP_LOGE(TAG, "Local call %s: %s", tool_name.c_str(), error.c_str());
+        return false;
+    }
+
+    try {
+        result = tool->Invoke(arguments);
+    } catch (const std::exception& e) {
+        ESP_LOGE(TAG, "Local call %s: %s", tool_name.c_str(), e.what());
+        return false;
+    }
+    return true;
 }
 
 void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size) {
-    auto tool_iter = std::find_if(tools_.begin(), tools_.end(), 
-                                 [&tool_name](const McpTool* tool) { 
-                                     return tool->name() == tool_name; 
-                                 });
-    
-    if (tool_iter == tools_.end()) {
+    auto tool = FindTool(tool_name);
+    if (tool == nullptr) {
         ESP_LOGE(TAG, "tools/call: Unknown tool: %s", tool_name.c_str());
         ReplyError(id, "Unknown tool: " + tool_name);
         return;
     }
 
-    PropertyList arguments = (*tool_iter)->properties();
-    try {
-        for (auto& argument : arguments) {
-            bool found = false;
-            if (cJSON_IsObject(tool_arguments)) {
-                auto value = cJSON_GetObjectItem(tool_arguments, argument.name().c_str());
-                if (argument.type() == kPropertyTypeBoolean && cJSON_IsBool(value)) {
-                    argument.set_value<bool>(value->valueint == 1);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeInteger && cJSON_IsNumber(value)) {
-                    argument.set_value<int>(value->valueint);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeString && cJSON_IsString(value)) {
-                    argument.set_value<std::string>(value->valuestring);
-                    found = true;
-                }
-            }
+    // The workers have stacks of a fixed size, larger requests are clamped to it
+    auto& config = TaskRegistry::GetInstance().Get(kTaskToolCall);
+    if (stack_size > (int)config.stack_size) {
+        ESP_LOGW(TAG, "tools/call: stackSize %d clamped to the %lu bytes of the workers", stack_size, config.stack_size);
+    }
+
+    PropertyList arguments;
+    std::string error;
+    if (!BindArguments(tool, tool_arguments, arguments, error)) {
+        ESP_LOGE(TAG, "tools/call: %s", error.c_str());
+        ReplyError(id, error);
+        return;
+    }
 
-            if (!argument.has_default_value() && !found) {
-                ESP_LOGE(TAG, "tools/call: Missing valid argument: %s", argument.name().c_str());
-                ReplyError(id, "Missing valid argument: " + argument.name());
-                return;
+    if (tool_call_queue_ == nullptr) {
+        StartToolWorkers();
+    }
+    if (tool_worker_count_ == 0) {
+        ReplyError(id, "No worker to run tools");
+        return;
+    }
+
+    // Calls over the workers and the queue are refused, so a burst cannot take more memory
+    ToolCall* call = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(tool_call_mutex_);
+        for (auto& slot : tool_calls_) {
+            if (!slot.in_use) {
+                call = &slot;
+                break;
             }
         }
-    } catch (const std::exception& e) {
-        ESP_LOGE(TAG, "tools/call: %s", e.what());
-        ReplyError(id, e.what());
+        if (call != nullptr) {
+            call->in_use = true;
+            call->id = id;
+            call->tool = tool;
+            call->arguments = std::move(arguments);
+            call->queued_us = esp_timer_get_time();
+            call->replied = false;
+            call->cancelled = false;
+        }
+    }
+    if (call == nullptr) {
+        tool_call_stats_.rejected.fetch_add(1, std::memory_order_relaxed);
+        ESP_LOGW(TAG, "tools/call: %s refused, %d calls in progress", tool_name.c_str(), MCP_TOOL_CALL_SLOTS);
+        ReplyError(id, "Too many tool calls in progress");
         return;
     }
+    tool_call_stats_.calls.fetch_add(1, std::memory_order_relaxed);
+    // The queue has room for every slot
+    xQueueSend(tool_call_queue_, &call, 0);
+}
+
+void McpServer::StartToolWorkers() {
+    tool_call_queue_ = xQueueCreate(MCP_TOOL_CALL_SLOTS, sizeof(ToolCall*));
+    assert(tool_call_queue_ != nullptr);
+
+    auto& tasks = TaskRegistry::GetInstance();
+    auto& config = tasks.Get(kTaskToolCall);
+    for (auto& worker : tool_workers_) {
+        // The stacks are kept for the life of the firmware and counted in the MCP budget
+        auto stack = (StackType_t*)MemoryBudget::GetInstance().Allocate(kMemoryMcp, config.stack_size, config.stack_caps);
+        auto task_buffer = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
+        if (stack == nullptr || task_buffer == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate tool worker %d", tool_worker_count_);
+            MemoryBudget::GetInstance().Free(kMemoryMcp, stack);
+            heap_caps_free(task_buffer);
+            break;
+        }
+
+        esp_timer_create_args_t timer_args = {
+            .callback = [](void* arg) {
+                McpServer::GetInstance().OnToolCallTimeout(*(ToolWorker*)arg);
+            },
+            .arg = &worker,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "tool_call_timeout",
+            .skip_unhandled_events = true
+        };
+        if (esp_timer_create(&timer_args, &worker.timer) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create the timer of tool worker %d", tool_worker_count_);
+            MemoryBudget::GetInstance().Free(kMemoryMcp, stack);
+            heap_caps_free(task_buffer);
+            break;
+        }
+
+        worker.task = xTaskCreateStaticPinnedToCore([](void* arg) {
+            McpServer::GetInstance().RunToolWorker(*(ToolWorker*)arg);
+        }, config.name, config.stack_size, &worker, config.priority, stack, task_buffer, config.core);
+        if (worker.task == nullptr) {
+            ESP_LOGE(TAG, "Failed to create tool worker %d", tool_worker_count_);
+            esp_timer_delete(worker.timer);
+            worker.timer = nullptr;
+            MemoryBudget::GetInstance().Free(kMemoryMcp, stack);
+            heap_caps_free(task_buffer);
+            break;
+        }
+        tasks.NoteCreated(kTaskToolCall);
+        tool_worker_count_++;
+    }
+    ESP_LOGI(TAG, "%d tool workers with %lu bytes of stack, %d call slots", tool_worker_count_, config.stack_size,
+        MCP_TOOL_CALL_SLOTS);
+}
 
-    // Start a task to receive data with stack size
-    esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
-    cfg.thread_name = "tool_call";
-    cfg.stack_size = stack_size;
-    cfg.prio = 1;
-    esp_pthread_set_cfg(&cfg);
-
-    // Use a thread to call the tool to avoid blocking the main thread
-    tool_call_thread_ = std::thread([this, id, tool_iter, arguments = std::move(arguments)]() {
-        try {
-            ReplyResult(id, (*tool_iter)->Call(arguments));
-        } catch (const std::exception& e) {
-            ESP_LOGE(TAG, "tools/call: %s", e.what());
-            ReplyError(id, e.what());
+void McpServer::RunToolWorker(ToolWorker& worker) {
+    while (true) {
+        ToolCall* call;
+        if (xQueueReceive(tool_call_queue_, &call, portMAX_DELAY) != pdTRUE) {
+            continue;
         }
-    });
-    tool_call_thread_.detach();
+
+        // Calls cancelled while they were waiting are dropped
+        if (!call->cancelled) {
+            int64_t started_us = esp_timer_get_time();
+            tool_call_stats_.ran.fetch_add(1, std::memory_order_relaxed);
+            RecordToolCallTime(tool_call_stats_.total_wait_us, tool_call_stats_.max_wait_us, started_us - call->queued_us);
+            {
+                std::lock_guard<std::mutex> lock(tool_call_mutex_);
+                call->started_us = started_us;
+                worker.call = call;
+            }
+            esp_timer_start_once(worker.timer, call->tool->timeout_ms() * 1000LL);
+
+            cJSON* result = nullptr;
+            std::string error;
+            try {
+                result = call->tool->Call(call->arguments);
+            } catch (const std::exception& e) {
+                ESP_LOGE(TAG, "tools/call: %s", e.what());
+                error = e.what();
+            }
+            esp_timer_stop(worker.timer);
+            RecordToolCallTime(tool_call_stats_.total_run_us, tool_call_stats_.max_run_us, esp_timer_get_time() - started_us);
+
+            if (!call->replied.exchange(true)) {
+                if (result != nullptr) {
+                    ReplyResult(call->id, result);
+                } else {
+                    ReplyError(call->id, error);
+                }
+            } else {
+                ESP_LOGW(TAG, "tools/call %d: %s returned after it was cancelled", call->id, call->tool->name().c_str());
+                cJSON_Delete(result);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(tool_call_mutex_);
+        worker.call = nullptr;
+        call->arguments = PropertyList();
+        call->in_use = false;
+    }
+}
+
+void McpServer::OnToolCallTimeout(ToolWorker& worker) {
+    int id;
+    int timeout_ms;
+    {
+        std::lock_guard<std::mutex> lock(tool_call_mutex_);
+        auto call = worker.call;
+        // The timer may fire while the worker moves on to the next call
+        if (call == nullptr || esp_timer_get_time() - call->started_us < call->tool->timeout_ms() * 1000LL) {
+            return;
+        }
+        call->cancelled = true;
+        if (call->replied.exchange(true)) {
+            return;
+        }
+        id = call->id;
+        timeout_ms = call->tool->timeout_ms();
+        ESP_LOGW(TAG, "tools/call %d: %s timed out after %d ms", id, call->tool->name().c_str(), timeout_ms);
+    }
+    tool_call_stats_.timed_out.fetch_add(1, std::memory_order_relaxed);
+    ReplyError(id, "Tool call timed out after " + std::to_string(timeout_ms) + " ms");
+}
+
+void McpServer::CancelToolCall(int id) {
+    std::lock_guard<std::mutex> lock(tool_call_mutex_);
+    for (auto& call : tool_calls_) {
+        if (!call.in_use || call.id != id) {
+            continue;
+        }
+        // A cancelled request gets no reply
+        call.cancelled = true;
+        if (!call.replied.exchange(true)) {
+            tool_call_stats_.cancelled.fetch_add(1, std::memory_order_relaxed);
+            ESP_LOGI(TAG, "tools/call %d: %s cancelled", id, call.tool->name().c_str());
+        }
+    }
+}
+
+bool McpServer::IsToolCallCancelled() {
+    auto task = xTaskGetCurrentTaskHandle();
+    std::lock_guard<std::mutex> lock(tool_call_mutex_);
+    for (auto& worker : tool_workers_) {
+        if (worker.task == task) {
+            return worker.call != nullptr && worker.call->cancelled;
+        }
+    }
+    return false;
+}
+
+void McpServer::SetToolTimeout(const std::string& tool_name, int timeout_ms) {
+    auto tool = FindTool(tool_name);
+    if (tool != nullptr) {
+        tool->set_timeout_ms(timeout_ms);
+    }
+}
+
+void McpServer::RecordToolCallTime(std::atomic<uint64_t>& total_us, std::atomic<uint32_t>& max_us, uint32_t time_us) {
+    total_us.fetch_add(time_us, std::memory_order_relaxed);
+    uint32_t max = max_us.load(std::memory_order_relaxed);
+    while (time_us > max && !max_us.compare_exchange_weak(max, time_us, std::memory_order_relaxed)) {
+    }
+}
+
+cJSON* McpServer::GetToolCallStats() {
+    auto& stats = tool_call_stats_;
+    int busy = 0;
+    {
+        std::lock_guard<std::mutex> lock(tool_call_mutex_);
+        for (int i = 0; i < tool_worker_count_; i++) {
+            busy += tool_workers_[i].call != nullptr;
+        }
+    }
+    uint32_t calls = stats.calls.load(std::memory_order_relaxed);
+    uint32_t ran = stats.ran.load(std::memory_order_relaxed);
+    auto json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "workers", tool_worker_count_);
+    cJSON_AddNumberToObject(json, "busy_workers", busy);
+    cJSON_AddNumberToObject(json, "queued", tool_call_queue_ != nullptr ? uxQueueMessagesWaiting(tool_call_queue_) : 0);
+    cJSON_AddNumberToObject(json, "slots", MCP_TOOL_CALL_SLOTS);
+    cJSON_AddNumberToObject(json, "calls", calls);
+    cJSON_AddNumberToObject(json, "ran", ran);
+    cJSON_AddNumberToObject(json, "rejected", stats.rejected.load(std::memory_order_relaxed));
+    cJSON_AddNumberToObject(json, "timed_out", stats.timed_out.load(std::memory_order_relaxed));
+    cJSON_AddNumberToObject(json, "cancelled", stats.cancelled.load(std::memory_order_relaxed));
+    if (ran > 0) {
+        cJSON_AddNumberToObject(json, "avg_wait_us", stats.total_wait_us.load(std::memory_order_relaxed) / ran);
+        cJSON_AddNumberToObject(json, "max_wait_us", stats.max_wait_us.load(std::memory_order_relaxed));
+        cJSON_AddNumberToObject(json, "avg_run_us", stats.total_run_us.load(std::memory_order_relaxed) / ran);
+        cJSON_AddNumberToObject(json, "max_run_us", stats.max_run_us.load(std::memory_order_relaxed));
+    }
+    return json;
 }
\ No newline at end of file
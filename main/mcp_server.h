@@ -2,18 +2,26 @@
 #define MCP_SERVER_H
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <functional>
 #include <variant>
 #include <optional>
 #include <stdexcept>
-#include <thread>
+#include <mutex>
+#include <atomic>
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <esp_timer.h>
 #include <cJSON.h>
 
 // 添加类型别名
 using ReturnValue = std::variant<bool, int, std::string>;
+using PropertyValue = std::variant<bool, int, std::string>;
 
 enum PropertyType {
     kPropertyTypeBoolean,
@@ -25,7 +33,7 @@ class Property {
 private:
     std::string name_;
     PropertyType type_;
-    std::variant<bool, int, std::string> value_;
+    PropertyValue value_;
     bool has_default_value_;
     std::optional<int> min_value_;  // 新增：整数最小值
     std::optional<int> max_value_;  // 新增：整数最大值
@@ -72,21 +80,28 @@ public:
         return std::get<T>(value_);
     }
 
+    inline const PropertyValue& default_value() const { return value_; }
+
+    // 检查整数值是否在范围内
+    void CheckRange(int value) const {
+        if (min_value_.has_value() && value < min_value_.value()) {
+            throw std::invalid_argument("Value is below minimum allowed: " + std::to_string(min_value_.value()));
+        }
+        if (max_value_.has_value() && value > max_value_.value()) {
+            throw std::invalid_argument("Value exceeds maximum allowed: " + std::to_string(max_value_.value()));
+        }
+    }
+
     template<typename T>
     inline void set_value(const T& value) {
-        // 添加对设置的整数值进行范围检查
         if constexpr (std::is_same_v<T, int>) {
-            if (min_value_.has_value() && value < min_value_.value()) {
-                throw std::invalid_argument("Value is below minimum allowed: " + std::to_string(min_value_.value()));
-            }
-            if (max_value_.has_value() && value > max_value_.value()) {
-                throw std::invalid_argument("Value exceeds maximum allowed: " + std::to_string(max_value_.value()));
-            }
+            CheckRange(value);
         }
         value_ = value;
     }
 
-    std::string to_json() const {
+    // The caller deletes the tree
+    cJSON* to_json() const {
         cJSON *json = cJSON_CreateObject();
         
         if (type_ == kPropertyTypeBoolean) {
@@ -112,37 +127,118 @@ public:
             }
         }
         
-        char *json_str = cJSON_PrintUnformatted(json);
-        std::string result(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(json);
-        
-        return result;
+        return json;
+    }
+};
+
+// A property as seen by a tool callback: the value given by the caller, or the default
+class Argument {
+private:
+    const Property& property_;
+    const PropertyValue& value_;
+
+public:
+    Argument(const Property& property, const PropertyValue& value) : property_(property), value_(value) {}
+
+    inline const std::string& name() const { return property_.name(); }
+    inline PropertyType type() const { return property_.type(); }
+
+    template<typename T>
+    inline T value() const {
+        return std::get<T>(value_);
     }
 };
 
+/*
+ * A list of properties is either the schema of a tool or the arguments of one call. The schema keeps
+ * the hash of every name, so a lookup compares a few integers before any string. Names match without
+ * regard to ASCII case, like the cJSON_GetObjectItem lookup of the arguments did. The arguments of a
+ * call point to the schema of the tool and only hold the values given by the caller, one optional slot
+ * per property, so the defaults are never copied.
+ */
 class PropertyList {
 private:
     std::vector<Property> properties_;
+    std::vector<uint32_t> hashes_;
+    const PropertyList* schema_ = nullptr;
+    std::vector<std::optional<PropertyValue>> values_;
+
+    static char ToLower(char c) {
+        return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+    // FNV-1a of the lowercased name
+    static uint32_t Hash(std::string_view name) {
+        uint32_t hash = 2166136261u;
+        for (char c : name) {
+            hash = (hash ^ (uint8_t)ToLower(c)) * 16777619u;
+        }
+        return hash;
+    }
+
+    static bool EqualsIgnoreCase(std::string_view a, std::string_view b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); i++) {
+            if (ToLower(a[i]) != ToLower(b[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
 
 public:
     PropertyList() = default;
-    PropertyList(const std::vector<Property>& properties) : properties_(properties) {}
+    PropertyList(const std::vector<Property>& properties) : properties_(properties) {
+        hashes_.reserve(properties_.size());
+        for (const auto& property : properties_) {
+            hashes_.push_back(Hash(property.name()));
+        }
+    }
     void AddProperty(const Property& property) {
         properties_.push_back(property);
+        hashes_.push_back(Hash(property.name()));
     }
 
-    const Property& operator[](const std::string& name) const {
-        for (const auto& property : properties_) {
-            if (property.name() == name) {
-                return property;
+    // Empty arguments for a call of the tool with this schema, the schema must outlive them
+    PropertyList Bind() const {
+        PropertyList arguments;
+        arguments.schema_ = this;
+        arguments.values_.resize(properties_.size());
+        return arguments;
+    }
+
+    const PropertyList& schema() const { return schema_ != nullptr ? *schema_ : *this; }
+    size_t size() const { return schema().properties_.size(); }
+    const Property& property(size_t slot) const { return schema().properties_[slot]; }
+
+    // Returns the slot of the property, or -1 if there is none with this name
+    int FindSlot(std::string_view name) const {
+        auto& schema = this->schema();
+        uint32_t hash = Hash(name);
+        for (size_t slot = 0; slot < schema.hashes_.size(); slot++) {
+            if (schema.hashes_[slot] == hash && EqualsIgnoreCase(schema.properties_[slot].name(), name)) {
+                return slot;
             }
         }
-        throw std::runtime_error("Property not found: " + name);
+        return -1;
     }
 
-    auto begin() { return properties_.begin(); }
-    auto end() { return properties_.end(); }
+    bool is_set(size_t slot) const { return slot < values_.size() && values_[slot].has_value(); }
+    void set_value(size_t slot, PropertyValue&& value) { values_[slot] = std::move(value); }
+
+    Argument operator[](const std::string& name) const {
+        int slot = FindSlot(name);
+        if (slot < 0) {
+            throw std::runtime_error("Property not found: " + name);
+        }
+        auto& property = this->property(slot);
+        return Argument(property, is_set(slot) ? *values_[slot] : property.default_value());
+    }
+
+    auto begin() const { return schema().properties_.begin(); }
+    auto end() const { return schema().properties_.end(); }
 
     std::vector<std::string> GetRequired() const {
         std::vector<std::string> required;
@@ -154,20 +250,14 @@ public:
         return required;
     }
 
-    std::string to_json() const {
+    cJSON* to_json() const {
         cJSON *json = cJSON_CreateObject();
         
         for (const auto& property : properties_) {
-            cJSON *prop_json = cJSON_Parse(property.to_json().c_str());
-            cJSON_AddItemToObject(json, property.name().c_str(), prop_json);
+            cJSON_AddItemToObject(json, property.name().c_str(), property.to_json());
         }
         
-        char *json_str = cJSON_PrintUnformatted(json);
-        std::string result(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(json);
-        
-        return result;
+        return json;
     }
 };
 
@@ -177,6 +267,7 @@ private:
     std::string description_;
     PropertyList properties_;
     std::function<ReturnValue(const PropertyList&)> callback_;
+    int timeout_ms_;
 
 public:
     McpTool(const std::string& name, 
@@ -186,13 +277,17 @@ public:
         : name_(name), 
         description_(description), 
         properties_(properties), 
-        callback_(callback) {}
+        callback_(callback),
+        timeout_ms_(CONFIG_MCP_TOOL_TIMEOUT_MS) {}
 
     inline const std::string& name() const { return name_; }
     inline const std::string& description() const { return description_; }
     inline const PropertyList& properties() const { return properties_; }
+    // After this time the server gets an error, the tool keeps its worker until it returns
+    inline int timeout_ms() const { return timeout_ms_; }
+    inline void set_timeout_ms(int timeout_ms) { timeout_ms_ = timeout_ms; }
 
-    std::string to_json() const {
+    cJSON* to_json() const {
         std::vector<std::string> required = properties_.GetRequired();
         
         cJSON *json = cJSON_CreateObject();
@@ -202,8 +297,7 @@ public:
         cJSON *input_schema = cJSON_CreateObject();
         cJSON_AddStringToObject(input_schema, "type", "object");
         
-        cJSON *properties = cJSON_Parse(properties_.to_json().c_str());
-        cJSON_AddItemToObject(input_schema, "properties", properties);
+        cJSON_AddItemToObject(input_schema, "properties", properties_.to_json());
         
         if (!required.empty()) {
             cJSON *required_array = cJSON_CreateArray();
@@ -215,16 +309,16 @@ public:
         
         cJSON_AddItemToObject(json, "inputSchema", input_schema);
         
-        char *json_str = cJSON_PrintUnformatted(json);
-        std::string result(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(json);
-        
-        return result;
+        return json;
+    }
+
+    ReturnValue Invoke(const PropertyList& properties) {
+        return callback_(properties);
     }
 
-    std::string Call(const PropertyList& properties) {
-        ReturnValue return_value = callback_(properties);
+    // The result is sent as a tree, the caller deletes it
+    cJSON* Call(const PropertyList& properties) {
+        ReturnValue return_value = Invoke(properties);
         // 返回结果
         cJSON* result = cJSON_CreateObject();
         cJSON* content = cJSON_CreateArray();
@@ -240,15 +334,42 @@ public:
         cJSON_AddItemToArray(content, text);
         cJSON_AddItemToObject(result, "content", content);
         cJSON_AddBoolToObject(result, "isError", false);
-
-        auto json_str = cJSON_PrintUnformatted(result);
-        std::string result_str(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(result);
-        return result_str;
+        return result;
     }
 };
 
+// A tools/call from the server, in one of the preallocated slots of the worker pool
+struct ToolCall {
+    bool in_use = false;
+    int id = 0;
+    McpTool* tool = nullptr;
+    PropertyList arguments;
+    int64_t queued_us = 0;
+    int64_t started_us = 0;
+    std::atomic<bool> replied = false;      // Answered, timed out or cancelled, no more replies
+    std::atomic<bool> cancelled = false;    // Tools may poll it through IsToolCallCancelled
+};
+
+struct ToolWorker {
+    TaskHandle_t task = nullptr;
+    esp_timer_handle_t timer = nullptr;
+    ToolCall* call = nullptr;
+};
+
+struct ToolCallStats {
+    std::atomic<uint32_t> calls = 0;
+    std::atomic<uint32_t> ran = 0;          // Calls not cancelled while queued
+    std::atomic<uint32_t> rejected = 0;     // No free slot
+    std::atomic<uint32_t> timed_out = 0;
+    std::atomic<uint32_t> cancelled = 0;
+    std::atomic<uint64_t> total_wait_us = 0;
+    std::atomic<uint32_t> max_wait_us = 0;
+    std::atomic<uint64_t> total_run_us = 0;
+    std::atomic<uint32_t> max_run_us = 0;
+};
+
+#define MCP_TOOL_CALL_SLOTS (CONFIG_MCP_TOOL_WORKERS + CONFIG_MCP_TOOL_QUEUE_LENGTH)
+
 class McpServer {
 public:
     static McpServer& GetInstance() {
@@ -261,6 +382,11 @@ public:
     void AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
     void ParseMessage(const cJSON* json);
     void ParseMessage(const std::string& message);
+    // Call a tool on the device without a server round trip, in the caller's task
+    bool CallToolLocally(const std::string& tool_name, const cJSON* tool_arguments, ReturnValue& result);
+    void SetToolTimeout(const std::string& tool_name, int timeout_ms);
+    // For long tools running in the worker pool: true once the server cancelled the call or it timed out
+    bool IsToolCallCancelled();
 
 private:
     McpServer();
@@ -268,14 +394,31 @@ private:
 
     void ParseCapabilities(const cJSON* capabilities);
 
-    void ReplyResult(int id, const std::string& result);
+    // Takes the ownership of the result tree
+    void ReplyResult(int id, cJSON* result);
     void ReplyError(int id, const std::string& message);
 
     void GetToolsList(int id, const std::string& cursor);
     void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size);
+    McpTool* FindTool(const std::string& tool_name);
+    bool BindArguments(const McpTool* tool, const cJSON* tool_arguments, PropertyList& arguments, std::string& error);
+    void StartToolWorkers();
+    void RunToolWorker(ToolWorker& worker);
+    void OnToolCallTimeout(ToolWorker& worker);
+    void CancelToolCall(int id);
+    void RecordToolCallTime(std::atomic<uint64_t>& total_us, std::atomic<uint32_t>& max_us, uint32_t time_us);
+    cJSON* GetToolCallStats();
 
     std::vector<McpTool*> tools_;
-    std::thread tool_call_thread_;
+    // The keys point to the names of the tools, which live as long as the server
+    std::unordered_map<std::string_view, McpTool*> tool_index_;
+
+    std::mutex tool_call_mutex_;
+    ToolCall tool_calls_[MCP_TOOL_CALL_SLOTS];
+    ToolWorker tool_workers_[CONFIG_MCP_TOOL_WORKERS];
+    int tool_worker_count_ = 0;
+    QueueHandle_t tool_call_queue_ = nullptr;
+    ToolCallStats tool_call_stats_;
 };
 
 #endif // MCP_SERVER_H
@@ -0,0 +1,178 @@
+#include "memory_budget.h"
+
+#include <esp_log.h>
+#include <esp_memory_utils.h>
+
+#define TAG "MemoryBudget"
+
+static constexpr const char* kSubsystemNames[kMemorySubsystemCount] = {
+    "display",
+    "audio",
+    "opus",
+    "mcp",
+    "protocol",
+};
+
+static constexpr const char* kTierNames[kMemoryTierCount] = {
+    "internal",
+    "psram",
+};
+
+static constexpr uint32_t kTierCaps[kMemoryTierCount] = {
+    MALLOC_CAP_INTERNAL,
+    MALLOC_CAP_SPIRAM,
+};
+
+// Set while Allocate tries PSRAM with a fallback, a failure there is expected and not counted
+static thread_local bool s_may_fall_back = false;
+
+MemoryBudget::MemoryBudget() {
+    // Internal SRAM the subsystems may hold in buffers they allocate themselves
+    SetBudget(kMemoryMcp, kMemoryTierInternal, 24 * 1024);
+    SetBudget(kMemoryProtocol, kMemoryTierInternal, 48 * 1024);
+
+    // Any failed allocation in the firmware, to find the out of memory errors of long sessions
+    heap_caps_register_failed_alloc_callback([](size_t size, uint32_t caps, const char* function_name) {
+        if (s_may_fall_back) {
+            return;
+        }
+        auto& budget = MemoryBudget::GetInstance();
+        budget.failed_allocs_.fetch_add(1, std::memory_order_relaxed);
+        budget.last_failed_size_.store(size, std::memory_order_relaxed);
+        budget.last_failed_caps_.store(caps, std::memory_order_relaxed);
+        ESP_LOGE(TAG, "%s failed to allocate %u bytes with caps 0x%lx, largest free block %u", function_name,
+            size, caps, heap_caps_get_largest_free_block(caps));
+    });
+}
+
+uint32_t MemoryBudget::DefaultPlacementPolicy(MemorySubsystem subsystem, size_t size, uint32_t caps) {
+    if (caps & (MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL | MALLOC_CAP_SPIRAM)) {
+        return caps;
+    }
+    if (size >= MEMORY_PSRAM_MIN_SIZE && heap_caps_get_total_size(MALLOC_CAP_SPIRAM) > 0) {
+        return caps | MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+    }
+    return caps | MALLOC_CAP_8BIT;
+}
+
+MemoryTier MemoryBudget::GetTier(const void* ptr) {
+    return esp_ptr_external_ram(ptr) ? kMemoryTierPsram : kMemoryTierInternal;
+}
+
+void* MemoryBudget::Allocate(MemorySubsystem subsystem, size_t size, uint32_t caps) {
+    uint32_t chosen_caps = policy_(subsystem, size, caps);
+    bool may_fall_back = caps == 0 && chosen_caps != MALLOC_CAP_8BIT;
+    s_may_fall_back = may_fall_back;
+    void* ptr = heap_caps_malloc(size, chosen_caps);
+    s_may_fall_back = false;
+    if (ptr == nullptr && may_fall_back) {
+        // The policy picked PSRAM and it is full, any memory will do
+        chosen_caps = MALLOC_CAP_8BIT;
+        ptr = heap_caps_malloc(size, chosen_caps);
+    }
+    if (ptr == nullptr) {
+        usage_[subsystem][(chosen_caps & MALLOC_CAP_SPIRAM) ? kMemoryTierPsram : kMemoryTierInternal]
+            .failures.fetch_add(1, std::memory_order_relaxed);
+        ESP_LOGE(TAG, "%s: failed to allocate %u bytes", kSubsystemNames[subsystem], size);
+        return nullptr;
+    }
+    auto tier = GetTier(ptr);
+    usage_[subsystem][tier].allocations.fetch_add(1, std::memory_order_relaxed);
+    Add(subsystem, tier, heap_caps_get_allocated_size(ptr));
+    return ptr;
+}
+
+void MemoryBudget::Free(MemorySubsystem subsystem, void* ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    Add(subsystem, GetTier(ptr), -(int32_t)heap_caps_get_allocated_size(ptr));
+    heap_caps_free(ptr);
+}
+
+void MemoryBudget::Track(MemorySubsystem subsystem, MemoryTier tier, int32_t delta) {
+    Add(subsystem, tier, delta);
+}
+
+void MemoryBudget::Add(MemorySubsystem subsystem, MemoryTier tier, int32_t bytes) {
+    auto& usage = usage_[subsystem][tier];
+    int32_t live = usage.live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    int32_t peak = usage.peak.load(std::memory_order_relaxed);
+    while (live > peak && !usage.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+    // Only the crossing is logged
+    if (bytes > 0 && usage.budget > 0 && live > (int32_t)usage.budget && live - bytes <= (int32_t)usage.budget) {
+        usage.over_budget.fetch_add(1, std::memory_order_relaxed);
+        ESP_LOGW(TAG, "%s is over its %s budget: %ld > %lu bytes", kSubsystemNames[subsystem], kTierNames[tier],
+            live, usage.budget);
+    }
+}
+
+void MemoryBudget::SetBudget(MemorySubsystem subsystem, MemoryTier tier, uint32_t bytes) {
+    usage_[subsystem][tier].budget = bytes;
+}
+
+MemoryBudget::Measure::Measure(MemorySubsystem subsystem) : subsystem_(subsystem) {
+    free_internal_ = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    free_psram_ = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+}
+
+MemoryBudget::Measure::~Measure() {
+    auto& budget = MemoryBudget::GetInstance();
+    int32_t internal = (int32_t)free_internal_ - (int32_t)heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    int32_t psram = (int32_t)free_psram_ - (int32_t)heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    budget.usage_[subsystem_][kMemoryTierInternal].measured.fetch_add(internal, std::memory_order_relaxed);
+    budget.usage_[subsystem_][kMemoryTierPsram].measured.fetch_add(psram, std::memory_order_relaxed);
+    ESP_LOGI(TAG, "%s took %ld bytes of internal SRAM and %ld bytes of PSRAM", kSubsystemNames[subsystem_],
+        internal, psram);
+}
+
+cJSON* MemoryBudget::ToJson() {
+    auto json = cJSON_CreateObject();
+    auto subsystems = cJSON_CreateObject();
+    for (int subsystem = 0; subsystem < kMemorySubsystemCount; subsystem++) {
+        auto item = cJSON_CreateObject();
+        for (int tier = 0; tier < kMemoryTierCount; tier++) {
+            auto& usage = usage_[subsystem][tier];
+            auto tier_item = cJSON_CreateObject();
+            cJSON_AddNumberToObject(tier_item, "live", usage.live.load(std::memory_order_relaxed));
+            cJSON_AddNumberToObject(tier_item, "peak", usage.peak.load(std::memory_order_relaxed));
+            cJSON_AddNumberToObject(tier_item, "measured", usage.measured.load(std::memory_order_relaxed));
+            cJSON_AddNumberToObject(tier_item, "allocations", usage.allocations.load(std::memory_order_relaxed));
+            cJSON_AddNumberToObject(tier_item, "failures", usage.failures.load(std::memory_order_relaxed));
+            if (usage.budget > 0) {
+                cJSON_AddNumberToObject(tier_item, "budget", usage.budget);
+                cJSON_AddNumberToObject(tier_item, "over_budget", usage.over_budget.load(std::memory_order_relaxed));
+            }
+            cJSON_AddItemToObject(item, kTierNames[tier], tier_item);
+        }
+        cJSON_AddItemToObject(subsystems, kSubsystemNames[subsystem], item);
+    }
+    cJSON_AddItemToObject(json, "subsystems", subsystems);
+
+    auto heaps = cJSON_CreateObject();
+    for (int tier = 0; tier < kMemoryTierCount; tier++) {
+        size_t total = heap_caps_get_total_size(kTierCaps[tier]);
+        if (total == 0) {
+            continue;
+        }
+        size_t free = heap_caps_get_free_size(kTierCaps[tier]);
+        size_t largest = heap_caps_get_largest_free_block(kTierCaps[tier]);
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "total", total);
+        cJSON_AddNumberToObject(item, "free", free);
+        cJSON_AddNumberToObject(item, "min_free", heap_caps_get_minimum_free_size(kTierCaps[tier]));
+        cJSON_AddNumberToObject(item, "largest_free_block", largest);
+        // 0 when the free memory is one block, close to 100 when it is scattered in small pieces
+        cJSON_AddNumberToObject(item, "fragmentation", free > 0 ? 100 - largest * 100 / free : 0);
+        cJSON_AddItemToObject(heaps, kTierNames[tier], item);
+    }
+    cJSON_AddItemToObject(json, "heaps", heaps);
+
+    auto failed = cJSON_CreateObject();
+    cJSON_AddNumberToObject(failed, "count", failed_allocs_.load(std::memory_order_relaxed));
+    cJSON_AddNumberToObject(failed, "last_size", last_failed_size_.load(std::memory_order_relaxed));
+    cJSON_AddNumberToObject(failed, "last_caps", last_failed_caps_.load(std::memory_order_relaxed));
+    cJSON_AddItemToObject(json, "failed_allocations", failed);
+    return json;
+}
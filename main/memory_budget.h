@@ -0,0 +1,94 @@
+#ifndef _MEMORY_BUDGET_H_
+#define _MEMORY_BUDGET_H_
+
+#include <esp_heap_caps.h>
+#include <cJSON.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Buffers from this size on go to PSRAM when the caller does not ask for a kind of memory
+#define MEMORY_PSRAM_MIN_SIZE 2048
+
+enum MemorySubsystem : uint8_t {
+    kMemoryDisplay,     // LVGL and the images shown
+    kMemoryAudio,       // AFE, wake word and voice memo buffers
+    kMemoryOpus,
+    kMemoryMcp,         // Tool worker stacks
+    kMemoryProtocol,    // Audio packets kept by the packet pool
+    kMemorySubsystemCount
+};
+
+enum MemoryTier : uint8_t {
+    kMemoryTierInternal,
+    kMemoryTierPsram,
+    kMemoryTierCount
+};
+
+struct MemoryUsage {
+    std::atomic<int32_t> live = 0;          // Allocated through MemoryBudget or tracked, bytes
+    std::atomic<int32_t> peak = 0;
+    std::atomic<int32_t> measured = 0;      // Taken by libraries while a Measure scope was open
+    std::atomic<uint32_t> allocations = 0;
+    std::atomic<uint32_t> failures = 0;
+    std::atomic<uint32_t> over_budget = 0;  // Times live went over the budget
+    uint32_t budget = 0;                    // 0 for no budget
+};
+
+// Returns the caps to allocate with. `caps` is what the caller asked for, 0 if it does not care
+using MemoryPlacementPolicy = uint32_t (*)(MemorySubsystem subsystem, size_t size, uint32_t caps);
+
+/*
+ * Memory use per subsystem and per tier (internal SRAM or PSRAM). Buffers allocated through
+ * Allocate are counted exactly, and go through a placement policy that moves large buffers without
+ * DMA or internal requirements to PSRAM. Memory taken inside libraries (LVGL, AFE, Opus) is measured
+ * by the drop of the free heap while a Measure scope is open, which also counts what other tasks
+ * allocate at the same time. Going over a budget is logged and counted, the allocation still happens.
+ */
+class MemoryBudget {
+public:
+    static MemoryBudget& GetInstance() {
+        static MemoryBudget instance;
+        return instance;
+    }
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    // Returns nullptr if there is no memory left with the chosen caps
+    void* Allocate(MemorySubsystem subsystem, size_t size, uint32_t caps = 0);
+    void Free(MemorySubsystem subsystem, void* ptr);
+    // For memory allocated by other means, like thread stacks and pooled buffers
+    void Track(MemorySubsystem subsystem, MemoryTier tier, int32_t delta);
+
+    void SetBudget(MemorySubsystem subsystem, MemoryTier tier, uint32_t bytes);
+    void SetPlacementPolicy(MemoryPlacementPolicy policy) { policy_ = policy; }
+    static uint32_t DefaultPlacementPolicy(MemorySubsystem subsystem, size_t size, uint32_t caps);
+    static MemoryTier GetTier(const void* ptr);
+
+    // Returns a new object with the usage of every subsystem and the state of the heaps, the caller owns it
+    cJSON* ToJson();
+
+    class Measure {
+    public:
+        explicit Measure(MemorySubsystem subsystem);
+        ~Measure();
+    private:
+        MemorySubsystem subsystem_;
+        size_t free_internal_;
+        size_t free_psram_;
+    };
+
+private:
+    MemoryBudget();
+
+    MemoryUsage usage_[kMemorySubsystemCount][kMemoryTierCount];
+    MemoryPlacementPolicy policy_ = DefaultPlacementPolicy;
+    std::atomic<uint32_t> failed_allocs_ = 0;   // Anywhere in the firmware
+    std::atomic<uint32_t> last_failed_size_ = 0;
+    std::atomic<uint32_t> last_failed_caps_ = 0;
+
+    void Add(MemorySubsystem subsystem, MemoryTier tier, int32_t bytes);
+};
+
+#endif // _MEMORY_BUDGET_H_
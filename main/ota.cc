@@ -1,6 +1,7 @@
 #include "ota.h"
 #include "system_info.h"
 #include "settings.h"
+#include "connection_manager.h"
 #include "assets/lang_config.h"
 
 #include <cJSON.h>
@@ -40,6 +41,12 @@ Ota::Ota() {
 Ota::~Ota() {
 }
 
+bool Ota::LoadCachedConfig() {
+    has_mqtt_config_ = !Settings("mqtt", false).GetString("endpoint").empty();
+    has_websocket_config_ = !Settings("websocket", false).GetString("url").empty();
+    return has_mqtt_config_ || has_websocket_config_;
+}
+
 std::string Ota::GetCheckVersionUrl() {
     Settings settings("wifi", false);
     std::string url = settings.GetString("ota_url");
@@ -49,12 +56,10 @@ std::string Ota::GetCheckVersionUrl() {
     return url;
 }
 
-std::unique_ptr<Http> Ota::SetupHttp() {
+void Ota::SetupHttp(Http* http) {
     auto& board = Board::GetInstance();
     auto app_desc = esp_app_get_description();
 
-    auto network = board.GetNetwork();
-    auto http = network->CreateHttp(0);
     auto user_agent = std::string(BOARD_NAME "/") + app_desc->version;
     http->SetHeader("Activation-Version", has_serial_number_ ? "2" : "1");
     http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
@@ -66,8 +71,6 @@ std::unique_ptr<Http> Ota::SetupHttp() {
     http->SetHeader("User-Agent", user_agent);
     http->SetHeader("Accept-Language", Lang::CODE);
     http->SetHeader("Content-Type", "application/json");
-
-    return http;
 }
 
 /* 
@@ -87,13 +90,13 @@ bool Ota::CheckVersion() {
         return false;
     }
 
-    auto http = SetupHttp();
-
     std::string data = board.GetJson();
     std::string method = data.length() > 0 ? "POST" : "GET";
-    http->SetContent(std::move(data));
-
-    if (!http->Open(method, url)) {
+    auto http = ConnectionManager::GetInstance().OpenHttp(kConnectionOtaCheck, method, url, [this, &data](Http* http) {
+        SetupHttp(http);
+        http->SetContent(std::string(data));
+    });
+    if (!http) {
         ESP_LOGE(TAG, "Failed to open HTTP connection");
         return false;
     }
@@ -141,6 +144,7 @@ bool Ota::CheckVersion() {
         }
     }
 
+    config_changed_ = false;
     has_mqtt_config_ = false;
     cJSON *mqtt = cJSON_GetObjectItem(root, "mqtt");
     if (cJSON_IsObject(mqtt)) {
@@ -150,10 +154,12 @@ bool Ota::CheckVersion() {
             if (cJSON_IsString(item)) {
                 if (settings.GetString(item->string) != item->valuestring) {
                     settings.SetString(item->string, item->valuestring);
+                    config_changed_ = true;
                 }
             } else if (cJSON_IsNumber(item)) {
                 if (settings.GetInt(item->string) != item->valueint) {
                     settings.SetInt(item->string, item->valueint);
+                    config_changed_ = true;
                 }
             }
         }
@@ -171,10 +177,12 @@ bool Ota::CheckVersion() {
             if (cJSON_IsString(item)) {
                 if (settings.GetString(item->string) != item->valuestring) {
                     settings.SetString(item->string, item->valuestring);
+                    config_changed_ = true;
                 }
             } else if (cJSON_IsNumber(item)) {
                 if (settings.GetInt(item->string) != item->valueint) {
                     settings.SetInt(item->string, item->valueint);
+                    config_changed_ = true;
                 }
             }
         }
@@ -183,6 +191,15 @@ bool Ota::CheckVersion() {
         ESP_LOGI(TAG, "No websocket section found!");
     }
 
+    // The cached configuration must not pick a broker the server no longer hands out
+    if (has_websocket_config_ && !has_mqtt_config_) {
+        Settings settings("mqtt", true);
+        if (!settings.GetString("endpoint").empty()) {
+            settings.EraseKey("endpoint");
+            config_changed_ = true;
+        }
+    }
+
     has_server_time_ = false;
     cJSON *server_time = cJSON_GetObjectItem(root, "server_time");
     if (cJSON_IsObject(server_time)) {
@@ -275,9 +292,8 @@ bool Ota::Upgrade(const std::string& firmware_url) {
     bool image_header_checked = false;
     std::string image_header;
 
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(0);
-    if (!http->Open("GET", firmware_url)) {
+    auto http = ConnectionManager::GetInstance().OpenHttp(kConnectionOtaUpgrade, "GET", firmware_url, [](Http* http) {});
+    if (!http) {
         ESP_LOGE(TAG, "Failed to open HTTP connection");
         return false;
     }
@@ -454,12 +470,12 @@ esp_err_t Ota::Activate() {
         url += "activate";
     }
 
-    auto http = SetupHttp();
-
     std::string data = GetActivationPayload();
-    http->SetContent(std::move(data));
-
-    if (!http->Open("POST", url)) {
+    auto http = ConnectionManager::GetInstance().OpenHttp(kConnectionOtaActivate, "POST", url, [this, &data](Http* http) {
+        SetupHttp(http);
+        http->SetContent(std::string(data));
+    });
+    if (!http) {
         ESP_LOGE(TAG, "Failed to open HTTP connection");
         return ESP_FAIL;
     }
@@ -13,6 +13,8 @@ public:
     ~Ota();
 
     bool CheckVersion();
+    // Takes the protocol from the settings of the last successful check, returns false if there are none
+    bool LoadCachedConfig();
     esp_err_t Activate();
     bool HasActivationChallenge() { return has_activation_challenge_; }
     bool HasNewVersion() { return has_new_version_; }
@@ -20,6 +22,8 @@ public:
     bool HasWebsocketConfig() { return has_websocket_config_; }
     bool HasActivationCode() { return has_activation_code_; }
     bool HasServerTime() { return has_server_time_; }
+    // The last check stored server settings that differ from the ones before
+    bool IsConfigChanged() { return config_changed_; }
     bool StartUpgrade(std::function<void(int progress, size_t speed)> callback);
     void MarkCurrentVersionValid();
 
@@ -39,6 +43,7 @@ private:
     bool has_activation_code_ = false;
     bool has_serial_number_ = false;
     bool has_activation_challenge_ = false;
+    bool config_changed_ = false;
     std::string current_version_;
     std::string firmware_version_;
     std::string firmware_url_;
@@ -51,7 +56,7 @@ private:
     std::vector<int> ParseVersion(const std::string& version);
     bool IsNewVersionAvailable(const std::string& currentVersion, const std::string& newVersion);
     std::string GetActivationPayload();
-    std::unique_ptr<Http> SetupHttp();
+    void SetupHttp(Http* http);
 };
 
 #endif // _OTA_H
@@ -0,0 +1,879 @@
+#include "cbor_json.h"
+
+#include <cJSON.h>
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define CBOR_FALSE 0xF4
+#define CBOR_TRUE 0xF5
+#define CBOR_NULL 0xF6
+#define CBOR_FLOAT16 0xF9
+#define CBOR_FLOAT32 0xFA
+#define CBOR_FLOAT64 0xFB
+
+namespace {
+
+// Writes CBOR items to the end of a buffer
+class CborWriter {
+public:
+    explicit CborWriter(std::vector<uint8_t>& out) : out_(out) {}
+
+protected:
+    std::vector<uint8_t>& out_;
+
+    void WriteHead(int major, uint64_t value) {
+        uint8_t type = major << 5;
+        if (value < 24) {
+            out_.push_back(type | value);
+        } else if (value <= 0xFF) {
+            out_.push_back(type | 24);
+            out_.push_back(value);
+        } else if (value <= 0xFFFF) {
+            out_.push_back(type | 25);
+            WriteBigEndian(value, 2);
+        } else if (value <= 0xFFFFFFFF) {
+            out_.push_back(type | 26);
+            WriteBigEndian(value, 4);
+        } else {
+            out_.push_back(type | 27);
+            WriteBigEndian(value, 8);
+        }
+    }
+
+    void WriteBigEndian(uint64_t value, int bytes) {
+        for (int i = bytes - 1; i >= 0; i--) {
+            out_.push_back((value >> (i * 8)) & 0xFF);
+        }
+    }
+
+    void WriteText(const char* text, size_t length) {
+        WriteHead(CBOR_MAJOR_TEXT, length);
+        out_.insert(out_.end(), text, text + length);
+    }
+
+    void WriteFloat(double value) {
+        float single = (float)value;
+        if ((double)single == value) {
+            uint32_t bits;
+            memcpy(&bits, &single, sizeof(bits));
+            out_.push_back(CBOR_FLOAT32);
+            WriteBigEndian(bits, 4);
+        } else {
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            out_.push_back(CBOR_FLOAT64);
+            WriteBigEndian(bits, 8);
+        }
+    }
+};
+
+class JsonReader : public CborWriter {
+public:
+    JsonReader(const char* data, size_t size, std::vector<uint8_t>& out) : CborWriter(out), p_(data), end_(data + size) {}
+
+    bool ReadDocument() {
+        if (!ReadValue(0)) {
+            return false;
+        }
+        SkipSpace();
+        return p_ == end_;
+    }
+
+private:
+    const char* p_;
+    const char* end_;
+
+    void SkipSpace() {
+        while (p_ < end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) {
+            p_++;
+        }
+    }
+
+    // Containers are written with a placeholder count, patched when the count is known
+    size_t BeginContainer(int major) {
+        size_t offset = out_.size();
+        out_.insert(out_.end(), 5, 0);
+        out_[offset] = major << 5;
+        return offset;
+    }
+
+    void EndContainer(size_t offset, uint32_t count) {
+        // Rewrite the head in its shortest form and close the gap
+        uint8_t type = out_[offset];
+        size_t head_size;
+        if (count < 24) {
+            out_[offset] = type | count;
+            head_size = 1;
+        } else if (count <= 0xFF) {
+            out_[offset] = type | 24;
+            out_[offset + 1] = count;
+            head_size = 2;
+        } else if (count <= 0xFFFF) {
+            out_[offset] = type | 25;
+            out_[offset + 1] = count >> 8;
+            out_[offset + 2] = count & 0xFF;
+            head_size = 3;
+        } else {
+            out_[offset] = type | 26;
+            for (int i = 0; i < 4; i++) {
+                out_[offset + 1 + i] = (count >> ((3 - i) * 8)) & 0xFF;
+            }
+            head_size = 5;
+        }
+        out_.erase(out_.begin() + offset + head_size, out_.begin() + offset + 5);
+    }
+
+    bool ReadValue(int depth) {
+        if (depth > CBOR_JSON_MAX_DEPTH) {
+            return false;
+        }
+        SkipSpace();
+        if (p_ >= end_) {
+            return false;
+        }
+        switch (*p_) {
+            case '{':
+                return ReadObject(depth);
+            case '[':
+                return ReadArray(depth);
+            case '"':
+                return ReadString();
+            case 't':
+                return ReadLiteral("true", CBOR_TRUE);
+            case 'f':
+                return ReadLiteral("false", CBOR_FALSE);
+            case 'n':
+                return ReadLiteral("null", CBOR_NULL);
+            default:
+                return ReadNumber();
+        }
+    }
+
+    bool ReadLiteral(const char* literal, uint8_t value) {
+        size_t length = strlen(literal);
+        if ((size_t)(end_ - p_) < length || memcmp(p_, literal, length) != 0) {
+            return false;
+        }
+        p_ += length;
+        out_.push_back(value);
+        return true;
+    }
+
+    bool ReadObject(int depth) {
+        p_++;
+        size_t offset = BeginContainer(CBOR_MAJOR_MAP);
+        uint32_t count = 0;
+        SkipSpace();
+        if (p_ < end_ && *p_ == '}') {
+            p_++;
+            EndContainer(offset, 0);
+            return true;
+        }
+        while (true) {
+            SkipSpace();
+            if (p_ >= end_ || *p_ != '"' || !ReadString()) {
+                return false;
+            }
+            SkipSpace();
+            if (p_ >= end_ || *p_++ != ':') {
+                return false;
+            }
+            if (!ReadValue(depth + 1)) {
+                return false;
+            }
+            count++;
+            SkipSpace();
+            if (p_ >= end_) {
+                return false;
+            }
+            if (*p_ == '}') {
+                p_++;
+                EndContainer(offset, count);
+                return true;
+            }
+            if (*p_++ != ',') {
+                return false;
+            }
+        }
+    }
+
+    bool ReadArray(int depth) {
+        p_++;
+        size_t offset = BeginContainer(CBOR_MAJOR_ARRAY);
+        uint32_t count = 0;
+        SkipSpace();
+        if (p_ < end_ && *p_ == ']') {
+            p_++;
+            EndContainer(offset, 0);
+            return true;
+        }
+        while (true) {
+            if (!ReadValue(depth + 1)) {
+                return false;
+            }
+            count++;
+            SkipSpace();
+            if (p_ >= end_) {
+                return false;
+            }
+            if (*p_ == ']') {
+                p_++;
+                EndContainer(offset, count);
+                return true;
+            }
+            if (*p_++ != ',') {
+                return false;
+            }
+        }
+    }
+
+    static int HexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    bool ReadHex4(uint32_t& value) {
+        if (end_ - p_ < 4) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 4; i++) {
+            int digit = HexValue(p_[i]);
+            if (digit < 0) {
+                return false;
+            }
+            value = (value << 4) | digit;
+        }
+        p_ += 4;
+        return true;
+    }
+
+    void WriteUtf8(std::string& text, uint32_t code_point) {
+        if (code_point < 0x80) {
+            text += (char)code_point;
+        } else if (code_point < 0x800) {
+            text += (char)(0xC0 | (code_point >> 6));
+            text += (char)(0x80 | (code_point & 0x3F));
+        } else if (code_point < 0x10000) {
+            text += (char)(0xE0 | (code_point >> 12));
+            text += (char)(0x80 | ((code_point >> 6) & 0x3F));
+            text += (char)(0x80 | (code_point & 0x3F));
+        } else {
+            text += (char)(0xF0 | (code_point >> 18));
+            text += (char)(0x80 | ((code_point >> 12) & 0x3F));
+            text += (char)(0x80 | ((code_point >> 6) & 0x3F));
+            text += (char)(0x80 | (code_point & 0x3F));
+        }
+    }
+
+    bool ReadString() {
+        p_++;
+        // Fast path, strings without escapes are copied as they are
+        const char* begin = p_;
+        while (p_ < end_ && *p_ != '"' && *p_ != '\\') {
+            p_++;
+        }
+        if (p_ >= end_) {
+            return false;
+        }
+        if (*p_ == '"') {
+            WriteText(begin, p_ - begin);
+            p_++;
+            return true;
+        }
+
+        std::string text(begin, p_);
+        while (p_ < end_) {
+            char c = *p_++;
+            if (c == '"') {
+                WriteText(text.data(), text.size());
+                return true;
+            }
+            if (c != '\\') {
+                text += c;
+                continue;
+            }
+            if (p_ >= end_) {
+                return false;
+            }
+            c = *p_++;
+            switch (c) {
+                case '"': text += '"'; break;
+                case '\\': text += '\\'; break;
+                case '/': text += '/'; break;
+                case 'b': text += '\b'; break;
+                case 'f': text += '\f'; break;
+                case 'n': text += '\n'; break;
+                case 'r': text += '\r'; break;
+                case 't': text += '\t'; break;
+                case 'u': {
+                    uint32_t code_point;
+                    if (!ReadHex4(code_point)) {
+                        return false;
+                    }
+                    if (code_point >= 0xD800 && code_point < 0xDC00) {
+                        uint32_t low;
+                        if (end_ - p_ < 2 || p_[0] != '\\' || p_[1] != 'u') {
+                            return false;
+                        }
+                        p_ += 2;
+                        if (!ReadHex4(low) || low < 0xDC00 || low > 0xDFFF) {
+                            return false;
+                        }
+                        code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    WriteUtf8(text, code_point);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return false;
+    }
+
+    bool ReadNumber() {
+        const char* begin = p_;
+        bool integral = true;
+        if (p_ < end_ && *p_ == '-') {
+            p_++;
+        }
+        while (p_ < end_ && ((*p_ >= '0' && *p_ <= '9') || *p_ == '.' || *p_ == 'e' || *p_ == 'E' || *p_ == '+' || *p_ == '-')) {
+            if (*p_ == '.' || *p_ == 'e' || *p_ == 'E') {
+                integral = false;
+            }
+            p_++;
+        }
+        if (p_ == begin) {
+            return false;
+        }
+        char buffer[40];
+        size_t length = p_ - begin;
+        if (length >= sizeof(buffer)) {
+            return false;
+        }
+        memcpy(buffer, begin, length);
+        buffer[length] = '\0';
+        char* number_end;
+
+        if (integral) {
+            errno = 0;
+            if (buffer[0] == '-') {
+                long long value = strtoll(buffer, &number_end, 10);
+                // -0 has no CBOR integer, it is written as the float -0.0 below
+                if (*number_end == '\0' && errno == 0 && value < 0) {
+                    WriteHead(CBOR_MAJOR_NEGATIVE, (uint64_t)(-(value + 1)));
+                    return true;
+                }
+            } else {
+                unsigned long long value = strtoull(buffer, &number_end, 10);
+                if (*number_end == '\0' && errno == 0) {
+                    WriteHead(CBOR_MAJOR_UNSIGNED, value);
+                    return true;
+                }
+            }
+        }
+
+        double value = strtod(buffer, &number_end);
+        if (*number_end != '\0') {
+            return false;
+        }
+        WriteFloat(value);
+        return true;
+    }
+};
+
+// Encodes a cJSON tree, the counts of the containers are known up front
+class CJsonWriter : public CborWriter {
+public:
+    explicit CJsonWriter(std::vector<uint8_t>& out) : CborWriter(out) {}
+
+    bool WriteItem(const cJSON* item, int depth) {
+        if (depth > CBOR_JSON_MAX_DEPTH) {
+            return false;
+        }
+        switch (item->type & 0xFF) {
+            case cJSON_False:
+                out_.push_back(CBOR_FALSE);
+                return true;
+            case cJSON_True:
+                out_.push_back(CBOR_TRUE);
+                return true;
+            case cJSON_NULL:
+                out_.push_back(CBOR_NULL);
+                return true;
+            case cJSON_Number:
+                WriteNumber(item->valuedouble);
+                return true;
+            case cJSON_String:
+                WriteText(item->valuestring, strlen(item->valuestring));
+                return true;
+            case cJSON_Raw:
+                // Raw items hold JSON text that is spliced into the tree
+                return item->valuestring != nullptr && JsonReader(item->valuestring, strlen(item->valuestring), out_).ReadDocument();
+            case cJSON_Array:
+            case cJSON_Object: {
+                bool object = cJSON_IsObject(item);
+                WriteHead(object ? CBOR_MAJOR_MAP : CBOR_MAJOR_ARRAY, cJSON_GetArraySize(item));
+                for (auto child = item->child; child != nullptr; child = child->next) {
+                    if (object) {
+                        if (child->string == nullptr) {
+                            return false;
+                        }
+                        WriteText(child->string, strlen(child->string));
+                    }
+                    if (!WriteItem(child, depth + 1)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+private:
+    // cJSON keeps every number as a double, integral values go out as CBOR integers
+    void WriteNumber(double value) {
+        if (std::trunc(value) == value && !std::signbit(value) && value < 18446744073709551616.0) {
+            WriteHead(CBOR_MAJOR_UNSIGNED, (uint64_t)value);
+        } else if (std::trunc(value) == value && value < 0 && value >= -9223372036854775808.0) {
+            WriteHead(CBOR_MAJOR_NEGATIVE, (uint64_t)(-(value + 1)));
+        } else {
+            WriteFloat(value);
+        }
+    }
+};
+
+class CborParser {
+public:
+    CborParser(const uint8_t* data, size_t size) : p_(data), end_(data + size) {}
+
+    const uint8_t* position() const { return p_; }
+
+    bool ReadHead(int& major, uint64_t& argument) {
+        if (p_ >= end_) {
+            return false;
+        }
+        uint8_t initial = *p_++;
+        major = initial >> 5;
+        return ReadArgument(initial & 0x1F, argument);
+    }
+
+    bool SkipItem(int depth) {
+        if (depth > CBOR_JSON_MAX_DEPTH || p_ >= end_) {
+            return false;
+        }
+        uint8_t initial = *p_;
+        if ((initial >> 5) == CBOR_MAJOR_SIMPLE) {
+            p_++;
+            uint64_t bits;
+            switch (initial) {
+                case CBOR_FALSE:
+                case CBOR_TRUE:
+                case CBOR_NULL:
+                    return true;
+                case CBOR_FLOAT16:
+                case CBOR_FLOAT32:
+                case CBOR_FLOAT64:
+                    return ReadArgument(initial & 0x1F, bits);
+                default:
+                    return false;
+            }
+        }
+        int major;
+        uint64_t argument;
+        if (!ReadHead(major, argument)) {
+            return false;
+        }
+        switch (major) {
+            case CBOR_MAJOR_UNSIGNED:
+                return true;
+            case CBOR_MAJOR_NEGATIVE:
+                return argument <= (uint64_t)INT64_MAX;
+            case CBOR_MAJOR_TEXT:
+                if ((uint64_t)(end_ - p_) < argument) {
+                    return false;
+                }
+                p_ += argument;
+                return true;
+            case CBOR_MAJOR_ARRAY:
+                for (uint64_t i = 0; i < argument; i++) {
+                    if (!SkipItem(depth + 1)) {
+                        return false;
+                    }
+                }
+                return true;
+            case CBOR_MAJOR_MAP:
+                for (uint64_t i = 0; i < argument; i++) {
+                    if (p_ >= end_ || (*p_ >> 5) != CBOR_MAJOR_TEXT || !SkipItem(depth + 1) || !SkipItem(depth + 1)) {
+                        return false;
+                    }
+                }
+                return true;
+            default:
+                return false;
+        }
+    }
+
+protected:
+    const uint8_t* p_;
+    const uint8_t* end_;
+
+    bool ReadArgument(uint8_t info, uint64_t& value) {
+        if (info < 24) {
+            value = info;
+            return true;
+        }
+        int bytes;
+        switch (info) {
+            case 24: bytes = 1; break;
+            case 25: bytes = 2; break;
+            case 26: bytes = 4; break;
+            case 27: bytes = 8; break;
+            default: return false;  // Indefinite lengths and reserved values
+        }
+        if (end_ - p_ < bytes) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < bytes; i++) {
+            value = (value << 8) | *p_++;
+        }
+        return true;
+    }
+
+    // `initial` is one of the float heads, `single` is set for half and single precision
+    bool ReadFloat(uint8_t initial, double& value, bool& single) {
+        uint64_t bits;
+        if (!ReadArgument(initial & 0x1F, bits)) {
+            return false;
+        }
+        single = initial != CBOR_FLOAT64;
+        if (initial == CBOR_FLOAT16) {
+            int exponent = (bits >> 10) & 0x1F;
+            int mantissa = bits & 0x3FF;
+            if (exponent == 0) {
+                value = std::ldexp(mantissa, -24);
+            } else if (exponent == 31) {
+                value = mantissa == 0 ? INFINITY : NAN;
+            } else {
+                value = std::ldexp(mantissa + 1024, exponent - 25);
+            }
+            if (bits & 0x8000) {
+                value = -value;
+            }
+        } else if (initial == CBOR_FLOAT32) {
+            uint32_t bits32 = bits;
+            float single_value;
+            memcpy(&single_value, &bits32, sizeof(single_value));
+            value = single_value;
+        } else {
+            memcpy(&value, &bits, sizeof(value));
+        }
+        return true;
+    }
+};
+
+class CborReader : public CborParser {
+public:
+    CborReader(const uint8_t* data, size_t size, std::string& out) : CborParser(data, size), out_(out) {}
+
+    bool ReadDocument() {
+        return ReadItem(0) && p_ == end_;
+    }
+
+private:
+    std::string& out_;
+
+    void WriteNumber(double value, bool single) {
+        if (!std::isfinite(value)) {
+            // JSON has no infinity or NaN
+            out_ += "null";
+            return;
+        }
+        char buffer[32];
+        // The shortest of the two forms that reads back as the same value
+        int precision = single ? 9 : 17;
+        snprintf(buffer, sizeof(buffer), "%.*g", precision - 2, value);
+        double parsed = strtod(buffer, nullptr);
+        if (single ? (float)parsed != (float)value : parsed != value) {
+            snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+        }
+        out_ += buffer;
+    }
+
+    bool WriteString(uint64_t length) {
+        if ((uint64_t)(end_ - p_) < length) {
+            return false;
+        }
+        out_ += '"';
+        for (uint64_t i = 0; i < length; i++) {
+            char c = (char)p_[i];
+            switch (c) {
+                case '"': out_ += "\\\""; break;
+                case '\\': out_ += "\\\\"; break;
+                case '\b': out_ += "\\b"; break;
+                case '\f': out_ += "\\f"; break;
+                case '\n': out_ += "\\n"; break;
+                case '\r': out_ += "\\r"; break;
+                case '\t': out_ += "\\t"; break;
+                default:
+                    if ((uint8_t)c < 0x20) {
+                        char escaped[8];
+                        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                        out_ += escaped;
+                    } else {
+                        out_ += c;
+                    }
+                    break;
+            }
+        }
+        out_ += '"';
+        p_ += length;
+        return true;
+    }
+
+    bool ReadItem(int depth) {
+        if (depth > CBOR_JSON_MAX_DEPTH || p_ >= end_) {
+            return false;
+        }
+        uint8_t initial = *p_++;
+        int major = initial >> 5;
+        uint8_t info = initial & 0x1F;
+
+        if (major == CBOR_MAJOR_SIMPLE) {
+            switch (initial) {
+                case CBOR_FALSE: out_ += "false"; return true;
+                case CBOR_TRUE: out_ += "true"; return true;
+                case CBOR_NULL: out_ += "null"; return true;
+                case CBOR_FLOAT16:
+                case CBOR_FLOAT32:
+                case CBOR_FLOAT64: {
+                    double value;
+                    bool single;
+                    if (!ReadFloat(initial, value, single)) {
+                        return false;
+                    }
+                    WriteNumber(value, single);
+                    return true;
+                }
+                default:
+                    return false;
+            }
+        }
+
+        uint64_t argument;
+        if (!ReadArgument(info, argument)) {
+            return false;
+        }
+        char buffer[24];
+        switch (major) {
+            case CBOR_MAJOR_UNSIGNED:
+                snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)argument);
+                out_ += buffer;
+                return true;
+            case CBOR_MAJOR_NEGATIVE:
+                if (argument > (uint64_t)INT64_MAX) {
+                    return false;
+                }
+                snprintf(buffer, sizeof(buffer), "%lld", -1 - (long long)argument);
+                out_ += buffer;
+                return true;
+            case CBOR_MAJOR_TEXT:
+                return WriteString(argument);
+            case CBOR_MAJOR_ARRAY:
+                out_ += '[';
+                for (uint64_t i = 0; i < argument; i++) {
+                    if (i > 0) {
+                        out_ += ',';
+                    }
+                    if (!ReadItem(depth + 1)) {
+                        return false;
+                    }
+                }
+                out_ += ']';
+                return true;
+            case CBOR_MAJOR_MAP:
+                out_ += '{';
+                for (uint64_t i = 0; i < argument; i++) {
+                    if (i > 0) {
+                        out_ += ',';
+                    }
+                    // JSON keys must be strings
+                    if (p_ >= end_ || (*p_ >> 5) != CBOR_MAJOR_TEXT || !ReadItem(depth + 1)) {
+                        return false;
+                    }
+                    out_ += ':';
+                    if (!ReadItem(depth + 1)) {
+                        return false;
+                    }
+                }
+                out_ += '}';
+                return true;
+            default:
+                // Byte strings and tags have no JSON counterpart
+                return false;
+        }
+    }
+};
+
+class CborTreeReader : public CborParser {
+public:
+    using CborParser::CborParser;
+
+    cJSON* ReadDocument() {
+        cJSON* root = ReadItem(0);
+        if (root != nullptr && p_ != end_) {
+            cJSON_Delete(root);
+            return nullptr;
+        }
+        return root;
+    }
+
+private:
+    // cJSON takes NUL terminated strings
+    std::string text_;
+
+    const char* ReadText(uint64_t length) {
+        if ((uint64_t)(end_ - p_) < length) {
+            return nullptr;
+        }
+        text_.assign((const char*)p_, length);
+        p_ += length;
+        return text_.c_str();
+    }
+
+    cJSON* ReadItem(int depth) {
+        if (depth > CBOR_JSON_MAX_DEPTH || p_ >= end_) {
+            return nullptr;
+        }
+        uint8_t initial = *p_;
+        if ((initial >> 5) == CBOR_MAJOR_SIMPLE) {
+            p_++;
+            switch (initial) {
+                case CBOR_FALSE: return cJSON_CreateFalse();
+                case CBOR_TRUE: return cJSON_CreateTrue();
+                case CBOR_NULL: return cJSON_CreateNull();
+                case CBOR_FLOAT16:
+                case CBOR_FLOAT32:
+                case CBOR_FLOAT64: {
+                    double value;
+                    bool single;
+                    if (!ReadFloat(initial, value, single)) {
+                        return nullptr;
+                    }
+                    // JSON has no infinity or NaN
+                    return std::isfinite(value) ? cJSON_CreateNumber(value) : cJSON_CreateNull();
+                }
+                default:
+                    return nullptr;
+            }
+        }
+
+        int major;
+        uint64_t argument;
+        if (!ReadHead(major, argument)) {
+            return nullptr;
+        }
+        switch (major) {
+            case CBOR_MAJOR_UNSIGNED:
+                return cJSON_CreateNumber((double)argument);
+            case CBOR_MAJOR_NEGATIVE:
+                if (argument > (uint64_t)INT64_MAX) {
+                    return nullptr;
+                }
+                return cJSON_CreateNumber(-1.0 - (double)argument);
+            case CBOR_MAJOR_TEXT: {
+                const char* text = ReadText(argument);
+                return text != nullptr ? cJSON_CreateString(text) : nullptr;
+            }
+            case CBOR_MAJOR_ARRAY: {
+                cJSON* array = cJSON_CreateArray();
+                for (uint64_t i = 0; i < argument; i++) {
+                    cJSON* item = ReadItem(depth + 1);
+                    if (item == nullptr) {
+                        cJSON_Delete(array);
+                        return nullptr;
+                    }
+                    cJSON_AddItemToArray(array, item);
+                }
+                return array;
+            }
+            case CBOR_MAJOR_MAP: {
+                cJSON* object = cJSON_CreateObject();
+                for (uint64_t i = 0; i < argument; i++) {
+                    // JSON keys must be strings, the key is copied once its value is read
+                    int key_major;
+                    uint64_t key_length;
+                    if (!ReadHead(key_major, key_length) || key_major != CBOR_MAJOR_TEXT ||
+                        (uint64_t)(end_ - p_) < key_length) {
+                        cJSON_Delete(object);
+                        return nullptr;
+                    }
+                    const uint8_t* key = p_;
+                    p_ += key_length;
+                    cJSON* item = ReadItem(depth + 1);
+                    if (item == nullptr) {
+                        cJSON_Delete(object);
+                        return nullptr;
+                    }
+                    text_.assign((const char*)key, key_length);
+                    cJSON_AddItemToObject(object, text_.c_str(), item);
+                }
+                return object;
+            }
+            default:
+                // Byte strings and tags have no JSON counterpart
+                return nullptr;
+        }
+    }
+};
+
+} // namespace
+
+bool JsonToCbor(const char* json, size_t size, std::vector<uint8_t>& cbor) {
+    JsonReader reader(json, size, cbor);
+    return reader.ReadDocument();
+}
+
+bool CJsonToCbor(const cJSON* root, std::vector<uint8_t>& cbor) {
+    CJsonWriter writer(cbor);
+    return root != nullptr && writer.WriteItem(root, 0);
+}
+
+bool CborToJson(const uint8_t* cbor, size_t size, std::string& json) {
+    json.clear();
+    CborReader reader(cbor, size, json);
+    return reader.ReadDocument();
+}
+
+cJSON* CborToCJson(const uint8_t* cbor, size_t size) {
+    CborTreeReader reader(cbor, size);
+    return reader.ReadDocument();
+}
+
+size_t CborItemSize(const uint8_t* cbor, size_t size) {
+    CborParser parser(cbor, size);
+    return parser.SkipItem(0) ? parser.position() - cbor : 0;
+}
+
+bool CborReadHead(const uint8_t* cbor, size_t size, int& major, uint64_t& argument, size_t& head_size) {
+    CborParser parser(cbor, size);
+    if (!parser.ReadHead(major, argument)) {
+        return false;
+    }
+    head_size = parser.position() - cbor;
+    return true;
+}
+
+bool IsCborMessage(const uint8_t* data, size_t size) {
+    return size > 0 && (data[0] >> 5) == CBOR_MAJOR_MAP;
+}
@@ -0,0 +1,49 @@
+#ifndef CBOR_JSON_H
+#define CBOR_JSON_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Conversion between the JSON control messages and CBOR (RFC 8949), used when the server
+ * announced "cbor" in its hello. The messages keep their JSON schema, only the encoding on
+ * the wire changes. Outgoing messages are encoded from their cJSON tree and incoming messages
+ * are decoded straight into a JsonMessage or a cJSON tree, without going through JSON text.
+ *
+ * - Objects, arrays, strings, true, false and null map to their CBOR counterparts
+ * - Integral numbers become CBOR integers, other numbers floats, 32 bit when that is exact
+ * - Only definite lengths are written and accepted
+ *
+ * The CBOR is appended, so a transport can keep its header in front of it. The buffers are
+ * reused by the callers, their capacity is kept between messages.
+ */
+
+#define CBOR_JSON_MAX_DEPTH 16
+
+#define CBOR_MAJOR_UNSIGNED 0
+#define CBOR_MAJOR_NEGATIVE 1
+#define CBOR_MAJOR_TEXT 3
+#define CBOR_MAJOR_ARRAY 4
+#define CBOR_MAJOR_MAP 5
+#define CBOR_MAJOR_SIMPLE 7
+
+struct cJSON;
+
+// Appends the encoded message to `cbor`, returns false if the text is not valid JSON
+bool JsonToCbor(const char* json, size_t size, std::vector<uint8_t>& cbor);
+// Appends the encoded tree to `cbor`, returns false if it holds an item that has no CBOR counterpart
+bool CJsonToCbor(const cJSON* root, std::vector<uint8_t>& cbor);
+// Replaces the content of `json`, returns false if the data is not a single, well formed CBOR item
+bool CborToJson(const uint8_t* cbor, size_t size, std::string& json);
+// Builds the tree of a single, well formed CBOR item, nullptr if it is not one. The tree is deleted by the caller
+cJSON* CborToCJson(const uint8_t* cbor, size_t size);
+// Size in bytes of the well formed item at the front of the data, 0 if there is none
+size_t CborItemSize(const uint8_t* cbor, size_t size);
+// Major type and argument of the item at the front of the data, e.g. the length of a text string
+bool CborReadHead(const uint8_t* cbor, size_t size, int& major, uint64_t& argument, size_t& head_size);
+// A control message is a map, so its first byte never looks like the '{' of a JSON message
+bool IsCborMessage(const uint8_t* data, size_t size);
+
+#endif // CBOR_JSON_H
@@ -0,0 +1,415 @@
+#include "json_message.h"
+#include "cbor_json.h"
+
+#include <esp_log.h>
+#include <cJSON.h>
+
+#include <cstring>
+
+#define TAG "JsonMessage"
+
+static const char* SkipSpace(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+static int HexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool ReadHex4(const char* p, const char* end, uint32_t& value) {
+    if (end - p < 4) {
+        return false;
+    }
+    value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = HexValue(p[i]);
+        if (digit < 0) {
+            return false;
+        }
+        value = (value << 4) | digit;
+    }
+    return true;
+}
+
+static char* WriteUtf8(char* out, uint32_t code_point) {
+    if (code_point < 0x80) {
+        *out++ = (char)code_point;
+    } else if (code_point < 0x800) {
+        *out++ = (char)(0xC0 | (code_point >> 6));
+        *out++ = (char)(0x80 | (code_point & 0x3F));
+    } else if (code_point < 0x10000) {
+        *out++ = (char)(0xE0 | (code_point >> 12));
+        *out++ = (char)(0x80 | ((code_point >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (code_point & 0x3F));
+    } else {
+        *out++ = (char)(0xF0 | (code_point >> 18));
+        *out++ = (char)(0x80 | ((code_point >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((code_point >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (code_point & 0x3F));
+    }
+    return out;
+}
+
+// `p` points after the opening quote. The string is unescaped in place, the result never grows,
+// so it is NUL terminated at the latest on its closing quote
+static char* ParseString(char* p, const char* end, std::string_view& value) {
+    char* out = p;
+    char* begin = p;
+    while (p < end) {
+        char c = *p++;
+        if (c == '"') {
+            *out = '\0';
+            value = std::string_view(begin, out - begin);
+            return p;
+        }
+        if (c != '\\') {
+            *out++ = c;
+            continue;
+        }
+        if (p >= end) {
+            return nullptr;
+        }
+        c = *p++;
+        switch (c) {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/': *out++ = '/'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': {
+                uint32_t code_point;
+                if (!ReadHex4(p, end, code_point)) {
+                    return nullptr;
+                }
+                p += 4;
+                // Surrogate pair
+                if (code_point >= 0xD800 && code_point < 0xDC00) {
+                    uint32_t low;
+                    if (end - p < 6 || p[0] != '\\' || p[1] != 'u' || !ReadHex4(p + 2, end, low) || low < 0xDC00 || low > 0xDFFF) {
+                        return nullptr;
+                    }
+                    p += 6;
+                    code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+                }
+                out = WriteUtf8(out, code_point);
+                break;
+            }
+            default:
+                return nullptr;
+        }
+    }
+    return nullptr;
+}
+
+// Skips a nested object or array, `p` points at the opening bracket
+static const char* SkipContainer(const char* p, const char* end) {
+    int depth = 0;
+    bool in_string = false;
+    while (p < end) {
+        char c = *p++;
+        if (in_string) {
+            if (c == '\\') {
+                p++;
+            } else if (c == '"') {
+                in_string = false;
+            }
+        } else if (c == '"') {
+            in_string = true;
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (--depth == 0) {
+                return p;
+            }
+        }
+    }
+    return nullptr;
+}
+
+bool JsonMessage::Parse(const char* data, size_t size) {
+    field_count_ = 0;
+    // The capacity of the buffer is kept, so messages of a usual size do not allocate
+    buffer_.assign(data, size);
+    char* p = buffer_.data();
+    const char* end = p + buffer_.size();
+
+    p = (char*)SkipSpace(p, end);
+    if (p >= end || *p++ != '{') {
+        return false;
+    }
+    p = (char*)SkipSpace(p, end);
+    if (p < end && *p == '}') {
+        return true;
+    }
+
+    while (p < end) {
+        std::string_view key;
+        if (*p != '"' || (p = ParseString(p + 1, end, key)) == nullptr) {
+            return false;
+        }
+        p = (char*)SkipSpace(p, end);
+        if (p >= end || *p++ != ':') {
+            return false;
+        }
+        p = (char*)SkipSpace(p, end);
+        if (p >= end) {
+            return false;
+        }
+
+        Field field = { key, {}, false, false };
+        if (*p == '"') {
+            field.is_string = true;
+            p = ParseString(p + 1, end, field.value);
+        } else if (*p == '{' || *p == '[') {
+            char* begin = p;
+            p = (char*)SkipContainer(p, end);
+            if (p != nullptr) {
+                field.value = std::string_view(begin, p - begin);
+            }
+        } else {
+            // Number, true, false or null
+            char* begin = p;
+            while (p < end && *p != ',' && *p != '}' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+                p++;
+            }
+            field.value = std::string_view(begin, p - begin);
+        }
+        if (p == nullptr || field.value.data() == nullptr) {
+            return false;
+        }
+        // Members after the limit are ignored, the server messages have far fewer
+        if (field_count_ < JSON_MESSAGE_MAX_FIELDS) {
+            fields_[field_count_++] = field;
+        }
+
+        p = (char*)SkipSpace(p, end);
+        if (p >= end) {
+            return false;
+        }
+        if (*p == '}') {
+            return true;
+        }
+        if (*p++ != ',') {
+            return false;
+        }
+        p = (char*)SkipSpace(p, end);
+    }
+    return false;
+}
+
+bool JsonMessage::ParseCbor(const uint8_t* data, size_t size) {
+    field_count_ = 0;
+    // The message is kept at the front of the buffer for its nested values. Strings are copied
+    // behind it with a NUL, scalars as JSON text, the views are taken once the buffer is complete
+    buffer_.assign((const char*)data, size);
+    struct {
+        size_t key, key_size, value, value_size;
+    } offsets[JSON_MESSAGE_MAX_FIELDS];
+
+    int major;
+    uint64_t count;
+    size_t head_size;
+    if (!CborReadHead(data, size, major, count, head_size) || major != CBOR_MAJOR_MAP) {
+        return false;
+    }
+    size_t p = head_size;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t key_size;
+        if (!CborReadHead(data + p, size - p, major, key_size, head_size) || major != CBOR_MAJOR_TEXT ||
+            key_size > size - p - head_size) {
+            return false;
+        }
+        size_t key = p + head_size;
+        p = key + key_size;
+        size_t item_size = CborItemSize(data + p, size - p);
+        if (item_size == 0) {
+            return false;
+        }
+        // Members after the limit are ignored, the server messages have far fewer
+        if (field_count_ < JSON_MESSAGE_MAX_FIELDS) {
+            auto& offset = offsets[field_count_];
+            auto& field = fields_[field_count_++];
+            offset.key = buffer_.size();
+            offset.key_size = key_size;
+            buffer_.append((const char*)data + key, key_size);
+            buffer_ += '\0';
+
+            uint64_t argument;
+            CborReadHead(data + p, size - p, major, argument, head_size);
+            field.is_string = major == CBOR_MAJOR_TEXT;
+            field.is_cbor = major == CBOR_MAJOR_MAP || major == CBOR_MAJOR_ARRAY;
+            if (field.is_string) {
+                offset.value = buffer_.size();
+                offset.value_size = argument;
+                buffer_.append((const char*)data + p + head_size, argument);
+            } else if (field.is_cbor) {
+                offset.value = p;
+                offset.value_size = item_size;
+            } else {
+                if (!CborToJson(data + p, item_size, raw_text_)) {
+                    return false;
+                }
+                offset.value = buffer_.size();
+                offset.value_size = raw_text_.size();
+                buffer_ += raw_text_;
+            }
+            if (!field.is_cbor) {
+                buffer_ += '\0';
+            }
+        }
+        p += item_size;
+    }
+    if (p != size) {
+        return false;
+    }
+
+    for (int i = 0; i < field_count_; i++) {
+        fields_[i].key = std::string_view(buffer_.data() + offsets[i].key, offsets[i].key_size);
+        fields_[i].value = std::string_view(buffer_.data() + offsets[i].value, offsets[i].value_size);
+    }
+    return true;
+}
+
+const JsonMessage::Field* JsonMessage::FindField(std::string_view key) const {
+    for (int i = 0; i < field_count_; i++) {
+        if (fields_[i].key == key) {
+            return &fields_[i];
+        }
+    }
+    return nullptr;
+}
+
+std::string_view JsonMessage::GetString(std::string_view key) const {
+    auto field = FindField(key);
+    if (field == nullptr || !field->is_string) {
+        return std::string_view("", 0);
+    }
+    return field->value;
+}
+
+std::string_view JsonMessage::GetRaw(std::string_view key) const {
+    auto field = FindField(key);
+    if (field == nullptr || field->is_string) {
+        return std::string_view();
+    }
+    if (field->is_cbor) {
+        // Only the handlers that want the text of a nested value pay for it
+        if (!CborToJson((const uint8_t*)field->value.data(), field->value.size(), raw_text_)) {
+            return std::string_view();
+        }
+        return raw_text_;
+    }
+    return field->value;
+}
+
+bool JsonMessage::IsObject(std::string_view key) const {
+    auto field = FindField(key);
+    if (field == nullptr || field->is_string || field->value.empty()) {
+        return false;
+    }
+    if (field->is_cbor) {
+        return IsCborMessage((const uint8_t*)field->value.data(), field->value.size());
+    }
+    return field->value[0] == '{';
+}
+
+cJSON* JsonMessage::GetTree(std::string_view key) const {
+    auto field = FindField(key);
+    if (field == nullptr || field->is_string) {
+        return nullptr;
+    }
+    if (field->is_cbor) {
+        return CborToCJson((const uint8_t*)field->value.data(), field->value.size());
+    }
+    return cJSON_ParseWithLength(field->value.data(), field->value.size());
+}
+
+uint32_t JsonMessageDispatcher::Hash(uint32_t seed, std::string_view type, std::string_view state) {
+    // FNV-1a, with the seed mixed into the offset basis
+    uint32_t hash = 2166136261u ^ (seed * 0x9E3779B9u);
+    for (char c : type) {
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    hash = (hash ^ 0xFF) * 16777619u;
+    for (char c : state) {
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
+
+void JsonMessageDispatcher::On(const char* type, const char* state, Handler handler) {
+    if (state == nullptr) {
+        state = "";
+    }
+    // Two entries with the same key would collide for every seed
+    for (auto& entry : entries_) {
+        if (entry.type == type && entry.state == state) {
+            ESP_LOGE(TAG, "Handler for %s/%s already added", type, state);
+            return;
+        }
+    }
+    entries_.push_back({ type, state, std::move(handler) });
+    if (!Rebuild()) {
+        ESP_LOGE(TAG, "No perfect hash for %s/%s, the handler is not added", type, state);
+        entries_.pop_back();
+        Rebuild();
+    }
+}
+
+bool JsonMessageDispatcher::Rebuild() {
+    size_t size = 8;
+    while (size < entries_.size() * 2) {
+        size *= 2;
+    }
+    for (; size <= JSON_DISPATCH_MAX_SLOTS; size *= 2) {
+        for (uint32_t seed = 0; seed < 1000; seed++) {
+            slots_.assign(size, -1);
+            bool collision = false;
+            for (size_t i = 0; i < entries_.size() && !collision; i++) {
+                auto& slot = slots_[Hash(seed, entries_[i].type, entries_[i].state) & (size - 1)];
+                collision = slot >= 0;
+                slot = i;
+            }
+            if (!collision) {
+                seed_ = seed;
+                return true;
+            }
+        }
+    }
+    slots_.clear();
+    return false;
+}
+
+const JsonMessageDispatcher::Entry* JsonMessageDispatcher::Find(std::string_view type, std::string_view state) const {
+    if (slots_.empty()) {
+        return nullptr;
+    }
+    int index = slots_[Hash(seed_, type, state) & (slots_.size() - 1)];
+    if (index < 0) {
+        return nullptr;
+    }
+    auto& entry = entries_[index];
+    return entry.type == type && entry.state == state ? &entry : nullptr;
+}
+
+bool JsonMessageDispatcher::Dispatch(const JsonMessage& message) const {
+    auto type = message.type();
+    auto entry = Find(type, message.state());
+    if (entry == nullptr) {
+        entry = Find(type, std::string_view());
+    }
+    if (entry == nullptr) {
+        return false;
+    }
+    entry->handler(message);
+    return true;
+}
@@ -0,0 +1,95 @@
+#ifndef JSON_MESSAGE_H
+#define JSON_MESSAGE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+struct cJSON;
+
+/*
+ * Text messages from the server are flat objects with a few string fields, e.g.
+ * {"type":"tts","state":"sentence_start","text":"..."}. Instead of building a cJSON tree for
+ * every message, JsonMessage scans the top level object once and keeps views of the member
+ * values in its own buffer, which is reused from message to message. Nested objects and arrays
+ * are skipped and only available as raw JSON text, for the handlers that really need a tree.
+ * CBOR messages are scanned the same way, their nested values are kept as CBOR and only decoded
+ * when a handler asks for them.
+ */
+
+#define JSON_MESSAGE_MAX_FIELDS 16
+// The dispatcher never grows its table past this many slots
+#define JSON_DISPATCH_MAX_SLOTS 1024
+
+class JsonMessage {
+public:
+    // Copies the text into the message buffer and scans it, returns false if it is not a JSON object
+    bool Parse(const char* data, size_t size);
+    // Same for a CBOR map, the strings and scalars end up as in a JSON message
+    bool ParseCbor(const uint8_t* data, size_t size);
+
+    // Unescaped value of a string member, NUL terminated, or empty if the member is missing or not a string
+    std::string_view GetString(std::string_view key) const;
+    // JSON text of any member value, e.g. a nested object
+    std::string_view GetRaw(std::string_view key) const;
+    bool IsObject(std::string_view key) const;
+    // Tree of a member value, to be deleted by the caller, nullptr if the member is missing or a string
+    cJSON* GetTree(std::string_view key) const;
+
+    std::string_view type() const { return GetString("type"); }
+    std::string_view state() const { return GetString("state"); }
+
+private:
+    struct Field {
+        std::string_view key;
+        std::string_view value;
+        bool is_string;
+        // The value is an encoded CBOR map or array
+        bool is_cbor;
+    };
+
+    std::string buffer_;
+    // JSON text of the last nested CBOR value asked for with GetRaw
+    mutable std::string raw_text_;
+    Field fields_[JSON_MESSAGE_MAX_FIELDS];
+    int field_count_ = 0;
+
+    const Field* FindField(std::string_view key) const;
+};
+
+/*
+ * Maps the type and state of a message to its handler through a perfect hash table,
+ * one hash and one key comparison per lookup instead of a chain of strcmp.
+ */
+class JsonMessageDispatcher {
+public:
+    using Handler = std::function<void(const JsonMessage& message)>;
+
+    // A handler without state is used for all states of the type that have no handler of their own.
+    // A second handler for the same type and state is refused
+    void On(const char* type, const char* state, Handler handler);
+    void On(const char* type, Handler handler) { On(type, nullptr, std::move(handler)); }
+
+    // Returns false if no handler matches the message
+    bool Dispatch(const JsonMessage& message) const;
+
+private:
+    struct Entry {
+        std::string type;
+        std::string state;
+        Handler handler;
+    };
+
+    std::vector<Entry> entries_;
+    std::vector<int16_t> slots_;    // Index into entries_, -1 if empty
+    uint32_t seed_ = 0;
+
+    static uint32_t Hash(uint32_t seed, std::string_view type, std::string_view state);
+    // Searches a seed that maps every entry to its own slot, returns false if there is none
+    bool Rebuild();
+    const Entry* Find(std::string_view type, std::string_view state) const;
+};
+
+#endif // JSON_MESSAGE_H
@@ -2,6 +2,7 @@
 #include "board.h"
 #include "application.h"
 #include "settings.h"
+#include "cbor_json.h"
 
 #include <esp_log.h>
 #include <cstring>
@@ -87,32 +88,36 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
-        cJSON* root = cJSON_Parse(payload.c_str());
-        if (root == nullptr) {
-            ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
+        const char* data = payload.data();
+        size_t size = payload.size();
+        // Both encodings may arrive on the topic, e.g. messages sent before this session's hello are JSON
+        bool cbor = IsCborMessage((const uint8_t*)data, size);
+        if (!ParseIncomingMessage(data, size, cbor)) {
             return;
         }
-        cJSON* type = cJSON_GetObjectItem(root, "type");
-        if (!cJSON_IsString(type)) {
+        auto type = incoming_message_.type();
+        if (type.empty()) {
             ESP_LOGE(TAG, "Message type is invalid");
-            cJSON_Delete(root);
             return;
         }
 
-        if (strcmp(type->valuestring, "hello") == 0) {
+        if (type == "hello") {
+            cJSON* root = ParseTree(data, size, cbor);
             ParseServerHello(root);
-        } else if (strcmp(type->valuestring, "goodbye") == 0) {
-            auto session_id = cJSON_GetObjectItem(root, "session_id");
-            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id ? session_id->valuestring : "null");
-            if (session_id == nullptr || session_id_ == session_id->valuestring) {
+            cJSON_Delete(root);
+        } else if (type == "goodbye") {
+            auto session_id = incoming_message_.GetString("session_id");
+            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id.empty() ? "null" : session_id.data());
+            if (session_id.empty() || session_id_ == session_id) {
                 Application::GetInstance().Schedule([this]() {
                     CloseAudioChannel();
                 });
             }
-        } else if (on_incoming_json_ != nullptr) {
-            on_incoming_json_(root);
+        } else if (type == "pong") {
+            HandlePong(incoming_message_);
+        } else if (on_incoming_message_ != nullptr) {
+            on_incoming_message_(incoming_message_);
         }
-        cJSON_Delete(root);
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -148,30 +153,56 @@ bool MqttProtocol::SendText(const std::string& text) {
     return true;
 }
 
+bool MqttProtocol::SendCbor() {
+    if (publish_topic_.empty()) {
+        return false;
+    }
+    if (!mqtt_->Publish(publish_topic_, std::string((const char*)cbor_buffer_.data(), cbor_buffer_.size()))) {
+        ESP_LOGE(TAG, "Failed to publish CBOR message, %u bytes", cbor_buffer_.size());
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    return true;
+}
+
 bool MqttProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
     std::lock_guard<std::mutex> lock(channel_mutex_);
     if (udp_ == nullptr) {
         return false;
     }
 
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet->payload.size());
+    /* The nonce goes into the headroom and the Opus data is encrypted in place */
+    packet->ReserveHeadroom(MQTT_UDP_NONCE_SIZE);
+    uint8_t* opus = packet->opus_data();
+    size_t opus_size = packet->opus_size();
+    uint8_t* nonce = opus - MQTT_UDP_NONCE_SIZE;
+    memcpy(nonce, aes_nonce_, MQTT_UDP_NONCE_SIZE);
+    *(uint16_t*)&nonce[2] = htons(opus_size);
     *(uint32_t*)&nonce[8] = htonl(packet->timestamp);
     *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
 
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet->payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
-
-    size_t nc_off = 0;
-    uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet->payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet->payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
+    if (!CryptAudio(nonce, opus, opus, opus_size)) {
         ESP_LOGE(TAG, "Failed to encrypt audio data");
         return false;
     }
 
-    return udp_->Send(encrypted) > 0;
+    NetworkQualityMonitor::GetInstance().OnAudioSent(MQTT_UDP_NONCE_SIZE + opus_size);
+    // Udp::Send only takes a std::string, this is the single copy left on the send path
+    return udp_->Send(std::string((const char*)nonce, MQTT_UDP_NONCE_SIZE + opus_size)) > 0;
+}
+
+/*
+ * The counter block is the packet header, which carries payload_len and timestamp besides the
+ * sequence, so the keystream is only known once the packet is, and cannot be computed ahead.
+ * One call covers the whole packet, so the AES engine is taken once per packet.
+ */
+bool MqttProtocol::CryptAudio(const uint8_t* nonce, const uint8_t* input, uint8_t* output, size_t size) {
+    // The counter is advanced by mbedtls, so it must not alias the header being sent or received
+    uint8_t nonce_counter[MQTT_UDP_NONCE_SIZE];
+    memcpy(nonce_counter, nonce, MQTT_UDP_NONCE_SIZE);
+    uint8_t stream_block[16];
+    size_t nc_off = 0;
+    return mbedtls_aes_crypt_ctr(&aes_ctx_, size, &nc_off, nonce_counter, stream_block, input, output) == 0;
 }
 
 void MqttProtocol::CloseAudioChannel() {
@@ -180,11 +211,13 @@ void MqttProtocol::CloseAudioChannel() {
         udp_.reset();
     }
 
-    std::string message = "{";
-    message += "\"session_id\":\"" + session_id_ + "\",";
-    message += "\"type\":\"goodbye\"";
-    message += "}";
-    SendText(message);
+    cJSON* goodbye = CreateMessage("goodbye");
+    SendJson(goodbye);
+    cJSON_Delete(goodbye);
+    // A channel closed with a goodbye is not resumed
+    session_id_.clear();
+    cbor_enabled_ = false;
+    DropResumableSession();
 
     if (on_audio_channel_closed_ != nullptr) {
         on_audio_channel_closed_();
@@ -200,8 +233,15 @@ bool MqttProtocol::OpenAudioChannel() {
     }
 
     error_occurred_ = false;
+    // The previous channel ended without a goodbye, e.g. the network dropped, offer its session to the server
+    auto idle_time = std::chrono::steady_clock::now() - last_incoming_time_;
+    if (!session_id_.empty() && idle_time < std::chrono::milliseconds(PROTOCOL_SESSION_RESUME_MS)) {
+        KeepSessionForResume();
+    }
     session_id_ = "";
-    xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
+    // The hello is always JSON, CBOR is only used once the server accepted it
+    cbor_enabled_ = false;
+    xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT | MQTT_PROTOCOL_SERVER_HELLO_FAILED_EVENT);
 
     auto message = GetHelloMessage();
     if (!SendText(message)) {
@@ -209,7 +249,13 @@ bool MqttProtocol::OpenAudioChannel() {
     }
 
     // 等待服务器响应
-    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
+    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT | MQTT_PROTOCOL_SERVER_HELLO_FAILED_EVENT,
+        pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
+    if (bits & MQTT_PROTOCOL_SERVER_HELLO_FAILED_EVENT) {
+        ESP_LOGE(TAG, "Invalid server hello");
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
     if (!(bits & MQTT_PROTOCOL_SERVER_HELLO_EVENT)) {
         ESP_LOGE(TAG, "Failed to receive server hello");
         SetError(Lang::Strings::SERVER_TIMEOUT);
@@ -225,7 +271,7 @@ bool MqttProtocol::OpenAudioChannel() {
          * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
          * |payload payload_len|
          */
-        if (data.size() < sizeof(aes_nonce_)) {
+        if (data.size() < MQTT_UDP_NONCE_SIZE) {
             ESP_LOGE(TAG, "Invalid audio packet size: %u", data.size());
             return;
         }
@@ -242,20 +288,20 @@ bool MqttProtocol::OpenAudioChannel() {
         if (sequence != remote_sequence_ + 1) {
             ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
         }
-
-        size_t decrypted_size = data.size() - aes_nonce_.size();
-        size_t nc_off = 0;
-        uint8_t stream_block[16] = {0};
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
-        auto packet = std::make_unique<AudioStreamPacket>();
+        auto& quality_monitor = NetworkQualityMonitor::GetInstance();
+        quality_monitor.OnSequence(sequence);
+        quality_monitor.OnAudioReceived(data.size(), 1, server_frame_duration_);
+
+        // The frame is decrypted straight into a pooled packet
+        size_t decrypted_size = data.size() - MQTT_UDP_NONCE_SIZE;
+        auto nonce = (const uint8_t*)data.data();
+        auto packet = AudioPacketPool::GetInstance().Acquire(decrypted_size);
         packet->sample_rate = server_sample_rate_;
         packet->frame_duration = server_frame_duration_;
         packet->timestamp = timestamp;
-        packet->payload.resize(decrypted_size);
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet->payload.data());
-        if (ret != 0) {
-            ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
+        if (!CryptAudio(nonce, nonce + MQTT_UDP_NONCE_SIZE, packet->payload.data(), decrypted_size)) {
+            ESP_LOGE(TAG, "Failed to decrypt audio data");
+            AudioPacketPool::GetInstance().Release(std::move(packet));
             return;
         }
         if (on_incoming_audio_ != nullptr) {
@@ -279,11 +325,22 @@ std::string MqttProtocol::GetHelloMessage() {
     cJSON_AddStringToObject(root, "type", "hello");
     cJSON_AddNumberToObject(root, "version", 3);
     cJSON_AddStringToObject(root, "transport", "udp");
+    // The previous session id is the resume token, the server answers with the same id if it resumed it
+    auto resume_session_id = GetResumableSessionId();
+    if (!resume_session_id.empty()) {
+        cJSON_AddStringToObject(root, "session_id", resume_session_id.c_str());
+    }
     cJSON* features = cJSON_CreateObject();
 #if CONFIG_USE_SERVER_AEC
     cJSON_AddBoolToObject(features, "aec", true);
+    int aec_delay_ms = Application::GetInstance().GetAudioService().GetAecDelayMs();
+    if (aec_delay_ms > 0) {
+        cJSON_AddNumberToObject(features, "aec_delay_ms", aec_delay_ms);
+    }
 #endif
     cJSON_AddBoolToObject(features, "mcp", true);
+    cJSON_AddBoolToObject(features, "ping", true);
+    cJSON_AddBoolToObject(features, "cbor", true);
     cJSON_AddItemToObject(root, "features", features);
     cJSON* audio_params = cJSON_CreateObject();
     cJSON_AddStringToObject(audio_params, "format", "opus");
@@ -302,6 +359,7 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
     auto transport = cJSON_GetObjectItem(root, "transport");
     if (transport == nullptr || strcmp(transport->valuestring, "udp") != 0) {
         ESP_LOGE(TAG, "Unsupported transport: %s", transport->valuestring);
+        xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_FAILED_EVENT);
         return;
     }
 
@@ -310,6 +368,8 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         session_id_ = session_id->valuestring;
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
+    CompleteSessionResume();
+    ParseServerFeatures(root);
 
     // Get sample rate from hello message
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
@@ -327,6 +387,7 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
     auto udp = cJSON_GetObjectItem(root, "udp");
     if (!cJSON_IsObject(udp)) {
         ESP_LOGE(TAG, "UDP is not specified");
+        xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_FAILED_EVENT);
         return;
     }
     udp_server_ = cJSON_GetObjectItem(udp, "server")->valuestring;
@@ -336,9 +397,16 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
 
     // auto encryption = cJSON_GetObjectItem(udp, "encryption")->valuestring;
     // ESP_LOGI(TAG, "UDP server: %s, port: %d, encryption: %s", udp_server_.c_str(), udp_port_, encryption);
-    aes_nonce_ = DecodeHexString(nonce);
+    auto aes_nonce = DecodeHexString(nonce);
+    auto aes_key = DecodeHexString(key);
+    if (aes_nonce.size() != MQTT_UDP_NONCE_SIZE || aes_key.size() != 16) {
+        ESP_LOGE(TAG, "Invalid UDP key or nonce size: %u, %u", aes_key.size(), aes_nonce.size());
+        xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_FAILED_EVENT);
+        return;
+    }
+    memcpy(aes_nonce_, aes_nonce.data(), MQTT_UDP_NONCE_SIZE);
     mbedtls_aes_init(&aes_ctx_);
-    mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
+    mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)aes_key.data(), 128);
     local_sequence_ = 0;
     remote_sequence_ = 0;
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
@@ -20,6 +20,10 @@
 #define MQTT_RECONNECT_INTERVAL_MS 60000
 
 #define MQTT_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
+#define MQTT_PROTOCOL_SERVER_HELLO_FAILED_EVENT (1 << 1)
+
+// The header of every UDP audio packet, it is also the initial AES-CTR counter block
+#define MQTT_UDP_NONCE_SIZE 16
 
 class MqttProtocol : public Protocol {
 public:
@@ -41,7 +45,7 @@ private:
     std::unique_ptr<Mqtt> mqtt_;
     std::unique_ptr<Udp> udp_;
     mbedtls_aes_context aes_ctx_;
-    std::string aes_nonce_;
+    uint8_t aes_nonce_[MQTT_UDP_NONCE_SIZE];
     std::string udp_server_;
     int udp_port_;
     uint32_t local_sequence_;
@@ -51,8 +55,10 @@ private:
     bool StartMqttClient(bool report_error=false);
     void ParseServerHello(const cJSON* root);
     std::string DecodeHexString(const std::string& hex_string);
+    bool CryptAudio(const uint8_t* nonce, const uint8_t* input, uint8_t* output, size_t size);
 
     bool SendText(const std::string& text) override;
+    bool SendCbor() override;
     std::string GetHelloMessage();
 };
 
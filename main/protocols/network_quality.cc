@@ -0,0 +1,131 @@
+#include "network_quality.h"
+
+#include <cmath>
+
+void NetworkQualityMonitor::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quality_ = NetworkQuality();
+    window_start_ = std::chrono::steady_clock::now();
+    window_sent_bytes_ = 0;
+    window_received_bytes_ = 0;
+    window_received_packets_ = 0;
+    window_lost_packets_ = 0;
+    has_last_arrival_ = false;
+    jitter_ms_ = 0;
+    rtt_ms_ = -1;
+    loss_percent_ = 0;
+    has_last_sequence_ = false;
+}
+
+void NetworkQualityMonitor::OnPong(uint32_t rtt_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (rtt_ms_ < 0) {
+        rtt_ms_ = rtt_ms;
+    } else {
+        rtt_ms_ += ((float)rtt_ms - rtt_ms_) / NETWORK_QUALITY_RTT_SMOOTHING;
+    }
+    quality_.rtt_ms = std::lround(rtt_ms_);
+    if (quality_.rtt_min_ms < 0 || (int)rtt_ms < quality_.rtt_min_ms) {
+        quality_.rtt_min_ms = rtt_ms;
+    }
+}
+
+void NetworkQualityMonitor::OnAudioSent(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    window_sent_bytes_ += bytes;
+}
+
+void NetworkQualityMonitor::OnAudioReceived(size_t bytes, int frame_count, int frame_duration_ms) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    window_received_bytes_ += bytes;
+    if (has_last_arrival_) {
+        // Deviation of the inter-arrival time from the audio in the previous message, early and late alike.
+        // A pause between sentences is not a deviation
+        float interval = std::chrono::duration<float, std::milli>(now - last_arrival_).count();
+        if (interval < NETWORK_QUALITY_MAX_GAP_MS) {
+            float deviation = std::fabs(interval - last_audio_ms_);
+            jitter_ms_ += (deviation - jitter_ms_) / NETWORK_QUALITY_JITTER_SMOOTHING;
+            quality_.jitter_ms = std::lround(jitter_ms_);
+        }
+    }
+    last_arrival_ = now;
+    last_audio_ms_ = frame_count * frame_duration_ms;
+    has_last_arrival_ = true;
+}
+
+void NetworkQualityMonitor::OnSequence(uint32_t sequence) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (has_last_sequence_ && sequence > last_sequence_ + 1) {
+        uint32_t lost = sequence - last_sequence_ - 1;
+        window_lost_packets_ += lost;
+        quality_.lost_packets += lost;
+    }
+    if (!has_last_sequence_ || sequence > last_sequence_) {
+        last_sequence_ = sequence;
+        has_last_sequence_ = true;
+    }
+    window_received_packets_++;
+    quality_.received_packets++;
+}
+
+void NetworkQualityMonitor::Update() {
+    NetworkQuality quality;
+    decltype(listeners_) listeners;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        float seconds = std::chrono::duration<float>(now - window_start_).count();
+        if (seconds <= 0) {
+            return;
+        }
+        quality_.uplink_kbps = std::lround(window_sent_bytes_ * 8 / 1000.0f / seconds);
+        quality_.downlink_kbps = std::lround(window_received_bytes_ * 8 / 1000.0f / seconds);
+
+        uint32_t expected = window_received_packets_ + window_lost_packets_;
+        if (expected > 0) {
+            float loss = 100.0f * window_lost_packets_ / expected;
+            loss_percent_ += (loss - loss_percent_) / NETWORK_QUALITY_LOSS_SMOOTHING;
+            quality_.loss_percent = std::round(loss_percent_ * 10) / 10;
+        }
+
+        window_start_ = now;
+        window_sent_bytes_ = 0;
+        window_received_bytes_ = 0;
+        window_received_packets_ = 0;
+        window_lost_packets_ = 0;
+        quality = quality_;
+        listeners = listeners_;
+    }
+    // Called without the lock, so a listener may read the monitor again
+    for (auto& listener : listeners) {
+        listener(quality);
+    }
+}
+
+NetworkQuality NetworkQualityMonitor::GetQuality() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return quality_;
+}
+
+void NetworkQualityMonitor::AddListener(std::function<void(const NetworkQuality& quality)> listener) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    listeners_.push_back(listener);
+}
+
+cJSON* NetworkQualityMonitor::ToJson() {
+    auto quality = GetQuality();
+    auto json = cJSON_CreateObject();
+    if (quality.rtt_ms >= 0) {
+        cJSON_AddNumberToObject(json, "rtt_ms", quality.rtt_ms);
+        cJSON_AddNumberToObject(json, "rtt_min_ms", quality.rtt_min_ms);
+    }
+    cJSON_AddNumberToObject(json, "jitter_ms", quality.jitter_ms);
+    if (quality.received_packets > 0) {
+        cJSON_AddNumberToObject(json, "loss_percent", quality.loss_percent);
+        cJSON_AddNumberToObject(json, "lost_packets", quality.lost_packets);
+    }
+    cJSON_AddNumberToObject(json, "uplink_kbps", quality.uplink_kbps);
+    cJSON_AddNumberToObject(json, "downlink_kbps", quality.downlink_kbps);
+    return json;
+}
@@ -0,0 +1,95 @@
+#ifndef NETWORK_QUALITY_H
+#define NETWORK_QUALITY_H
+
+#include <cJSON.h>
+#include <cstdint>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <functional>
+
+/*
+ * Rolling statistics of the audio channel, fed by the protocols:
+ * - RTT from ping/pong messages, when the server announced "ping" in its hello
+ * - Jitter of the incoming audio, from the arrival times against the frame duration
+ * - Loss from the sequence gaps of the UDP channel
+ * - Achieved uplink and downlink throughput of the audio
+ *
+ * Update() is called once per second, it closes the throughput and loss windows and
+ * notifies the listeners, so they can adapt e.g. the encoder or the jitter buffer.
+ */
+
+// Smoothing of RTT and loss, the weight of the newest sample is 1/N
+#define NETWORK_QUALITY_RTT_SMOOTHING 8
+#define NETWORK_QUALITY_LOSS_SMOOTHING 4
+// Jitter uses the RFC 3550 estimator, gain 1/16
+#define NETWORK_QUALITY_JITTER_SMOOTHING 16
+// Longer gaps between incoming frames are pauses of the speech
+#define NETWORK_QUALITY_MAX_GAP_MS 1000
+
+struct NetworkQuality {
+    int rtt_ms = -1;            // Smoothed, -1 until the first pong
+    int rtt_min_ms = -1;
+    int jitter_ms = 0;
+    float loss_percent = 0;     // Smoothed over the one second windows, UDP only
+    uint32_t received_packets = 0;
+    uint32_t lost_packets = 0;
+    int uplink_kbps = 0;        // Last window
+    int downlink_kbps = 0;
+};
+
+class NetworkQualityMonitor {
+public:
+    static NetworkQualityMonitor& GetInstance() {
+        static NetworkQualityMonitor instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    NetworkQualityMonitor(const NetworkQualityMonitor&) = delete;
+    NetworkQualityMonitor& operator=(const NetworkQualityMonitor&) = delete;
+
+    // Called when an audio channel is opened
+    void Reset();
+
+    void OnPong(uint32_t rtt_ms);
+    void OnAudioSent(size_t bytes);
+    // One call per audio message, a message of protocol version 4 may carry several frames
+    void OnAudioReceived(size_t bytes, int frame_count, int frame_duration_ms);
+    // Sequence number of a received UDP packet
+    void OnSequence(uint32_t sequence);
+
+    // Closes the current window and notifies the listeners, called once per second
+    void Update();
+
+    NetworkQuality GetQuality();
+    // Listeners are called in the context of Update()
+    void AddListener(std::function<void(const NetworkQuality& quality)> listener);
+    // Returns a new object for the device status, the caller owns it
+    cJSON* ToJson();
+
+private:
+    NetworkQualityMonitor() = default;
+
+    std::mutex mutex_;
+    NetworkQuality quality_;
+    std::vector<std::function<void(const NetworkQuality& quality)>> listeners_;
+
+    // Current window
+    std::chrono::steady_clock::time_point window_start_ = std::chrono::steady_clock::now();
+    size_t window_sent_bytes_ = 0;
+    size_t window_received_bytes_ = 0;
+    uint32_t window_received_packets_ = 0;
+    uint32_t window_lost_packets_ = 0;
+
+    // Jitter state
+    std::chrono::steady_clock::time_point last_arrival_;
+    bool has_last_arrival_ = false;
+    int last_audio_ms_ = 0;     // Audio carried by the last message, the time expected until the next one
+    float jitter_ms_ = 0;
+    float rtt_ms_ = -1;
+    float loss_percent_ = 0;
+    uint32_t last_sequence_ = 0;
+    bool has_last_sequence_ = false;
+};
+
+#endif // NETWORK_QUALITY_H
@@ -1,11 +1,62 @@
 #include "protocol.h"
+#include "cbor_json.h"
+#include "memory_budget.h"
 
 #include <esp_log.h>
 
 #define TAG "Protocol"
 
-void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
-    on_incoming_json_ = callback;
+std::unique_ptr<AudioStreamPacket> AudioPacketPool::Acquire(size_t size) {
+    std::unique_ptr<AudioStreamPacket> packet;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_packets_.empty()) {
+            packet = std::move(free_packets_.back());
+            free_packets_.pop_back();
+            TrackPooled(packet.get(), -1);
+        } else {
+            allocated_count_++;
+        }
+    }
+    if (!packet) {
+        packet = std::make_unique<AudioStreamPacket>();
+    }
+    packet->headroom = 0;
+    packet->payload.resize(size);
+    return packet;
+}
+
+void AudioPacketPool::Release(std::unique_ptr<AudioStreamPacket> packet) {
+    if (!packet) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_packets_.size() < AUDIO_PACKET_POOL_SIZE) {
+        TrackPooled(packet.get(), 1);
+        free_packets_.push_back(std::move(packet));
+    }
+}
+
+// The payload capacity held by the pool counts as protocol memory
+void AudioPacketPool::TrackPooled(const AudioStreamPacket* packet, int sign) {
+    int32_t bytes = sizeof(AudioStreamPacket) + packet->payload.capacity();
+    auto tier = packet->payload.capacity() > 0 ? MemoryBudget::GetTier(packet->payload.data()) : kMemoryTierInternal;
+    MemoryBudget::GetInstance().Track(kMemoryProtocol, tier, sign * bytes);
+}
+
+bool Protocol::SendAudioFrames(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) {
+    bool success = true;
+    for (auto& packet : packets) {
+        if (success) {
+            success = SendAudio(std::move(packet));
+        }
+    }
+    packets.clear();
+    return success;
+}
+
+void Protocol::OnIncomingMessage(std::function<void(const JsonMessage& message)> callback) {
+    on_incoming_message_ = callback;
 }
 
 void Protocol::OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback) {
@@ -32,6 +83,10 @@ void Protocol::OnDisconnected(std::function<void()> callback) {
     on_disconnected_ = callback;
 }
 
+void Protocol::OnSessionLost(std::function<void()> callback) {
+    on_session_lost_ = callback;
+}
+
 void Protocol::SetError(const std::string& message) {
     error_occurred_ = true;
     if (on_network_error_ != nullptr) {
@@ -39,43 +94,161 @@ void Protocol::SetError(const std::string& message) {
     }
 }
 
+// Control messages are built as trees, so that the CBOR encoding does not go through JSON text
+cJSON* Protocol::CreateMessage(const char* type) {
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "session_id", session_id_.c_str());
+    cJSON_AddStringToObject(root, "type", type);
+    return root;
+}
+
+bool Protocol::SendJson(const cJSON* root) {
+    if (cbor_enabled_) {
+        cbor_buffer_.assign(cbor_header_size_, 0);
+        if (CJsonToCbor(root, cbor_buffer_) && cbor_buffer_.size() - cbor_header_size_ <= max_cbor_payload_size_) {
+            return SendCbor();
+        }
+        // The server accepts both encodings, a message the encoder does not take goes out as JSON
+        ESP_LOGW(TAG, "Failed to encode message as CBOR, %u bytes", cbor_buffer_.size());
+    }
+    char* text = cJSON_PrintUnformatted(root);
+    if (text == nullptr) {
+        return false;
+    }
+    bool sent = SendText(text);
+    cJSON_free(text);
+    return sent;
+}
+
 void Protocol::SendAbortSpeaking(AbortReason reason) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"abort\"";
+    cJSON* root = CreateMessage("abort");
     if (reason == kAbortReasonWakeWordDetected) {
-        message += ",\"reason\":\"wake_word_detected\"";
+        cJSON_AddStringToObject(root, "reason", "wake_word_detected");
     }
-    message += "}";
-    SendText(message);
+    SendJson(root);
+    cJSON_Delete(root);
 }
 
 void Protocol::SendWakeWordDetected(const std::string& wake_word) {
-    std::string json = "{\"session_id\":\"" + session_id_ + 
-                      "\",\"type\":\"listen\",\"state\":\"detect\",\"text\":\"" + wake_word + "\"}";
-    SendText(json);
+    cJSON* root = CreateMessage("listen");
+    cJSON_AddStringToObject(root, "state", "detect");
+    cJSON_AddStringToObject(root, "text", wake_word.c_str());
+    SendJson(root);
+    cJSON_Delete(root);
 }
 
 void Protocol::SendStartListening(ListeningMode mode) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\"";
-    message += ",\"type\":\"listen\",\"state\":\"start\"";
+    cJSON* root = CreateMessage("listen");
+    cJSON_AddStringToObject(root, "state", "start");
     if (mode == kListeningModeRealtime) {
-        message += ",\"mode\":\"realtime\"";
+        cJSON_AddStringToObject(root, "mode", "realtime");
     } else if (mode == kListeningModeAutoStop) {
-        message += ",\"mode\":\"auto\"";
+        cJSON_AddStringToObject(root, "mode", "auto");
     } else {
-        message += ",\"mode\":\"manual\"";
+        cJSON_AddStringToObject(root, "mode", "manual");
     }
-    message += "}";
-    SendText(message);
+    SendJson(root);
+    cJSON_Delete(root);
 }
 
 void Protocol::SendStopListening() {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"listen\",\"state\":\"stop\"}";
-    SendText(message);
+    cJSON* root = CreateMessage("listen");
+    cJSON_AddStringToObject(root, "state", "stop");
+    SendJson(root);
+    cJSON_Delete(root);
+}
+
+void Protocol::SendMcpMessage(cJSON* payload) {
+    cJSON* root = CreateMessage("mcp");
+    cJSON_AddItemToObject(root, "payload", payload);
+    SendJson(root);
+    cJSON_Delete(root);
+}
+
+void Protocol::KeepSessionForResume() {
+    if (session_id_.empty()) {
+        return;
+    }
+    resume_session_id_ = session_id_;
+    resume_deadline_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(PROTOCOL_SESSION_RESUME_MS);
+    ESP_LOGI(TAG, "Keep session %s for resume", resume_session_id_.c_str());
+}
+
+void Protocol::DropResumableSession() {
+    resume_session_id_.clear();
+}
+
+std::string Protocol::GetResumableSessionId() const {
+    if (resume_session_id_.empty() || std::chrono::steady_clock::now() > resume_deadline_) {
+        return "";
+    }
+    return resume_session_id_;
+}
+
+bool Protocol::CompleteSessionResume() {
+    if (resume_session_id_.empty()) {
+        return true;
+    }
+    bool resumed = session_id_ == resume_session_id_;
+    if (resumed) {
+        ESP_LOGI(TAG, "Session %s resumed", session_id_.c_str());
+    } else {
+        ESP_LOGW(TAG, "Session %s was not resumed, new session: %s", resume_session_id_.c_str(), session_id_.c_str());
+    }
+    DropResumableSession();
+    return resumed;
+}
+
+static uint32_t GetPingTimestamp() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
 }
 
-void Protocol::SendMcpMessage(const std::string& payload) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"payload\":" + payload + "}";
-    SendText(message);
+void Protocol::SendPing() {
+    if (!ping_supported_) {
+        return;
+    }
+    cJSON* root = CreateMessage("ping");
+    cJSON_AddNumberToObject(root, "timestamp", GetPingTimestamp());
+    SendJson(root);
+    cJSON_Delete(root);
+}
+
+void Protocol::ParseServerFeatures(const cJSON* root) {
+    auto features = cJSON_GetObjectItem(root, "features");
+    ping_supported_ = cJSON_IsTrue(cJSON_GetObjectItem(features, "ping"));
+    cbor_enabled_ = cJSON_IsTrue(cJSON_GetObjectItem(features, "cbor"));
+    if (cbor_enabled_) {
+        ESP_LOGI(TAG, "Server accepted CBOR control messages");
+    }
+}
+
+bool Protocol::ParseIncomingMessage(const char* data, size_t size, bool cbor) {
+    if (cbor) {
+        if (!incoming_message_.ParseCbor((const uint8_t*)data, size)) {
+            ESP_LOGE(TAG, "Failed to decode CBOR message, size: %u", size);
+            return false;
+        }
+    } else if (!incoming_message_.Parse(data, size)) {
+        ESP_LOGE(TAG, "Failed to parse json message %.*s", (int)size, data);
+        return false;
+    }
+    return true;
+}
+
+// The hello is rare and has nested objects, it is parsed again from the original message
+cJSON* Protocol::ParseTree(const char* data, size_t size, bool cbor) {
+    return cbor ? CborToCJson((const uint8_t*)data, size) : cJSON_ParseWithLength(data, size);
+}
+
+// The server echoes the timestamp of the ping
+void Protocol::HandlePong(const JsonMessage& message) {
+    auto timestamp = message.GetRaw("timestamp");
+    if (timestamp.empty()) {
+        return;
+    }
+    uint32_t sent = strtoul(std::string(timestamp).c_str(), nullptr, 10);
+    NetworkQualityMonitor::GetInstance().OnPong(GetPingTimestamp() - sent);
 }
 
 bool Protocol::IsTimeout() const {
@@ -6,14 +6,76 @@
 #include <functional>
 #include <chrono>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+#include "json_message.h"
+#include "network_quality.h"
+
+// Bytes reserved in front of the Opus data of outgoing packets, so that the transport can fill in
+// its header in place and send one contiguous buffer. Fits BinaryProtocol2 and the UDP nonce.
+#define AUDIO_PACKET_HEADROOM 16
 
 struct AudioStreamPacket {
     int sample_rate = 0;
     int frame_duration = 0;
     uint32_t timestamp = 0;
     std::vector<uint8_t> payload;
+    // The first `headroom` bytes of payload are reserved for the transport header, the Opus data follows
+    size_t headroom = 0;
+
+    inline uint8_t* opus_data() { return payload.data() + headroom; }
+    inline const uint8_t* opus_data() const { return payload.data() + headroom; }
+    inline size_t opus_size() const { return payload.size() - headroom; }
+
+    // Only moves the data if the packet was not created with enough headroom
+    void ReserveHeadroom(size_t size) {
+        if (headroom < size) {
+            payload.insert(payload.begin(), size - headroom, 0);
+            headroom = size;
+        }
+    }
+};
+
+// Received packets kept for reuse, enough to refill the decode queue without allocating
+#define AUDIO_PACKET_POOL_SIZE 48
+
+/*
+ * Free list of incoming audio packets. The transports take a packet, copy or decrypt the frame
+ * into its payload, and the decoder returns it after use, so the payload capacity is reused.
+ */
+class AudioPacketPool {
+public:
+    static AudioPacketPool& GetInstance() {
+        static AudioPacketPool instance;
+        return instance;
+    }
+    // Delete copy constructor and assignment operator
+    AudioPacketPool(const AudioPacketPool&) = delete;
+    AudioPacketPool& operator=(const AudioPacketPool&) = delete;
+
+    // Returns a packet with payload resized to `size` and headroom 0
+    std::unique_ptr<AudioStreamPacket> Acquire(size_t size);
+    void Release(std::unique_ptr<AudioStreamPacket> packet);
+
+    uint32_t allocated_count() const { return allocated_count_; }
+
+private:
+    AudioPacketPool() = default;
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<AudioStreamPacket>> free_packets_;
+    uint32_t allocated_count_ = 0;
+
+    void TrackPooled(const AudioStreamPacket* packet, int sign);
 };
 
+// Message types of the binary protocols. CBOR control messages are only sent and expected after
+// the server accepted "cbor" in its hello, they use the BinaryProtocol3 layout
+#define BINARY_MESSAGE_TYPE_OPUS 0
+#define BINARY_MESSAGE_TYPE_CBOR 2
+
 struct BinaryProtocol2 {
     uint16_t version;
     uint16_t type;          // Message type (0: OPUS, 1: JSON)
@@ -30,6 +92,27 @@ struct BinaryProtocol3 {
     uint8_t payload[];
 } __attribute__((packed));
 
+/*
+ * Version 4 packs several Opus frames into one message, each with its own timestamp and size.
+ * It is only used after the server accepted it in its hello.
+ */
+struct BinaryProtocol4 {
+    uint8_t type;           // Message type (0: OPUS)
+    uint8_t frame_count;
+    uint16_t payload_size;  // Size of all frames, headers included
+    uint8_t payload[];      // frame_count x BinaryProtocol4Frame
+} __attribute__((packed));
+
+struct BinaryProtocol4Frame {
+    uint32_t timestamp;     // Timestamp in milliseconds (used for server-side AEC)
+    uint16_t size;
+    uint8_t data[];
+} __attribute__((packed));
+
+// A session that dropped without a goodbye is offered to the server again within this period,
+// so a network blip does not end the conversation
+#define PROTOCOL_SESSION_RESUME_MS 30000
+
 enum AbortReason {
     kAbortReasonNone,
     kAbortReasonWakeWordDetected
@@ -56,40 +139,82 @@ public:
     }
 
     void OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback);
-    void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    void OnIncomingMessage(std::function<void(const JsonMessage& message)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
     void OnConnected(std::function<void()> callback);
     void OnDisconnected(std::function<void()> callback);
+    // The connection came back after a drop but the server started a new session, the conversation is gone
+    void OnSessionLost(std::function<void()> callback);
 
     virtual bool Start() = 0;
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel() = 0;
     virtual bool IsAudioChannelOpened() const = 0;
     virtual bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) = 0;
+    // Sends the packets in as few messages as the protocol allows, the packets are consumed
+    virtual bool SendAudioFrames(std::vector<std::unique_ptr<AudioStreamPacket>>& packets);
+    // Frames that fit into one audio message, more than 1 once the server accepted batching
+    virtual size_t max_audio_frames_per_message() const { return 1; }
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
     virtual void SendAbortSpeaking(AbortReason reason);
-    virtual void SendMcpMessage(const std::string& message);
+    // Takes the ownership of the payload tree
+    virtual void SendMcpMessage(cJSON* payload);
+    // Control messages go out as CBOR
+    bool cbor_enabled() const { return cbor_enabled_; }
+    // RTT probe, only sent if the server announced "ping" in its hello
+    virtual void SendPing();
 
 protected:
-    std::function<void(const cJSON* root)> on_incoming_json_;
+    std::function<void(const JsonMessage& message)> on_incoming_message_;
     std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
     std::function<void(const std::string& message)> on_network_error_;
     std::function<void()> on_connected_;
     std::function<void()> on_disconnected_;
+    std::function<void()> on_session_lost_;
 
     int server_sample_rate_ = 24000;
     int server_frame_duration_ = 60;
     bool error_occurred_ = false;
+    bool ping_supported_ = false;
+    // Control messages are CBOR encoded, set from the server hello
+    bool cbor_enabled_ = false;
     std::string session_id_;
+    // Reused for every text message from the server
+    JsonMessage incoming_message_;
+    // Reused for the CBOR encoding of outgoing messages, the transport header comes first
+    std::vector<uint8_t> cbor_buffer_;
+    size_t cbor_header_size_ = 0;
+    size_t max_cbor_payload_size_ = SIZE_MAX;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
+    std::string resume_session_id_;
+    std::chrono::time_point<std::chrono::steady_clock> resume_deadline_;
 
     virtual bool SendText(const std::string& text) = 0;
+    // Sends cbor_buffer_, the transport fills in its header
+    virtual bool SendCbor() = 0;
+    // A message with session_id and type, the caller deletes the tree
+    cJSON* CreateMessage(const char* type);
+    // Sends the tree in the encoding the server accepted
+    bool SendJson(const cJSON* root);
+    // Session resumption, the session id is sent in the next hello as the resume token
+    void KeepSessionForResume();
+    void DropResumableSession();
+    // Empty if there is nothing to resume or the grace period is over
+    std::string GetResumableSessionId() const;
+    // Called with the server hello, after session_id_ was updated. Returns false if a session was
+    // offered for resume and the server answered with another one
+    bool CompleteSessionResume();
+    void ParseServerFeatures(const cJSON* root);
+    // Parses a JSON or CBOR message into incoming_message_
+    bool ParseIncomingMessage(const char* data, size_t size, bool cbor);
+    static cJSON* ParseTree(const char* data, size_t size, bool cbor);
+    void HandlePong(const JsonMessage& message);
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
 };
@@ -3,8 +3,11 @@
 #include "system_info.h"
 #include "application.h"
 #include "settings.h"
+#include "connection_manager.h"
+#include "task_registry.h"
 
 #include <cstring>
+#include <algorithm>
 #include <cJSON.h>
 #include <esp_log.h>
 #include <arpa/inet.h>
@@ -14,9 +17,26 @@
 
 WebsocketProtocol::WebsocketProtocol() {
     event_group_handle_ = xEventGroupCreate();
+    cbor_header_size_ = sizeof(BinaryProtocol3);
+    max_cbor_payload_size_ = UINT16_MAX;
+
+    esp_timer_create_args_t resume_timer_args = {
+        .callback = [](void* arg) {
+            WebsocketProtocol* protocol = (WebsocketProtocol*)arg;
+            Application::GetInstance().Schedule([protocol]() {
+                protocol->ResumeAudioChannel();
+            });
+        },
+        .arg = this,
+    };
+    esp_timer_create(&resume_timer_args, &resume_timer_);
 }
 
 WebsocketProtocol::~WebsocketProtocol() {
+    if (resume_timer_ != nullptr) {
+        esp_timer_stop(resume_timer_);
+        esp_timer_delete(resume_timer_);
+    }
     vEventGroupDelete(event_group_handle_);
 }
 
@@ -26,39 +46,84 @@ bool WebsocketProtocol::Start() {
 }
 
 bool WebsocketProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
-    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+    if (IsConnectionBusy() || websocket_ == nullptr || !websocket_->IsConnected()) {
         return false;
     }
 
+    /* The header is written into the headroom right in front of the Opus data */
     if (version_ == 2) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol2) + packet->payload.size());
-        auto bp2 = (BinaryProtocol2*)serialized.data();
+        packet->ReserveHeadroom(sizeof(BinaryProtocol2));
+        auto bp2 = (BinaryProtocol2*)(packet->opus_data() - sizeof(BinaryProtocol2));
         bp2->version = htons(version_);
-        bp2->type = 0;
+        bp2->type = htons(BINARY_MESSAGE_TYPE_OPUS);
         bp2->reserved = 0;
         bp2->timestamp = htonl(packet->timestamp);
-        bp2->payload_size = htonl(packet->payload.size());
-        memcpy(bp2->payload, packet->payload.data(), packet->payload.size());
+        bp2->payload_size = htonl(packet->opus_size());
 
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+        NetworkQualityMonitor::GetInstance().OnAudioSent(sizeof(BinaryProtocol2) + packet->opus_size());
+        return websocket_->Send(bp2, sizeof(BinaryProtocol2) + packet->opus_size(), true);
+    } else if (version_ == 4) {
+        const size_t header_size = sizeof(BinaryProtocol4) + sizeof(BinaryProtocol4Frame);
+        packet->ReserveHeadroom(header_size);
+        auto bp4 = (BinaryProtocol4*)(packet->opus_data() - header_size);
+        auto frame = (BinaryProtocol4Frame*)bp4->payload;
+        bp4->type = BINARY_MESSAGE_TYPE_OPUS;
+        bp4->frame_count = 1;
+        bp4->payload_size = htons(sizeof(BinaryProtocol4Frame) + packet->opus_size());
+        frame->timestamp = htonl(packet->timestamp);
+        frame->size = htons(packet->opus_size());
+
+        NetworkQualityMonitor::GetInstance().OnAudioSent(header_size + packet->opus_size());
+        return websocket_->Send(bp4, header_size + packet->opus_size(), true);
     } else if (version_ == 3) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol3) + packet->payload.size());
-        auto bp3 = (BinaryProtocol3*)serialized.data();
-        bp3->type = 0;
+        packet->ReserveHeadroom(sizeof(BinaryProtocol3));
+        auto bp3 = (BinaryProtocol3*)(packet->opus_data() - sizeof(BinaryProtocol3));
+        bp3->type = BINARY_MESSAGE_TYPE_OPUS;
         bp3->reserved = 0;
-        bp3->payload_size = htons(packet->payload.size());
-        memcpy(bp3->payload, packet->payload.data(), packet->payload.size());
+        bp3->payload_size = htons(packet->opus_size());
 
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+        NetworkQualityMonitor::GetInstance().OnAudioSent(sizeof(BinaryProtocol3) + packet->opus_size());
+        return websocket_->Send(bp3, sizeof(BinaryProtocol3) + packet->opus_size(), true);
     } else {
-        return websocket_->Send(packet->payload.data(), packet->payload.size(), true);
+        NetworkQualityMonitor::GetInstance().OnAudioSent(packet->opus_size());
+        return websocket_->Send(packet->opus_data(), packet->opus_size(), true);
     }
 }
 
-bool WebsocketProtocol::SendText(const std::string& text) {
+bool WebsocketProtocol::SendAudioFrames(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) {
+    if (IsConnectionBusy()) {
+        packets.clear();
+        return false;
+    }
+    // A single frame goes out in place through SendAudio, only a backlog is packed into one message
+    if (version_ != 4 || packets.size() <= 1) {
+        return Protocol::SendAudioFrames(packets);
+    }
     if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        packets.clear();
+        return false;
+    }
+
+    batch_buffer_.resize(sizeof(BinaryProtocol4));
+    for (auto& packet : packets) {
+        size_t offset = batch_buffer_.size();
+        batch_buffer_.resize(offset + sizeof(BinaryProtocol4Frame) + packet->opus_size());
+        auto frame = (BinaryProtocol4Frame*)(batch_buffer_.data() + offset);
+        frame->timestamp = htonl(packet->timestamp);
+        frame->size = htons(packet->opus_size());
+        memcpy(frame->data, packet->opus_data(), packet->opus_size());
+    }
+    auto bp4 = (BinaryProtocol4*)batch_buffer_.data();
+    bp4->type = BINARY_MESSAGE_TYPE_OPUS;
+    bp4->frame_count = packets.size();
+    bp4->payload_size = htons(batch_buffer_.size() - sizeof(BinaryProtocol4));
+    packets.clear();
+    NetworkQualityMonitor::GetInstance().OnAudioSent(batch_buffer_.size());
+    return websocket_->Send(batch_buffer_.data(), batch_buffer_.size(), true);
+}
+
+bool WebsocketProtocol::SendText(const std::string& text) {
+    if (IsConnectionBusy() || websocket_ == nullptr || !websocket_->IsConnected()) {
         return false;
     }
 
@@ -71,27 +136,128 @@ bool WebsocketProtocol::SendText(const std::string& text) {
     return true;
 }
 
+bool WebsocketProtocol::SendCbor() {
+    if (IsConnectionBusy() || websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
+
+    auto bp3 = (BinaryProtocol3*)cbor_buffer_.data();
+    bp3->type = BINARY_MESSAGE_TYPE_CBOR;
+    bp3->reserved = 0;
+    bp3->payload_size = htons(cbor_buffer_.size() - sizeof(BinaryProtocol3));
+    if (!websocket_->Send(cbor_buffer_.data(), cbor_buffer_.size(), true)) {
+        ESP_LOGE(TAG, "Failed to send CBOR message, %u bytes", cbor_buffer_.size());
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+
+    return true;
+}
+
 bool WebsocketProtocol::IsAudioChannelOpened() const {
-    return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
+    return !IsConnectionBusy() && websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
 }
 
 void WebsocketProtocol::CloseAudioChannel() {
+    esp_timer_stop(resume_timer_);
+    if (resume_task_ != nullptr) {
+        // The attempt owns the connection until it is done, the channel is closed then
+        resume_cancelled_ = true;
+        return;
+    }
+    DropResumableSession();
+    if (resume_pending_) {
+        // The connection is already gone, so the close is reported here
+        websocket_.reset();
+        resume_pending_ = false;
+        if (on_audio_channel_closed_ != nullptr) {
+            on_audio_channel_closed_();
+        }
+        return;
+    }
+
+    closing_ = true;
     websocket_.reset();
+    closing_ = false;
+}
+
+// Runs in the main loop. Each attempt blocks on the connect and the server hello, so it runs in its own
+// task and posts the result back, until the session is back or the grace period is over
+void WebsocketProtocol::ResumeAudioChannel() {
+    if (!resume_pending_ || resume_task_ != nullptr) {
+        return;
+    }
+    if (GetResumableSessionId().empty()) {
+        ESP_LOGW(TAG, "Failed to resume session within %d seconds", PROTOCOL_SESSION_RESUME_MS / 1000);
+        DropResumableSession();
+        websocket_.reset();
+        resume_pending_ = false;
+        if (on_audio_channel_closed_ != nullptr) {
+            on_audio_channel_closed_();
+        }
+        return;
+    }
+
+    ESP_LOGI(TAG, "Resuming session %s", resume_session_id_.c_str());
+    bool created = TaskRegistry::GetInstance().Create(kTaskSessionResume, [](void* arg) {
+        auto protocol = (WebsocketProtocol*)arg;
+        bool opened = protocol->OpenAudioChannel();
+        Application::GetInstance().Schedule([protocol, opened]() {
+            protocol->OnResumeAttemptDone(opened);
+        });
+        vTaskDelete(NULL);
+    }, this, &resume_task_);
+    if (!created) {
+        ESP_LOGE(TAG, "Failed to create the resume task");
+        resume_task_ = nullptr;
+        OnResumeAttemptDone(false);
+    }
+}
+
+// Runs in the main loop
+void WebsocketProtocol::OnResumeAttemptDone(bool opened) {
+    resume_task_ = nullptr;
+    if (resume_cancelled_) {
+        resume_cancelled_ = false;
+        CloseAudioChannel();
+        return;
+    }
+    if (opened) {
+        resume_pending_ = false;
+        return;
+    }
+    ESP_LOGI(TAG, "Next resume attempt in %d ms", resume_retry_ms_);
+    esp_timer_start_once(resume_timer_, resume_retry_ms_ * 1000);
+    resume_retry_ms_ = std::min(resume_retry_ms_ * 2, WEBSOCKET_RESUME_MAX_RETRY_MS);
+}
+
+// While an attempt runs, the main loop finds the channel closed instead of racing the attempt for the connection
+bool WebsocketProtocol::IsConnectionBusy() const {
+    return resume_task_ != nullptr && xTaskGetCurrentTaskHandle() != resume_task_;
+}
+
+void WebsocketProtocol::SetError(const std::string& message) {
+    // Errors while resuming are retried silently, the conversation is only ended when the grace period is over
+    if (resume_pending_) {
+        ESP_LOGW(TAG, "Resume attempt failed: %s", message.c_str());
+        return;
+    }
+    Protocol::SetError(message);
 }
 
 bool WebsocketProtocol::OpenAudioChannel() {
     Settings settings("websocket", false);
     std::string url = settings.GetString("url");
     std::string token = settings.GetString("token");
-    int version = settings.GetInt("version");
-    if (version != 0) {
-        version_ = version;
-    }
+    // Version 4 is only used when the server accepts it in this session's hello
+    version_ = settings.GetInt("version", 1);
 
     error_occurred_ = false;
+    // The hello is always JSON, CBOR is only used once the server accepted it
+    cbor_enabled_ = false;
 
-    auto network = Board::GetInstance().GetNetwork();
-    websocket_ = network->CreateWebSocket(1);
+    auto& connections = ConnectionManager::GetInstance();
+    websocket_ = connections.CreateWebSocket(url);
     if (websocket_ == nullptr) {
         ESP_LOGE(TAG, "Failed to create websocket");
         return false;
@@ -109,70 +275,45 @@ bool WebsocketProtocol::OpenAudioChannel() {
     websocket_->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
 
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
-        if (binary) {
-            if (on_incoming_audio_ != nullptr) {
-                if (version_ == 2) {
-                    BinaryProtocol2* bp2 = (BinaryProtocol2*)data;
-                    bp2->version = ntohs(bp2->version);
-                    bp2->type = ntohs(bp2->type);
-                    bp2->timestamp = ntohl(bp2->timestamp);
-                    bp2->payload_size = ntohl(bp2->payload_size);
-                    auto payload = (uint8_t*)bp2->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = bp2->timestamp,
-                        .payload = std::vector<uint8_t>(payload, payload + bp2->payload_size)
-                    }));
-                } else if (version_ == 3) {
-                    BinaryProtocol3* bp3 = (BinaryProtocol3*)data;
-                    bp3->type = bp3->type;
-                    bp3->payload_size = ntohs(bp3->payload_size);
-                    auto payload = (uint8_t*)bp3->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>(payload, payload + bp3->payload_size)
-                    }));
-                } else {
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len)
-                    }));
-                }
-            }
-        } else {
-            // Parse JSON data
-            auto root = cJSON_Parse(data);
-            auto type = cJSON_GetObjectItem(root, "type");
-            if (cJSON_IsString(type)) {
-                if (strcmp(type->valuestring, "hello") == 0) {
-                    ParseServerHello(root);
-                } else {
-                    if (on_incoming_json_ != nullptr) {
-                        on_incoming_json_(root);
-                    }
-                }
+        if (!binary) {
+            HandleMessage(data, len, false);
+        } else if (cbor_enabled_ && len > 0 && data[0] == BINARY_MESSAGE_TYPE_CBOR) {
+            auto bp3 = (const BinaryProtocol3*)data;
+            if (len < sizeof(BinaryProtocol3) || sizeof(BinaryProtocol3) + ntohs(bp3->payload_size) > len) {
+                ESP_LOGE(TAG, "Invalid CBOR message size: %u", len);
             } else {
-                ESP_LOGE(TAG, "Missing message type, data: %s", data);
+                HandleMessage((const char*)bp3->payload, ntohs(bp3->payload_size), true);
             }
-            cJSON_Delete(root);
+        } else if (on_incoming_audio_ != nullptr) {
+            ParseAudioMessage((const uint8_t*)data, len);
         }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     websocket_->OnDisconnected([this]() {
         ESP_LOGI(TAG, "Websocket disconnected");
+        if (closing_ || resume_pending_) {
+            if (closing_ && on_audio_channel_closed_ != nullptr) {
+                on_audio_channel_closed_();
+            }
+            return;
+        }
+        // A drop in the middle of a conversation is resumed, instead of going back to idle
+        auto state = Application::GetInstance().GetDeviceState();
+        if (!session_id_.empty() && (state == kDeviceStateListening || state == kDeviceStateSpeaking)) {
+            KeepSessionForResume();
+            resume_pending_ = true;
+            resume_retry_ms_ = WEBSOCKET_RESUME_RETRY_MS;
+            esp_timer_start_once(resume_timer_, WEBSOCKET_RESUME_FIRST_RETRY_MS * 1000);
+            return;
+        }
         if (on_audio_channel_closed_ != nullptr) {
             on_audio_channel_closed_();
         }
     });
 
     ESP_LOGI(TAG, "Connecting to websocket server: %s with version: %d", url.c_str(), version_);
-    if (!websocket_->Connect(url.c_str())) {
+    if (!connections.ConnectWebSocket(websocket_.get(), url)) {
         ESP_LOGE(TAG, "Failed to connect to websocket server");
         SetError(Lang::Strings::SERVER_NOT_CONNECTED);
         return false;
@@ -185,7 +326,8 @@ bool WebsocketProtocol::OpenAudioChannel() {
     }
 
     // Wait for server hello
-    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
+    int hello_timeout_ms = resume_pending_ ? WEBSOCKET_RESUME_HELLO_TIMEOUT_MS : 10000;
+    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(hello_timeout_ms));
     if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
         ESP_LOGE(TAG, "Failed to receive server hello");
         SetError(Lang::Strings::SERVER_TIMEOUT);
@@ -199,16 +341,49 @@ bool WebsocketProtocol::OpenAudioChannel() {
     return true;
 }
 
+void WebsocketProtocol::HandleMessage(const char* data, size_t len, bool cbor) {
+    if (!ParseIncomingMessage(data, len, cbor)) {
+        return;
+    }
+    if (incoming_message_.type() == "hello") {
+        auto root = ParseTree(data, len, cbor);
+        ParseServerHello(root);
+        cJSON_Delete(root);
+    } else if (incoming_message_.type() == "pong") {
+        HandlePong(incoming_message_);
+    } else if (incoming_message_.type().empty()) {
+        ESP_LOGE(TAG, "Missing message type, size: %u", len);
+    } else if (on_incoming_message_ != nullptr) {
+        on_incoming_message_(incoming_message_);
+    }
+}
+
 std::string WebsocketProtocol::GetHelloMessage() {
     // keys: message type, version, audio_params (format, sample_rate, channels)
     cJSON* root = cJSON_CreateObject();
     cJSON_AddStringToObject(root, "type", "hello");
     cJSON_AddNumberToObject(root, "version", version_);
+    // The previous session id is the resume token, the server answers with the same id if it resumed it
+    auto resume_session_id = GetResumableSessionId();
+    if (!resume_session_id.empty()) {
+        cJSON_AddStringToObject(root, "session_id", resume_session_id.c_str());
+    }
     cJSON* features = cJSON_CreateObject();
 #if CONFIG_USE_SERVER_AEC
     cJSON_AddBoolToObject(features, "aec", true);
+    int aec_delay_ms = Application::GetInstance().GetAudioService().GetAecDelayMs();
+    if (aec_delay_ms > 0) {
+        cJSON_AddNumberToObject(features, "aec_delay_ms", aec_delay_ms);
+    }
 #endif
     cJSON_AddBoolToObject(features, "mcp", true);
+    cJSON_AddBoolToObject(features, "ping", true);
+    // Offer protocol version 4, the server answers with "version": 4 to accept it
+    cJSON_AddNumberToObject(features, "audio_batch", WEBSOCKET_MAX_AUDIO_FRAMES);
+    // CBOR control messages share the binary frames with the audio, they need the one byte message type of version 3 and 4
+    if (version_ >= 3) {
+        cJSON_AddBoolToObject(features, "cbor", true);
+    }
     cJSON_AddItemToObject(root, "features", features);
     cJSON_AddStringToObject(root, "transport", "websocket");
     cJSON* audio_params = cJSON_CreateObject();
@@ -236,6 +411,20 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
         session_id_ = session_id->valuestring;
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
+    // The device is still listening or speaking in the old session, which the server no longer knows
+    if (!CompleteSessionResume() && resume_pending_ && on_session_lost_ != nullptr) {
+        on_session_lost_();
+    }
+    ParseServerFeatures(root);
+    if (version_ < 3) {
+        cbor_enabled_ = false;
+    }
+
+    auto version = cJSON_GetObjectItem(root, "version");
+    if (cJSON_IsNumber(version) && version->valueint == 4) {
+        ESP_LOGI(TAG, "Server accepted audio batching, using protocol version 4");
+        version_ = 4;
+    }
 
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
     if (cJSON_IsObject(audio_params)) {
@@ -251,3 +440,68 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
 
     xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
 }
+
+// The header is read without touching the transport buffer, only the Opus data is copied,
+// into pooled packets
+void WebsocketProtocol::ParseAudioMessage(const uint8_t* data, size_t len) {
+    auto& pool = AudioPacketPool::GetInstance();
+    if (version_ == 4) {
+        auto bp4 = (const BinaryProtocol4*)data;
+        if (len < sizeof(BinaryProtocol4) || sizeof(BinaryProtocol4) + ntohs(bp4->payload_size) > len) {
+            ESP_LOGE(TAG, "Invalid audio packet size: %u", len);
+            return;
+        }
+        NetworkQualityMonitor::GetInstance().OnAudioReceived(len, bp4->frame_count, server_frame_duration_);
+        const uint8_t* frame_data = bp4->payload;
+        const uint8_t* end = frame_data + ntohs(bp4->payload_size);
+        for (int i = 0; i < bp4->frame_count; i++) {
+            auto frame = (const BinaryProtocol4Frame*)frame_data;
+            if (frame_data + sizeof(BinaryProtocol4Frame) > end || frame->data + ntohs(frame->size) > end) {
+                ESP_LOGE(TAG, "Invalid audio frame %d of %d", i, bp4->frame_count);
+                return;
+            }
+            size_t size = ntohs(frame->size);
+            auto packet = pool.Acquire(size);
+            packet->sample_rate = server_sample_rate_;
+            packet->frame_duration = server_frame_duration_;
+            packet->timestamp = ntohl(frame->timestamp);
+            memcpy(packet->payload.data(), frame->data, size);
+            on_incoming_audio_(std::move(packet));
+            frame_data = frame->data + size;
+        }
+        return;
+    }
+
+    NetworkQualityMonitor::GetInstance().OnAudioReceived(len, 1, server_frame_duration_);
+    uint32_t timestamp = 0;
+    size_t payload_offset = 0;
+    size_t payload_size = len;
+    if (version_ == 2) {
+        auto bp2 = (const BinaryProtocol2*)data;
+        if (len < sizeof(BinaryProtocol2)) {
+            ESP_LOGE(TAG, "Invalid audio packet size: %u", len);
+            return;
+        }
+        timestamp = ntohl(bp2->timestamp);
+        payload_offset = sizeof(BinaryProtocol2);
+        payload_size = ntohl(bp2->payload_size);
+    } else if (version_ == 3) {
+        auto bp3 = (const BinaryProtocol3*)data;
+        if (len < sizeof(BinaryProtocol3)) {
+            ESP_LOGE(TAG, "Invalid audio packet size: %u", len);
+            return;
+        }
+        payload_offset = sizeof(BinaryProtocol3);
+        payload_size = ntohs(bp3->payload_size);
+    }
+    if (payload_offset + payload_size > len) {
+        ESP_LOGE(TAG, "Invalid audio payload size: %u, packet size: %u", payload_size, len);
+        return;
+    }
+    auto packet = pool.Acquire(payload_size);
+    packet->sample_rate = server_sample_rate_;
+    packet->frame_duration = server_frame_duration_;
+    packet->timestamp = timestamp;
+    memcpy(packet->payload.data(), data + payload_offset, payload_size);
+    on_incoming_audio_(std::move(packet));
+}
@@ -7,8 +7,18 @@
 #include <web_socket.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
 
 #define WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
+// Frames per message with protocol version 4, a backlog after a stall is sent in batches of this size
+#define WEBSOCKET_MAX_AUDIO_FRAMES 8
+// Reconnect attempts after the connection dropped in the middle of a conversation
+#define WEBSOCKET_RESUME_FIRST_RETRY_MS 200
+// Every attempt costs a connect and a hello, so the later ones are spaced out, doubling each time
+#define WEBSOCKET_RESUME_RETRY_MS 1000
+#define WEBSOCKET_RESUME_MAX_RETRY_MS 8000
+#define WEBSOCKET_RESUME_HELLO_TIMEOUT_MS 3000
 
 class WebsocketProtocol : public Protocol {
 public:
@@ -17,6 +27,8 @@ public:
 
     bool Start() override;
     bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    bool SendAudioFrames(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) override;
+    size_t max_audio_frames_per_message() const override { return version_ == 4 ? WEBSOCKET_MAX_AUDIO_FRAMES : 1; }
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
@@ -25,9 +37,24 @@ private:
     EventGroupHandle_t event_group_handle_;
     std::unique_ptr<WebSocket> websocket_;
     int version_ = 1;
+    std::vector<uint8_t> batch_buffer_;
+    esp_timer_handle_t resume_timer_ = nullptr;
+    volatile bool resume_pending_ = false;
+    // The task of the running resume attempt, it alone uses the connection until the attempt is done
+    TaskHandle_t resume_task_ = nullptr;
+    bool resume_cancelled_ = false;
+    int resume_retry_ms_ = WEBSOCKET_RESUME_RETRY_MS;
+    volatile bool closing_ = false;
 
     void ParseServerHello(const cJSON* root);
+    void ParseAudioMessage(const uint8_t* data, size_t len);
+    void HandleMessage(const char* data, size_t len, bool cbor);
     bool SendText(const std::string& text) override;
+    bool SendCbor() override;
+    void SetError(const std::string& message) override;
+    void ResumeAudioChannel();
+    void OnResumeAttemptDone(bool opened);
+    bool IsConnectionBusy() const;
     std::string GetHelloMessage();
 };
 
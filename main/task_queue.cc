@@ -0,0 +1,199 @@
+#include "task_queue.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <algorithm>
+#include <cassert>
+
+#define TAG "TaskQueue"
+
+void StallDetector::Begin(const char* name, const void* origin) {
+    name_.store(name, std::memory_order_relaxed);
+    origin_.store(origin, std::memory_order_relaxed);
+    reported_.store(false, std::memory_order_relaxed);
+    started_us_.store(esp_timer_get_time(), std::memory_order_release);
+}
+
+int64_t StallDetector::End() {
+    int64_t started_us = started_us_.exchange(0, std::memory_order_acq_rel);
+    int64_t elapsed_us = esp_timer_get_time() - started_us;
+    if (elapsed_us >= (int64_t)threshold_ms_ * 1000) {
+        stall_count_++;
+        ESP_LOGW(TAG, "Main loop blocked %lld ms by %s (queued from %p)", elapsed_us / 1000,
+            name_.load(std::memory_order_relaxed), origin_.load(std::memory_order_relaxed));
+    }
+    return elapsed_us;
+}
+
+void StallDetector::Check() {
+    int64_t started_us = started_us_.load(std::memory_order_acquire);
+    if (started_us == 0 || reported_.load(std::memory_order_relaxed)) {
+        return;
+    }
+    auto name = name_.load(std::memory_order_relaxed);
+    auto origin = origin_.load(std::memory_order_relaxed);
+    // The work may have ended and the next one started while reading
+    if (started_us_.load(std::memory_order_acquire) != started_us) {
+        return;
+    }
+    int64_t elapsed_us = esp_timer_get_time() - started_us;
+    if (elapsed_us >= (int64_t)threshold_ms_ * 1000) {
+        reported_.store(true, std::memory_order_relaxed);
+        ESP_LOGW(TAG, "Main loop busy for %lld ms in %s (queued from %p)", elapsed_us / 1000, name, origin);
+    }
+}
+
+TaskQueue::TaskQueue(const char* name, size_t capacity)
+    : name_(name), mask_(capacity - 1), slots_(new Slot[capacity]) {
+    assert((capacity & (capacity - 1)) == 0);
+    for (size_t i = 0; i < capacity; i++) {
+        slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+void TaskQueue::Push(ScheduledTask& task, const void* origin) {
+    if (task.on_heap()) {
+        heap_tasks_.fetch_add(1, std::memory_order_relaxed);
+        ESP_LOGD(TAG, "%s: task queued from %p does not fit in place", name_, origin);
+    }
+    // Once tasks overflowed, later ones queue behind them until the main loop caught up
+    if (overflow_size_.load(std::memory_order_acquire) == 0 && PushToRing(task, origin)) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(overflow_mutex_);
+    overflow_.push_back({ esp_timer_get_time(), origin, std::move(task) });
+    overflow_size_.store(overflow_.size(), std::memory_order_release);
+    if (overflowed_.fetch_add(1, std::memory_order_relaxed) == 0) {
+        ESP_LOGW(TAG, "%s: queue full, task from %p goes to the overflow list", name_, origin);
+    }
+}
+
+// Returns false if the ring is full, the task is left untouched then
+bool TaskQueue::PushToRing(ScheduledTask& task, const void* origin) {
+    uint32_t position = tail_.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &slots_[position & mask_];
+        uint32_t sequence = slot->sequence.load(std::memory_order_acquire);
+        int32_t diff = (int32_t)(sequence - position);
+        if (diff == 0) {
+            // The slot is free, claim it
+            if (tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The slot still holds the task of the previous round
+            return false;
+        } else {
+            position = tail_.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->queued_us = esp_timer_get_time();
+    slot->origin = origin;
+    slot->task = std::move(task);
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    uint32_t depth = position + 1 - head_.load(std::memory_order_relaxed);
+    uint32_t max_depth = max_depth_.load(std::memory_order_relaxed);
+    while (depth > max_depth && !max_depth_.compare_exchange_weak(max_depth, depth, std::memory_order_relaxed)) {
+    }
+    return true;
+}
+
+bool TaskQueue::RunNext(StallDetector& stall_detector) {
+    uint32_t position = head_.load(std::memory_order_relaxed);
+    Slot& slot = slots_[position & mask_];
+    if (slot.sequence.load(std::memory_order_acquire) == position + 1) {
+        auto task = std::move(slot.task);
+        int64_t queued_us = slot.queued_us;
+        const void* origin = slot.origin;
+        // Hand the slot back to the producers before running, the task may schedule more
+        slot.sequence.store(position + mask_ + 1, std::memory_order_release);
+        head_.store(position + 1, std::memory_order_relaxed);
+        Run(task, queued_us, origin, stall_detector);
+        return true;
+    }
+
+    // The ring is empty, the overflow list holds the newer tasks
+    if (overflow_size_.load(std::memory_order_acquire) == 0) {
+        return false;
+    }
+    OverflowTask next;
+    {
+        std::lock_guard<std::mutex> lock(overflow_mutex_);
+        next = std::move(overflow_.front());
+        overflow_.pop_front();
+        overflow_size_.store(overflow_.size(), std::memory_order_release);
+    }
+    Run(next.task, next.queued_us, next.origin, stall_detector);
+    return true;
+}
+
+void TaskQueue::Run(ScheduledTask& task, int64_t queued_us, const void* origin, StallDetector& stall_detector) {
+    stall_detector.Begin(name_, origin);
+    uint32_t wait_ms = (esp_timer_get_time() - queued_us) / 1000;
+    task();
+    task.Reset();
+    int64_t run_us = stall_detector.End();
+
+    stats_.run++;
+    stats_.total_run_us += run_us;
+    if (wait_ms > stats_.max_wait_ms) {
+        stats_.max_wait_ms = wait_ms;
+    }
+    if (run_us / 1000 > stats_.max_run_ms) {
+        stats_.max_run_ms = run_us / 1000;
+    }
+    RecordOrigin(origin, run_us);
+}
+
+void TaskQueue::RecordOrigin(const void* origin, int64_t run_us) {
+    size_t index = 0;
+    while (index < origin_count_ && origin_stats_[index].origin != origin) {
+        index++;
+    }
+    if (index == origin_count_) {
+        if (origin_count_ == TASK_QUEUE_ORIGIN_SLOTS) {
+            index = TASK_QUEUE_ORIGIN_SLOTS - 1;
+        } else {
+            // The last entry is shared by all further addresses
+            origin_stats_[index].origin = index < TASK_QUEUE_ORIGIN_SLOTS - 1 ? origin : nullptr;
+            origin_count_++;
+        }
+    }
+    auto& entry = origin_stats_[index];
+    entry.run++;
+    entry.total_run_us += run_us;
+    if (run_us / 1000 > entry.max_run_ms) {
+        entry.max_run_ms = run_us / 1000;
+    }
+}
+
+bool TaskQueue::Empty() const {
+    uint32_t position = head_.load(std::memory_order_relaxed);
+    return slots_[position & mask_].sequence.load(std::memory_order_acquire) != position + 1 &&
+        overflow_size_.load(std::memory_order_acquire) == 0;
+}
+
+TaskQueueStats TaskQueue::stats() const {
+    TaskQueueStats stats = stats_;
+    stats.max_depth = max_depth_.load(std::memory_order_relaxed);
+    stats.heap_tasks = heap_tasks_.load(std::memory_order_relaxed);
+    stats.overflowed = overflowed_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+size_t TaskQueue::GetOriginStats(TaskOriginStats* stats, size_t max_count) const {
+    TaskOriginStats sorted[TASK_QUEUE_ORIGIN_SLOTS];
+    size_t count = origin_count_;
+    std::copy(origin_stats_, origin_stats_ + count, sorted);
+    std::sort(sorted, sorted + count, [](const TaskOriginStats& a, const TaskOriginStats& b) {
+        return a.total_run_us > b.total_run_us;
+    });
+    count = std::min(count, max_count);
+    std::copy(sorted, sorted + count, stats);
+    return count;
+}
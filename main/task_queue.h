@@ -0,0 +1,230 @@
+#ifndef TASK_QUEUE_H
+#define TASK_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Captures up to this size are stored in the queue slot, larger ones are allocated on the heap.
+// Fits `this`, two pointers and a std::string
+#define SCHEDULED_TASK_INLINE_SIZE 32
+
+/*
+ * A move-only void() callable that keeps small captures in place instead of allocating like
+ * std::function does for anything larger than two pointers.
+ */
+class ScheduledTask {
+public:
+    ScheduledTask() = default;
+
+    template <typename Callable, typename Function = std::decay_t<Callable>,
+        typename = std::enable_if_t<!std::is_same_v<Function, ScheduledTask>>>
+    ScheduledTask(Callable&& callable) {
+        if constexpr (sizeof(Function) <= SCHEDULED_TASK_INLINE_SIZE && alignof(Function) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible_v<Function>) {
+            new (storage_) Function(std::forward<Callable>(callable));
+            ops_ = &InlineOps<Function>::ops;
+        } else {
+            *reinterpret_cast<Function**>(storage_) = new Function(std::forward<Callable>(callable));
+            ops_ = &HeapOps<Function>::ops;
+        }
+    }
+
+    ScheduledTask(ScheduledTask&& other) noexcept {
+        MoveFrom(other);
+    }
+
+    ScheduledTask& operator=(ScheduledTask&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+
+    ScheduledTask(const ScheduledTask&) = delete;
+    ScheduledTask& operator=(const ScheduledTask&) = delete;
+
+    ~ScheduledTask() {
+        Reset();
+    }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+    bool on_heap() const { return ops_ != nullptr && ops_->on_heap; }
+
+    void operator()() {
+        ops_->invoke(storage_);
+    }
+
+    void Reset() {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* to, void* from);     // Move constructs into `to` and destroys `from`
+        void (*destroy)(void* storage);
+        bool on_heap;
+    };
+
+    template <typename Function>
+    struct InlineOps {
+        static constexpr Ops ops = {
+            [](void* storage) { (*static_cast<Function*>(storage))(); },
+            [](void* to, void* from) {
+                new (to) Function(std::move(*static_cast<Function*>(from)));
+                static_cast<Function*>(from)->~Function();
+            },
+            [](void* storage) { static_cast<Function*>(storage)->~Function(); },
+            false,
+        };
+    };
+
+    template <typename Function>
+    struct HeapOps {
+        static constexpr Ops ops = {
+            [](void* storage) { (**static_cast<Function**>(storage))(); },
+            [](void* to, void* from) { *static_cast<Function**>(to) = *static_cast<Function**>(from); },
+            [](void* storage) { delete *static_cast<Function**>(storage); },
+            true,
+        };
+    };
+
+    void MoveFrom(ScheduledTask& other) {
+        if (other.ops_ != nullptr) {
+            other.ops_->move(storage_, other.storage_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage_[SCHEDULED_TASK_INLINE_SIZE];
+    const Ops* ops_ = nullptr;
+};
+
+/*
+ * Tracks the work the main loop is busy with. Work that takes longer than the threshold is logged
+ * when it ends, and Check() reports work that is still running from another task, so a loop that
+ * hangs in a network call shows up while it hangs.
+ */
+class StallDetector {
+public:
+    explicit StallDetector(uint32_t threshold_ms) : threshold_ms_(threshold_ms) {}
+
+    // `origin` is the code address that queued the work, or nullptr
+    void Begin(const char* name, const void* origin);
+    // Returns how long the work ran, in us
+    int64_t End();
+    void Check();
+
+    uint32_t stall_count() const { return stall_count_; }
+
+    class Scope {
+    public:
+        Scope(StallDetector& detector, const char* name) : detector_(detector) { detector_.Begin(name, nullptr); }
+        ~Scope() { detector_.End(); }
+    private:
+        StallDetector& detector_;
+    };
+
+private:
+    const uint32_t threshold_ms_;
+    std::atomic<int64_t> started_us_ = 0;     // 0 while idle
+    std::atomic<const char*> name_ = nullptr;
+    std::atomic<const void*> origin_ = nullptr;
+    std::atomic<bool> reported_ = false;
+    uint32_t stall_count_ = 0;
+};
+
+struct TaskQueueStats {
+    uint32_t run = 0;
+    uint32_t max_depth = 0;
+    uint32_t max_wait_ms = 0;       // Longest time a task waited in the queue
+    uint32_t max_run_ms = 0;        // Longest time a task ran
+    uint64_t total_run_us = 0;
+    uint32_t heap_tasks = 0;        // Tasks whose captures did not fit in place
+    uint32_t overflowed = 0;        // Tasks that found the ring full and went to the overflow list
+};
+
+// Code addresses that queued tasks, tracked separately. Tasks from further addresses share the last entry
+#define TASK_QUEUE_ORIGIN_SLOTS 16
+
+struct TaskOriginStats {
+    const void* origin = nullptr;   // nullptr for the shared entry
+    uint32_t run = 0;
+    uint32_t max_run_ms = 0;
+    uint64_t total_run_us = 0;
+};
+
+/*
+ * Multi-producer, single-consumer queue of scheduled tasks. Producers claim a slot of the ring with a
+ * compare-and-swap on the tail and publish it with the slot sequence, so pushing takes no lock and
+ * does not allocate. When the ring is full the tasks go to an overflow list under a mutex, and keep
+ * going there until the main loop emptied it, so no task is lost and the order is kept.
+ * Only the main loop pops.
+ */
+class TaskQueue {
+public:
+    // `capacity` must be a power of two
+    TaskQueue(const char* name, size_t capacity);
+    TaskQueue(const TaskQueue&) = delete;
+    TaskQueue& operator=(const TaskQueue&) = delete;
+
+    void Push(ScheduledTask& task, const void* origin);
+    // Runs the oldest task, returns false if the queue was empty
+    bool RunNext(StallDetector& stall_detector);
+    bool Empty() const;
+
+    const char* name() const { return name_; }
+    TaskQueueStats stats() const;
+    // Copies up to `max_count` entries, those with the longest total run time first. Returns the count
+    size_t GetOriginStats(TaskOriginStats* stats, size_t max_count) const;
+
+private:
+    struct Slot {
+        std::atomic<uint32_t> sequence;
+        int64_t queued_us;
+        const void* origin;
+        ScheduledTask task;
+    };
+
+    struct OverflowTask {
+        int64_t queued_us;
+        const void* origin;
+        ScheduledTask task;
+    };
+
+    const char* name_;
+    const uint32_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<uint32_t> tail_ = 0;    // Next slot to claim by the producers
+    std::atomic<uint32_t> head_ = 0;    // Next slot to run by the consumer
+    // Counted by the producers
+    std::atomic<uint32_t> max_depth_ = 0;
+    std::atomic<uint32_t> heap_tasks_ = 0;
+    std::atomic<uint32_t> overflowed_ = 0;
+    std::mutex overflow_mutex_;
+    std::deque<OverflowTask> overflow_;
+    // Non-zero while the overflow list holds tasks, read without the mutex
+    std::atomic<uint32_t> overflow_size_ = 0;
+    // Counted by the consumer
+    TaskQueueStats stats_;
+    TaskOriginStats origin_stats_[TASK_QUEUE_ORIGIN_SLOTS];
+    size_t origin_count_ = 0;
+
+    bool PushToRing(ScheduledTask& task, const void* origin);
+    void Run(ScheduledTask& task, int64_t queued_us, const void* origin, StallDetector& stall_detector);
+    void RecordOrigin(const void* origin, int64_t run_us);
+};
+
+#endif // TASK_QUEUE_H
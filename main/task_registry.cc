@@ -0,0 +1,169 @@
+#include "task_registry.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#define TAG "TaskRegistry"
+
+// Headroom over the measured use when suggesting a stack size
+#define TASK_STACK_MARGIN 512
+
+static constexpr TaskConfig kDefaultConfigs[kTaskCount] = {
+#if CONFIG_USE_AUDIO_PROCESSOR
+    { "audio_input", 2048 * 3, 8, 1, MALLOC_CAP_INTERNAL },
+    { "audio_output", 2048 * 2, 3, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+#else
+    { "audio_input", 2048 * 2, 8, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+    { "audio_output", 2048, 3, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+#endif
+    { "opus_codec", 2048 * 13, 2, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+    { "audio_communication", 4096, 3, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+    { "audio_detection", 4096, 3, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+    { "encode_wake_word", 4096 * 7, 2, tskNO_AFFINITY, MALLOC_CAP_SPIRAM },
+    { "calibration_probe", 2048 * 2, 8, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+    { "acoustic_calibration", 2048 * 2, 2, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+    { "check_version", 4096 * 2, 2, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+    { "session_resume", 4096 * 2, 3, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+    { "memo_writer", 2048 * 2, 2, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+    { "memo_player", 2048 * 2, 2, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+#if CONFIG_MCP_TOOL_STACK_IN_PSRAM
+    { "tool_call", 1024 * 8, 1, tskNO_AFFINITY, MALLOC_CAP_SPIRAM },
+#else
+    { "tool_call", 1024 * 8, 1, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+#endif
+    // Below the audio tasks, so a long servo move cannot starve the microphone
+    { "robot_action", 1024 * 4, 5, tskNO_AFFINITY, MALLOC_CAP_INTERNAL },
+};
+
+TaskRegistry::TaskRegistry() {
+    memcpy(configs_, kDefaultConfigs, sizeof(configs_));
+}
+
+void TaskRegistry::Override(TaskId id, uint32_t stack_size, UBaseType_t priority, BaseType_t core) {
+    auto& config = configs_[id];
+    ESP_LOGI(TAG, "%s: stack %lu -> %lu, priority %u -> %u, core %d -> %d", config.name,
+        config.stack_size, stack_size, config.priority, priority, config.core, core);
+    config.stack_size = stack_size;
+    config.priority = priority;
+    config.core = core;
+}
+
+#if CONFIG_USE_TASK_STACK_TUNING
+struct TaskStart {
+    TaskMeasurement* measurement;
+    TaskFunction_t function;
+    void* arg;
+    int64_t create_us;
+};
+#endif
+
+bool TaskRegistry::Create(TaskId id, TaskFunction_t function, void* arg, TaskHandle_t* handle) {
+    auto& config = configs_[id];
+    NoteCreated(id);
+#if CONFIG_USE_TASK_STACK_TUNING
+    auto start = new TaskStart{ &measurements_[id], function, arg, esp_timer_get_time() };
+    auto ret = xTaskCreatePinnedToCore([](void* arg) {
+        auto start = (TaskStart*)arg;
+        uint32_t delay_us = esp_timer_get_time() - start->create_us;
+        uint32_t max_delay_us = start->measurement->max_start_delay_us.load();
+        while (delay_us > max_delay_us && !start->measurement->max_start_delay_us.compare_exchange_weak(max_delay_us, delay_us)) {
+        }
+        auto function = start->function;
+        auto function_arg = start->arg;
+        delete start;
+        function(function_arg);
+    }, config.name, config.stack_size, start, config.priority, handle, config.core);
+    if (ret != pdPASS) {
+        delete start;
+    }
+#else
+    auto ret = xTaskCreatePinnedToCore(function, config.name, config.stack_size, arg, config.priority, handle, config.core);
+#endif
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create %s with %lu bytes of stack, free internal heap %u", config.name,
+            config.stack_size, heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+        return false;
+    }
+    return true;
+}
+
+void TaskRegistry::NoteCreated(TaskId id) {
+    measurements_[id].created.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TaskRegistry::Sample() {
+#if CONFIG_USE_TASK_STACK_TUNING
+    UBaseType_t count = uxTaskGetNumberOfTasks() + 4;
+    auto tasks = (TaskStatus_t*)malloc(sizeof(TaskStatus_t) * count);
+    if (tasks == nullptr) {
+        return;
+    }
+    count = uxTaskGetSystemState(tasks, count, nullptr);
+    for (UBaseType_t i = 0; i < count; i++) {
+        for (int id = 0; id < kTaskCount; id++) {
+            // Names longer than configMAX_TASK_NAME_LEN - 1 are cut by FreeRTOS
+            if (strncmp(tasks[i].pcTaskName, configs_[id].name, configMAX_TASK_NAME_LEN - 1) != 0) {
+                continue;
+            }
+            auto& min_free = measurements_[id].min_free_stack;
+            uint32_t free_stack = tasks[i].usStackHighWaterMark;
+            if (free_stack < min_free.load(std::memory_order_relaxed)) {
+                min_free.store(free_stack, std::memory_order_relaxed);
+            }
+            break;
+        }
+    }
+    free(tasks);
+#endif
+}
+
+uint32_t TaskRegistry::GetSuggestedStackSize(TaskId id) const {
+    uint32_t min_free = measurements_[id].min_free_stack.load(std::memory_order_relaxed);
+    uint32_t stack_size = configs_[id].stack_size;
+    if (min_free == UINT32_MAX || min_free > stack_size) {
+        return 0;
+    }
+    uint32_t used = stack_size - min_free;
+    // Multiples of 256 bytes, a quarter over the use plus the margin
+    return (used + used / 4 + TASK_STACK_MARGIN + 255) & ~255u;
+}
+
+void TaskRegistry::PrintReport() {
+    ESP_LOGI(TAG, "%-20s %7s %7s %9s %7s", "task", "stack", "used", "suggested", "delay");
+    for (int id = 0; id < kTaskCount; id++) {
+        auto& config = configs_[id];
+        auto& measurement = measurements_[id];
+        uint32_t min_free = measurement.min_free_stack.load(std::memory_order_relaxed);
+        if (min_free == UINT32_MAX) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%-20s %7lu %7lu %9lu %5luus", config.name, config.stack_size, config.stack_size - min_free,
+            GetSuggestedStackSize((TaskId)id), measurement.max_start_delay_us.load(std::memory_order_relaxed));
+    }
+}
+
+cJSON* TaskRegistry::ToJson() {
+    auto json = cJSON_CreateObject();
+    for (int id = 0; id < kTaskCount; id++) {
+        auto& config = configs_[id];
+        auto& measurement = measurements_[id];
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "stack_size", config.stack_size);
+        cJSON_AddNumberToObject(item, "priority", config.priority);
+        cJSON_AddNumberToObject(item, "core", config.core == tskNO_AFFINITY ? -1 : config.core);
+        cJSON_AddBoolToObject(item, "psram_stack", (config.stack_caps & MALLOC_CAP_SPIRAM) != 0);
+        cJSON_AddNumberToObject(item, "created", measurement.created.load(std::memory_order_relaxed));
+        uint32_t min_free = measurement.min_free_stack.load(std::memory_order_relaxed);
+        if (min_free != UINT32_MAX) {
+            cJSON_AddNumberToObject(item, "stack_used", config.stack_size - min_free);
+            cJSON_AddNumberToObject(item, "suggested_stack_size", GetSuggestedStackSize((TaskId)id));
+            cJSON_AddNumberToObject(item, "max_start_delay_us", measurement.max_start_delay_us.load(std::memory_order_relaxed));
+        }
+        cJSON_AddItemToObject(json, config.name, item);
+    }
+    return json;
+}
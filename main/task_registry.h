@@ -0,0 +1,83 @@
+#ifndef _TASK_REGISTRY_H_
+#define _TASK_REGISTRY_H_
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <cJSON.h>
+
+#include <atomic>
+#include <cstdint>
+
+// Every task the firmware creates outside the board files
+enum TaskId : uint8_t {
+    kTaskAudioInput,
+    kTaskAudioOutput,
+    kTaskOpusCodec,
+    kTaskAudioProcessor,        // AFE voice processing
+    kTaskWakeWordDetection,     // AFE wake word
+    kTaskWakeWordEncode,        // Static task, its stack is allocated once with the caps below
+    kTaskCalibrationProbe,
+    kTaskAcousticCalibration,
+    kTaskCheckVersion,
+    kTaskSessionResume,         // Websocket resume attempts, they block on the connect and the hello
+    kTaskMemoWriter,
+    kTaskMemoPlayer,
+    kTaskToolCall,              // MCP tool workers, static tasks
+    kTaskRobotAction,           // Servo actions of the robot boards
+    kTaskCount
+};
+
+struct TaskConfig {
+    const char* name;
+    uint32_t stack_size;    // Bytes
+    UBaseType_t priority;
+    BaseType_t core;        // tskNO_AFFINITY lets the scheduler pick
+    uint32_t stack_caps;    // MALLOC_CAP_INTERNAL or MALLOC_CAP_SPIRAM, only for tasks that own their stack
+};
+
+struct TaskMeasurement {
+    std::atomic<uint32_t> created = 0;
+    std::atomic<uint32_t> min_free_stack = UINT32_MAX;     // Lowest stack high-water mark seen, bytes
+    std::atomic<uint32_t> max_start_delay_us = 0;          // From the create call to the first instruction of the task
+};
+
+/*
+ * Stack, priority, core and stack memory of every firmware task in one table. Boards override
+ * entries in their constructor, before the tasks are created. With CONFIG_USE_TASK_STACK_TUNING the
+ * registry also records how much stack each task really used and how long it waited to start, and
+ * suggests a tighter stack size.
+ */
+class TaskRegistry {
+public:
+    static TaskRegistry& GetInstance() {
+        static TaskRegistry instance;
+        return instance;
+    }
+    TaskRegistry(const TaskRegistry&) = delete;
+    TaskRegistry& operator=(const TaskRegistry&) = delete;
+
+    const TaskConfig& Get(TaskId id) const { return configs_[id]; }
+    void Override(TaskId id, uint32_t stack_size, UBaseType_t priority, BaseType_t core = tskNO_AFFINITY);
+
+    // Creates a task with a stack from the internal heap. Returns false if the task cannot be created
+    bool Create(TaskId id, TaskFunction_t function, void* arg, TaskHandle_t* handle = nullptr);
+    // For the tasks created by other means, like pthreads and static tasks
+    void NoteCreated(TaskId id);
+
+    // Samples the stack high-water marks of the running tasks, does nothing without stack tuning
+    void Sample();
+    // Logs the use of every task that has run and the suggested stack size
+    void PrintReport();
+    // Returns a new object with the config and the measurements, the caller owns it
+    cJSON* ToJson();
+
+private:
+    TaskRegistry();
+
+    TaskConfig configs_[kTaskCount];
+    TaskMeasurement measurements_[kTaskCount];
+
+    uint32_t GetSuggestedStackSize(TaskId id) const;
+};
+
+#endif // _TASK_REGISTRY_H_
@@ -0,0 +1,433 @@
+#include "voice_memo.h"
+#include "application.h"
+#include "board.h"
+#include "display.h"
+#include "system_info.h"
+#include "connection_manager.h"
+#include "task_registry.h"
+#include "memory_budget.h"
+
+#include <esp_log.h>
+#include <esp_vfs_fat.h>
+#include <esp_random.h>
+#include <esp_heap_caps.h>
+#include <cJSON.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <strings.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "VoiceMemo"
+
+bool VoiceMemo::Initialize(AudioService* audio_service) {
+    audio_service_ = audio_service;
+
+    esp_vfs_fat_mount_config_t mount_config = {};
+    mount_config.format_if_mount_failed = true;
+    mount_config.max_files = 2;
+    mount_config.allocation_unit_size = CONFIG_WL_SECTOR_SIZE;
+    wl_handle_t wl_handle = WL_INVALID_HANDLE;
+    esp_err_t err = esp_vfs_fat_spiflash_mount_rw_wl(VOICE_MEMO_BASE_PATH, CONFIG_VOICE_MEMO_PARTITION_LABEL, &mount_config, &wl_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to mount partition %s: %s", CONFIG_VOICE_MEMO_PARTITION_LABEL, esp_err_to_name(err));
+        return false;
+    }
+    mounted_ = true;
+
+    /* Continue numbering after the last memo on the partition */
+    DIR* dir = opendir(VOICE_MEMO_BASE_PATH);
+    if (dir != nullptr) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            if (strncasecmp(entry->d_name, "memo", 4) == 0) {
+                next_id_ = std::max(next_id_, atoi(entry->d_name + 4) + 1);
+            }
+        }
+        closedir(dir);
+    }
+
+    audio_service_->OnMemoPacket([this](const AudioStreamPacket& packet) {
+        OnPacket(packet);
+    });
+    ESP_LOGI(TAG, "Voice memo initialized, next id: %d", next_id_);
+    return true;
+}
+
+bool VoiceMemo::StartRecording(int max_seconds) {
+    if (!mounted_ || IsRecording() || IsPlaying()) {
+        return false;
+    }
+
+    max_seconds_ = std::clamp(max_seconds, 1, VOICE_MEMO_MAX_SECONDS);
+    stop_recording_ = false;
+    TaskRegistry::GetInstance().Create(kTaskMemoWriter, [](void* arg) {
+        auto memo = (VoiceMemo*)arg;
+        memo->WriterTask();
+        memo->writer_task_handle_ = nullptr;
+        vTaskDelete(NULL);
+    }, this, &writer_task_handle_);
+    return true;
+}
+
+void VoiceMemo::StopRecording() {
+    stop_recording_ = true;
+    if (writer_task_handle_ != nullptr) {
+        xTaskNotifyGive(writer_task_handle_);
+    }
+}
+
+bool VoiceMemo::StartPlayback(const std::string& name) {
+    if (!mounted_ || IsRecording() || IsPlaying() || !IsValidName(name)) {
+        return false;
+    }
+
+    struct stat st;
+    if (stat(GetPath(name).c_str(), &st) != 0) {
+        return false;
+    }
+
+    play_name_ = name;
+    stop_playback_ = false;
+    TaskRegistry::GetInstance().Create(kTaskMemoPlayer, [](void* arg) {
+        auto memo = (VoiceMemo*)arg;
+        memo->PlayerTask();
+        memo->player_task_handle_ = nullptr;
+        vTaskDelete(NULL);
+    }, this, &player_task_handle_);
+    return true;
+}
+
+void VoiceMemo::StopPlayback() {
+    stop_playback_ = true;
+}
+
+bool VoiceMemo::WaitForIdle() {
+    auto& app = Application::GetInstance();
+    for (int i = 0; i < 50; i++) {
+        if (app.GetDeviceState() == kDeviceStateIdle && audio_service_->IsIdle()) {
+            return true;
+        }
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    return false;
+}
+
+void VoiceMemo::WriterTask() {
+    auto& app = Application::GetInstance();
+    auto display = Board::GetInstance().GetDisplay();
+    if (!WaitForIdle()) {
+        ESP_LOGW(TAG, "Device is not idle, skip recording");
+        return;
+    }
+
+    char name[16];
+    snprintf(name, sizeof(name), "memo%04d.ogg", next_id_ % 10000);
+    std::string path = GetPath(name);
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        ESP_LOGE(TAG, "Failed to create %s", path.c_str());
+        display->ShowNotification("Memo recording failed", 3000);
+        return;
+    }
+    /* The double buffer is already sector sized, skip the stdio buffer */
+    setvbuf(file, nullptr, _IONBF, 0);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& buffer : buffers_) {
+            buffer.data = (uint8_t*)MemoryBudget::GetInstance().Allocate(kMemoryAudio, VOICE_MEMO_BUFFER_SIZE);
+            buffer.size = 0;
+            buffer.full = false;
+        }
+        active_buffer_ = 0;
+        dropped_pages_ = 0;
+        if (buffers_[0].data != nullptr && buffers_[1].data != nullptr) {
+            writer_ = std::make_unique<OggOpusWriter>([this](const uint8_t* page, size_t size) {
+                return AppendPage(page, size);
+            }, esp_random());
+            writer_->WriteHeaders(16000, 1, VOICE_MEMO_OPUS_PRE_SKIP);
+            recording_ = true;
+        }
+    }
+
+    bool success = recording_;
+    if (success) {
+        next_id_++;
+        ESP_LOGI(TAG, "Recording %s, max %d seconds", name, max_seconds_);
+        display->ShowNotification("Recording memo...", max_seconds_ * 1000);
+        audio_service_->EnableMemoRecording(true);
+
+        int64_t deadline = esp_timer_get_time() + (int64_t)max_seconds_ * 1000000;
+        while (!stop_recording_ && esp_timer_get_time() < deadline && app.GetDeviceState() == kDeviceStateIdle) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+            if (!WritePendingBuffers(file, false)) {
+                success = false;
+                break;
+            }
+        }
+
+        audio_service_->EnableMemoRecording(false);
+        /* Let the frames already in the encode queue reach the writer */
+        vTaskDelay(pdMS_TO_TICKS(OPUS_FRAME_DURATION_MS * (MAX_ENCODE_TASKS_IN_QUEUE + 1)));
+    } else {
+        ESP_LOGE(TAG, "Failed to allocate memo buffers");
+    }
+
+    uint64_t granule = 0;
+    uint32_t dropped_pages = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        recording_ = false;
+        if (writer_) {
+            writer_->Finish();
+            granule = writer_->granule_position();
+            writer_.reset();
+        }
+        dropped_pages = dropped_pages_;
+    }
+    success = WritePendingBuffers(file, true) && success;
+    fclose(file);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& buffer : buffers_) {
+            MemoryBudget::GetInstance().Free(kMemoryAudio, buffer.data);
+            buffer.data = nullptr;
+        }
+    }
+
+    if (granule == 0) {
+        remove(path.c_str());
+        success = false;
+    }
+    ESP_LOGI(TAG, "Memo %s %s, duration=%llums dropped_pages=%lu", name, success ? "saved" : "failed",
+        granule * 1000 / OGG_OPUS_GRANULE_RATE, dropped_pages);
+    display->ShowNotification(success ? "Memo saved" : "Memo recording failed", 3000);
+}
+
+void VoiceMemo::OnPacket(const AudioStreamPacket& packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!recording_ || !writer_) {
+        return;
+    }
+    writer_->WritePacket(packet.opus_data(), packet.opus_size(), packet.frame_duration);
+}
+
+// Called with mutex_ held. A page is either copied completely or dropped, so the file stays valid
+bool VoiceMemo::AppendPage(const uint8_t* page, size_t size) {
+    auto& active = buffers_[active_buffer_];
+    auto& other = buffers_[active_buffer_ ^ 1];
+    size_t space = active.full ? 0 : (VOICE_MEMO_BUFFER_SIZE - active.size) + (other.full ? 0 : VOICE_MEMO_BUFFER_SIZE);
+    if (size > space) {
+        dropped_pages_++;
+        return false;
+    }
+
+    size_t copied = std::min(size, VOICE_MEMO_BUFFER_SIZE - active.size);
+    memcpy(active.data + active.size, page, copied);
+    active.size += copied;
+    if (active.size == VOICE_MEMO_BUFFER_SIZE) {
+        active.full = true;
+        if (!other.full) {
+            active_buffer_ ^= 1;
+        }
+        xTaskNotifyGive(writer_task_handle_);
+    }
+
+    if (copied < size) {
+        auto& next = buffers_[active_buffer_];
+        memcpy(next.data, page + copied, size - copied);
+        next.size = size - copied;
+    }
+    return true;
+}
+
+bool VoiceMemo::WritePendingBuffers(FILE* file, bool flush_active) {
+    while (true) {
+        MemoBuffer* buffer = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& older = buffers_[active_buffer_ ^ 1];
+            if (older.full) {
+                buffer = &older;
+            } else if (flush_active && buffers_[active_buffer_].size > 0) {
+                /* Only after the recording stopped, nobody appends to the active buffer anymore */
+                buffer = &buffers_[active_buffer_];
+            } else {
+                return true;
+            }
+        }
+
+        /* The buffer being written is not touched by OnPacket, no need to hold the lock */
+        bool success = fwrite(buffer->data, 1, buffer->size, file) == buffer->size;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        buffer->size = 0;
+        buffer->full = false;
+        if (buffers_[active_buffer_].full) {
+            /* Both buffers were full, continue with the one just written */
+            active_buffer_ ^= 1;
+        }
+        if (!success) {
+            ESP_LOGE(TAG, "Failed to write memo, the partition may be full");
+            return false;
+        }
+    }
+}
+
+void VoiceMemo::PlayerTask() {
+    auto& app = Application::GetInstance();
+    if (!WaitForIdle()) {
+        ESP_LOGW(TAG, "Device is not idle, skip playback");
+        return;
+    }
+
+    FILE* file = fopen(GetPath(play_name_).c_str(), "rb");
+    if (file == nullptr) {
+        ESP_LOGE(TAG, "Failed to open %s", play_name_.c_str());
+        return;
+    }
+
+    OggOpusReader reader([file](uint8_t* data, size_t size) {
+        return fread(data, 1, size, file);
+    });
+    if (!reader.ReadHeaders()) {
+        ESP_LOGE(TAG, "Invalid memo file %s", play_name_.c_str());
+        fclose(file);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Playing %s", play_name_.c_str());
+    auto& pool = AudioPacketPool::GetInstance();
+    while (!stop_playback_ && app.GetDeviceState() == kDeviceStateIdle) {
+        auto packet = pool.Acquire(0);
+        if (!reader.ReadPacket(packet->payload)) {
+            pool.Release(std::move(packet));
+            break;
+        }
+        packet->sample_rate = reader.sample_rate();
+        packet->frame_duration = OPUS_FRAME_DURATION_MS;
+        audio_service_->PushPacketToDecodeQueue(std::move(packet), true);
+    }
+    fclose(file);
+
+    if (stop_playback_) {
+        audio_service_->ResetDecoder();
+    }
+    if (reader.corrupted_pages() > 0) {
+        ESP_LOGW(TAG, "Skipped %lu corrupted pages in %s", reader.corrupted_pages(), play_name_.c_str());
+    }
+}
+
+bool VoiceMemo::Delete(const std::string& name) {
+    if (!mounted_ || !IsValidName(name)) {
+        return false;
+    }
+    return remove(GetPath(name).c_str()) == 0;
+}
+
+std::string VoiceMemo::GetMemosAsJson() {
+    cJSON* json = cJSON_CreateArray();
+    DIR* dir = mounted_ ? opendir(VOICE_MEMO_BASE_PATH) : nullptr;
+    if (dir != nullptr) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            if (!IsValidName(entry->d_name)) {
+                continue;
+            }
+            struct stat st;
+            if (stat(GetPath(entry->d_name).c_str(), &st) != 0) {
+                continue;
+            }
+            cJSON* item = cJSON_CreateObject();
+            cJSON_AddStringToObject(item, "name", entry->d_name);
+            cJSON_AddNumberToObject(item, "size", st.st_size);
+            cJSON_AddItemToArray(json, item);
+        }
+        closedir(dir);
+    }
+
+    char* json_str = cJSON_PrintUnformatted(json);
+    std::string result(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(json);
+    return result;
+}
+
+void VoiceMemo::SetUploadUrl(const std::string& url, const std::string& token) {
+    upload_url_ = url;
+    upload_token_ = token;
+}
+
+std::string VoiceMemo::Upload(const std::string& name) {
+    if (upload_url_.empty()) {
+        return "{\"success\": false, \"message\": \"Upload URL is not configured\"}";
+    }
+    if (!mounted_ || !IsValidName(name)) {
+        return "{\"success\": false, \"message\": \"Invalid memo name\"}";
+    }
+    FILE* file = fopen(GetPath(name).c_str(), "rb");
+    if (file == nullptr) {
+        return "{\"success\": false, \"message\": \"Memo not found\"}";
+    }
+
+    auto http = ConnectionManager::GetInstance().OpenHttp(kConnectionVoiceMemo, "POST", upload_url_, [this, &name](Http* http) {
+        http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
+        http->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
+        if (!upload_token_.empty()) {
+            http->SetHeader("Authorization", "Bearer " + upload_token_);
+        }
+        http->SetHeader("Content-Type", "audio/ogg");
+        http->SetHeader("X-Memo-Name", name);
+        http->SetHeader("Transfer-Encoding", "chunked");
+    });
+    if (!http) {
+        ESP_LOGE(TAG, "Failed to connect to upload URL");
+        fclose(file);
+        return "{\"success\": false, \"message\": \"Failed to connect to upload URL\"}";
+    }
+
+    /* Stream the file in chunks, never load the whole memo */
+    std::vector<char> chunk(VOICE_MEMO_UPLOAD_CHUNK_SIZE);
+    size_t total_sent = 0;
+    size_t bytes_read;
+    while ((bytes_read = fread(chunk.data(), 1, chunk.size(), file)) > 0) {
+        if (http->Write(chunk.data(), bytes_read) < (int)bytes_read) {
+            ESP_LOGE(TAG, "Upload of %s stopped after %u bytes, the connection was lost", name.c_str(), total_sent);
+            fclose(file);
+            http->Close();
+            return "{\"success\": false, \"message\": \"Connection lost during upload\"}";
+        }
+        total_sent += bytes_read;
+    }
+    fclose(file);
+    // 结束块
+    if (http->Write("", 0) < 0) {
+        ESP_LOGE(TAG, "Failed to finish the upload of %s", name.c_str());
+        http->Close();
+        return "{\"success\": false, \"message\": \"Connection lost during upload\"}";
+    }
+
+    if (http->GetStatusCode() != 200) {
+        ESP_LOGE(TAG, "Failed to upload memo, status code: %d", http->GetStatusCode());
+        return "{\"success\": false, \"message\": \"Failed to upload memo\"}";
+    }
+
+    std::string result = http->ReadAll();
+    http->Close();
+    ESP_LOGI(TAG, "Uploaded %s, size=%u\n%s", name.c_str(), total_sent, result.c_str());
+    return result;
+}
+
+bool VoiceMemo::IsValidName(const std::string& name) const {
+    // 8.3 names only, without any path component
+    if (name.size() < 5 || name.size() > 12 || name.find('/') != std::string::npos) {
+        return false;
+    }
+    return strcasecmp(name.c_str() + name.size() - 4, ".ogg") == 0;
+}
+
+std::string VoiceMemo::GetPath(const std::string& name) const {
+    return std::string(VOICE_MEMO_BASE_PATH) + "/" + name;
+}
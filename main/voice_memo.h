@@ -0,0 +1,100 @@
+#ifndef VOICE_MEMO_H
+#define VOICE_MEMO_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <cstdio>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+#include "audio_service.h"
+#include "ogg_opus_stream.h"
+
+/*
+ * Voice memos are recorded from the 16kHz capture path, encoded by the Opus encoder of
+ * the audio service and written as Ogg/Opus files to a FAT partition.
+ *
+ * (MIC) -> [audio_input] -> {Encode Queue} -> [opus_codec] -> OnPacket -> {Double Buffer} -> [memo_writer] -> (Flash)
+ *
+ * OnPacket only copies whole Ogg pages into the active buffer. The writer task flushes a
+ * buffer when it is full, so a flash erase stall only delays the writer task and never
+ * blocks the audio tasks. If both buffers are full the page is dropped.
+ */
+
+#define VOICE_MEMO_BASE_PATH "/memo"
+#define VOICE_MEMO_BUFFER_SIZE 8192     // Multiple of the FAT sector size
+#define VOICE_MEMO_UPLOAD_CHUNK_SIZE 2048
+#define VOICE_MEMO_MAX_SECONDS 300
+#define VOICE_MEMO_OPUS_PRE_SKIP 312
+
+class VoiceMemo {
+public:
+    static VoiceMemo& GetInstance() {
+        static VoiceMemo instance;
+        return instance;
+    }
+    // 删除拷贝构造函数和赋值运算符
+    VoiceMemo(const VoiceMemo&) = delete;
+    VoiceMemo& operator=(const VoiceMemo&) = delete;
+
+    bool Initialize(AudioService* audio_service);
+    bool IsMounted() const { return mounted_; }
+    bool IsRecording() const { return writer_task_handle_ != nullptr; }
+    bool IsPlaying() const { return player_task_handle_ != nullptr; }
+
+    // Recording and playback start after the device becomes idle
+    bool StartRecording(int max_seconds);
+    void StopRecording();
+    bool StartPlayback(const std::string& name);
+    void StopPlayback();
+
+    bool Delete(const std::string& name);
+    std::string GetMemosAsJson();
+    std::string Upload(const std::string& name);
+    void SetUploadUrl(const std::string& url, const std::string& token);
+
+private:
+    VoiceMemo() = default;
+    ~VoiceMemo() = default;
+
+    struct MemoBuffer {
+        uint8_t* data = nullptr;
+        size_t size = 0;
+        bool full = false;
+    };
+
+    AudioService* audio_service_ = nullptr;
+    bool mounted_ = false;
+    int next_id_ = 1;
+    std::string upload_url_;
+    std::string upload_token_;
+
+    // Recording state, guarded by mutex_
+    std::mutex mutex_;
+    bool recording_ = false;
+    std::unique_ptr<OggOpusWriter> writer_;
+    MemoBuffer buffers_[2];
+    int active_buffer_ = 0;
+    uint32_t dropped_pages_ = 0;
+
+    std::atomic<bool> stop_recording_ = false;
+    std::atomic<bool> stop_playback_ = false;
+    TaskHandle_t writer_task_handle_ = nullptr;
+    TaskHandle_t player_task_handle_ = nullptr;
+    int max_seconds_ = 0;
+    std::string play_name_;
+
+    void WriterTask();
+    void PlayerTask();
+    bool WaitForIdle();
+    void OnPacket(const AudioStreamPacket& packet);
+    bool AppendPage(const uint8_t* page, size_t size);
+    bool WritePendingBuffers(FILE* file, bool flush_active);
+    bool IsValidName(const std::string& name) const;
+    std::string GetPath(const std::string& name) const;
+};
+
+#endif // VOICE_MEMO_H
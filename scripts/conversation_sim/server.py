@@ -0,0 +1,360 @@
+'''
+  Stand-in conversation server for latency and throughput measurements without the cloud backend.
+  It speaks the WebSocket protocol (binary versions 1-4) and MQTT + UDP, answers every finished
+  utterance with the canned stt/llm/tts messages of a scenario file and replays a recorded Opus
+  file as TTS, through a configurable delay, jitter and loss. Every event is logged with a timestamp.
+'''
+import argparse
+import asyncio
+import json
+import os
+import uuid
+
+from sim_protocol import (EventLog, Impairment, UdpCrypto, now_ms, opus_frame_duration_ms, pack_audio,
+                          read_opus_file, unpack_audio)
+
+
+DEFAULT_SCENARIO = {
+    'stt_delay_ms': 300,
+    'llm_delay_ms': 200,
+    'tts_delay_ms': 300,
+    # End of speech in the auto and realtime modes, after the audio paused this long
+    'vad_silence_ms': 500,
+    'turns': [
+        {'stt': '你好', 'emotion': 'happy', 'sentences': ['你好，有什么可以帮你的？']},
+    ],
+}
+
+
+class Session:
+    '''Conversation logic shared by the transports, the transports implement send_json and send_audio'''
+
+    def __init__(self, server, transport):
+        self.server = server
+        self.transport = transport
+        self.session_id = str(uuid.uuid4())
+        self.log = server.log
+        self.version = 1
+        self.client_frame_ms = 60
+        self.listening = False
+        self.auto_stop = False
+        self.received_audio_ms = 0
+        self.vad_timer = None
+        self.reply_task = None
+        self.turn_index = 0
+        self.mcp_requests = {}
+        self.next_mcp_id = 1
+
+    async def send_json(self, message):
+        raise NotImplementedError
+
+    async def send_audio(self, timestamp, opus):
+        raise NotImplementedError
+
+    def hello_reply(self, hello):
+        sample_rate = self.server.tts_sample_rate
+        frame_ms = self.server.tts_frame_ms
+        reply = {
+            'type': 'hello',
+            'transport': self.transport,
+            'session_id': hello.get('session_id') or self.session_id,
+            'audio_params': {'format': 'opus', 'sample_rate': sample_rate, 'channels': 1, 'frame_duration': frame_ms},
+            'features': {'ping': True},
+        }
+        self.session_id = reply['session_id']
+        self.client_frame_ms = hello.get('audio_params', {}).get('frame_duration', 60)
+        return reply
+
+    async def handle_json(self, message):
+        msg_type = message.get('type')
+        self.log.log('recv_json', transport=self.transport, type=msg_type, state=message.get('state'))
+        if msg_type == 'listen':
+            state = message.get('state')
+            if state == 'start':
+                self.listening = True
+                self.auto_stop = message.get('mode') != 'manual'
+                self.received_audio_ms = 0
+            elif state == 'stop' and self.listening:
+                self.listening = False
+                self.start_reply()
+        elif msg_type == 'abort':
+            if self.reply_task and not self.reply_task.done():
+                self.reply_task.cancel()
+                self.log.log('tts_aborted', session_id=self.session_id)
+        elif msg_type == 'ping':
+            await self.send_json({'session_id': self.session_id, 'type': 'pong', 'timestamp': message.get('timestamp')})
+        elif msg_type == 'mcp':
+            payload = message.get('payload', {})
+            sent = self.mcp_requests.pop(payload.get('id'), None)
+            if sent is not None:
+                self.log.log('mcp_reply', id=payload.get('id'), latency_ms=round(now_ms() - sent, 1))
+
+    def handle_audio(self, frames):
+        for _ in frames:
+            if self.server.verbose:
+                self.log.log('recv_audio', transport=self.transport)
+            if not self.listening:
+                continue
+            self.received_audio_ms += self.client_frame_ms
+        # Stand-in for the server VAD of the auto and realtime modes
+        if self.listening and self.auto_stop:
+            if self.vad_timer is not None:
+                self.vad_timer.cancel()
+            self.vad_timer = asyncio.get_running_loop().call_later(self.server.scenario['vad_silence_ms'] / 1000, self.end_of_speech)
+
+    def end_of_speech(self):
+        self.vad_timer = None
+        if self.listening:
+            self.listening = False
+            self.log.log('vad_end_of_speech', audio_ms=self.received_audio_ms)
+            self.start_reply()
+
+    def start_reply(self):
+        if self.reply_task and not self.reply_task.done():
+            self.reply_task.cancel()
+        self.reply_task = asyncio.ensure_future(self.reply())
+
+    async def reply(self):
+        scenario = self.server.scenario
+        turn = scenario['turns'][self.turn_index % len(scenario['turns'])]
+        self.turn_index += 1
+        sid = self.session_id
+
+        await asyncio.sleep(scenario['stt_delay_ms'] / 1000)
+        await self.send_json({'session_id': sid, 'type': 'stt', 'text': turn['stt']})
+        self.log.log('sent_stt', text=turn['stt'])
+
+        await asyncio.sleep(scenario['llm_delay_ms'] / 1000)
+        await self.send_json({'session_id': sid, 'type': 'llm', 'emotion': turn.get('emotion', 'neutral'), 'text': ''})
+        if 'mcp' in turn:
+            request = dict(turn['mcp'], jsonrpc='2.0', id=self.next_mcp_id)
+            self.mcp_requests[self.next_mcp_id] = now_ms()
+            self.next_mcp_id += 1
+            await self.send_json({'session_id': sid, 'type': 'mcp', 'payload': request})
+            self.log.log('sent_mcp', method=request.get('method'))
+
+        await asyncio.sleep(scenario['tts_delay_ms'] / 1000)
+        await self.send_json({'session_id': sid, 'type': 'tts', 'state': 'start'})
+        self.log.log('sent_tts_start')
+        for sentence in turn['sentences']:
+            await self.send_json({'session_id': sid, 'type': 'tts', 'state': 'sentence_start', 'text': sentence})
+            await self.stream_tts()
+        await self.send_json({'session_id': sid, 'type': 'tts', 'state': 'stop'})
+        self.log.log('sent_tts_stop')
+
+    async def stream_tts(self):
+        '''Sends the recording in real time, each frame through the impairment'''
+        impairment = self.server.impairment
+        pending = []
+        next_send = now_ms()
+        timestamp = 0
+        sent = lost = 0
+        for opus in self.server.tts_packets:
+            delay = next_send - now_ms()
+            if delay > 0:
+                await asyncio.sleep(delay / 1000)
+            if impairment.dropped():
+                lost += 1
+            else:
+                pending.append(asyncio.ensure_future(self.delayed_send(impairment.delay_seconds(), timestamp, opus)))
+                sent += 1
+            frame_ms = opus_frame_duration_ms(opus)
+            next_send += frame_ms
+            timestamp += int(frame_ms)
+        if pending:
+            await asyncio.gather(*pending)
+        self.log.log('sent_tts_audio', frames=sent, lost=lost)
+
+    async def delayed_send(self, delay, timestamp, opus):
+        if delay > 0:
+            await asyncio.sleep(delay)
+        await self.send_audio(timestamp, opus)
+
+    def close(self):
+        if self.vad_timer is not None:
+            self.vad_timer.cancel()
+        if self.reply_task and not self.reply_task.done():
+            self.reply_task.cancel()
+
+
+# ---- WebSocket ----
+
+class WebsocketSession(Session):
+    def __init__(self, server, websocket):
+        super().__init__(server, 'websocket')
+        self.websocket = websocket
+
+    async def send_json(self, message):
+        await self.websocket.send(json.dumps(message, ensure_ascii=False))
+
+    async def send_audio(self, timestamp, opus):
+        for message in pack_audio(self.version, [(timestamp, opus)]):
+            await self.websocket.send(message)
+
+    async def run(self, headers):
+        self.version = int(headers.get('Protocol-Version', '1'))
+        self.log.log('ws_connected', device_id=headers.get('Device-Id'), version=self.version)
+        try:
+            async for message in self.websocket:
+                if isinstance(message, bytes):
+                    self.handle_audio(unpack_audio(self.version, message))
+                    continue
+                message = json.loads(message)
+                if message.get('type') == 'hello':
+                    reply = self.hello_reply(message)
+                    # Accept the batching of protocol version 4 when the device offers it
+                    if self.server.accept_batch and message.get('features', {}).get('audio_batch'):
+                        self.version = 4
+                        reply['version'] = 4
+                    await self.send_json(reply)
+                    self.log.log('sent_hello', session_id=self.session_id, version=self.version)
+                else:
+                    await self.handle_json(message)
+        except Exception as e:
+            self.log.log('ws_error', error=str(e))
+        finally:
+            self.close()
+            self.log.log('ws_disconnected')
+
+
+async def websocket_handler(server, websocket, path=None):
+    # The request headers moved between websockets versions
+    request = getattr(websocket, 'request', None)
+    headers = request.headers if request is not None else websocket.request_headers
+    await WebsocketSession(server, websocket).run(headers)
+
+
+# ---- MQTT + UDP ----
+
+class MqttSession(Session):
+    def __init__(self, server):
+        super().__init__(server, 'udp')
+        key = os.urandom(16)
+        nonce = bytearray(os.urandom(16))
+        # The first byte of the header is the packet type, which the device checks
+        nonce[0] = 0x01
+        nonce[1] = 0
+        self.crypto = UdpCrypto(key, bytes(nonce))
+        self.remote_sequence = 0
+        self.udp_address = None
+
+    async def send_json(self, message):
+        self.server.mqtt.publish(self.server.args.mqtt_reply_topic, json.dumps(message, ensure_ascii=False))
+
+    async def send_audio(self, timestamp, opus):
+        if self.udp_address is not None:
+            self.server.udp.sendto(self.crypto.encrypt(timestamp, opus), self.udp_address)
+
+    def hello_reply(self, hello):
+        reply = super().hello_reply(hello)
+        reply['udp'] = {
+            'server': self.server.args.udp_advertise,
+            'port': self.server.args.udp_port,
+            'key': self.crypto.key.hex().upper(),
+            'nonce': self.crypto.nonce.hex().upper(),
+        }
+        return reply
+
+    def handle_datagram(self, data, address):
+        self.udp_address = address
+        timestamp, sequence, opus = self.crypto.decrypt(data)
+        if sequence != self.remote_sequence + 1:
+            self.log.log('udp_sequence_gap', expected=self.remote_sequence + 1, received=sequence)
+        self.remote_sequence = sequence
+        self.handle_audio([(timestamp, opus)])
+
+
+class UdpServerProtocol(asyncio.DatagramProtocol):
+    def __init__(self, server):
+        self.server = server
+
+    def datagram_received(self, data, address):
+        if self.server.mqtt_session is not None and len(data) >= 16:
+            self.server.mqtt_session.handle_datagram(data, address)
+
+
+class StandInServer:
+    def __init__(self, args):
+        self.args = args
+        self.log = EventLog(args.log)
+        self.verbose = args.verbose
+        self.accept_batch = not args.no_batch
+        self.impairment = Impairment(args.delay, args.jitter, args.loss, args.seed)
+        self.scenario = dict(DEFAULT_SCENARIO)
+        if args.scenario:
+            with open(args.scenario, encoding='utf-8') as f:
+                self.scenario.update(json.load(f))
+        self.tts_packets, self.tts_sample_rate = read_opus_file(args.tts)
+        self.tts_frame_ms = int(opus_frame_duration_ms(self.tts_packets[0]))
+        self.mqtt = None
+        self.udp = None
+        self.mqtt_session = None
+
+    async def on_mqtt_message(self, payload):
+        message = json.loads(payload)
+        msg_type = message.get('type')
+        if msg_type == 'hello':
+            if self.mqtt_session is not None:
+                self.mqtt_session.close()
+            self.mqtt_session = MqttSession(self)
+            await self.mqtt_session.send_json(self.mqtt_session.hello_reply(message))
+            self.log.log('sent_hello', transport='udp', session_id=self.mqtt_session.session_id)
+        elif msg_type == 'goodbye':
+            if self.mqtt_session is not None:
+                self.mqtt_session.close()
+                self.mqtt_session = None
+            self.log.log('recv_json', transport='udp', type='goodbye')
+        elif self.mqtt_session is not None:
+            await self.mqtt_session.handle_json(message)
+
+    def start_mqtt(self, loop):
+        import paho.mqtt.client as mqtt
+
+        host, _, port = self.args.mqtt.partition(':')
+        client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id='xiaozhi-stand-in')
+
+        def on_connect(client, userdata, flags, reason_code, properties):
+            client.subscribe(self.args.mqtt_topic)
+            self.log.log('mqtt_connected', topic=self.args.mqtt_topic)
+
+        def on_message(client, userdata, message):
+            asyncio.run_coroutine_threadsafe(self.on_mqtt_message(message.payload), loop)
+
+        client.on_connect = on_connect
+        client.on_message = on_message
+        client.connect(host, int(port or 1883))
+        client.loop_start()
+        self.mqtt = client
+
+    async def run(self):
+        import websockets
+
+        loop = asyncio.get_running_loop()
+        self.log.log('tts_loaded', frames=len(self.tts_packets), sample_rate=self.tts_sample_rate, frame_ms=self.tts_frame_ms)
+        if self.args.mqtt:
+            self.start_mqtt(loop)
+            self.udp, _ = await loop.create_datagram_endpoint(lambda: UdpServerProtocol(self), local_addr=('0.0.0.0', self.args.udp_port))
+        async with websockets.serve(lambda ws, *rest: websocket_handler(self, ws), '0.0.0.0', self.args.port):
+            self.log.log('listening', websocket_port=self.args.port)
+            await asyncio.Future()
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='本地替身对话服务器，用于端到端延迟与吞吐测试')
+    parser.add_argument('--port', type=int, default=8765, help='WebSocket 端口 (默认: 8765)')
+    parser.add_argument('--tts', required=True, help='作为 TTS 回放的 Opus 录音，.ogg 或 .p3')
+    parser.add_argument('--scenario', help='场景 JSON 文件，覆盖默认的 stt/llm/tts 消息与延迟')
+    parser.add_argument('--delay', type=float, default=0, help='下行音频附加延迟，毫秒')
+    parser.add_argument('--jitter', type=float, default=0, help='下行音频延迟抖动范围 ±毫秒')
+    parser.add_argument('--loss', type=float, default=0, help='下行音频丢包率，百分比')
+    parser.add_argument('--seed', type=int, help='随机数种子，用于复现同一组丢包与抖动')
+    parser.add_argument('--no-batch', action='store_true', help='不接受二进制协议版本4')
+    parser.add_argument('--mqtt', help='MQTT broker 地址 host:port，指定后启用 MQTT + UDP')
+    parser.add_argument('--mqtt-topic', default='device-server', help='设备发布消息的主题 (默认: device-server)')
+    parser.add_argument('--mqtt-reply-topic', default='devices/simulator', help='下发给设备的主题 (默认: devices/simulator)')
+    parser.add_argument('--udp-port', type=int, default=8884, help='UDP 音频端口 (默认: 8884)')
+    parser.add_argument('--udp-advertise', default='127.0.0.1', help='hello 中告知设备的 UDP 服务器地址')
+    parser.add_argument('--log', help='事件日志文件，每行一个 JSON')
+    parser.add_argument('--verbose', action='store_true', help='记录每个收到的音频帧')
+    args = parser.parse_args()
+    asyncio.run(StandInServer(args).run())
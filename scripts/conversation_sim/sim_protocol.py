@@ -0,0 +1,188 @@
+'''
+  Wire formats shared by the stand-in server and the device simulator,
+  as implemented in main/protocols/websocket_protocol.cc and mqtt_protocol.cc.
+'''
+import json
+import random
+import struct
+import time
+
+from cryptography.hazmat.primitives.ciphers import Cipher, algorithms, modes
+
+
+def now_ms():
+    return time.monotonic() * 1000
+
+
+# ---- Opus sources ----
+
+def opus_frame_duration_ms(packet):
+    '''Duration of an Opus packet from its TOC byte (RFC 6716 3.1)'''
+    toc = packet[0]
+    config = toc >> 3
+    if config < 12:
+        frame_ms = (10, 20, 40, 60)[config & 3]
+    elif config < 16:
+        frame_ms = (10, 20)[config & 1]
+    else:
+        frame_ms = (2.5, 5, 10, 20)[config & 3]
+    code = toc & 3
+    if code == 0:
+        count = 1
+    elif code in (1, 2):
+        count = 2
+    else:
+        count = packet[1] & 0x3F
+    return frame_ms * count
+
+
+def read_p3(path):
+    '''P3 files: 4 byte header (type, reserved, size) + Opus packet, see scripts/p3_tools'''
+    packets = []
+    with open(path, 'rb') as f:
+        while True:
+            header = f.read(4)
+            if len(header) < 4:
+                break
+            _, _, size = struct.unpack('>BBH', header)
+            packets.append(f.read(size))
+    return packets, 16000
+
+
+def read_ogg_opus(path):
+    '''Opus packets of an Ogg file, like the sounds in main/assets, and the sample rate from OpusHead'''
+    with open(path, 'rb') as f:
+        data = f.read()
+    packets = []
+    sample_rate = 48000
+    pending = b''
+    offset = 0
+    while offset + 27 <= len(data):
+        if data[offset:offset + 4] != b'OggS':
+            raise ValueError('Invalid Ogg page at offset %d' % offset)
+        segment_count = data[offset + 26]
+        table = data[offset + 27:offset + 27 + segment_count]
+        body = offset + 27 + segment_count
+        for size in table:
+            pending += data[body:body + size]
+            body += size
+            if size < 255:
+                if pending.startswith(b'OpusHead'):
+                    sample_rate = struct.unpack('<I', pending[12:16])[0]
+                elif not pending.startswith(b'OpusTags') and pending:
+                    packets.append(pending)
+                pending = b''
+        offset = body
+    return packets, sample_rate
+
+
+def read_opus_file(path):
+    if path.endswith('.p3'):
+        return read_p3(path)
+    return read_ogg_opus(path)
+
+
+# ---- WebSocket binary protocols ----
+
+BINARY_MESSAGE_TYPE_OPUS = 0
+
+
+def pack_audio(version, frames):
+    '''frames: list of (timestamp, opus). Returns the binary messages for the given protocol version'''
+    if version == 4:
+        payload = b''.join(struct.pack('>IH', ts, len(opus)) + opus for ts, opus in frames)
+        return [struct.pack('>BBH', BINARY_MESSAGE_TYPE_OPUS, len(frames), len(payload)) + payload]
+    messages = []
+    for ts, opus in frames:
+        if version == 2:
+            messages.append(struct.pack('>HHIII', version, BINARY_MESSAGE_TYPE_OPUS, 0, ts, len(opus)) + opus)
+        elif version == 3:
+            messages.append(struct.pack('>BBH', BINARY_MESSAGE_TYPE_OPUS, 0, len(opus)) + opus)
+        else:
+            messages.append(opus)
+    return messages
+
+
+def unpack_audio(version, message):
+    '''Returns a list of (timestamp, opus)'''
+    if version == 4:
+        _, count, size = struct.unpack('>BBH', message[:4])
+        frames = []
+        offset = 4
+        for _ in range(count):
+            ts, frame_size = struct.unpack('>IH', message[offset:offset + 6])
+            frames.append((ts, message[offset + 6:offset + 6 + frame_size]))
+            offset += 6 + frame_size
+        return frames
+    if version == 2:
+        _, _, _, ts, size = struct.unpack('>HHIII', message[:16])
+        return [(ts, message[16:16 + size])]
+    if version == 3:
+        _, _, size = struct.unpack('>BBH', message[:4])
+        return [(0, message[4:4 + size])]
+    return [(0, message)]
+
+
+# ---- UDP audio channel of MQTT ----
+
+class UdpCrypto:
+    '''|type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|payload|, AES-CTR with the header as counter'''
+
+    def __init__(self, key, nonce):
+        self.key = key
+        self.nonce = nonce
+        self.sequence = 0
+
+    def encrypt(self, timestamp, opus):
+        self.sequence += 1
+        header = bytearray(self.nonce)
+        struct.pack_into('>H', header, 2, len(opus))
+        struct.pack_into('>I', header, 8, timestamp)
+        struct.pack_into('>I', header, 12, self.sequence)
+        encryptor = Cipher(algorithms.AES(self.key), modes.CTR(bytes(header))).encryptor()
+        return bytes(header) + encryptor.update(opus) + encryptor.finalize()
+
+    def decrypt(self, packet):
+        '''Returns (timestamp, sequence, opus)'''
+        header = packet[:16]
+        timestamp, sequence = struct.unpack('>II', header[8:16])
+        decryptor = Cipher(algorithms.AES(self.key), modes.CTR(header)).decryptor()
+        return timestamp, sequence, decryptor.update(packet[16:]) + decryptor.finalize()
+
+
+# ---- Network impairment ----
+
+class Impairment:
+    '''Delay, jitter and loss applied to every message the sender passes through it'''
+
+    def __init__(self, delay_ms=0, jitter_ms=0, loss_percent=0, seed=None):
+        self.delay_ms = delay_ms
+        self.jitter_ms = jitter_ms
+        self.loss_percent = loss_percent
+        self.random = random.Random(seed)
+
+    def dropped(self):
+        return self.random.uniform(0, 100) < self.loss_percent
+
+    def delay_seconds(self):
+        delay = self.delay_ms + self.random.uniform(-self.jitter_ms, self.jitter_ms)
+        return max(delay, 0) / 1000
+
+
+# ---- Logging ----
+
+class EventLog:
+    '''One JSON object per line with a monotonic timestamp in milliseconds'''
+
+    def __init__(self, path=None):
+        self.file = open(path, 'a') if path else None
+        self.start = now_ms()
+
+    def log(self, event, **fields):
+        record = {'t_ms': round(now_ms() - self.start, 1), 'event': event}
+        record.update(fields)
+        line = json.dumps(record, ensure_ascii=False)
+        print(line, flush=True)
+        if self.file:
+            self.file.write(line + '\n')
+            self.file.flush()
@@ -0,0 +1,262 @@
+'''
+  Device simulator for end-to-end latency and throughput measurements.
+  Each round follows the device after a wake word: it opens the audio channel with a hello,
+  sends listen detect and start, streams a recorded utterance in real time, and collects the
+  reply of the server until tts stop. MCP requests of the server are answered right away.
+  The hello, the messages and the binary formats follow main/protocols.
+  The device side is this Python model, not the firmware: its numbers leave out the audio pipeline,
+  the codec and the scheduling of the device. Point a real device at server.py to measure those.
+'''
+import argparse
+import asyncio
+import json
+import statistics
+import uuid
+
+from sim_protocol import EventLog, UdpCrypto, now_ms, opus_frame_duration_ms, pack_audio, read_opus_file, unpack_audio
+
+
+PROTOCOL_VERSIONS = (1, 2, 3)
+
+
+class Device:
+    '''The transports feed `events` with (kind, payload, time_ms) tuples'''
+
+    def __init__(self, args, log):
+        self.args = args
+        self.log = log
+        self.session_id = ''
+        self.events = asyncio.Queue()
+        self.hello = asyncio.get_running_loop().create_future()
+
+    def hello_message(self, transport):
+        return {
+            'type': 'hello',
+            'version': self.args.version,
+            'transport': transport,
+            'features': {'mcp': True, 'ping': True},
+            'audio_params': {'format': 'opus', 'sample_rate': 16000, 'channels': 1, 'frame_duration': self.args.frame_ms},
+        }
+
+    def on_json(self, message):
+        if message.get('type') == 'hello':
+            self.session_id = message.get('session_id', '')
+            if not self.hello.done():
+                self.hello.set_result(message)
+            return
+        self.events.put_nowait(('json', message, now_ms()))
+
+    def on_audio(self, frames):
+        self.events.put_nowait(('audio', frames, now_ms()))
+
+    async def send_message(self, message):
+        message = dict(message, session_id=self.session_id)
+        await self.send_json(message)
+
+
+class WebsocketDevice(Device):
+    async def open(self):
+        import websockets
+
+        headers = {
+            'Protocol-Version': str(self.args.version),
+            'Device-Id': self.args.device_id,
+            'Client-Id': str(uuid.uuid4()),
+        }
+        if self.args.token:
+            headers['Authorization'] = 'Bearer ' + self.args.token
+        try:
+            self.websocket = await websockets.connect(self.args.url, additional_headers=headers)
+        except TypeError:
+            # websockets before 14
+            self.websocket = await websockets.connect(self.args.url, extra_headers=headers)
+        # Until the server accepts version 4 in its hello
+        self.version = self.args.version
+        self.reader = asyncio.ensure_future(self.read())
+        hello = self.hello_message('websocket')
+        if self.args.batch:
+            hello['features']['audio_batch'] = 8
+        await self.websocket.send(json.dumps(hello))
+        reply = await asyncio.wait_for(self.hello, 10)
+        self.version = reply.get('version', self.args.version)
+
+    async def read(self):
+        async for message in self.websocket:
+            if isinstance(message, bytes):
+                self.on_audio(unpack_audio(self.version, message))
+            else:
+                self.on_json(json.loads(message))
+
+    async def send_json(self, message):
+        await self.websocket.send(json.dumps(message, ensure_ascii=False))
+
+    async def send_audio(self, timestamp, opus):
+        for message in pack_audio(self.version, [(timestamp, opus)]):
+            await self.websocket.send(message)
+
+    async def close(self):
+        await self.websocket.close()
+        self.reader.cancel()
+
+
+class UdpClientProtocol(asyncio.DatagramProtocol):
+    def __init__(self, device):
+        self.device = device
+
+    def datagram_received(self, data, address):
+        timestamp, _, opus = self.device.crypto.decrypt(data)
+        self.device.on_audio([(timestamp, opus)])
+
+
+class MqttDevice(Device):
+    async def open(self):
+        import paho.mqtt.client as mqtt
+
+        loop = asyncio.get_running_loop()
+        host, _, port = self.args.mqtt.partition(':')
+        self.client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=self.args.device_id)
+        connected = loop.create_future()
+
+        def on_connect(client, userdata, flags, reason_code, properties):
+            client.subscribe(self.args.mqtt_reply_topic)
+            loop.call_soon_threadsafe(lambda: connected.done() or connected.set_result(True))
+
+        def on_message(client, userdata, message):
+            loop.call_soon_threadsafe(self.on_json, json.loads(message.payload))
+
+        self.client.on_connect = on_connect
+        self.client.on_message = on_message
+        self.client.connect(host, int(port or 1883))
+        self.client.loop_start()
+        await asyncio.wait_for(connected, 10)
+
+        await self.send_json(self.hello_message('udp'))
+        reply = await asyncio.wait_for(self.hello, 10)
+        udp = reply['udp']
+        self.crypto = UdpCrypto(bytes.fromhex(udp['key']), bytes.fromhex(udp['nonce']))
+        self.transport, _ = await loop.create_datagram_endpoint(lambda: UdpClientProtocol(self),
+                                                               remote_addr=(udp['server'], udp['port']))
+
+    async def send_json(self, message):
+        self.client.publish(self.args.mqtt_topic, json.dumps(message, ensure_ascii=False))
+
+    async def send_audio(self, timestamp, opus):
+        self.transport.sendto(self.crypto.encrypt(timestamp, opus))
+
+    async def close(self):
+        await self.send_message({'type': 'goodbye'})
+        self.transport.close()
+        self.client.loop_stop()
+        self.client.disconnect()
+
+
+async def run_round(args, log, utterance):
+    device = MqttDevice(args, log) if args.mqtt else WebsocketDevice(args, log)
+    result = {}
+    t_wake = now_ms()
+    await device.open()
+    result['channel_open_ms'] = now_ms() - t_wake
+
+    await device.send_message({'type': 'listen', 'state': 'detect', 'text': args.wake_word})
+    await device.send_message({'type': 'listen', 'state': 'start', 'mode': args.mode})
+    t_ping = now_ms()
+    await device.send_message({'type': 'ping', 'timestamp': 0})
+
+    next_send = now_ms()
+    timestamp = 0
+    for opus in utterance:
+        delay = next_send - now_ms()
+        if delay > 0:
+            await asyncio.sleep(delay / 1000)
+        await device.send_audio(timestamp, opus)
+        frame_ms = opus_frame_duration_ms(opus)
+        next_send += frame_ms
+        timestamp += int(frame_ms)
+    t_end_of_speech = now_ms()
+    if args.mode == 'manual':
+        await device.send_message({'type': 'listen', 'state': 'stop'})
+
+    audio_bytes = 0
+    audio_frames = 0
+    t_first_audio = None
+    while True:
+        try:
+            kind, payload, t = await asyncio.wait_for(device.events.get(), args.timeout)
+        except asyncio.TimeoutError:
+            result['timeout'] = True
+            break
+        if kind == 'audio':
+            for _, opus in payload:
+                audio_frames += 1
+                audio_bytes += len(opus)
+            if t_first_audio is None:
+                t_first_audio = t
+                result['speech_end_to_first_audio_ms'] = t - t_end_of_speech
+            continue
+        msg_type = payload.get('type')
+        if msg_type == 'pong':
+            result['ping_rtt_ms'] = t - t_ping
+        elif msg_type == 'stt':
+            result['speech_end_to_stt_ms'] = t - t_end_of_speech
+        elif msg_type == 'mcp' and 'method' in payload.get('payload', {}):
+            request = payload['payload']
+            reply = {'jsonrpc': '2.0', 'id': request.get('id'),
+                     'result': {'content': [{'type': 'text', 'text': 'true'}], 'isError': False}}
+            await device.send_message({'type': 'mcp', 'payload': reply})
+        elif msg_type == 'tts' and payload.get('state') == 'stop':
+            result['speech_end_to_tts_stop_ms'] = t - t_end_of_speech
+            if t_first_audio is not None and t > t_first_audio:
+                result['downlink_kbps'] = audio_bytes * 8 / (t - t_first_audio)
+            result['audio_frames'] = audio_frames
+            break
+    await device.close()
+    result['wake_to_first_audio_ms'] = (t_first_audio - t_wake) if t_first_audio else None
+    return result
+
+
+def print_summary(results):
+    print('\n%-30s %8s %8s %8s %8s' % ('metric', 'min', 'median', 'p90', 'max'))
+    keys = sorted({key for result in results for key, value in result.items() if isinstance(value, (int, float)) and not isinstance(value, bool)})
+    for key in keys:
+        values = sorted(result[key] for result in results if result.get(key) is not None)
+        if not values:
+            continue
+        p90 = values[min(len(values) - 1, int(len(values) * 0.9))]
+        print('%-30s %8.1f %8.1f %8.1f %8.1f' % (key, values[0], statistics.median(values), p90, values[-1]))
+    timeouts = sum(1 for result in results if result.get('timeout'))
+    if timeouts:
+        print('timeouts: %d of %d rounds' % (timeouts, len(results)))
+
+
+async def main(args):
+    log = EventLog(args.log)
+    utterance, _ = read_opus_file(args.audio)
+    results = []
+    for i in range(args.rounds):
+        result = await run_round(args, log, utterance)
+        log.log('round', index=i, **{key: round(value, 1) if isinstance(value, float) else value for key, value in result.items()})
+        results.append(result)
+        await asyncio.sleep(args.interval)
+    print_summary(results)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='设备端模拟器，连接替身服务器测量端到端延迟与吞吐')
+    parser.add_argument('--url', default='ws://127.0.0.1:8765', help='WebSocket 地址 (默认: ws://127.0.0.1:8765)')
+    parser.add_argument('--version', type=int, default=3, choices=PROTOCOL_VERSIONS, help='二进制协议版本 (默认: 3)')
+    parser.add_argument('--batch', action='store_true', help='在 hello 中提供版本4的多帧合并')
+    parser.add_argument('--token', help='WebSocket 访问令牌')
+    parser.add_argument('--mqtt', help='MQTT broker 地址 host:port，指定后使用 MQTT + UDP')
+    parser.add_argument('--mqtt-topic', default='device-server', help='发布消息的主题 (默认: device-server)')
+    parser.add_argument('--mqtt-reply-topic', default='devices/simulator', help='订阅服务器消息的主题 (默认: devices/simulator)')
+    parser.add_argument('--device-id', default='sim:00:00:00:00:01', help='Device-Id 请求头与 MQTT Client ID')
+    parser.add_argument('--audio', required=True, help='模拟说话内容的 16kHz Opus 录音，.ogg 或 .p3')
+    parser.add_argument('--frame-ms', type=int, default=60, help='hello 中声明的上行帧长 (默认: 60)')
+    parser.add_argument('--mode', default='auto', choices=('auto', 'manual', 'realtime'), help='聆听模式 (默认: auto)')
+    parser.add_argument('--wake-word', default='你好小智', help='listen detect 消息中的唤醒词')
+    parser.add_argument('--rounds', type=int, default=10, help='测试轮数 (默认: 10)')
+    parser.add_argument('--interval', type=float, default=1, help='两轮之间的间隔，秒 (默认: 1)')
+    parser.add_argument('--timeout', type=float, default=15, help='等待服务器回复的超时，秒 (默认: 15)')
+    parser.add_argument('--log', help='事件日志文件，每行一个 JSON')
+    args = parser.parse_args()
+    asyncio.run(main(args))